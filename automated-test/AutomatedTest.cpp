@@ -1,6 +1,13 @@
 #include "Particle.h"
 #include "SleepHelper.h"
 
+#include <chrono>
+#include <cmath>
+#include <memory>
+#include <atomic>
+#include <thread>
+#include <mutex>
+
 
 void readTestData(const char *filename, char *&data, size_t &size) {
 
@@ -105,9 +112,11 @@ void _assertFile(const char *msg, const char *gotPath, const char *expectedPath,
 void settingsTest() {
 	
 	const char *testPath = "settings1.json";
+	String backupPath = String(testPath) + ".bak";
 
 	{
 		unlink(testPath);
+		unlink(backupPath);
 
 		SleepHelper::SettingsFile settings;
 		settings.withPath(testPath);
@@ -189,11 +198,13 @@ void settingsTest() {
 		assertInt("", boolValue, false);
 
 		unlink(testPath);
+		unlink(backupPath);
 	}
 
 	{
 		// Default values on initial set
 		unlink(testPath);
+		unlink(backupPath);
 
 		const char *defaultValues = "{\"t1\":1234,\"t2\":\"testing 2!\",\"t3\":-5.5,\"t4\":false}";
 
@@ -273,12 +284,14 @@ void settingsTest() {
 
 
 		unlink(testPath);
+		unlink(backupPath);
 
 	}
 
 	// Cloud Settings
 	{
 		unlink(testPath);
+		unlink(backupPath);
 
 		const char *cloudSettings = "{\"t1\":1234,\"t2\":\"testing 2!\",\"t3\":-5.5,\"t4\":false}";
 
@@ -323,7 +336,7 @@ void settingsTest() {
 		assertInt("", bResult, true);
 		assertInt("", boolValue, false);
 
-		assertInt("", (int)settings.getHash(), 1924270570);
+		assertInt("", (int)settings.getHash(), 498805597);
 
 		const char *cloudSettings2 = "{\"t1\":9999,\"t2\":\"testing 2!\",\"t3\":-5.5,\"t4\":false}";
 		settings.setValuesJson(cloudSettings2);
@@ -333,226 +346,1774 @@ void settingsTest() {
 		assertInt("", bResult, true);
 		assertInt("", intValue, 9999);
 
-		assertInt("", (int)settings.getHash(), 109685353);
+		assertInt("", (int)settings.getHash(), -840602934);
 
 		unlink(testPath);
+		unlink(backupPath);
 	}
 
+	// Transactions
+	{
+		unlink(testPath);
+		unlink(backupPath);
 
-}
+		SleepHelper::SettingsFile settings;
+		settings.withPath(testPath);
+		settings.load();
+		settings.setValue("t1", 0);
 
-void persistentDataTest() {
-	const char *persistentDataPath = "./temp01.dat";
-	{
-		SleepHelper::PersistentData data(persistentDataPath);
-		unlink(persistentDataPath);
-		data.withSaveDelayMs(0);
-		data.load();
-		data.save();
+		std::vector<String> keysChanged;
+		int savedValue = -1;
 
-		assertFile("", persistentDataPath, "testfiles/test01.dat");
+		settings.withSettingChangeFunction([&keysChanged, &savedValue, testPath](const char *key) {
+			keysChanged.push_back(key);
 
-		data.setValue_lastUpdateCheck(123);
+			// The file must already be saved when notified
+			SleepHelper::SettingsFile settings2;
+			settings2.withPath(testPath);
+			settings2.load();
+			settings2.getValue("t1", savedValue);
+			return true;
+		});
+
+		settings.beginTransaction();
+		assertInt("", settings.getInTransaction(), true);
+
+		for(int ii = 1; ii <= 10; ii++) {
+			settings.setValue("t1", ii);
+		}
+		settings.setValue("t2", "testing");
+		settings.updateValuesJson("{\"t2\":\"testing 2!\",\"t3\":-5.5}");
+		assertInt("", (int)keysChanged.size(), 0);
+
+		// Nested transaction does not save
+		settings.beginTransaction();
+		settings.setValue("t4", true);
+		assertInt("", settings.commitTransaction(), false);
+		assertInt("", (int)keysChanged.size(), 0);
+
+		assertInt("", settings.commitTransaction(), true);
+		assertInt("", settings.getInTransaction(), false);
+
+		// 13 changes were grouped into one save
+		assertInt("", (int)settings.getSavesAvoided(), 12);
+		printf("settings transaction saves avoided %lu\n", (unsigned long)settings.getSavesAvoided());
+
+		// One notification per key, after the save
+		assertInt("", (int)keysChanged.size(), 4);
+		assertStr("", keysChanged[0], "t1");
+		assertStr("", keysChanged[1], "t2");
+		assertStr("", keysChanged[2], "t3");
+		assertStr("", keysChanged[3], "t4");
+		assertInt("", savedValue, 10);
+
+		// Commit without begin does nothing
+		assertInt("", settings.commitTransaction(), false);
+
+		// Outside of a transaction, changes save immediately
+		keysChanged.clear();
+		settings.setValue("t1", 11);
+		assertInt("", (int)keysChanged.size(), 1);
+		assertInt("", (int)settings.getSavesAvoided(), 12);
+
+		unlink(testPath);
+		unlink(backupPath);
 	}
 
+	// Validated load and backup
 	{
-	}
+		String metaPath = String(testPath) + ".meta";
+		unlink(testPath);
+		unlink(backupPath);
 
-	unlink(persistentDataPath);
-}
+		bool bResult;
+		int intValue;
 
-class MyPersistentData : public StorageHelperRK::PersistentDataFile {
-public:
-	class MyData {
-	public:
-		// This structure must always begin with the header (16 bytes)
-		StorageHelperRK::PersistentDataBase::SavedDataHeader header;
-		// Your fields go here. Once you've added a field you cannot add fields
-		// (except at the end), insert fields, remove fields, change size of a field.
-		// Doing so will cause the data to be corrupted!
-		// You may want to keep a version number in your data.
-		int test1;
-		bool test2;
-		double test3;
-		char test4[10];
-		// OK to add more fields here 
-	};
+		SleepHelper::SettingsFile settings;
+		settings.withPath(testPath);
+		settings.load();
+		settings.setValue("t1", 1);
+		settings.setValue("t1", 2);
 
-	static const uint32_t DATA_MAGIC = 0x20a99e73;
-	static const uint16_t DATA_VERSION = 1;
+		// Reload with matching hash uses the settings already in RAM
+		settings.load();
+		assertInt("", settings.getLoadedFromBackup(), false);
+		bResult = settings.getValue("t1", intValue);
+		assertInt("", bResult, true);
+		assertInt("", intValue, 2);
 
-	MyPersistentData(const char *filename) : StorageHelperRK::PersistentDataFile(filename, &myData.header, sizeof(MyData), DATA_MAGIC, DATA_VERSION) {};
+		// The settings file only contains the JSON, so earlier versions can read it
+		{
+			char buf[64];
+			memset(buf, 0, sizeof(buf));
+			int fd = open(testPath, O_RDONLY);
+			read(fd, buf, sizeof(buf) - 1);
+			close(fd);
+			assertStr("", buf, "{\"t1\":2}");
 
-	int getValue_test1() const {
-		return getValue<int>(offsetof(MyData, test1));
-	}
+			struct stat sb;
+			assertInt("", stat(metaPath, &sb), 0);
+			assertInt("", (int)sb.st_size, (int)sizeof(SleepHelper::SettingsFile::SettingsFileMeta));
+		}
 
-	void setValue_test1(int value) {
-		setValue<int>(offsetof(MyData, test1), value);
-	}
+		// Corrupt one byte of the JSON in the settings file
+		{
+			int fd = open(testPath, O_RDWR);
+			lseek(fd, 6, SEEK_SET);
+			write(fd, "7", 1);
+			close(fd);
+		}
 
-	bool getValue_test2() const {
-		return getValue<bool>(offsetof(MyData, test2));
-	}
+		SleepHelper::SettingsFile settings2;
+		settings2.withPath(testPath);
+		settings2.load();
+		assertInt("", settings2.getLoadedFromBackup(), true);
+		bResult = settings2.getValue("t1", intValue);
+		assertInt("", bResult, true);
+		assertInt("", intValue, 1);
 
-	void setValue_test2(bool value) {
-		setValue<bool>(offsetof(MyData, test2), value);
-	}
+		// Settings file missing, as if reset between renames in save
+		unlink(testPath);
+		SleepHelper::SettingsFile settings3;
+		settings3.withPath(testPath);
+		settings3.load();
+		assertInt("", settings3.getLoadedFromBackup(), true);
+		bResult = settings3.getValue("t1", intValue);
+		assertInt("", bResult, true);
+		assertInt("", intValue, 1);
 
-	double getValue_test3() const {
-		return getValue<double>(offsetof(MyData, test3));
-	}
+		// Truncated settings file and no backup
+		{
+			int fd = open(testPath, O_RDWR | O_CREAT | O_TRUNC, 0666);
+			write(fd, "{\"t1\":", 6);
+			close(fd);
+			unlink(backupPath);
+		}
+		SleepHelper::SettingsFile settings4;
+		settings4.withPath(testPath);
+		settings4.load();
+		assertInt("", settings4.getLoadedFromBackup(), false);
+		bResult = settings4.getValue("t1", intValue);
+		assertInt("", bResult, false);
+
+		// Settings file from an earlier version without a .meta file
+		{
+			int fd = open(testPath, O_RDWR | O_CREAT | O_TRUNC, 0666);
+			write(fd, "{\"t1\":5}", 8);
+			close(fd);
+			unlink(metaPath);
+		}
+		SleepHelper::SettingsFile settings5;
+		settings5.withPath(testPath);
+		settings5.load();
+		assertInt("", settings5.getLoadedFromBackup(), false);
+		bResult = settings5.getValue("t1", intValue);
+		assertInt("", bResult, true);
+		assertInt("", intValue, 5);
 
-	void setValue_test3(double value) {
-		setValue<double>(offsetof(MyData, test3), value);
-	}
+		// Saved again by an earlier version after a rollback, leaving a .meta file for a different size
+		settings5.setValue("t1", 6);
+		{
+			int fd = open(testPath, O_RDWR | O_CREAT | O_TRUNC, 0666);
+			write(fd, "{\"t1\":5,\"t2\":1}", 15);
+			close(fd);
+		}
+		SleepHelper::SettingsFile settings6;
+		settings6.withPath(testPath);
+		settings6.load();
+		assertInt("", settings6.getLoadedFromBackup(), false);
+		bResult = settings6.getValue("t2", intValue);
+		assertInt("", bResult, true);
+		assertInt("", intValue, 1);
 
-	String getValue_test4() const {
-		String result;
-		getValueString(offsetof(MyData, test4), sizeof(MyData::test4), result);
-		return result;
-	}
-	bool setValue_test4(const char *str) {
-		return setValueString(offsetof(MyData, test4), sizeof(MyData::test4), str);
+		unlink(testPath);
+		unlink(backupPath);
+		unlink(metaPath);
+		unlink(backupPath + ".meta");
 	}
 
 
-	MyData myData;
-};
+}
 
+void settingsLargeTest() {
+	const char *testPath = "settings2.json";
+	String backupPath = String(testPath) + ".bak";
+
+	unlink(testPath);
+	unlink(backupPath);
+
+	const size_t numKeys[] = { 20, 100, 300 };
+	for(size_t ii = 0; ii < sizeof(numKeys) / sizeof(numKeys[0]); ii++) {
+		// Every fourth setting is an array, which uses additional tokens
+		String json = "{";
+		for(size_t key = 0; key < numKeys[ii]; key++) {
+			if (key > 0) {
+				json += ",";
+			}
+			if ((key % 4) == 3) {
+				json += String::format("\"k%u\":[%u,%u,%u]", (unsigned)key, (unsigned)key, (unsigned)key + 1, (unsigned)key + 2);
+			}
+			else {
+				json += String::format("\"k%u\":%u", (unsigned)key, (unsigned)key * 10);
+			}
+		}
+		json += "}";
 
+		bool bResult;
+		int intValue;
 
-class MyPersistentData2 : public StorageHelperRK::PersistentDataFile {
-public:
-	class MyData {
-	public:
-		// This structure must always begin with the header (16 bytes)
-		StorageHelperRK::PersistentDataBase::SavedDataHeader header;
-		// Your fields go here. Once you've added a field you cannot add fields
-		// (except at the end), insert fields, remove fields, change size of a field.
-		// Doing so will cause the data to be corrupted!
-		// You may want to keep a version number in your data.
-		int test1;
-		bool test2;
-		double test3;
-		char test4[10];
-		uint32_t test5;
-		// OK to add more fields here 
-	};
+		SleepHelper::SettingsFile settings;
+		settings.withPath(testPath);
+		settings.load();
+		bResult = settings.setValuesJson(json);
+		assertInt("", bResult, true);
 
-	static const uint32_t DATA_MAGIC = 0x20a99e73;
-	static const uint16_t DATA_VERSION = 1;
+		// Larger than the 50 token limit of the fixed-size parser
+		size_t tokenCount = settings.getTokenCount();
+		assertInt("", tokenCount > 50, true);
 
-	MyPersistentData2(const char *filename) : StorageHelperRK::PersistentDataFile(filename, &myData.header, sizeof(MyData), DATA_MAGIC, DATA_VERSION) {};
+		auto start = std::chrono::steady_clock::now();
+		SleepHelper::SettingsFile settings2;
+		settings2.withPath(testPath);
+		settings2.load();
+		auto loadUs = std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::steady_clock::now() - start).count();
 
-	int getValue_test1() const {
-		return getValue<int>(offsetof(MyData, test1));
-	}
+		assertInt("", settings2.getLoadedFromBackup(), false);
+		assertInt("", (int)settings2.getTokenCount(), (int)tokenCount);
 
-	void setValue_test1(int value) {
-		setValue<int>(offsetof(MyData, test1), value);
-	}
+		String lastKey = String::format("k%u", (unsigned)numKeys[ii] - 2);
+		const int lookupCount = 1000;
+		start = std::chrono::steady_clock::now();
+		for(int jj = 0; jj < lookupCount; jj++) {
+			intValue = 0;
+			bResult = settings2.getValue(lastKey, intValue);
+		}
+		auto lookupUs = std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::steady_clock::now() - start).count();
+		assertInt("", bResult, true);
+		assertInt("", intValue, (int)(numKeys[ii] - 2) * 10);
 
-	bool getValue_test2() const {
-		return getValue<bool>(offsetof(MyData, test2));
-	}
+		// Memory is sized from the file, rounded up to the page size
+		size_t memoryUsage = settings2.getMemoryUsage();
+		size_t expectedMax = ((json.length() + 256) / 256) * 256 + tokenCount * sizeof(JsonParserGeneratorRK::jsmntok_t);
+		assertInt("", memoryUsage <= expectedMax, true);
 
-	void setValue_test2(bool value) {
-		setValue<bool>(offsetof(MyData, test2), value);
-	}
+		printf("settings keys=%u bytes=%u tokens=%u memory=%u load=%ldus lookup=%.2fus\n", 
+			(unsigned)numKeys[ii], (unsigned)json.length(), (unsigned)tokenCount, (unsigned)memoryUsage, (long)loadUs, (double)lookupUs / lookupCount);
 
-	double getValue_test3() const {
-		return getValue<double>(offsetof(MyData, test3));
-	}
+		// Grows on insert
+		String longValue;
+		for(int jj = 0; jj < 400; jj++) {
+			longValue += "x";
+		}
+		bResult = settings2.setValue("long", longValue);
+		assertInt("", bResult, true);
+		String stringValue;
+		bResult = settings2.getValue("long", stringValue);
+		assertInt("", bResult, true);
+		assertStr("", stringValue, longValue);
+		bResult = settings2.getValue(lastKey, intValue);
+		assertInt("", bResult, true);
+		assertInt("", intValue, (int)(numKeys[ii] - 2) * 10);
 
-	void setValue_test3(double value) {
-		setValue<double>(offsetof(MyData, test3), value);
+		unlink(testPath);
+		unlink(backupPath);
 	}
 
-	String getValue_test4() const {
-		String result;
-		getValueString(offsetof(MyData, test4), sizeof(MyData::test4), result);
-		return result;
-	}
-	bool setValue_test4(const char *str) {
-		return setValueString(offsetof(MyData, test4), sizeof(MyData::test4), str);
-	}
+	// Maximum size is enforced
+	{
+		SleepHelper::SettingsFile settings;
+		settings.withPath(testPath);
+		settings.withMaxSize(512);
+		settings.load();
 
-	uint32_t getValue_test5() const {
-		return getValue<uint32_t>(offsetof(MyData, test5));
-	}
+		String longValue;
+		for(int jj = 0; jj < 300; jj++) {
+			longValue += "x";
+		}
+		bool bResult = settings.setValue("t1", longValue);
+		assertInt("", bResult, false);
+		assertInt("", settings.getMemoryUsage() <= 512 + 16 * sizeof(JsonParserGeneratorRK::jsmntok_t), true);
 
-	void setValue_test5(uint32_t value) {
-		setValue<uint32_t>(offsetof(MyData, test5), value);
-	}
+		bResult = settings.setValue("t1", 1234);
+		assertInt("", bResult, true);
 
-	MyData myData;
-};
+		// The merged settings plus the null terminator must fit, otherwise nothing is changed
+		String json;
+		settings.getValuesJson(json);
+		assertStr("", json.c_str(), "{\"t1\":1234}");
 
+		String update = "{\"t2\":\"";
+		for(int jj = 0; jj < 512 - 19; jj++) {
+			update += "x";
+		}
+		update += "\"}";
+		bResult = settings.updateValuesJson(update);
+		assertInt("", bResult, false);
+		settings.getValuesJson(json);
+		assertStr("", json.c_str(), "{\"t1\":1234}");
 
-void customPersistentDataTest() {
-	const char *persistentDataPath = "./temp02.dat";
-	unlink(persistentDataPath);
+		unlink(testPath);
+		unlink(backupPath);
+	}
 
-	MyPersistentData data(persistentDataPath);
-	bool bResult;
-	String s;
+	// A file that fills the maximum size exactly leaves no room for the null terminator
+	{
+		SleepHelper::SettingsFile settings;
+		settings.withPath(testPath);
+		settings.load();
+		settings.setValue("t1", 1234);
 
-	data.load();
-	data.save();
+		String json;
+		settings.getValuesJson(json);
+		unlink(backupPath);
 
-	data.setValue_test1(0x55aa55aa);
-	assertInt("", data.getValue_test1(), 0x55aa55aa);
+		SleepHelper::SettingsFile settings2;
+		settings2.withPath(testPath);
+		settings2.withMaxSize(json.length());
+		settings2.load();
+		int intValue = 0;
+		assertInt("", settings2.getValue("t1", intValue), false);
+
+		SleepHelper::SettingsFile settings3;
+		settings3.withPath(testPath);
+		settings3.withMaxSize(json.length() + 1);
+		settings3.load();
+		assertInt("", settings3.getValue("t1", intValue), true);
+		assertInt("", intValue, 1234);
 
-	assertInt("", data.getValue_test2(), false);
-	data.setValue_test2(true);
-	assertInt("", data.getValue_test2(), true);
+		unlink(testPath);
+		unlink(backupPath);
+	}
 
+}
 
-	assertDouble("", data.getValue_test3(), 0.0, 0.001);
-	data.setValue_test3(9999999.12345);
-	assertDouble("", data.getValue_test3(), 9999999.12345, 0.001);
+void settingsIndexTest() {
+	const char *testPath = "settings3.json";
+	String backupPath = String(testPath) + ".bak";
 
-	s = data.getValue_test4();
-	assertStr("", s, "");
-	data.setValue_test4("testing!"); 
-	s = data.getValue_test4();
-	assertStr("", s, "testing!");
+	unlink(testPath);
+	unlink(backupPath);
 
-	data.setValue_test4("testing1!"); 
-	s = data.getValue_test4();
-	assertStr("", s, "testing1!");
+	// Typed bindings
+	{
+		SleepHelper::SettingsFile settings;
+		settings.withPath(testPath);
+		settings.withDefaultValues("{\"t1\":1234,\"t2\":\"testing\",\"t3\":-5.5,\"t4\":false}");
+		settings.load();
 
-	bResult = data.setValue_test4("testing12!"); 
-	assertInt("", bResult, false);
-	s = data.getValue_test4();
-	assertStr("", s, "testing1!");
+		int t1 = 0;
+		String t2;
+		double t3 = 0;
+		bool t4 = true;
+		int t5 = 77;
+		settings.withBinding("t1", t1);
+		settings.withBinding("t2", t2);
+		settings.withBinding("t3", t3);
+		settings.withBinding("t4", t4);
+		settings.withBinding("t5", t5);
+		assertInt("", t1, 1234);
+		assertStr("", t2, "testing");
+		assertDouble("", t3, -5.5, 0.001);
+		assertInt("", t4, false);
+		assertInt("", t5, 77);
+
+		// Bound variables are updated before change notifications
+		int notifiedValue = 0;
+		settings.withSettingChangeFunction([&notifiedValue, &t1](const char *key) {
+			notifiedValue = t1;
+			return true;
+		});
 
-	data.save();
+		settings.setValue("t1", 5678);
+		assertInt("", t1, 5678);
+		assertInt("", notifiedValue, 5678);
 
+		settings.updateValuesJson("{\"t2\":\"testing 2!\",\"t5\":5}");
+		assertStr("", t2, "testing 2!");
+		assertInt("", t5, 5);
 
-	MyPersistentData data2(persistentDataPath);
-	data2.load();
+		settings.setValuesJson("{\"t1\":9999,\"t3\":1.5}");
+		assertInt("", t1, 9999);
+		assertInt("", notifiedValue, 9999);
+		assertDouble("", t3, 1.5, 0.001);
 
-	assertInt("", data2.getValue_test1(), 0x55aa55aa);
-	assertInt("", data2.getValue_test2(), true);
-	assertDouble("", data2.getValue_test3(), 9999999.12345, 0.001);
-	assertStr("", data2.getValue_test4(), "testing1!");
+		// Removed keys leave the variable unchanged
+		assertStr("", t2, "testing 2!");
 
-	// Simulate a new version that adds a new field without changing the version or magic
-	MyPersistentData2 data2b(persistentDataPath);
-	data2b.load();
+		int intValue = 0;
+		assertInt("", settings.getValue("t1", intValue), true);
+		assertInt("", intValue, 9999);
+		assertInt("", settings.getValue("t2", intValue), false);
 
-	assertInt("", data2b.getValue_test1(), 0x55aa55aa);
-	assertInt("", data2b.getValue_test2(), true);
-	assertDouble("", data2b.getValue_test3(), 9999999.12345, 0.001);
-	assertStr("", data2b.getValue_test4(), "testing1!");
-	assertInt("", data2b.getValue_test5(), 0);
+		unlink(testPath);
+		unlink(backupPath);
+	}
 
-	data2b.setValue_test5(12345);
-	assertInt("", data2b.getValue_test5(), 12345);
+	// Lookup benchmark: linear scan of the tokens vs. index vs. bound variable
+	const size_t numKeys[] = { 5, 50, 200 };
+	for(size_t ii = 0; ii < sizeof(numKeys) / sizeof(numKeys[0]); ii++) {
+		String json = "{";
+		for(size_t key = 0; key < numKeys[ii]; key++) {
+			if (key > 0) {
+				json += ",";
+			}
+			json += String::format("\"setting%u\":%u", (unsigned)key, (unsigned)key);
+		}
+		json += "}";
 
-	data2b.save();
+		SleepHelper::SettingsFile settings;
+		settings.withPath(testPath);
+		settings.load();
+		settings.setValuesJson(json);
+
+		JsonParser linearParser;
+		linearParser.addString(json);
+		linearParser.parse();
+
+		String lastKey = String::format("setting%u", (unsigned)numKeys[ii] - 1);
+		int expected = (int)numKeys[ii] - 1;
+		int boundValue = 0;
+		settings.withBinding(lastKey, boundValue);
+
+		const int lookupCount = 100000;
+		int intValue = 0;
+		int64_t sum = 0;
+
+		auto start = std::chrono::steady_clock::now();
+		for(int jj = 0; jj < lookupCount; jj++) {
+			linearParser.getOuterValueByKey(lastKey, intValue);
+			sum += intValue;
+		}
+		double linearSec = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+		assertInt("", (int)(sum / lookupCount), expected);
+
+		sum = 0;
+		start = std::chrono::steady_clock::now();
+		for(int jj = 0; jj < lookupCount; jj++) {
+			settings.getValue(lastKey, intValue);
+			sum += intValue;
+		}
+		double indexSec = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+		assertInt("", (int)(sum / lookupCount), expected);
+
+		sum = 0;
+		volatile int *boundPtr = &boundValue;
+		start = std::chrono::steady_clock::now();
+		for(int jj = 0; jj < lookupCount; jj++) {
+			sum += *boundPtr;
+		}
+		double boundSec = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+		assertInt("", (int)(sum / lookupCount), expected);
+
+		printf("settings lookup keys=%u linear=%.0f/sec index=%.0f/sec binding=%.0f/sec\n", (unsigned)numKeys[ii], 
+			lookupCount / linearSec, lookupCount / indexSec, lookupCount / boundSec);
+
+		unlink(testPath);
+		unlink(backupPath);
+	}
+}
+
+void settingsSubscriptionTest() {
+	const char *testPath = "settings4.json";
+	String backupPath = String(testPath) + ".bak";
+
+	unlink(testPath);
+	unlink(backupPath);
+
+	{
+		SleepHelper::SettingsFile settings;
+		settings.withPath(testPath);
+		settings.load();
+
+		// Many modules each subscribed to their own key
+		const int numSubscribers = 100;
+		int subscriberCalls[numSubscribers] = {0};
+		for(int ii = 0; ii < numSubscribers; ii++) {
+			int *calls = &subscriberCalls[ii];
+			settings.withSettingChangeFunction(String::format("k%d", ii), [calls](const char *key) {
+				(*calls)++;
+				return true;
+			});
+		}
+
+		std::vector<String> prefixKeys;
+		settings.withSettingChangeFunction("net.*", [&prefixKeys](const char *key) {
+			prefixKeys.push_back(key);
+			return true;
+		});
+
+		int batchCalls = 0;
+		size_t batchSize = 0;
+		settings.withSettingsBatchChangeFunction([&batchCalls, &batchSize](const std::vector<String> &keys) {
+			batchCalls++;
+			batchSize = keys.size();
+			return true;
+		});
+
+		int allCalls = 0;
+		settings.withSettingChangeFunction([&allCalls](const char *key) {
+			allCalls++;
+			return true;
+		});
+
+		settings.setValue("k5", 5);
+		assertInt("", subscriberCalls[5], 1);
+		assertInt("", subscriberCalls[50], 0);
+		assertInt("", batchCalls, 1);
+		assertInt("", (int)batchSize, 1);
+		assertInt("", allCalls, 1);
+
+		// Bulk update: only the subscribers for changed keys are called, batch is called once
+		settings.updateValuesJson("{\"k1\":1,\"k2\":2,\"k3\":3,\"net.apn\":\"x\",\"net.mode\":1,\"network\":1}");
+		assertInt("", subscriberCalls[1], 1);
+		assertInt("", subscriberCalls[2], 1);
+		assertInt("", subscriberCalls[3], 1);
+		assertInt("", subscriberCalls[4], 0);
+		assertInt("", subscriberCalls[5], 1);
+		assertInt("", batchCalls, 2);
+		assertInt("", (int)batchSize, 6);
+		assertInt("", allCalls, 7);
+
+		assertInt("", (int)prefixKeys.size(), 2);
+		assertStr("", prefixKeys[0], "net.apn");
+		assertStr("", prefixKeys[1], "net.mode");
+
+		// Key that is a prefix of a subscribed key does not match
+		settings.setValue("k", 1);
+		assertInt("", subscriberCalls[1], 1);
+		assertInt("", batchCalls, 3);
+
+		// Transaction delivers one batch on commit
+		settings.beginTransaction();
+		settings.setValue("k10", 10);
+		settings.setValue("k11", 11);
+		settings.setValue("k10", 100);
+		assertInt("", batchCalls, 3);
+		settings.commitTransaction();
+		assertInt("", batchCalls, 4);
+		assertInt("", (int)batchSize, 2);
+		assertInt("", subscriberCalls[10], 1);
+		assertInt("", subscriberCalls[11], 1);
+
+		int total = 0;
+		for(int ii = 0; ii < numSubscribers; ii++) {
+			total += subscriberCalls[ii];
+		}
+		assertInt("", total, 6);
+
+		unlink(testPath);
+		unlink(backupPath);
+	}
+}
+
+// Merge default values by inserting each key with JsonModifier, which reparses after each
+// key. This is how SettingsFile::addDefaultValues worked before mergeValuesJson, and is
+// used as the baseline for the merge benchmark.
+void jsonModifierAddDefaults(JsonParser &parser, const char *inputJson) {
+	JsonParser inputParser;
+	inputParser.addString(inputJson);
+	inputParser.parse();
+
+	const JsonParserGeneratorRK::jsmntok_t *keyToken;
+	const JsonParserGeneratorRK::jsmntok_t *valueToken;
+
+	for(size_t index = 0; inputParser.getKeyValueTokenByIndex(inputParser.getOuterObject(), keyToken, valueToken, index); index++) {
+		String key;
+		inputParser.getTokenValue(keyToken, key);
+
+		const JsonParserGeneratorRK::jsmntok_t *oldValueToken;
+		if (!parser.getValueTokenByKey(parser.getOuterObject(), key, oldValueToken)) {
+			JsonModifier modifier(parser);
+			modifier.insertOrUpdateKeyValue(parser.getOuterObject(), key, (int)0);
+
+			parser.getValueTokenByKey(parser.getOuterObject(), key, oldValueToken);
+			const JsonParserGeneratorRK::jsmntok_t expandedValueToken = modifier.tokenWithQuotes(valueToken);
+			const JsonParserGeneratorRK::jsmntok_t expandedOldValueToken = modifier.tokenWithQuotes(oldValueToken);
+			modifier.startModify(&expandedOldValueToken);
+			for(int ii = expandedValueToken.start; ii < expandedValueToken.end; ii++) {
+				modifier.insertChar(inputParser.getBuffer()[ii]);
+			}
+			modifier.finish();
+		}
+	}
+}
+
+void settingsMergeTest() {
+	const char *testPath = "settings5.json";
+	String backupPath = String(testPath) + ".bak";
+
+	unlink(testPath);
+	unlink(backupPath);
+
+	// 60-key default set, with a mix of types
+	String defaults = "{";
+	for(int ii = 0; ii < 60; ii++) {
+		if (ii > 0) {
+			defaults += ",";
+		}
+		switch(ii % 4) {
+			case 0:
+				defaults += String::format("\"int%d\":%d", ii, ii * 100);
+				break;
+			case 1:
+				defaults += String::format("\"str%d\":\"value %d\"", ii, ii);
+				break;
+			case 2:
+				defaults += String::format("\"dbl%d\":%d.5", ii, ii);
+				break;
+			default:
+				defaults += String::format("\"arr%d\":[%d,%d]", ii, ii, ii + 1);
+				break;
+		}
+	}
+	defaults += "}";
+
+	// Correctness of merges
+	{
+		SleepHelper::SettingsFile settings;
+		settings.withPath(testPath);
+		settings.load();
+
+		settings.setValue("int0", 5);
+		settings.setValue("str1", "existing");
+
+		std::vector<String> changedKeys;
+		settings.withSettingsBatchChangeFunction([&changedKeys](const std::vector<String> &keys) {
+			changedKeys = keys;
+			return true;
+		});
+
+		// Defaults do not override existing values and do not notify
+		assertInt("", settings.addDefaultValues(defaults), true);
+		assertInt("", (int)changedKeys.size(), 0);
+
+		int intValue = 0;
+		String stringValue;
+		double doubleValue = 0;
+		assertInt("", settings.getValue("int0", intValue), true);
+		assertInt("", intValue, 5);
+		assertInt("", settings.getValue("str1", stringValue), true);
+		assertStr("", stringValue, "existing");
+		assertInt("", settings.getValue("dbl58", doubleValue), true);
+		assertDouble("", doubleValue, 58.5, 0.001);
+		assertInt("", settings.getValue("int56", intValue), true);
+		assertInt("", intValue, 5600);
+
+		// Update replaces values of different lengths and types, and appends new keys
+		assertInt("", settings.updateValuesJson("{\"str5\":\"a longer value than before\",\"int4\":\"now a string\",\"arr3\":[1],\"new1\":1,\"int0\":5}"), true);
+		assertInt("", (int)changedKeys.size(), 4);
+		assertStr("", changedKeys[0], "str5");
+		assertStr("", changedKeys[3], "new1");
+
+		assertInt("", settings.getValue("str5", stringValue), true);
+		assertStr("", stringValue, "a longer value than before");
+		assertInt("", settings.getValue("int4", stringValue), true);
+		assertStr("", stringValue, "now a string");
+		assertInt("", settings.getValue("new1", intValue), true);
+		assertInt("", intValue, 1);
+		assertInt("", settings.getValue("str9", stringValue), true);
+		assertStr("", stringValue, "value 9");
+
+		// With duplicate keys the first one is used, even when it does not change the value
+		changedKeys.clear();
+		assertInt("", settings.updateValuesJson("{\"int0\":5,\"int0\":6,\"new2\":1,\"new2\":2}"), true);
+		assertInt("", (int)changedKeys.size(), 1);
+		assertStr("", changedKeys[0], "new2");
+		assertInt("", settings.getValue("int0", intValue), true);
+		assertInt("", intValue, 5);
+		assertInt("", settings.getValue("new2", intValue), true);
+		assertInt("", intValue, 1);
+
+		// Invalid JSON leaves the settings unchanged
+		String before;
+		settings.getValuesJson(before);
+		assertInt("", settings.updateValuesJson("{\"int0\":"), false);
+		assertInt("", settings.setValuesJson("{\"int0\":"), false);
+		String after;
+		settings.getValuesJson(after);
+		assertStr("", after, before);
+
+		// Removing a key is saved without a change notification
+		changedKeys.clear();
+		settings.setValuesJson("{\"int0\":5}");
+		assertInt("", (int)changedKeys.size(), 0);
+		SleepHelper::SettingsFile settings2;
+		settings2.withPath(testPath);
+		settings2.load();
+		settings2.getValuesJson(after);
+		assertStr("", after, "{\"int0\":5}");
+
+		unlink(testPath);
+		unlink(backupPath);
+	}
+
+	// Cold boot benchmark: merge 60 default values into empty settings
+	{
+		const int iterations = 200;
+
+		auto start = std::chrono::steady_clock::now();
+		for(int ii = 0; ii < iterations; ii++) {
+			JsonParser parser;
+			parser.allocate(4096);
+			parser.addString("{}");
+			parser.parse();
+			jsonModifierAddDefaults(parser, defaults);
+		}
+		double modifierUs = std::chrono::duration<double, std::micro>(std::chrono::steady_clock::now() - start).count() / iterations;
+
+		start = std::chrono::steady_clock::now();
+		for(int ii = 0; ii < iterations; ii++) {
+			SleepHelper::SettingsFile settings;
+			settings.load();
+			settings.addDefaultValues(defaults);
+		}
+		double mergeUs = std::chrono::duration<double, std::micro>(std::chrono::steady_clock::now() - start).count() / iterations;
+
+		printf("settings 60 defaults: JsonModifier per key=%.1fus single pass merge=%.1fus\n", modifierUs, mergeUs);
+	}
+}
+
+// Generates settings "setting0" to "settingN", optionally with one changed value, one removed key, and one added key
+String makeCloudSettings(int numKeys, int changedKey = -1, int removedKey = -1, bool addKey = false) {
+	String json = "{";
+	for(int ii = 0; ii < numKeys; ii++) {
+		if (ii == removedKey) {
+			continue;
+		}
+		if (json.length() > 1) {
+			json += ",";
+		}
+		json += String::format("\"setting%d\":%d", ii, (ii == changedKey) ? -1 : ii);
+	}
+	if (addKey) {
+		json += ",\"added\":\"yes\"";
+	}
+	json += "}";
+	return json;
+}
+
+void settingsDeltaSyncTest() {
+	const char *testPath = "settings6.json";
+	String backupPath = String(testPath) + ".bak";
+
+	unlink(testPath);
+	unlink(backupPath);
+
+	{
+		String cloudSettings = makeCloudSettings(40);
+
+		SleepHelper::CloudSettingsFile settings;
+		settings.withPath(testPath);
+		settings.load();
+		settings.setValuesJson(cloudSettings);
+
+		std::vector<String> changedKeys;
+		settings.withSettingsBatchChangeFunction([&changedKeys](const std::vector<String> &keys) {
+			changedKeys = keys;
+			return true;
+		});
+
+		String digest;
+		String delta;
+		settings.getDigestJson(digest);
+		assertInt("", (int)digest.length(), 8 + (int)SleepHelper::CloudSettingsFile::DIGEST_BUCKETS * 8);
+
+		// In sync
+		assertInt("", SleepHelper::CloudSettingsFile::getDeltaJson(cloudSettings, digest, delta), true);
+		assertStr("", delta, "{\"b\":[],\"v\":{}}");
+		assertInt("", settings.applyDeltaJson(delta), true);
+		assertInt("", (int)changedKeys.size(), 0);
+
+		// Digest does not depend on key order or whitespace
+		SleepHelper::CloudSettingsFile reordered;
+		reordered.setValuesJson("{ \"setting1\" : 1, \"setting0\" : 0 }");
+		SleepHelper::CloudSettingsFile ordered;
+		ordered.setValuesJson("{\"setting0\":0,\"setting1\":1}");
+		String digest1, digest2;
+		reordered.getDigestJson(digest1);
+		ordered.getDigestJson(digest2);
+		assertStr("", digest1, digest2);
+
+		// Cloud changes one value, removes one key, and adds one key
+		String newCloudSettings = makeCloudSettings(40, 7, 12, true);
+
+		assertInt("", SleepHelper::CloudSettingsFile::getDeltaJson(newCloudSettings, digest, delta), true);
+		printf("settings delta sync: full=%u bytes digest=%u bytes delta=%u bytes\n", 
+			(unsigned)newCloudSettings.length(), (unsigned)digest.length(), (unsigned)delta.length());
+		assertInt("", delta.length() < newCloudSettings.length() / 2, true);
+
+		assertInt("", settings.applyDeltaJson(delta), true);
+
+		int intValue = 0;
+		String stringValue;
+		assertInt("", settings.getValue("setting7", intValue), true);
+		assertInt("", intValue, -1);
+		assertInt("", settings.getValue("setting12", intValue), false);
+		assertInt("", settings.getValue("added", stringValue), true);
+		assertStr("", stringValue, "yes");
+		assertInt("", settings.getValue("setting39", intValue), true);
+		assertInt("", intValue, 39);
+
+		// Only the changed and added keys are notified
+		assertInt("", (int)changedKeys.size(), 2);
+
+		// Device and cloud are now in sync
+		settings.getDigestJson(digest);
+		SleepHelper::CloudSettingsFile cloud;
+		cloud.setValuesJson(newCloudSettings);
+		cloud.getDigestJson(digest2);
+		assertStr("", digest, digest2);
+		assertInt("", SleepHelper::CloudSettingsFile::getDeltaJson(newCloudSettings, digest, delta), true);
+		assertStr("", delta, "{\"b\":[],\"v\":{}}");
+
+		// Invalid input
+		assertInt("", SleepHelper::CloudSettingsFile::getDeltaJson(newCloudSettings, "{\"b\":\"1234\"}", delta), false);
+		assertInt("", settings.applyDeltaJson("{\"b\":[99],\"v\":{}}"), false);
+
+		unlink(testPath);
+		unlink(backupPath);
+	}
+}
+
+void settingsHashTest() {
+	// Hash does not depend on key order or whitespace
+	{
+		SleepHelper::CloudSettingsFile settings1;
+		settings1.setValuesJson("{\"t1\":1234,\"t2\":\"testing 2!\",\"t3\":[1,2,{\"a\":true}]}");
+
+		SleepHelper::CloudSettingsFile settings2;
+		settings2.setValuesJson("{ \"t3\" : [ 1, 2, { \"a\" : true } ],\n\"t2\": \"testing 2!\", \"t1\": 1234 }");
+		assertInt("", settings1.getHash() == settings2.getHash(), true);
+
+		// But does depend on types and structure
+		SleepHelper::CloudSettingsFile settings3;
+		settings3.setValuesJson("{\"t1\":\"1234\",\"t2\":\"testing 2!\",\"t3\":[1,2,{\"a\":true}]}");
+		assertInt("", settings1.getHash() == settings3.getHash(), false);
+
+		SleepHelper::CloudSettingsFile settings4;
+		settings4.setValuesJson("{\"t1\":1234,\"t2\":\"testing 2!\",\"t3\":[[1,2],{\"a\":true}]}");
+		assertInt("", settings1.getHash() == settings4.getHash(), false);
+	}
+
+	// Incremental updates match a full calculation
+	{
+		SleepHelper::SettingsFile settings;
+		settings.load();
+		settings.setValue("t1", 1);
+		settings.setValue("t2", "testing");
+		settings.getHash();
+
+		settings.setValue("t1", 2);
+		settings.setValue("t3", 3.5);
+		settings.updateValuesJson("{\"t2\":\"testing 2!\",\"t4\":[1,2],\"t1\":2}");
+		settings.addDefaultValues("{\"t5\":false,\"t1\":99}");
+
+		String json;
+		settings.getValuesJson(json);
+		SleepHelper::SettingsFile settings2;
+		settings2.load();
+		settings2.setValuesJson(json);
+		assertInt("", settings.getHash() == settings2.getHash(), true);
+	}
+
+	// Benchmark: hash of the whole buffer vs. cached hash, by settings size
+	const size_t numKeys[] = { 10, 100, 500 };
+	for(size_t ii = 0; ii < sizeof(numKeys) / sizeof(numKeys[0]); ii++) {
+		String json = "{";
+		for(size_t key = 0; key < numKeys[ii]; key++) {
+			if (key > 0) {
+				json += ",";
+			}
+			json += String::format("\"setting%u\":\"value %u\"", (unsigned)key, (unsigned)key);
+		}
+		json += "}";
+
+		SleepHelper::SettingsFile settings;
+		settings.load();
+		settings.setValuesJson(json);
+
+		const int iterations = 10000;
+		uint32_t result = 0;
+
+		auto start = std::chrono::steady_clock::now();
+		for(int jj = 0; jj < iterations; jj++) {
+			result ^= settings.getBufferHash();
+		}
+		double bufferUs = std::chrono::duration<double, std::micro>(std::chrono::steady_clock::now() - start).count() / iterations;
+
+		start = std::chrono::steady_clock::now();
+		settings.getHash();
+		double firstUs = std::chrono::duration<double, std::micro>(std::chrono::steady_clock::now() - start).count();
+
+		start = std::chrono::steady_clock::now();
+		for(int jj = 0; jj < iterations; jj++) {
+			result ^= settings.getHash();
+		}
+		double cachedUs = std::chrono::duration<double, std::micro>(std::chrono::steady_clock::now() - start).count() / iterations;
+
+		start = std::chrono::steady_clock::now();
+		settings.setValue("setting0", "changed");
+		result ^= settings.getHash();
+		double changeUs = std::chrono::duration<double, std::micro>(std::chrono::steady_clock::now() - start).count();
+
+		printf("settings hash keys=%u bytes=%u buffer=%.2fus first=%.2fus cached=%.3fus setValue+hash=%.2fus (%08lx)\n", 
+			(unsigned)numKeys[ii], (unsigned)json.length(), bufferUs, firstUs, cachedUs, changeUs, (unsigned long)result);
+	}
+}
+
+constexpr SleepHelper::SettingsFile::IntSetting schemaInterval("interval", 900, 60, 86400);
+constexpr SleepHelper::SettingsFile::DoubleSetting schemaThreshold("threshold", 2.5, 0, 100);
+constexpr SleepHelper::SettingsFile::BoolSetting schemaEnabled("enabled", true);
+constexpr SleepHelper::SettingsFile::StringSetting schemaName("name", "sensor \"1\"", 16);
+constexpr SleepHelper::SettingsFile::IntSetting schemaRetries("retries", 3, 0, 10);
+
+const SleepHelper::SettingsFile::SettingDef *settingsSchemaV1[] = { &schemaInterval, &schemaThreshold, &schemaEnabled, &schemaName };
+const SleepHelper::SettingsFile::SettingDef *settingsSchemaV2[] = { &schemaInterval, &schemaThreshold, &schemaEnabled, &schemaName, &schemaRetries };
+
+void settingsSchemaTest() {
+	const char *testPath = "settings7.json";
+	String backupPath = String(testPath) + ".bak";
+
+	unlink(testPath);
+	unlink(backupPath);
+
+	{
+		// Cold boot: defaults are materialized from the schema
+		SleepHelper::SettingsFile settings;
+		settings.withPath(testPath);
+		settings.withSchema(settingsSchemaV1, 1);
+		settings.load();
+		assertInt("", settings.getDefaultsMergedOnLoad(), true);
+
+		assertInt("", settings.get(schemaInterval), 900);
+		assertDouble("", settings.get(schemaThreshold), 2.5, 0.001);
+		assertInt("", settings.get(schemaEnabled), true);
+		assertStr("", settings.get(schemaName), "sensor \"1\"");
+
+		String json;
+		settings.getValuesJson(json);
+		assertStr("", json, "{\"interval\":900,\"threshold\":2.5,\"enabled\":true,\"name\":\"sensor \\\"1\\\"\"}");
+
+		// Typed set with bounds
+		assertInt("", settings.set(schemaInterval, 30), false);
+		assertInt("", settings.set(schemaInterval, 120), true);
+		assertInt("", settings.get(schemaInterval), 120);
+		assertInt("", settings.set(schemaName, "this name is too long"), false);
+		assertInt("", settings.set(schemaEnabled, false), true);
+
+		// Validation of JSON updates
+		assertInt("", settings.setValuesJson("{\"interval\":10,\"threshold\":1}"), false);
+		assertInt("", settings.setValuesJson("{\"interval\":\"900\"}"), false);
+		assertInt("", settings.setValuesJson("{\"interval\":900.5}"), false);
+		assertInt("", settings.updateValuesJson("{\"enabled\":1}"), false);
+		assertInt("", settings.updateValuesJson("{\"threshold\":true}"), false);
+		assertInt("", settings.updateValuesJson("{\"name\":\"this name is too long\"}"), false);
+		assertInt("", settings.get(schemaInterval), 120);
+		assertInt("", settings.get(schemaEnabled), false);
+
+		assertInt("", settings.updateValuesJson("{\"threshold\":1e1,\"other\":\"not in schema\"}"), true);
+		assertDouble("", settings.get(schemaThreshold), 10.0, 0.001);
+	}
+
+	{
+		// Warm boot with the same schema version skips the default merge
+		SleepHelper::SettingsFile settings;
+		settings.withPath(testPath);
+		settings.withSchema(settingsSchemaV1, 1);
+		settings.load();
+		assertInt("", settings.getDefaultsMergedOnLoad(), false);
+		assertInt("", settings.get(schemaInterval), 120);
+		assertInt("", settings.get(schemaEnabled), false);
+
+		// Not in the schema version 1, so the default is returned without being stored
+		assertInt("", settings.get(schemaRetries), 3);
+		int intValue;
+		assertInt("", settings.getValue("retries", intValue), false);
+	}
+
+	{
+		// New schema version adds the new default and keeps existing values
+		SleepHelper::SettingsFile settings;
+		settings.withPath(testPath);
+		settings.withSchema(settingsSchemaV2, 2);
+		settings.load();
+		assertInt("", settings.getDefaultsMergedOnLoad(), true);
+		assertInt("", settings.get(schemaInterval), 120);
+		int intValue;
+		assertInt("", settings.getValue("retries", intValue), true);
+		assertInt("", intValue, 3);
+
+		SleepHelper::SettingsFile settings2;
+		settings2.withPath(testPath);
+		settings2.withSchema(settingsSchemaV2, 2);
+		settings2.load();
+		assertInt("", settings2.getDefaultsMergedOnLoad(), false);
+	}
+
+	{
+		// Cloud settings return schema defaults but do not store them
+		unlink(testPath);
+		unlink(backupPath);
+
+		SleepHelper::CloudSettingsFile settings;
+		settings.withPath(testPath);
+		settings.withSchema(settingsSchemaV1, 1);
+		settings.load();
+		assertInt("", settings.get(schemaInterval), 900);
+
+		String json;
+		settings.getValuesJson(json);
+		assertStr("", json, "{}");
+
+		assertInt("", settings.setValuesJson("{\"interval\":5}"), false);
+		assertInt("", settings.setValuesJson("{\"interval\":600}"), true);
+		assertInt("", settings.get(schemaInterval), 600);
+	}
+
+	unlink(testPath);
+	unlink(backupPath);
+}
+
+void settingsViewTest() {
+	const char *t1 = "{\"t1\":1234,\"t2\":\"testing \\\"2\\\"\",\"t3\":[1,2.5,{\"a\":true,\"b\":null}],\"t4\":false}";
+
+	SleepHelper::SettingsFile settings;
+	settings.setValuesJson(t1);
+
+	// View matches the stored JSON without copying
+	{
+		SleepHelper::SettingsFile::ValuesView view = settings.getValuesView();
+		assertStr("", view.c_str(), t1);
+		assertInt("", (int)view.length(), (int)strlen(t1));
+	}
+
+	{
+		String json;
+		settings.getValuesJson(json);
+		assertStr("", json, t1);
+	}
+
+	// Copy to a buffer, with truncation like snprintf
+	{
+		char buf[256];
+		assertInt("", (int)settings.copyValuesJson(buf, sizeof(buf)), (int)strlen(t1));
+		assertStr("", buf, t1);
+
+		char smallBuf[8];
+		assertInt("", (int)settings.copyValuesJson(smallBuf, sizeof(smallBuf)), (int)strlen(t1));
+		assertStr("", smallBuf, "{\"t1\":12");
+	}
+
+	// Write to a JSONWriter
+	{
+		char buf[256];
+		memset(buf, 0, sizeof(buf));
+		JSONBufferWriter writer(buf, sizeof(buf) - 1);
+		writer.beginObject();
+		writer.name("x");
+		assertInt("", settings.writeValuesJson(writer), true);
+		writer.endObject();
+
+		assertStr("", buf, String::format("{\"x\":%s}", t1));
+	}
+
+	// Numbers are written so they read back as the same value
+	{
+		SleepHelper::SettingsFile settings2;
+		settings2.setValuesJson("{\"a\":3000000000,\"b\":1.2345678901,\"c\":-2.50,\"d\":1e3,\"e\":1.5e-3}");
+
+		char buf[256];
+		memset(buf, 0, sizeof(buf));
+		JSONBufferWriter writer(buf, sizeof(buf) - 1);
+		assertInt("", settings2.writeValuesJson(writer), true);
+		assertStr("", buf, "{\"a\":3000000000,\"b\":1.2345678901,\"c\":-2.50,\"d\":1000,\"e\":0.0015}");
+
+		// Too many digits for a double is an error, not a different value
+		settings2.setValuesJson("{\"a\":12345678901234567890,\"b\":1}");
+		memset(buf, 0, sizeof(buf));
+		JSONBufferWriter writer2(buf, sizeof(buf) - 1);
+		assertInt("", settings2.writeValuesJson(writer2), false);
+		assertStr("", buf, "{\"a\":null,\"b\":1}");
+	}
+
+	// Empty settings
+	{
+		SleepHelper::SettingsFile settings2;
+		settings2.setValuesJson("{}");
+
+		SleepHelper::SettingsFile::ValuesView view = settings2.getValuesView();
+		assertStr("", view.c_str(), "{}");
+	}
+
+	// Benchmark: getValuesJson vs. view by settings size
+	const size_t numKeys[] = { 10, 100, 300 };
+	for(size_t ii = 0; ii < sizeof(numKeys) / sizeof(numKeys[0]); ii++) {
+		String json = "{";
+		for(size_t key = 0; key < numKeys[ii]; key++) {
+			if (key > 0) {
+				json += ",";
+			}
+			json += String::format("\"setting%u\":\"value %u\"", (unsigned)key, (unsigned)key);
+		}
+		json += "}";
+
+		SleepHelper::SettingsFile settings2;
+		settings2.withMaxSize(32768);
+		settings2.setValuesJson(json);
+
+		const int iterations = 2000;
+		size_t result = 0;
+
+		auto start = std::chrono::steady_clock::now();
+		for(int jj = 0; jj < iterations; jj++) {
+			String json2;
+			settings2.getValuesJson(json2);
+			result += json2.length();
+		}
+		double stringUs = std::chrono::duration<double, std::micro>(std::chrono::steady_clock::now() - start).count() / iterations;
+
+		start = std::chrono::steady_clock::now();
+		for(int jj = 0; jj < iterations; jj++) {
+			SleepHelper::SettingsFile::ValuesView view = settings2.getValuesView();
+			result += view.length();
+		}
+		double viewUs = std::chrono::duration<double, std::micro>(std::chrono::steady_clock::now() - start).count() / iterations;
+
+		printf("settings export keys=%u bytes=%u getValuesJson=%.2fus view=%.3fus (%u)\n", 
+			(unsigned)numKeys[ii], (unsigned)json.length(), stringUs, viewUs, (unsigned)result);
+	}
+}
+
+void settingsPartitionTest() {
+	const char *testPath = "settings3.json";
+	const char *partitionPath = "settings3.cal.json";
+	const char *paths[] = { testPath, "settings3.json.bak", partitionPath, "settings3.cal.json.bak", 
+		"settings3.json.meta", "settings3.json.bak.meta", "settings3.cal.json.meta", "settings3.cal.json.bak.meta" };
+
+	for(size_t ii = 0; ii < sizeof(paths) / sizeof(paths[0]); ii++) {
+		unlink(paths[ii]);
+	}
+
+	{
+		SleepHelper::SettingsFile settings;
+		settings.withPath(testPath);
+		settings.withDefaultValues("{\"interval\":900,\"name\":\"test\"}");
+
+		SleepHelper::SettingsFile &cal = settings.addPartition("cal");
+		cal.withDefaultValues("{\"offset\":0.5,\"gain\":1}");
+		assertInt("", (int)settings.getPartitionCount(), 1);
+		assertInt("", settings.getPartition("cal") == &cal, true);
+		assertInt("", settings.getPartition("other") == NULL, true);
+
+		double offset = 0;
+		settings.withBinding("offset", offset);
+
+		String keysChanged;
+		settings.withSettingChangeFunction([&keysChanged](const char *key) {
+			keysChanged += key;
+			keysChanged += ",";
+			return true;
+		});
+
+		settings.load();
+		assertDouble("", offset, 0.5, 0.001);
+
+		// Keys in the partition are readable through the parent
+		int intValue = 0;
+		assertInt("", settings.getValue("gain", intValue), true);
+		assertInt("", intValue, 1);
+		assertInt("", settings.getValue("interval", intValue), true);
+		assertInt("", intValue, 900);
+
+		String json;
+		settings.getValuesJson(json);
+		assertStr("", json, "{\"interval\":900,\"name\":\"test\"}");
+		cal.getValuesJson(json);
+		assertStr("", json, "{\"offset\":0.5,\"gain\":1}");
+		settings.getMergedValuesJson(json);
+		assertStr("", json, "{\"interval\":900,\"name\":\"test\",\"offset\":0.5,\"gain\":1}");
+
+		// Setting a partition key through the parent only changes the partition file
+		struct stat sb1, sb2;
+		stat(testPath, &sb1);
+		keysChanged = "";
+		settings.setValue("offset", 1.25);
+		assertDouble("", offset, 1.25, 0.001);
+		assertStr("", keysChanged, "offset,");
+		settings.getValuesJson(json);
+		assertStr("", json, "{\"interval\":900,\"name\":\"test\"}");
+		stat(testPath, &sb2);
+		assertInt("", sb1.st_mtime == sb2.st_mtime && sb1.st_size == sb2.st_size, true);
+		assertInt("", stat(partitionPath, &sb2), 0);
+
+		// Updates are split between the parent and partition
+		keysChanged = "";
+		settings.updateValuesJson("{\"interval\":600,\"gain\":2,\"added\":true}");
+		assertStr("", keysChanged, "gain,interval,added,");
+		cal.getValuesJson(json);
+		assertStr("", json, "{\"offset\":1.25,\"gain\":2}");
+		settings.getValuesJson(json);
+		assertStr("", json, "{\"interval\":600,\"name\":\"test\",\"added\":true}");
+	}
+
+	{
+		// Reload from both files
+		SleepHelper::SettingsFile settings;
+		settings.withPath(testPath);
+		settings.addPartition("cal");
+		settings.load();
+
+		double doubleValue = 0;
+		assertInt("", settings.getValue("offset", doubleValue), true);
+		assertDouble("", doubleValue, 1.25, 0.001);
+
+		int intValue = 0;
+		assertInt("", settings.getValue("interval", intValue), true);
+		assertInt("", intValue, 600);
+	}
+
+	for(size_t ii = 0; ii < sizeof(paths) / sizeof(paths[0]); ii++) {
+		unlink(paths[ii]);
+	}
+
+	{
+		// Keys in a partition are routed the same way by every function and checked against the parent schema
+		SleepHelper::SettingsFile settings;
+		settings.withPath(testPath);
+		settings.withSchema(settingsSchemaV1, 1);
+
+		SleepHelper::SettingsFile &cal = settings.addPartition("cal");
+		cal.withDefaultValues("{\"interval\":900}");
+		settings.load();
+
+		String json;
+		settings.getValuesJson(json);
+		assertInt("", strstr(json.c_str(), "interval") == NULL, true);
+		assertInt("", settings.get(schemaInterval), 900);
+
+		assertInt("", settings.updateValuesJson("{\"interval\":5}"), false);
+		assertInt("", settings.setValuesJson("{\"interval\":5}"), false);
+		assertInt("", settings.get(schemaInterval), 900);
+
+		assertInt("", settings.updateValuesJson("{\"interval\":600,\"threshold\":5}"), true);
+		int intValue = 0;
+		assertInt("", cal.getValue("interval", intValue), true);
+		assertInt("", intValue, 600);
+		assertInt("", settings.get(schemaInterval), 600);
+		assertDouble("", settings.get(schemaThreshold), 5, 0.001);
+
+		// Cloud sync replaces the parent settings and merges into the partition
+		assertInt("", settings.setValuesJson("{\"interval\":300,\"enabled\":false}"), true);
+		assertInt("", settings.get(schemaInterval), 300);
+		assertInt("", settings.get(schemaEnabled), false);
+		settings.getValuesJson(json);
+		assertStr("", json, "{\"enabled\":false}");
+		cal.getValuesJson(json);
+		assertStr("", json, "{\"interval\":300}");
+
+		// Defaults for partition keys do not create a copy in the parent
+		assertInt("", settings.addDefaultValues("{\"interval\":1200,\"retries\":3}"), true);
+		settings.getValuesJson(json);
+		assertStr("", json, "{\"enabled\":false,\"retries\":3}");
+		assertInt("", settings.get(schemaInterval), 300);
+	}
+
+	for(size_t ii = 0; ii < sizeof(paths) / sizeof(paths[0]); ii++) {
+		unlink(paths[ii]);
+	}
+}
+
+void settingsJournalTest() {
+	const char *testPath = "settings4.json";
+	const char *journalPath = "settings4.json.journal";
+	const char *paths[] = { testPath, "settings4.json.bak", journalPath, "settings4.json.meta", "settings4.json.bak.meta" };
+
+	for(size_t ii = 0; ii < sizeof(paths) / sizeof(paths[0]); ii++) {
+		unlink(paths[ii]);
+	}
+
+	struct stat sb1, sb2;
+	int intValue;
+	String stringValue;
+
+	{
+		SleepHelper::SettingsFile settings;
+		settings.withPath(testPath);
+		settings.withJournal(256);
+		settings.withDefaultValues("{\"a\":1,\"b\":\"test\"}");
+		settings.load();
+
+		// Defaults on first boot are written to the settings file
+		assertInt("", (int)settings.getJournalSize(), 0);
+		assertInt("", stat(testPath, &sb1), 0);
+
+		// Changes are appended to the journal
+		settings.setValue("a", 2);
+		settings.setValue("b", "changed");
+		assertInt("", settings.getJournalSize() > 0, true);
+		assertInt("", settings.getJournalSize() < 64, true);
+		stat(testPath, &sb2);
+		assertInt("", sb1.st_size == sb2.st_size, true);
+
+		// Transactions write one record
+		size_t journalSize = settings.getJournalSize();
+		settings.beginTransaction();
+		settings.setValue("a", 3);
+		settings.setValue("c", true);
+		settings.commitTransaction();
+		assertInt("", settings.getJournalSize() - journalSize, (int)strlen("{\"a\":3,\"c\":true}\n"));
+	}
+
+	{
+		// Load replays the journal
+		SleepHelper::SettingsFile settings;
+		settings.withPath(testPath);
+		settings.withJournal(256);
+		settings.load();
+
+		assertInt("", settings.getValue("a", intValue), true);
+		assertInt("", intValue, 3);
+		assertInt("", settings.getValue("b", stringValue), true);
+		assertStr("", stringValue, "changed");
+
+		String json;
+		settings.getValuesJson(json);
+		assertStr("", json, "{\"a\":3,\"b\":\"changed\",\"c\":true}");
+
+		// Without the journal, only the settings file is used
+		SleepHelper::SettingsFile settings2;
+		settings2.withPath(testPath);
+		settings2.load();
+		assertInt("", settings2.getValue("a", intValue), true);
+		assertInt("", intValue, 1);
+
+		// Compacts when the journal would exceed the maximum size
+		for(int ii = 0; ii < 30; ii++) {
+			settings.setValue("a", 100 + ii);
+			assertInt("", settings.getJournalSize() <= 256, true);
+		}
+		settings2.load();
+		assertInt("", settings2.getValue("a", intValue), true);
+		assertInt("", intValue > 100 && intValue <= 129, true);
+
+		// Compact on demand, optionally only above a minimum journal size
+		assertInt("", settings.compactJournal(settings.getJournalSize() + 1), false);
+		assertInt("", settings.getJournalSize() > 0, true);
+		assertInt("", settings.compactJournal(), true);
+		assertInt("", (int)settings.getJournalSize(), 0);
+		assertInt("", stat(journalPath, &sb1), -1);
+		assertInt("", settings.compactJournal(), false);
+		settings2.load();
+		assertInt("", settings2.getValue("a", intValue), true);
+		assertInt("", intValue, 129);
+
+		// setValuesJson can remove keys, so it always writes the settings file
+		settings.setValue("a", 5);
+		assertInt("", settings.getJournalSize() > 0, true);
+		settings.setValuesJson("{\"a\":6}");
+		assertInt("", (int)settings.getJournalSize(), 0);
+		assertInt("", stat(journalPath, &sb1), -1);
+	}
+
+	{
+		// Incomplete record from a reset during save is ignored
+		SleepHelper::SettingsFile settings;
+		settings.withPath(testPath);
+		settings.withJournal(256);
+		settings.load();
+		settings.setValue("a", 7);
+
+		int fd = open(journalPath, O_WRONLY | O_APPEND);
+		write(fd, "{\"a\":8", 6);
+		close(fd);
+
+		SleepHelper::SettingsFile settings2;
+		settings2.withPath(testPath);
+		settings2.withJournal(256);
+		settings2.load();
+		assertInt("", settings2.getValue("a", intValue), true);
+		assertInt("", intValue, 7);
+
+		// Next save writes the settings file instead of appending after the incomplete record
+		settings2.setValue("a", 9);
+		assertInt("", (int)settings2.getJournalSize(), 0);
+	}
+
+	for(size_t ii = 0; ii < sizeof(paths) / sizeof(paths[0]); ii++) {
+		unlink(paths[ii]);
+	}
+}
+
+void persistentDataTest() {
+	const char *persistentDataPath = "./temp01.dat";
+	{
+		SleepHelper::PersistentData data(persistentDataPath);
+		unlink(persistentDataPath);
+		data.withSaveDelayMs(0);
+		data.load();
+		data.save();
+
+		assertFile("", persistentDataPath, "testfiles/test01.dat");
+
+		data.setValue_lastUpdateCheck(123);
+	}
+
+	{
+		// Write-behind: changes are held in RAM until flushed
+		unlink(persistentDataPath);
+
+		SleepHelper::PersistentData data(persistentDataPath);
+		data.withSaveDelayMs(0);
+		data.withWriteBehind(std::chrono::milliseconds(60000));
+		data.load();
+		data.save();
+		assertInt("", data.getWriteBehind(), true);
+
+		data.setValue_lastFullWake(1656633600);
+		data.setValue_lastQuickWake(1656633700);
+		data.setValue_nextDataCapture(1656633720);
+		assertInt("", data.getWriteBehindDirty(), true);
+		assertInt("", (int)data.getWritesAvoided(), 2);
+
+		SleepHelper::PersistentData data2(persistentDataPath);
+		data2.load();
+		assertInt("", (int)data2.getValue_lastFullWake(), 0);
+		assertInt("", (int)data2.getValue_nextDataCapture(), 0);
+
+		// Max delay has not elapsed
+		assertInt("", data.flushWriteBehind(false), false);
+
+		assertInt("", data.flushWriteBehind(true), true);
+		assertInt("", data.getWriteBehindDirty(), false);
+		assertInt("", data.flushWriteBehind(true), false);
+
+		SleepHelper::PersistentData data3(persistentDataPath);
+		data3.load();
+		assertInt("", (int)data3.getValue_lastFullWake(), 1656633600);
+		assertInt("", (int)data3.getValue_lastQuickWake(), 1656633700);
+		assertInt("", (int)data3.getValue_nextDataCapture(), 1656633720);
+
+		// Simulated wake cycles, each setting the quick wake and next data capture times, then sleeping
+		const int numCycles = 100;
+		uint32_t avoidedBefore = data.getWritesAvoided();
+		int writes = 0;
+		for(int ii = 0; ii < numCycles; ii++) {
+			data.setValue_lastQuickWake(1656634000 + ii * 120);
+			data.setValue_nextDataCapture(1656634000 + ii * 120 + 120);
+			if (data.flushWriteBehind(true)) {
+				writes++;
+			}
+		}
+		printf("write-behind: %d wake cycles, %d writes, %u writes avoided\n", numCycles, writes, (unsigned)(data.getWritesAvoided() - avoidedBefore));
+		assertInt("", writes, numCycles);
+		assertInt("", (int)(data.getWritesAvoided() - avoidedBefore), numCycles);
+	}
+
+	unlink(persistentDataPath);
+}
+
+void persistentDataRetainedTest() {
+	const char *persistentDataPath = "./temp01.dat";
+	unlink(persistentDataPath);
+
+	SleepHelper::PersistentData::RetainedData retainedData; // Simulating retained data
+	memset(&retainedData, 0, sizeof(retainedData));
+
+	{
+		// Cold boot: retained memory is not valid, load from the file
+		SleepHelper::PersistentData data(persistentDataPath);
+		data.withSaveDelayMs(0);
+		data.withRetained(&retainedData, std::chrono::seconds(3600));
+		assertInt("", data.loadRetained(), false);
+		data.load();
+		data.saveRetained();
+
+		data.setValue_lastFullWake(1656633600);
+		data.setValue_nextDataCapture(1656633720);
+		assertInt("", data.getWriteBehindDirty(), true);
+
+		// File has not been written
+		struct stat sb;
+		assertInt("", stat(persistentDataPath, &sb), -1);
+
+		// Warm boot: retained memory is used, the file is not read
+		SleepHelper::PersistentData data2(persistentDataPath);
+		data2.withRetained(&retainedData, std::chrono::seconds(3600));
+		assertInt("", data2.loadRetained(), true);
+		assertInt("", (int)data2.getValue_lastFullWake(), 1656633600);
+		assertInt("", (int)data2.getValue_nextDataCapture(), 1656633720);
+
+		// Forced write of the file mirror, as on reset
+		assertInt("", data.getFileSaveDue(1656633600), true);
+		assertInt("", data.flushWriteBehind(true), true);
+		assertInt("", stat(persistentDataPath, &sb), 0);
+
+		data.setValue_nextDataCapture(1656633840);
+		assertInt("", data.getFileSaveDue((time_t)retainedData.lastFileSave + 3599), false);
+		assertInt("", data.getFileSaveDue((time_t)retainedData.lastFileSave + 3600), true);
+
+		// Corrupted retained memory falls back to the file, losing changes since the last file write
+		retainedData.data.nextDataCapture ^= 1;
+		SleepHelper::PersistentData data3(persistentDataPath);
+		data3.withRetained(&retainedData, std::chrono::seconds(3600));
+		assertInt("", data3.loadRetained(), false);
+		data3.load();
+		assertInt("", (int)data3.getValue_lastFullWake(), 1656633600);
+		assertInt("", (int)data3.getValue_nextDataCapture(), 1656633720);
+	}
+
+	{
+		// Model 1 week of 2 minute quick wakes with the file mirror written hourly, with power loss 
+		// (retained memory lost) at arbitrary times. Compare file writes and data lost on power loss
+		// to writing the file on every change.
+		unlink(persistentDataPath);
+		memset(&retainedData, 0, sizeof(retainedData));
+
+		SleepHelper::PersistentData data(persistentDataPath);
+		data.withSaveDelayMs(0);
+		data.withRetained(&retainedData, std::chrono::seconds(3600));
+		data.load();
+		data.saveRetained();
+
+		const time_t startTime = 1656633600;
+		const int numCycles = 7 * 24 * 30;
+		int fileWrites = 0;
+		int powerLosses = 0;
+		int maxSecondsLost = 0;
+		uint32_t seed = 1;
+
+		for(int ii = 0; ii < numCycles; ii++) {
+			time_t now = startTime + ii * 120;
+			data.setValue_lastQuickWake(now);
+			data.setValue_nextDataCapture(now + 120);
+
+			if (data.getFileSaveDue(now)) {
+				assertInt("", data.flushWriteBehind(true), true);
+				retainedData.lastFileSave = (uint32_t)now;
+				fileWrites++;
+			}
+
+			seed = seed * 1103515245 + 12345;
+			if (((seed >> 16) % 500) == 0) {
+				// Power loss: retained memory is lost, reload from the file
+				powerLosses++;
+				memset(&retainedData, 0, sizeof(retainedData));
+
+				SleepHelper::PersistentData data2(persistentDataPath);
+				data2.withRetained(&retainedData, std::chrono::seconds(3600));
+				assertInt("", data2.loadRetained(), false);
+				data2.load();
+
+				int secondsLost = (int)(now - data2.getValue_lastQuickWake());
+				assertInt("", secondsLost >= 0 && secondsLost <= 3600, true);
+				if (secondsLost > maxSecondsLost) {
+					maxSecondsLost = secondsLost;
+				}
+				data2.saveRetained();
+				assertInt("", data.loadRetained(), true);
+				retainedData.lastFileSave = (uint32_t)now;
+			}
+		}
+		printf("retained: %d quick wakes, %d file writes (vs. %d), %d power losses, max %d sec of state lost\n", 
+			numCycles, fileWrites, numCycles * 2, powerLosses, maxSecondsLost);
+		assertInt("", fileWrites <= numCycles / 30 + 1, true);
+	}
+
+	unlink(persistentDataPath);
+}
+
+class MyPersistentData : public StorageHelperRK::PersistentDataFile {
+public:
+	class MyData {
+	public:
+		// This structure must always begin with the header (16 bytes)
+		StorageHelperRK::PersistentDataBase::SavedDataHeader header;
+		// Your fields go here. Once you've added a field you cannot add fields
+		// (except at the end), insert fields, remove fields, change size of a field.
+		// Doing so will cause the data to be corrupted!
+		// You may want to keep a version number in your data.
+		int test1;
+		bool test2;
+		double test3;
+		char test4[10];
+		// OK to add more fields here 
+	};
+
+	static const uint32_t DATA_MAGIC = 0x20a99e73;
+	static const uint16_t DATA_VERSION = 1;
+
+	MyPersistentData(const char *filename) : StorageHelperRK::PersistentDataFile(filename, &myData.header, sizeof(MyData), DATA_MAGIC, DATA_VERSION) {};
+
+	int getValue_test1() const {
+		return getValue<int>(offsetof(MyData, test1));
+	}
+
+	void setValue_test1(int value) {
+		setValue<int>(offsetof(MyData, test1), value);
+	}
+
+	bool getValue_test2() const {
+		return getValue<bool>(offsetof(MyData, test2));
+	}
+
+	void setValue_test2(bool value) {
+		setValue<bool>(offsetof(MyData, test2), value);
+	}
+
+	double getValue_test3() const {
+		return getValue<double>(offsetof(MyData, test3));
+	}
+
+	void setValue_test3(double value) {
+		setValue<double>(offsetof(MyData, test3), value);
+	}
+
+	String getValue_test4() const {
+		String result;
+		getValueString(offsetof(MyData, test4), sizeof(MyData::test4), result);
+		return result;
+	}
+	bool setValue_test4(const char *str) {
+		return setValueString(offsetof(MyData, test4), sizeof(MyData::test4), str);
+	}
+
+
+	MyData myData;
+};
+
+
+
+class MyPersistentData2 : public StorageHelperRK::PersistentDataFile {
+public:
+	class MyData {
+	public:
+		// This structure must always begin with the header (16 bytes)
+		StorageHelperRK::PersistentDataBase::SavedDataHeader header;
+		// Your fields go here. Once you've added a field you cannot add fields
+		// (except at the end), insert fields, remove fields, change size of a field.
+		// Doing so will cause the data to be corrupted!
+		// You may want to keep a version number in your data.
+		int test1;
+		bool test2;
+		double test3;
+		char test4[10];
+		uint32_t test5;
+		// OK to add more fields here 
+	};
+
+	static const uint32_t DATA_MAGIC = 0x20a99e73;
+	static const uint16_t DATA_VERSION = 1;
+
+	MyPersistentData2(const char *filename) : StorageHelperRK::PersistentDataFile(filename, &myData.header, sizeof(MyData), DATA_MAGIC, DATA_VERSION) {};
+
+	int getValue_test1() const {
+		return getValue<int>(offsetof(MyData, test1));
+	}
+
+	void setValue_test1(int value) {
+		setValue<int>(offsetof(MyData, test1), value);
+	}
+
+	bool getValue_test2() const {
+		return getValue<bool>(offsetof(MyData, test2));
+	}
+
+	void setValue_test2(bool value) {
+		setValue<bool>(offsetof(MyData, test2), value);
+	}
+
+	double getValue_test3() const {
+		return getValue<double>(offsetof(MyData, test3));
+	}
+
+	void setValue_test3(double value) {
+		setValue<double>(offsetof(MyData, test3), value);
+	}
+
+	String getValue_test4() const {
+		String result;
+		getValueString(offsetof(MyData, test4), sizeof(MyData::test4), result);
+		return result;
+	}
+	bool setValue_test4(const char *str) {
+		return setValueString(offsetof(MyData, test4), sizeof(MyData::test4), str);
+	}
+
+	uint32_t getValue_test5() const {
+		return getValue<uint32_t>(offsetof(MyData, test5));
+	}
+
+	void setValue_test5(uint32_t value) {
+		setValue<uint32_t>(offsetof(MyData, test5), value);
+	}
+
+	MyData myData;
+};
+
+
+void customPersistentDataTest() {
+	const char *persistentDataPath = "./temp02.dat";
+	unlink(persistentDataPath);
+
+	MyPersistentData data(persistentDataPath);
+	bool bResult;
+	String s;
+
+	data.load();
+	data.save();
+
+	data.setValue_test1(0x55aa55aa);
+	assertInt("", data.getValue_test1(), 0x55aa55aa);
+
+	assertInt("", data.getValue_test2(), false);
+	data.setValue_test2(true);
+	assertInt("", data.getValue_test2(), true);
+
+
+	assertDouble("", data.getValue_test3(), 0.0, 0.001);
+	data.setValue_test3(9999999.12345);
+	assertDouble("", data.getValue_test3(), 9999999.12345, 0.001);
+
+	s = data.getValue_test4();
+	assertStr("", s, "");
+	data.setValue_test4("testing!"); 
+	s = data.getValue_test4();
+	assertStr("", s, "testing!");
+
+	data.setValue_test4("testing1!"); 
+	s = data.getValue_test4();
+	assertStr("", s, "testing1!");
+
+	bResult = data.setValue_test4("testing12!"); 
+	assertInt("", bResult, false);
+	s = data.getValue_test4();
+	assertStr("", s, "testing1!");
+
+	data.save();
+
+
+	MyPersistentData data2(persistentDataPath);
+	data2.load();
+
+	assertInt("", data2.getValue_test1(), 0x55aa55aa);
+	assertInt("", data2.getValue_test2(), true);
+	assertDouble("", data2.getValue_test3(), 9999999.12345, 0.001);
+	assertStr("", data2.getValue_test4(), "testing1!");
+
+	// Simulate a new version that adds a new field without changing the version or magic
+	MyPersistentData2 data2b(persistentDataPath);
+	data2b.load();
+
+	assertInt("", data2b.getValue_test1(), 0x55aa55aa);
+	assertInt("", data2b.getValue_test2(), true);
+	assertDouble("", data2b.getValue_test3(), 9999999.12345, 0.001);
+	assertStr("", data2b.getValue_test4(), "testing1!");
+	assertInt("", data2b.getValue_test5(), 0);
+
+	data2b.setValue_test5(12345);
+	assertInt("", data2b.getValue_test5(), 12345);
+
+	data2b.save();
 
 	MyPersistentData2 data2c(persistentDataPath);
 	data2c.load();
@@ -672,6 +2233,346 @@ void customRetainedDataTest() {
 }
 
 
+void callbackStatsTest() {
+	// Disabled by default, names are still kept
+	{
+		SleepHelper::AppCallback<int> callbacks;
+		callbacks.add([](int) { return true; }, "a");
+		callbacks.add([](int) { return false; });
+		callbacks.forEach(1);
+
+		assertInt("", callbacks.getStatsEnabled(), false);
+		assertInt("", (int)callbacks.getStats().size(), 2);
+		assertStr("", callbacks.getStats()[0].name, "a");
+		assertInt("", callbacks.getStats()[1].name == nullptr, true);
+		assertInt("", (int)callbacks.getStats()[0].callCount, 0);
+	}
+
+	// AppCallback
+	{
+		uint32_t savedWakeCycle = SleepHelper::CallbackStats::wakeCycle;
+		SleepHelper::CallbackStats::wakeCycle = 5;
+
+		SleepHelper::AppCallback<int> callbacks;
+		callbacks.withStats(true);
+		callbacks.add([](int) { return true; }, "stayAwake");
+		callbacks.add([](int) { return false; }, "ready");
+
+		assertInt("", callbacks.whileAnyTrue(false, 1), true);
+		callbacks.forEach(2);
+		assertInt("", callbacks.untilTrue(false, 3), true);
+
+		const std::vector<SleepHelper::CallbackStats> &stats = callbacks.getStats();
+		assertInt("", (int)stats[0].callCount, 3);
+		assertInt("", (int)stats[1].callCount, 2);
+		assertInt("", (int)stats[0].lastTrueWakeCycle, 5);
+		assertInt("", (int)stats[1].lastTrueWakeCycle, 0);
+		assertInt("", stats[0].maxMicros <= stats[0].totalMicros, true);
+
+		callbacks.resetStats();
+		assertInt("", (int)stats[0].callCount, 0);
+		assertStr("", stats[0].name, "stayAwake");
+
+		SleepHelper::CallbackStats::wakeCycle = savedWakeCycle;
+	}
+
+	// AppCallbackWithState, callbacks that returned false are not called again
+	{
+		uint32_t savedWakeCycle = SleepHelper::CallbackStats::wakeCycle;
+		SleepHelper::CallbackStats::wakeCycle = 7;
+
+		SleepHelper::AppCallbackWithState<> callbacks;
+		callbacks.withStats(true);
+		int count = 0;
+		callbacks.add([&count](SleepHelper::AppCallbackState &state) {
+			return ++count < 3;
+		}, "capture");
+
+		while(callbacks.whileAnyTrue()) {
+		}
+		callbacks.whileAnyTrue();
+
+		assertInt("", (int)callbacks.getStats()[0].callCount, 3);
+		assertInt("", (int)callbacks.getStats()[0].lastTrueWakeCycle, 7);
+
+		SleepHelper::CallbackStats::wakeCycle = savedWakeCycle;
+	}
+}
+
+void callbackTaskTest() {
+	// sleepFor, yield, and state changes
+	{
+		SleepHelper::AppCallbackWithState<> callbacks;
+		int calls = 0;
+		callbacks.add([&calls](SleepHelper::AppCallbackState &state) {
+			calls++;
+			switch(state.callbackState) {
+				case SleepHelper::AppCallbackState::CALLBACK_STATE_START:
+					return state.sleepFor(100, 1);
+
+				case 1:
+					return state.yield(2);
+
+				default:
+					return false;
+			}
+		});
+		callbacks.setStartState();
+
+		assertInt("", callbacks.whileAnyTrueAt(1000), true);
+		assertInt("", calls, 1);
+		assertInt("", (int)callbacks.getMillisUntilReady(1000), 100);
+		assertInt("", (int)callbacks.getMillisUntilReady(1060), 40);
+
+		assertInt("", callbacks.whileAnyTrueAt(1099), true);
+		assertInt("", calls, 1);
+
+		assertInt("", callbacks.whileAnyTrueAt(1100), true);
+		assertInt("", calls, 2);
+		assertInt("", callbacks.callbackState[0].callbackState, 2);
+		assertInt("", (int)callbacks.getMillisUntilReady(1100), 0);
+
+		assertInt("", callbacks.whileAnyTrueAt(1101), false);
+		assertInt("", calls, 3);
+		assertInt("", (int)callbacks.getMillisUntilReady(1101), (int)0xffffffff);
+
+		// setStartState clears any pending sleep
+		callbacks.setStartState();
+		callbacks.whileAnyTrueAt(2000);
+		callbacks.setStartState();
+		assertInt("", callbacks.callbackState[0].isWaiting(), false);
+	}
+
+	// sleepUntil handles millis() rollover
+	{
+		SleepHelper::AppCallbackWithState<> callbacks;
+		int calls = 0;
+		callbacks.add([&calls](SleepHelper::AppCallbackState &state) {
+			calls++;
+			if (state.callbackState == SleepHelper::AppCallbackState::CALLBACK_STATE_START) {
+				return state.sleepUntil(state.callMillis + 20, 1);
+			}
+			return false;
+		});
+		callbacks.setStartState();
+
+		callbacks.whileAnyTrueAt(0xfffffff0);
+		assertInt("", (int)callbacks.getMillisUntilReady(0xfffffff0), 20);
+		assertInt("", callbacks.whileAnyTrueAt(0x00000003), true);
+		assertInt("", calls, 1);
+		assertInt("", callbacks.whileAnyTrueAt(0x00000004), false);
+		assertInt("", calls, 2);
+	}
+
+	// waitUntil
+	{
+		SleepHelper::AppCallbackWithState<> callbacks;
+		bool flag = false;
+		int calls = 0;
+		callbacks.add([&calls, &flag](SleepHelper::AppCallbackState &state) {
+			calls++;
+			if (state.callbackState == SleepHelper::AppCallbackState::CALLBACK_STATE_START) {
+				return state.waitUntil([&flag]() { return flag; }, 1, 50);
+			}
+			return false;
+		});
+		callbacks.setStartState();
+
+		callbacks.whileAnyTrueAt(0);
+		assertInt("", (int)callbacks.getMillisUntilReady(0), 50);
+		assertInt("", callbacks.whileAnyTrueAt(10), true);
+		assertInt("", calls, 1);
+		assertInt("", (int)callbacks.getMillisUntilReady(10), 50);
+
+		flag = true;
+		assertInt("", callbacks.whileAnyTrueAt(20), false);
+		assertInt("", calls, 2);
+	}
+
+	// Loop iterations saved: three tasks that each sample every 250 ms for 2 seconds. Compare
+	// polling every 1 ms to advancing to the next deadline.
+	{
+		int pollingCalls = 0;
+		int taskCalls = 0;
+		int pollingLoops = 0;
+		int taskLoops = 0;
+
+		for(int pass = 0; pass < 2; pass++) {
+			bool useTasks = (pass == 1);
+			int &calls = useTasks ? taskCalls : pollingCalls;
+			int &loops = useTasks ? taskLoops : pollingLoops;
+
+			SleepHelper::AppCallbackWithState<> callbacks;
+			for(int ii = 0; ii < 3; ii++) {
+				callbacks.add([&calls, useTasks, ii](SleepHelper::AppCallbackState &state) {
+					calls++;
+					if (state.callbackState == SleepHelper::AppCallbackState::CALLBACK_STATE_START) {
+						state.callbackState = 0;
+						state.callbackData = (void *)(uintptr_t)state.callMillis;
+					}
+					system_tick_t start = (system_tick_t)(uintptr_t)state.callbackData;
+					system_tick_t next = start + (state.callbackState + 1) * 250 + ii;
+					if ((int32_t)(state.callMillis - next) < 0) {
+						// Not time for the next sample yet
+						return useTasks ? state.sleepUntil(next) : true;
+					}
+					state.callbackState++;
+					return state.callbackState < 8;
+				});
+			}
+			callbacks.setStartState();
+
+			system_tick_t now = 5000;
+			while(callbacks.whileAnyTrueAt(now)) {
+				loops++;
+				system_tick_t ms = useTasks ? callbacks.getMillisUntilReady(now) : 0;
+				now += (ms ? ms : 1);
+			}
+			assertInt("", (int)(now - 5000), 2002);
+		}
+
+		printf("callback tasks: polling loops=%d calls=%d, tasks loops=%d calls=%d\n", 
+			pollingLoops, pollingCalls, taskLoops, taskCalls);
+		assertInt("", taskLoops < 40, true);
+		assertInt("", pollingLoops > 1900, true);
+		assertInt("", taskCalls < 60, true);
+	}
+}
+
+void parallelDataCaptureTest() {
+	// Synthetic blocking captures: four sensors that each block for 50 ms, two of which share a bus
+	static const int BLOCK_MS = 50;
+	static int busToken;
+
+	std::atomic<int> busUsers(0);
+	std::atomic<int> maxBusUsers(0);
+
+	SleepHelper::AppCallbackWithState<> callbacks;
+	for(int ii = 0; ii < 4; ii++) {
+		bool onBus = (ii < 2);
+		callbacks.add([onBus, &busUsers, &maxBusUsers](SleepHelper::AppCallbackState &state) {
+			if (onBus) {
+				int users = ++busUsers;
+				if (users > maxBusUsers) {
+					maxBusUsers = users;
+				}
+			}
+			std::this_thread::sleep_for(std::chrono::milliseconds(BLOCK_MS));
+			if (onBus) {
+				busUsers--;
+			}
+			return false;
+		});
+		if (onBus) {
+			callbacks.callbackState.back().lockGroup = &busToken;
+		}
+	}
+
+	// Sequential, as called from loop()
+	callbacks.setStartState();
+	auto start = std::chrono::steady_clock::now();
+	while(callbacks.whileAnyTrue()) {
+	}
+	long sequentialMs = (long)std::chrono::duration_cast<std::chrono::milliseconds>(std::chrono::steady_clock::now() - start).count();
+
+	// Parallel, on 4 worker threads. The two bus callbacks are one job, so the expected time is 2 * BLOCK_MS.
+	long parallelMs;
+	{
+		SleepHelper::DataCaptureWorkers workers(4);
+
+		callbacks.setStartState();
+		start = std::chrono::steady_clock::now();
+		assertInt("", workers.start(callbacks), true);
+		assertInt("", workers.isBusy(), true);
+		assertInt("", workers.start(callbacks), false);
+		workers.join();
+		parallelMs = (long)std::chrono::duration_cast<std::chrono::milliseconds>(std::chrono::steady_clock::now() - start).count();
+
+		assertInt("", workers.isBusy(), false);
+		for(size_t ii = 0; ii < callbacks.callbackState.size(); ii++) {
+			assertInt("", callbacks.callbackState[ii].callbackState, SleepHelper::AppCallbackState::CALLBACK_START_RETURNED_FALSE);
+		}
+		assertInt("", maxBusUsers, 1);
+
+		// Workers are reused for the next capture
+		callbacks.setStartState();
+		workers.start(callbacks);
+		workers.join();
+		assertInt("", callbacks.callbackState[3].callbackState, SleepHelper::AppCallbackState::CALLBACK_START_RETURNED_FALSE);
+		assertInt("", maxBusUsers, 1);
+	}
+
+	printf("parallel data capture: sequential=%ld ms, parallel=%ld ms\n", sequentialMs, parallelMs);
+	assertInt("", sequentialMs >= 4 * BLOCK_MS, true);
+	assertInt("", parallelMs >= 2 * BLOCK_MS, true);
+	assertInt("", parallelMs < 3 * BLOCK_MS, true);
+
+	// Callbacks that return true are called again by the worker until they return false
+	{
+		SleepHelper::DataCaptureWorkers workers(1);
+		SleepHelper::AppCallbackWithState<> callbacks;
+		std::atomic<int> calls(0);
+		callbacks.add([&calls](SleepHelper::AppCallbackState &state) {
+			return ++calls < 3;
+		});
+		callbacks.setStartState();
+		workers.start(callbacks);
+		workers.join();
+		assertInt("", calls, 3);
+	}
+
+	// A lock resource is locked during each call, excluding other code that locks it too
+	{
+		struct BusLock {
+			std::recursive_mutex mutex;
+			std::atomic<int> locks{0};
+			std::atomic<int> unlocks{0};
+			void lock() { mutex.lock(); locks++; }
+			void unlock() { unlocks++; mutex.unlock(); }
+		} bus;
+		std::atomic<int> busUsers(0);
+		std::atomic<int> maxBusUsers(0);
+		auto useBus = [&busUsers, &maxBusUsers]() {
+			int users = ++busUsers;
+			if (users > maxBusUsers) {
+				maxBusUsers = users;
+			}
+			std::this_thread::sleep_for(std::chrono::milliseconds(5));
+			busUsers--;
+		};
+
+		SleepHelper::DataCaptureWorkers workers(2);
+		SleepHelper::AppCallbackWithState<> callbacks;
+		for(int ii = 0; ii < 2; ii++) {
+			callbacks.add([&useBus](SleepHelper::AppCallbackState &state) {
+				useBus();
+				return false;
+			});
+			callbacks.callbackState.back().setLockResource(bus);
+		}
+		assertInt("", callbacks.callbackState[0].lockGroup == &bus, true);
+
+		// Simulates loop() using the bus at the same time
+		std::atomic<bool> done(false);
+		std::thread other([&bus, &useBus, &done]() {
+			while(!done) {
+				std::lock_guard<BusLock> lock(bus);
+				useBus();
+			}
+		});
+
+		callbacks.setStartState();
+		workers.start(callbacks);
+		workers.join();
+		done = true;
+		other.join();
+
+		assertInt("", maxBusUsers, 1);
+		assertInt("", bus.locks, bus.unlocks);
+		assertInt("", bus.locks >= 2, true);
+	}
+}
+
 void eventCombinerTest() {
 	{
 		SleepHelper::EventCombiner t1;
@@ -900,6 +2801,157 @@ void eventCombinerTest() {
 		assertStr("", events[0].c_str(), "{\"a\":123}");
 
 	}
+
+	// Fixed slots
+	{
+		SleepHelper::EventCombiner t1;
+		int value = 5;
+		size_t slot1 = t1.addSlot("s1", 50, [&value](JSONWriter &jw) {
+			jw.value(value);
+		});
+		size_t slot2 = t1.addSlot("s2", 60, [](JSONWriter &jw) {
+			jw.value(true);
+		});
+		assertInt("", (int)slot1, 0);
+		assertInt("", (int)slot2, 1);
+
+		std::vector<String> events;
+		t1.generateEvents(events, 64);
+		assertInt("", events.size(), 0);
+
+		t1.setSlotPending(slot1);
+		t1.setSlotPending(slot2);
+		assertInt("", t1.getSlotPending(slot1), true);
+		t1.generateEvents(events, 64);
+		assertInt("", events.size(), 1);
+		assertStr("", events[0].c_str(), "{\"s2\":true,\"s1\":5}");
+		assertInt("", t1.getSlotPending(slot1), false);
+
+		// Only included again when set pending, with the current value
+		t1.generateEvents(events, 64);
+		assertInt("", events.size(), 0);
+
+		value = 6;
+		t1.setSlotPending(slot1);
+		t1.generateEvents(events, 64);
+		assertInt("", events.size(), 1);
+		assertStr("", events[0].c_str(), "{\"s1\":6}");
+
+		t1.setSlotPending(slot1);
+		t1.clearOneTimeCallbacks();
+		assertInt("", t1.getSlotPending(slot1), false);
+	}
+}
+
+void inlineFunctionTest() {
+	// Captures are stored inline
+	{
+		int a = 1, b = 2;
+		SleepHelper::InlineFunction<int(int)> fn = [&a, b](int c) {
+			return a + b + c;
+		};
+		assertInt("", (bool)fn, true);
+		assertInt("", fn(3), 6);
+		a = 10;
+		assertInt("", fn(3), 15);
+
+		// Copy and move
+		SleepHelper::InlineFunction<int(int)> fn2 = fn;
+		assertInt("", fn2(0), 12);
+		SleepHelper::InlineFunction<int(int)> fn3 = std::move(fn2);
+		assertInt("", fn3(1), 13);
+		assertInt("", (bool)fn2, false);
+
+		fn3.reset();
+		assertInt("", (bool)fn3, false);
+
+		SleepHelper::InlineFunction<int(int)> empty;
+		assertInt("", (bool)empty, false);
+	}
+
+	// Mutable state, reference parameters, function pointers, and std::function
+	{
+		SleepHelper::InlineFunction<void(int &)> counter = [count = 0](int &result) mutable {
+			result = ++count;
+		};
+		int result = 0;
+		counter(result);
+		counter(result);
+		assertInt("", result, 2);
+
+		SleepHelper::InlineFunction<int(const char *)> fnPtr = strlen;
+		assertInt("", fnPtr("test"), 4);
+
+		std::function<bool(int)> stdFn = [](int x) { return x > 5; };
+		SleepHelper::InlineFunction<bool(int)> wrapped = stdFn;
+		assertInt("", wrapped(6), true);
+		assertInt("", wrapped(4), false);
+	}
+
+	// Object with a destructor is destroyed when replaced
+	{
+		std::shared_ptr<int> shared = std::make_shared<int>(7);
+		{
+			SleepHelper::InlineFunction<int()> fn = [shared]() {
+				return *shared;
+			};
+			assertInt("", (int)shared.use_count(), 2);
+			assertInt("", fn(), 7);
+			fn = []() { return 8; };
+			assertInt("", (int)shared.use_count(), 1);
+			assertInt("", fn(), 8);
+		}
+	}
+
+	// AppCallback with lambdas and std::function
+	{
+		SleepHelper::AppCallback<int, int &> callbacks;
+		callbacks.reserve(4);
+		callbacks.add([](int a, int &sum) {
+			sum += a;
+			return true;
+		});
+		std::function<bool(int, int &)> fn = [](int a, int &sum) {
+			sum += a * 10;
+			return false;
+		};
+		callbacks.add(fn);
+
+		int sum = 0;
+		callbacks.forEach(2, sum);
+		assertInt("", sum, 22);
+		assertInt("", callbacks.whileAnyTrue(false, 1, sum), true);
+		assertInt("", sum, 33);
+
+		size_t capacity = callbacks.callbackFunctions.capacity();
+		callbacks.removeAll();
+		callbacks.add([](int, int &) { return true; });
+		assertInt("", callbacks.callbackFunctions.capacity() == capacity, true);
+	}
+
+	// with*Function setters forward lambdas, std::function, and function pointers to the callback list
+	{
+		SleepHelper::SettingsFile settings;
+		settings.setValuesJson("{\"a\":1}");
+
+		int calls = 0;
+		settings.withSettingChangeFunction([&calls](const char *key) {
+			calls++;
+			return true;
+		});
+		std::function<bool(const char *)> stdFn = [&calls](const char *key) {
+			calls += 10;
+			return true;
+		};
+		settings.withSettingChangeFunction(stdFn);
+		bool (*fnPtr)(const char *) = [](const char *key) {
+			return true;
+		};
+		settings.withSettingChangeFunction(fnPtr);
+
+		settings.setValue("a", 2);
+		assertInt("", calls, 11);
+	}
 }
 
 void eventHistoryTest() {
@@ -1274,13 +3326,945 @@ void eventHistoryTest() {
 	// unlink(eventsFile);
 }
 
+void wakeTimelineTest() {
+	const char *tzConfig = "EST5EDT,M3.2.0/02:00:00,M11.1.0/02:00:00";
+	LocalTime::instance().withConfig(tzConfig);
+
+	LocalTimeScheduleManager manager;
+	manager.getScheduleByName("quick").withFlags(LocalTimeSchedule::FLAG_QUICK_WAKE);
+	manager.getScheduleByName("data").withFlags(LocalTimeSchedule::FLAG_QUICK_WAKE).withMinuteOfHour(2);
+	manager.getScheduleByName("full").withFlags(LocalTimeSchedule::FLAG_FULL_WAKE).withMinuteOfHour(15);
+
+	// 2022-03-13 06:00:00 UTC, 6 hours spans the start of daylight saving at 07:00:00 UTC. 
+	// Stepping by 10 seconds from the top of the hour includes times exactly on the schedule.
+	const time_t startTime = 1647151200;
+	const time_t endTime = startTime + 6 * 3600;
+
+	{
+		// Timeline results must match evaluating the schedule directly
+		SleepHelper::WakeTimeline timeline;
+		timeline.withTimeConfig(tzConfig);
+
+		for(time_t now = startTime; now < endTime; now += 10) {
+			LocalTimeConvert conv;
+			conv.withTime(now).convert();
+
+			assertInt("", (int)timeline.getNextTime(manager, SleepHelper::WakeTimeline::TYPE_WAKE, now), (int)manager.getNextWake(conv));
+			assertInt("", (int)timeline.getNextTime(manager, SleepHelper::WakeTimeline::TYPE_FULL_WAKE, now), (int)manager.getNextFullWake(conv));
+			assertInt("", (int)timeline.getNextTime(manager, SleepHelper::WakeTimeline::TYPE_DATA_CAPTURE, now), (int)manager.getNextDataCapture(conv));
+		}
+
+		// Restoring saved timeline data (like after reset) only needs to calculate the configuration hash
+		SleepHelper::WakeTimeline timeline2;
+		timeline2.withTimeConfig(tzConfig);
+		timeline2.setData(timeline.getData());
+
+		time_t now = endTime - 5;
+		LocalTimeConvert conv;
+		conv.withTime(now).convert();
+		assertInt("", (int)timeline2.getNextTime(manager, SleepHelper::WakeTimeline::TYPE_FULL_WAKE, now), (int)manager.getNextFullWake(conv));
+		assertInt("", (int)timeline2.getEvaluationCount(), 6);
+
+		// A later invalidate() discards the timeline even though the sampled hash is the same, 
+		// because the hash does not detect every schedule change
+		timeline2.invalidate();
+		timeline2.getNextTime(manager, SleepHelper::WakeTimeline::TYPE_FULL_WAKE, now);
+		assertInt("", timeline2.getData().configHash, timeline.getData().configHash);
+		assertInt("", timeline2.getEvaluationCount() >= 6 + 6 + SleepHelper::WakeTimeline::TIMELINE_SIZE, true);
+	}
+
+	{
+		// A time exactly on the schedule is returned, the same as evaluating directly
+		SleepHelper::WakeTimeline timeline;
+		timeline.withTimeConfig(tzConfig);
+
+		// 06:15:00 UTC
+		time_t now = startTime + 15 * 60;
+		LocalTimeConvert conv;
+		conv.withTime(now).convert();
+		time_t expected = manager.getNextFullWake(conv);
+		assertInt("", (int)timeline.getNextTime(manager, SleepHelper::WakeTimeline::TYPE_FULL_WAKE, now - 60), (int)now);
+		assertInt("", (int)timeline.getNextTime(manager, SleepHelper::WakeTimeline::TYPE_FULL_WAKE, now), (int)expected);
+	}
+
+	{
+		// Benchmark schedule evaluation cost per loop iteration. This simulates one loop per second 
+		// for a day, with the three schedule lookups done per wake cycle in SleepHelper.
+		const time_t benchEndTime = startTime + 24 * 3600;
+		time_t sum = 0;
+
+		auto start = std::chrono::steady_clock::now();
+		for(time_t now = startTime; now < benchEndTime; now++) {
+			LocalTimeConvert conv;
+			conv.withTime(now).convert();
+			sum += manager.getNextWake(conv) + manager.getNextFullWake(conv) + manager.getNextDataCapture(conv);
+		}
+		double directUs = std::chrono::duration<double, std::micro>(std::chrono::steady_clock::now() - start).count();
+
+		SleepHelper::WakeTimeline timeline;
+		timeline.withTimeConfig(tzConfig);
+
+		time_t sum2 = 0;
+		start = std::chrono::steady_clock::now();
+		for(time_t now = startTime; now < benchEndTime; now++) {
+			sum2 += timeline.getNextTime(manager, SleepHelper::WakeTimeline::TYPE_WAKE, now)
+				+ timeline.getNextTime(manager, SleepHelper::WakeTimeline::TYPE_FULL_WAKE, now)
+				+ timeline.getNextTime(manager, SleepHelper::WakeTimeline::TYPE_DATA_CAPTURE, now);
+		}
+		double timelineUs = std::chrono::duration<double, std::micro>(std::chrono::steady_clock::now() - start).count();
+
+		size_t loops = (size_t)(benchEndTime - startTime);
+		printf("schedule evaluation: direct %.3f us/loop (%lu evaluations), timeline %.3f us/loop (%lu evaluations)\n", 
+			directUs / loops, (unsigned long)(loops * 3), timelineUs / loops, (unsigned long)timeline.getEvaluationCount());
+
+		// Keeps the compiler from optimizing away the loops, and checks the results match
+		assertInt("", sum2 == sum, true);
+	}
+
+	{
+		// Changing the schedule discards the timeline
+		SleepHelper::WakeTimeline timeline;
+		timeline.withTimeConfig(tzConfig);
+
+		time_t now = startTime;
+		timeline.getNextTime(manager, SleepHelper::WakeTimeline::TYPE_FULL_WAKE, now);
+		uint32_t oldHash = timeline.getData().configHash;
+
+		manager.getScheduleByName("full").withMinuteOfHour(7);
+		timeline.invalidate();
+
+		LocalTimeConvert conv;
+		conv.withTime(now).convert();
+		assertInt("", (int)timeline.getNextTime(manager, SleepHelper::WakeTimeline::TYPE_FULL_WAKE, now), (int)manager.getNextFullWake(conv));
+		assertInt("", timeline.getData().configHash != oldHash, true);
+	}
+}
+
+void printArrivalHistogram(const char *title, const int *buckets, size_t numBuckets, int bucketSec) {
+	printf("%s\n", title);
+	for(size_t ii = 0; ii < numBuckets; ii++) {
+		printf("  %4d-%4ds %5d ", (int)ii * bucketSec, (int)(ii + 1) * bucketSec - 1, buckets[ii]);
+		for(int jj = 0; jj < buckets[ii]; jj += 20) {
+			printf("#");
+		}
+		printf("\n");
+	}
+}
+
+void wakeJitterTest() {
+	{
+		// Offset is the same for a given Device ID and within range
+		const char *deviceId = "e00fce68f1b2c3d4e5f60718";
+		int jitter = SleepHelper::calculateWakeJitter(deviceId, 300);
+		assertInt("", SleepHelper::calculateWakeJitter(deviceId, 300), jitter);
+		assertInt("", jitter >= 0 && jitter <= 300, true);
+		assertInt("", SleepHelper::calculateWakeJitter(deviceId, 0), 0);
+		assertInt("", SleepHelper::calculateWakeJitter(0, 300), 0);
+	}
+
+	{
+		// Fleet simulation: devices with a full wake schedule every 15 minutes. Shows the arrival 
+		// rate at the cloud during the 15 minute period after the scheduled time, with and without
+		// a per-device offset of up to 5 minutes.
+		const int numDevices = 1000;
+		const int maxSpreadSec = 300;
+		const int periodSec = 900;
+		const int bucketSec = 30;
+		const size_t numBuckets = periodSec / bucketSec;
+
+		int withoutJitter[numBuckets];
+		int withJitter[numBuckets];
+		int perSecond[periodSec];
+		memset(withoutJitter, 0, sizeof(withoutJitter));
+		memset(withJitter, 0, sizeof(withJitter));
+		memset(perSecond, 0, sizeof(perSecond));
+
+		for(int ii = 0; ii < numDevices; ii++) {
+			char deviceId[32];
+			snprintf(deviceId, sizeof(deviceId), "e00fce68%08x%08x", (unsigned)(ii * 2654435761u), (unsigned)ii);
+
+			int jitter = SleepHelper::calculateWakeJitter(deviceId, maxSpreadSec);
+			assertInt("", jitter >= 0 && jitter <= maxSpreadSec, true);
+
+			withoutJitter[0]++;
+			withJitter[jitter / bucketSec]++;
+			perSecond[jitter]++;
+		}
+
+		printArrivalHistogram("full wake arrivals without jitter (# = 20 devices)", withoutJitter, numBuckets, bucketSec);
+		printArrivalHistogram("full wake arrivals with 5 minute jitter (# = 20 devices)", withJitter, numBuckets, bucketSec);
+
+		int peakBucket = 0;
+		for(size_t ii = 0; ii < numBuckets; ii++) {
+			if (withJitter[ii] > peakBucket) {
+				peakBucket = withJitter[ii];
+			}
+		}
+		int peakSecond = 0;
+		for(int ii = 0; ii < periodSec; ii++) {
+			if (perSecond[ii] > peakSecond) {
+				peakSecond = perSecond[ii];
+			}
+		}
+		printf("peak arrivals per second: without jitter %d, with jitter %d\n", numDevices, peakSecond);
+
+		// Roughly 100 per bucket is expected with a uniform spread
+		assertInt("", peakBucket < 200, true);
+	}
+
+	{
+		// Sleep time calculation with the offset. 2022-03-13 06:05:00 UTC, the next 15 minute 
+		// full wake is 06:15:00 UTC and is shifted to 06:17:00 by a 120 second offset.
+		LocalTime::instance().withConfig("EST5EDT,M3.2.0/02:00:00,M11.1.0/02:00:00");
+		const time_t now = 1647151500;
+		const time_t fullWake = 1647151500 + 10 * 60;
+
+		LocalTimeScheduleManager manager;
+		manager.getScheduleByName("quick").withFlags(LocalTimeSchedule::FLAG_QUICK_WAKE);
+		manager.getScheduleByName("data").withFlags(LocalTimeSchedule::FLAG_QUICK_WAKE);
+		manager.getScheduleByName("full").withFlags(LocalTimeSchedule::FLAG_FULL_WAKE).withMinuteOfHour(15);
+
+		SleepHelper::WakeTimeline timeline;
+		assertInt("", (int)SleepHelper::calculateNextWakeWithJitter(manager, timeline, now, 0, false), (int)fullWake);
+		assertInt("", (int)SleepHelper::calculateNextWakeWithJitter(manager, timeline, now, 120, false), (int)fullWake + 120);
+
+		// A quick wake at the unshifted full wake time is kept
+		manager.getScheduleByName("quick").withMinuteOfHour(15);
+		timeline.invalidate();
+		assertInt("", (int)SleepHelper::calculateNextWakeWithJitter(manager, timeline, now, 120, false), (int)fullWake);
+
+		// Shifted full wake is before the next quick wake
+		LocalTimeScheduleManager manager2;
+		manager2.getScheduleByName("quick").withFlags(LocalTimeSchedule::FLAG_QUICK_WAKE).withMinuteOfHour(20);
+		manager2.getScheduleByName("data").withFlags(LocalTimeSchedule::FLAG_QUICK_WAKE);
+		manager2.getScheduleByName("full").withFlags(LocalTimeSchedule::FLAG_FULL_WAKE).withMinuteOfHour(15);
+		SleepHelper::WakeTimeline timeline2;
+		assertInt("", (int)SleepHelper::calculateNextWakeWithJitter(manager2, timeline2, now, 120, false), (int)fullWake + 120);
+	}
+}
+
+void burstCaptureTest() {
+	const float pi = 3.14159265f;
+	const int sampleRateHz = 100;
+
+	{
+		// The timer period is a whole number of milliseconds, so only rates that divide 1000 are used
+		SleepHelper::BurstCapture burst(100);
+		assertInt("", burst.getSampleRateHz(), 100);
+		assertInt("", burst.withSampleRateHz(300).getSampleRateHz(), 250);
+		assertInt("", burst.withSampleRateHz(700).getSampleRateHz(), 500);
+		assertInt("", burst.withSampleRateHz(150).getSampleRateHz(), 125);
+		assertInt("", burst.withSampleRateHz(40).getSampleRateHz(), 40);
+		assertInt("", burst.withSampleRateHz(0).getSampleRateHz(), 1);
+		assertInt("", burst.withSampleRateHz(5000).getSampleRateHz(), 1000);
+	}
+
+	{
+		// 20 Hz sine wave, amplitude 1.0, sampled at 100 Hz for 10 seconds
+		SleepHelper::BurstCapture burst(1000);
+		burst.withSampleRateHz(sampleRateHz);
+
+		for(int ii = 0; ii < 1000; ii++) {
+			burst.addSample(std::sin(2 * pi * 20 * ii / sampleRateHz));
+		}
+		assertInt("", (int)burst.getCount(), 1000);
+
+		SleepHelper::BurstCapture::Stats stats;
+		burst.getStats(stats);
+		assertInt("", (int)stats.count, 1000);
+		assertDouble("", stats.mean, 0.0, 0.01);
+		assertDouble("", stats.rms, 0.7071, 0.01);
+		assertDouble("", stats.peak, 1.0, 0.01);
+		assertDouble("", stats.min, -1.0, 0.01);
+		assertDouble("", stats.max, 1.0, 0.01);
+
+		// 8 bins from 0 - 50 Hz, 6.25 Hz each, so 20 Hz is in bin 3
+		float bins[8];
+		assertInt("", (int)burst.getSpectrum(bins, 8), 8);
+		int peakBin = 0;
+		for(int ii = 1; ii < 8; ii++) {
+			if (bins[ii] > bins[peakBin]) {
+				peakBin = ii;
+			}
+		}
+		assertInt("", peakBin, 3);
+		assertInt("", bins[3] > 0.5, true);
+	}
+
+	{
+		// Ring buffer keeps the most recent samples
+		SleepHelper::BurstCapture burst(4);
+		for(int ii = 0; ii < 6; ii++) {
+			burst.addSample((float)ii);
+		}
+		assertInt("", (int)burst.getCount(), 4);
+		assertDouble("", burst.getSample(0), 2.0, 0.001);
+		assertDouble("", burst.getSample(3), 5.0, 0.001);
+
+		float values[2];
+		assertInt("", (int)burst.getDownsampled(values, 2), 2);
+		assertDouble("", values[0], 2.5, 0.001);
+		assertDouble("", values[1], 4.5, 0.001);
+	}
+
+	{
+		// Storage: one summary record vs. one event per sample
+		SleepHelper::BurstCapture burst(1000);
+		burst.withSampleRateHz(sampleRateHz).withKey("vib");
+
+		auto start = std::chrono::steady_clock::now();
+		const int numLoops = 100;
+		for(int loop = 0; loop < numLoops; loop++) {
+			for(int ii = 0; ii < 1000; ii++) {
+				burst.addSample(std::sin(2 * pi * 20 * ii / sampleRateHz));
+			}
+		}
+		auto elapsed = std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::steady_clock::now() - start).count();
+		printf("burst addSample: %.1f Msamples/sec\n", (elapsed > 0) ? (numLoops * 1000.0 / elapsed) : 0.0);
+
+		char buf[1024];
+		start = std::chrono::steady_clock::now();
+		size_t summarySize = 0;
+		for(int loop = 0; loop < numLoops; loop++) {
+			JSONBufferWriter writer(buf, sizeof(buf) - 1);
+			writer.beginObject();
+			burst.writeSummary(writer);
+			writer.endObject();
+			summarySize = writer.dataSize();
+			buf[summarySize] = 0;
+		}
+		elapsed = std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::steady_clock::now() - start).count();
+		printf("burst reduction: %.1f us per summary\n", (double)elapsed / numLoops);
+		printf("burst summary: %s\n", buf);
+
+		JSONValue outerObj = JSONValue::parseCopy(buf);
+		assertInt("", outerObj.isValid(), true);
+
+		size_t rawSize = 0;
+		for(size_t ii = 0; ii < burst.getCount(); ii++) {
+			char rawBuf[64];
+			JSONBufferWriter writer(rawBuf, sizeof(rawBuf));
+			writer.beginObject();
+			writer.name("vib").value(burst.getSample(ii), 3);
+			writer.endObject();
+			rawSize += writer.dataSize();
+		}
+		printf("burst bytes: summary %u, raw per-sample %u\n", (unsigned)summarySize, (unsigned)rawSize);
+		assertInt("", summarySize < rawSize / 20, true);
+	}
+}
+
+void sampleAggregatorTest() {
+	const char *aggPath = "./temp03.dat";
+	const char *eventsFile = "./events.txt";
+	const time_t startTime = 1656633600; // 2022-07-01 00:00:00 UTC
+
+	unlink(aggPath);
+	unlink(eventsFile);
+
+	{
+		// Statistics for a single window
+		SleepHelper::SampleAggregator agg(aggPath);
+		agg.withChannel("c", 1).withChannel("h", 0);
+		agg.load();
+
+		const float values[] = { 20.0, 22.0, 24.0, 26.0 };
+		for(size_t ii = 0; ii < sizeof(values) / sizeof(values[0]); ii++) {
+			assertInt("", agg.addSample("c", values[ii], startTime + ii * 120), true);
+		}
+		assertInt("", agg.addSample("x", 1.0, startTime), false);
+
+		SleepHelper::SampleAggregator::Stats stats;
+		assertInt("", agg.getStats("c", stats), true);
+		assertInt("", (int)stats.count, 4);
+		assertDouble("", stats.mean, 23.0, 0.001);
+		assertDouble("", stats.stddev, 2.582, 0.001);
+		assertDouble("", stats.min, 20.0, 0.001);
+		assertDouble("", stats.max, 26.0, 0.001);
+
+		assertInt("", agg.getStats("h", stats), true);
+		assertInt("", (int)stats.count, 0);
+		assertInt("", (int)agg.getWindowStart(), (int)startTime);
+
+		// Samples are not written to the file one at a time
+		{
+			SleepHelper::SampleAggregator aggFile(aggPath);
+			aggFile.withChannel("c", 1).withChannel("h", 0);
+			aggFile.load();
+			assertInt("", aggFile.getStats("c", stats), true);
+			assertInt("", (int)stats.count, 0);
+		}
+		assertInt("", agg.getUnsavedChanges(), true);
+		assertInt("", agg.saveChanges(), true);
+		assertInt("", agg.getUnsavedChanges(), false);
+		assertInt("", agg.saveChanges(), false);
+
+		// Running statistics are preserved across reset
+		SleepHelper::SampleAggregator agg2(aggPath);
+		agg2.withChannel("c", 1).withChannel("h", 0);
+		agg2.load();
+		assertInt("", agg2.getStats("c", stats), true);
+		assertInt("", (int)stats.count, 4);
+		assertDouble("", stats.mean, 23.0, 0.001);
+
+		// Changing the channel order discards the statistics for the changed slots
+		SleepHelper::SampleAggregator agg3(aggPath);
+		agg3.withChannel("h", 0).withChannel("c", 1);
+		agg3.load();
+		assertInt("", agg3.getStats("c", stats), true);
+		assertInt("", (int)stats.count, 0);
+
+		unlink(aggPath);
+	}
+
+	{
+		// Window closes on first sample of the next window, or checkWindow
+		SleepHelper::EventCombiner combiner;
+		combiner.withEventHistory(eventsFile, "eh");
+
+		SleepHelper::SampleAggregator agg(aggPath);
+		agg.withChannel("c", 1).withEventCombiner(combiner);
+		agg.load();
+
+		agg.addSample("c", 20.0, startTime + 60);
+		agg.addSample("c", 22.0, startTime + 600);
+		assertInt("", (int)agg.getWindowCount(), 0);
+		assertInt("", agg.checkWindow(startTime + 899), false);
+		assertInt("", agg.checkWindow(startTime + 900), true);
+		assertInt("", (int)agg.getWindowCount(), 1);
+		assertInt("", agg.checkWindow(startTime + 1000), false);
+
+		agg.addSample("c", 30.0, startTime + 960);
+		agg.addSample("c", 30.0, startTime + 1800);
+		assertInt("", (int)agg.getWindowCount(), 2);
+
+		std::vector<String> events;
+		combiner.generateEvents(events, 256);
+		assertInt("", events.size(), 1);
+		assertStr("", events[0].c_str(), "{\"eh\":[{\"agg\":{\"t\":1656633600,\"c\":{\"n\":2,\"mean\":21.0,\"sd\":1.4,\"min\":20.0,\"max\":22.0}}},{\"agg\":{\"t\":1656634500,\"c\":{\"n\":1,\"mean\":30.0,\"sd\":0.0,\"min\":30.0,\"max\":30.0}}}]}");
+
+		unlink(aggPath);
+		unlink(eventsFile);
+	}
+
+	{
+		// Payload size: capture every 2 minutes, publish every 15 minutes, for 24 hours
+		size_t payloadSize[2];
+
+		for(int raw = 0; raw < 2; raw++) {
+			SleepHelper::EventCombiner combiner;
+			combiner.withEventHistory(eventsFile, "eh");
+
+			SleepHelper::SampleAggregator agg(aggPath);
+			agg.withChannel("c", 1, (raw != 0)).withEventCombiner(combiner);
+			agg.load();
+
+			payloadSize[raw] = 0;
+			for(time_t t = startTime; t < startTime + 86400; t += 120) {
+				agg.addSample("c", 20.0 + (t % 900) / 100.0, t);
+				if (((t - startTime) % 900) == 780) {
+					agg.checkWindow(t + 120);
+
+					std::vector<String> events;
+					combiner.generateEvents(events, 1024);
+					for(auto it = events.begin(); it != events.end(); ++it) {
+						payloadSize[raw] += it->length();
+					}
+				}
+			}
+			unlink(aggPath);
+			unlink(eventsFile);
+		}
+		printf("aggregator payload bytes per day: summary %u, summary + raw %u\n", (unsigned)payloadSize[0], (unsigned)payloadSize[1]);
+		assertInt("", payloadSize[0] > 0, true);
+		assertInt("", payloadSize[0] < payloadSize[1], true);
+	}
+}
+
+// Exposes the parts of SleepHelper that are normally used by the state machine
+class SleepHelperTester : public SleepHelper {
+public:
+	using SleepHelper::setNoConnectionWake;
+	using SleepHelper::writeFilesBeforeSleep;
+	using SleepHelper::sleepPreservesRam;
+	using SleepHelper::wakeEventFunctions;
+	using SleepHelper::shouldConnectFunctions;
+};
+
+void reportByExceptionTest() {
+	const char *reportPath = "./temp04.dat";
+	const char *eventsFile = "./events.txt";
+	const time_t startTime = 1656633600; // 2022-07-01 00:00:00 UTC
+
+	unlink(reportPath);
+	unlink(eventsFile);
+
+	{
+		SleepHelper::EventCombiner combiner;
+		combiner.withEventHistory(eventsFile, "eh");
+
+		int escalations = 0;
+
+		SleepHelper::ReportByException report(reportPath);
+		report.withChannel("c", 0.5, 0, 1)
+			.withChannel("p", 5.0, 0.1, 0).withEscalation(80)
+			.withHeartbeat(std::chrono::seconds(3600))
+			.withEventCombiner(combiner)
+			.withEscalationFunction([&escalations]() {
+				escalations++;
+			});
+		report.load();
+
+		assertInt("", report.addSample("x", 1.0, startTime), SleepHelper::ReportByException::REPORT_UNKNOWN_CHANNEL);
+
+		// Deadband
+		assertInt("", report.addSample("c", 20.0, startTime), SleepHelper::ReportByException::REPORT_FIRST);
+		assertInt("", report.addSample("c", 20.4, startTime + 120), SleepHelper::ReportByException::REPORT_SUPPRESSED);
+		assertInt("", report.addSample("c", 19.6, startTime + 240), SleepHelper::ReportByException::REPORT_SUPPRESSED);
+		assertInt("", report.addSample("c", 20.6, startTime + 360), SleepHelper::ReportByException::REPORT_DEADBAND);
+		assertInt("", report.addSample("c", 20.2, startTime + 480), SleepHelper::ReportByException::REPORT_SUPPRESSED);
+
+		// Heartbeat
+		assertInt("", report.addSample("c", 20.6, startTime + 360 + 3599), SleepHelper::ReportByException::REPORT_SUPPRESSED);
+		assertInt("", report.addSample("c", 20.6, startTime + 360 + 3600), SleepHelper::ReportByException::REPORT_HEARTBEAT);
+
+		float value;
+		assertInt("", report.getLastReport("c", value), true);
+		assertDouble("", value, 20.6, 0.001);
+		assertInt("", report.getLastReport("p", value), false);
+
+		// Rate of change: 4 units in 20 seconds is inside the deadband but over 0.1/sec
+		assertInt("", report.addSample("p", 100.0, startTime), SleepHelper::ReportByException::REPORT_FIRST);
+		assertInt("", report.getEscalationPending(), false);
+		assertInt("", report.addSample("p", 101.0, startTime + 120), SleepHelper::ReportByException::REPORT_SUPPRESSED);
+		assertInt("", report.addSample("p", 105.0, startTime + 140), SleepHelper::ReportByException::REPORT_RATE);
+		assertInt("", report.getEscalationPending(), true);
+		assertInt("", escalations, 1);
+		assertInt("", report.getEscalationConviction(), 80);
+
+		report.clearEscalation();
+		assertInt("", report.getEscalationPending(), false);
+		assertInt("", report.getEscalationConviction(), 0);
+
+		assertInt("", (int)report.getReportedCount(), 5);
+		assertInt("", (int)report.getSuppressedCount(), 5);
+
+		std::vector<String> events;
+		combiner.generateEvents(events, 1024);
+		assertInt("", events.size(), 1);
+		assertStr("", events[0].c_str(), "{\"eh\":[{\"t\":1656633600,\"c\":20.0},{\"t\":1656633960,\"c\":20.6},{\"t\":1656637560,\"c\":20.6},{\"t\":1656633600,\"p\":100},{\"t\":1656633740,\"p\":105}]}");
+
+		report.save();
+
+		// Last reported values are preserved across reset
+		SleepHelper::ReportByException report2(reportPath);
+		report2.withChannel("c", 0.5, 0, 1)
+			.withChannel("p", 5.0, 0.1, 0).withEscalation(80);
+		report2.load();
+		assertInt("", report2.getLastReport("c", value), true);
+		assertDouble("", value, 20.6, 0.001);
+		assertInt("", report2.addSample("c", 20.8, startTime + 360 + 3700), SleepHelper::ReportByException::REPORT_SUPPRESSED);
+
+		unlink(reportPath);
+		unlink(eventsFile);
+	}
+
+	{
+		// Conviction is per channel; the highest pending conviction is used
+		SleepHelper::ReportByException report(reportPath);
+		report.withChannel("c", 0.5, 0, 1)
+			.withChannel("p", 5.0, 0, 0).withEscalation(80)
+			.withChannel("h", 5.0, 0, 0).withEscalation(40);
+		report.load();
+
+		assertInt("", report.addSample("c", 20.0, startTime), SleepHelper::ReportByException::REPORT_FIRST);
+		assertInt("", report.addSample("c", 21.0, startTime + 120), SleepHelper::ReportByException::REPORT_DEADBAND);
+		assertInt("", report.getEscalationPending(), false);
+
+		assertInt("", report.addSample("h", 50.0, startTime), SleepHelper::ReportByException::REPORT_FIRST);
+		assertInt("", report.addSample("h", 60.0, startTime + 120), SleepHelper::ReportByException::REPORT_DEADBAND);
+		assertInt("", report.getEscalationConviction(), 40);
+
+		assertInt("", report.addSample("p", 100.0, startTime), SleepHelper::ReportByException::REPORT_FIRST);
+		assertInt("", report.addSample("p", 110.0, startTime + 120), SleepHelper::ReportByException::REPORT_DEADBAND);
+		assertInt("", report.getEscalationConviction(), 80);
+
+		assertInt("", report.addSample("h", 70.0, startTime + 240), SleepHelper::ReportByException::REPORT_DEADBAND);
+		assertInt("", report.getEscalationConviction(), 80);
+
+		report.clearEscalation();
+		assertInt("", report.addSample("h", 80.0, startTime + 360), SleepHelper::ReportByException::REPORT_DEADBAND);
+		assertInt("", report.getEscalationConviction(), 40);
+
+		unlink(reportPath);
+	}
+
+	{
+		// An escalation vetoed by a higher no connect conviction is kept until a connection is made
+		SleepHelperTester sleepHelper;
+		SleepHelper::ReportByException report(reportPath);
+		report.withChannel("p", 5.0, 0, 0).withEscalation(80);
+		report.load();
+		sleepHelper.withReportByException(report);
+
+		int noConnectConviction = 90;
+		sleepHelper.withShouldConnectFunction([&noConnectConviction](int &connectConviction, int &noConnectConviction_) {
+			noConnectConviction_ = noConnectConviction;
+			return true;
+		});
+
+		assertInt("", report.addSample("p", 100.0, startTime), SleepHelper::ReportByException::REPORT_FIRST);
+		assertInt("", report.addSample("p", 110.0, startTime + 120), SleepHelper::ReportByException::REPORT_DEADBAND);
+		assertInt("", report.getEscalationPending(), true);
+
+		assertInt("", sleepHelper.shouldConnectFunctions.shouldConnect(), false);
+		assertInt("", sleepHelper.shouldConnectFunctions.shouldConnect(), false);
+		assertInt("", report.getEscalationConviction(), 80);
+
+		noConnectConviction = 50;
+		assertInt("", sleepHelper.shouldConnectFunctions.shouldConnect(), true);
+		assertInt("", report.getEscalationPending(), true);
+
+		// Generating the wake events after connecting clears it
+		std::vector<String> events;
+		sleepHelper.wakeEventFunctions.generateEvents(events, 1024);
+		assertInt("", report.getEscalationPending(), false);
+		assertInt("", sleepHelper.shouldConnectFunctions.shouldConnect(), false);
+
+		unlink(reportPath);
+	}
+
+	{
+		// Slowly drifting temperature with noise, captured every 2 minutes for 24 hours
+		SleepHelper::ReportByException report(reportPath);
+		report.withChannel("c", 0.5, 0, 1);
+		report.load();
+
+		int numSamples = 0;
+		uint32_t seed = 1;
+		for(time_t t = startTime; t < startTime + 86400; t += 120) {
+			seed = seed * 1103515245 + 12345;
+			float noise = (float)((seed >> 16) & 0x7fff) / 32768.0f * 0.4f - 0.2f;
+			float value = 20.0f + 3.0f * std::sin((float)(t - startTime) * 2.0f * 3.14159265f / 86400.0f) + noise;
+			report.addSample("c", value, t);
+			numSamples++;
+		}
+		printf("report by exception: %d samples, %u reported, %u suppressed\n", numSamples, (unsigned)report.getReportedCount(), (unsigned)report.getSuppressedCount());
+		assertInt("", (int)(report.getReportedCount() + report.getSuppressedCount()), numSamples);
+		assertInt("", (int)report.getReportedCount() < numSamples / 4, true);
+		assertInt("", (int)report.getReportedCount() >= 12, true);
+
+		unlink(reportPath);
+		unlink(eventsFile);
+	}
+}
+
+class TracePoint {
+public:
+	time_t t;
+	float value;
+};
+
+void readTrace(const char *filename, std::vector<TracePoint> &trace) {
+	char *data = readTestData(filename);
+	if (!data) {
+		return;
+	}
+
+	char *save = 0;
+	for(char *line = strtok_r(data, "\n", &save); line; line = strtok_r(0, "\n", &save)) {
+		long t;
+		float value;
+		if (sscanf(line, "%ld,%f", &t, &value) == 2) {
+			trace.push_back(TracePoint{(time_t)t, value});
+		}
+	}
+	free(data);
+}
+
+// Simulate data capture against a trace. Returns the number of captures (wakes), and the RMS and maximum
+// error when the trace is reconstructed by linear interpolation between captured samples.
+int simulateSampling(const std::vector<TracePoint> &trace, SleepHelper::AdaptiveSampler *sampler, int fixedIntervalSec, float &rmsError, float &maxError) {
+	std::vector<TracePoint> captures;
+	time_t traceStep = trace[1].t - trace[0].t;
+
+	for(time_t t = trace[0].t; t <= trace.back().t; ) {
+		float value = trace[(t - trace[0].t) / traceStep].value;
+		captures.push_back(TracePoint{t, value});
+
+		if (sampler) {
+			t = sampler->addSample(value, t);
+		}
+		else {
+			t += fixedIntervalSec;
+		}
+	}
+
+	double sumSquares = 0;
+	maxError = 0;
+	size_t cur = 0;
+	for(auto it = trace.begin(); it != trace.end(); ++it) {
+		while(cur + 1 < captures.size() && captures[cur + 1].t <= it->t) {
+			cur++;
+		}
+		float reconstructed = captures[cur].value;
+		if (cur + 1 < captures.size()) {
+			const TracePoint &a = captures[cur];
+			const TracePoint &b = captures[cur + 1];
+			reconstructed = a.value + (b.value - a.value) * (float)(it->t - a.t) / (float)(b.t - a.t);
+		}
+		float error = std::fabs(reconstructed - it->value);
+		sumSquares += error * error;
+		if (error > maxError) {
+			maxError = error;
+		}
+	}
+	rmsError = (float)std::sqrt(sumSquares / trace.size());
+
+	return (int)captures.size();
+}
+
+void adaptiveSamplerTest() {
+	{
+		SleepHelper::AdaptiveSampler sampler;
+		sampler.withIntervalRange(std::chrono::seconds(120), std::chrono::seconds(960)).withThreshold(1.0);
+
+		time_t t = 1656633600;
+		assertInt("", (int)sampler.getNextCaptureTime(), 0);
+
+		// Stable signal backs off to the maximum
+		t = sampler.addSample(20.0, t);
+		assertInt("", sampler.getIntervalSec(), 120);
+		t = sampler.addSample(20.1, t);
+		assertInt("", sampler.getIntervalSec(), 240);
+		t = sampler.addSample(20.1, t);
+		t = sampler.addSample(20.2, t);
+		t = sampler.addSample(20.2, t);
+		assertInt("", sampler.getIntervalSec(), 960);
+		assertInt("", (int)sampler.getNextCaptureTime(), (int)t);
+
+		// A step drops to the minimum, then a linear ramp is predicted so the interval grows again
+		t = sampler.addSample(22.2, t);
+		assertInt("", sampler.getIntervalSec(), 120);
+		t = sampler.addSample(22.45, t);
+		assertInt("", sampler.getIntervalSec(), 240);
+		t = sampler.addSample(22.95, t);
+		assertInt("", sampler.getIntervalSec(), 480);
+
+		// Change in direction drops back to the minimum
+		t = sampler.addSample(20.0, t);
+		assertInt("", sampler.getIntervalSec(), 120);
+
+		assertInt("", (int)sampler.getSampleCount(), 9);
+		assertInt("", sampler.getEffectiveIntervalSec() > 120, true);
+
+		sampler.reset();
+		assertInt("", (int)sampler.getSampleCount(), 0);
+		assertInt("", sampler.getIntervalSec(), 120);
+	}
+
+	{
+		// 24 hour temperature trace at 1 minute resolution with a door opening and HVAC cycling
+		std::vector<TracePoint> trace;
+		readTrace("testfiles/trace01.csv", trace);
+		assertInt("", trace.size(), 1440);
+
+		float fixedRms, fixedMax;
+		int fixedWakes = simulateSampling(trace, 0, 120, fixedRms, fixedMax);
+		printf("fixed 2 min: %d wakes, rms error %.3f, max error %.3f\n", fixedWakes, fixedRms, fixedMax);
+
+		const float thresholds[] = { 0.1, 0.25, 0.5 };
+		for(size_t ii = 0; ii < sizeof(thresholds) / sizeof(thresholds[0]); ii++) {
+			SleepHelper::AdaptiveSampler sampler;
+			sampler.withIntervalRange(std::chrono::seconds(120), std::chrono::seconds(1800)).withThreshold(thresholds[ii]);
+
+			float rms, max;
+			int wakes = simulateSampling(trace, &sampler, 0, rms, max);
+			printf("adaptive 2-30 min, threshold %.2f: %d wakes (%d%% saved), rms error %.3f, max error %.3f, effective interval %.0f sec\n", 
+				thresholds[ii], wakes, (fixedWakes - wakes) * 100 / fixedWakes, rms, max, sampler.getEffectiveIntervalSec());
+
+			if (ii == 0) {
+				assertInt("", wakes < fixedWakes / 2, true);
+				assertInt("", rms < 0.5, true);
+			}
+		}
+	}
+}
+
+void quickWakeNoFilesystemTest() {
+	const char *persistentDataPath = "./temp01.dat";
+	const char *eventsFile = "./events.txt";
+	const time_t startTime = 1656633600; // 2022-07-01 00:00:00 UTC
+
+	unlink(persistentDataPath);
+	unlink(eventsFile);
+
+	{
+		// Deferred event history writes
+		SleepHelper::EventHistory events;
+		events.withPath(eventsFile).withDeferredWrites(24);
+
+		events.addEvent("{\"a\":123}");
+		events.addEvent("{\"a\":222}");
+		assertInt("", (int)events.getDeferredSize(), 20);
+		assertInt("", events.getHasEvents(), true);
+
+		struct stat sb;
+		assertInt("", stat(eventsFile, &sb), -1);
+
+		// Buffer is full, so the first two events are written before adding the third
+		events.addEvent("{\"a\":333}");
+		assertInt("", (int)events.getDeferredSize(), 10);
+		assertFile("", eventsFile, "testfiles/events02.txt");
+
+		// Getting events writes the remaining deferred events first
+		char buf[256];
+		memset(buf, 0, sizeof(buf));
+		JSONBufferWriter writer(buf, sizeof(buf) - 1);
+		assertInt("", events.getEvents(writer, sizeof(buf)), true);
+		assertStr("", buf, "[{\"a\":123},{\"a\":222},{\"a\":333}]");
+		assertInt("", (int)events.getDeferredSize(), 0);
+		assertInt("", events.flushDeferred(), false);
+
+		unlink(eventsFile);
+	}
+
+	{
+		// Events are only held in RAM during quick wakes
+		SleepHelperTester sleepHelper;
+		sleepHelper.withEventHistory(eventsFile, "eh");
+		sleepHelper.withQuickWakeNoFilesystem(256);
+
+		sleepHelper.setNoConnectionWake(true);
+		sleepHelper.addEvent("{\"a\":123}");
+		assertInt("", (int)sleepHelper.wakeEventFunctions.getDeferredSize(), 10);
+		sleepHelper.writeFilesBeforeSleep();
+		assertInt("", (int)sleepHelper.wakeEventFunctions.getDeferredSize(), 10);
+
+		struct stat sb;
+		assertInt("", stat(eventsFile, &sb), -1);
+
+		// A full wake writes the events from the quick wake first, then does not defer
+		sleepHelper.setNoConnectionWake(false);
+		assertInt("", (int)sleepHelper.wakeEventFunctions.getDeferredSize(), 0);
+		sleepHelper.addEvent("{\"a\":222}");
+		sleepHelper.writeFilesBeforeSleep();
+		assertInt("", (int)sleepHelper.wakeEventFunctions.getDeferredSize(), 0);
+		assertFile("", eventsFile, "testfiles/events02.txt");
+		unlink(eventsFile);
+
+		// A quick wake before a sleep mode that does not preserve RAM writes the events before sleep
+		sleepHelper.setNoConnectionWake(true);
+		sleepHelper.addEvent("{\"a\":333}");
+		assertInt("", (int)sleepHelper.wakeEventFunctions.getDeferredSize(), 10);
+		sleepHelper.sleepPreservesRam = false;
+		assertInt("", sleepHelper.getFileSystemWritesDeferred(), false);
+		sleepHelper.writeFilesBeforeSleep();
+		assertInt("", (int)sleepHelper.wakeEventFunctions.getDeferredSize(), 0);
+		assertInt("", stat(eventsFile, &sb), 0);
+		unlink(eventsFile);
+	}
+
+	{
+		// Quick wake cycle: update quick wake time and next data capture time, and add one event history
+		// event. Compare writing through to the file system with RAM/retained memory only, which is
+		// written at the next full wake (every 8th cycle here).
+		const int numCycles = 1000;
+		const int cyclesPerFullWake = 8;
+		double usPerQuickWake[2];
+		double usPerFullWake[2];
+
+		for(int noFilesystem = 0; noFilesystem < 2; noFilesystem++) {
+			unlink(persistentDataPath);
+			unlink(eventsFile);
+
+			SleepHelper::PersistentData::RetainedData retainedData;
+			memset(&retainedData, 0, sizeof(retainedData));
+
+			SleepHelper::PersistentData data(persistentDataPath);
+			data.withSaveDelayMs(0);
+			if (noFilesystem) {
+				data.withRetained(&retainedData, std::chrono::seconds(86400));
+			}
+			data.load();
+			data.saveRetained();
+
+			SleepHelper::EventHistory events;
+			events.withPath(eventsFile);
+			if (noFilesystem) {
+				events.withDeferredWrites(2048);
+			}
+
+			std::chrono::steady_clock::duration quickTime(0);
+			std::chrono::steady_clock::duration fullTime(0);
+			int numFullWakes = 0;
+
+			for(int ii = 0; ii < numCycles; ii++) {
+				time_t now = startTime + ii * 120;
+
+				auto start = std::chrono::steady_clock::now();
+				data.setValue_lastQuickWake(now);
+				data.setValue_nextDataCapture(now + 120);
+				events.addEvent([now](JSONWriter &writer) {
+					writer.name("t").value((int)now);
+					writer.name("c").value(21.5, 1);
+				});
+				quickTime += std::chrono::steady_clock::now() - start;
+
+				if ((ii % cyclesPerFullWake) == (cyclesPerFullWake - 1)) {
+					start = std::chrono::steady_clock::now();
+					data.flushWriteBehind(true);
+					events.flushDeferred();
+					fullTime += std::chrono::steady_clock::now() - start;
+					numFullWakes++;
+
+					// Publishing removes the events
+					unlink(eventsFile);
+				}
+			}
+			usPerQuickWake[noFilesystem] = (double)std::chrono::duration_cast<std::chrono::nanoseconds>(quickTime).count() / 1000.0 / numCycles;
+			usPerFullWake[noFilesystem] = (double)std::chrono::duration_cast<std::chrono::nanoseconds>(fullTime).count() / 1000.0 / numFullWakes;
+		}
+
+		printf("quick wake storage: file system %.2f us, RAM/retained %.2f us (%.1fx); deferred writes at full wake %.2f us\n", 
+			usPerQuickWake[0], usPerQuickWake[1], 
+			(usPerQuickWake[1] > 0) ? usPerQuickWake[0] / usPerQuickWake[1] : 0.0, usPerFullWake[1]);
+		assertInt("", usPerQuickWake[1] < usPerQuickWake[0], true);
+	}
+
+	unlink(persistentDataPath);
+	unlink(eventsFile);
+}
+
 
 int main(int argc, char *argv[]) {
 	settingsTest();
+	settingsLargeTest();
+	settingsIndexTest();
+	settingsSubscriptionTest();
+	settingsMergeTest();
+	settingsDeltaSyncTest();
+	settingsHashTest();
+	settingsSchemaTest();
+	settingsViewTest();
+	settingsPartitionTest();
+	settingsJournalTest();
 	persistentDataTest();
+	persistentDataRetainedTest();
 	customPersistentDataTest();
 	customRetainedDataTest();
+	inlineFunctionTest();
+	callbackStatsTest();
+	callbackTaskTest();
+	parallelDataCaptureTest();
 	eventCombinerTest();
 	eventHistoryTest();
+	wakeTimelineTest();
+	wakeJitterTest();
+	burstCaptureTest();
+	sampleAggregatorTest();
+	reportByExceptionTest();
+	adaptiveSamplerTest();
+	quickWakeNoFilesystemTest();
 	return 0;
 }
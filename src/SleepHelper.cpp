@@ -4,12 +4,17 @@
 #include "BackgroundPublishRK.h"
 #endif
 
+#include <cerrno>
+#include <cfloat> // DBL_DIG
+#include <climits> // INT_MIN, INT_MAX
 #include <cmath>
 #include <fcntl.h>
 #include <algorithm> // std::sort
 
 SleepHelper *SleepHelper::_instance;
 
+uint32_t SleepHelper::CallbackStats::wakeCycle = 0;
+
 // [static]
 SleepHelper &SleepHelper::instance() {
     if (!_instance) {
@@ -32,6 +37,9 @@ static SleepHelperWakeEvents _wakeEvents[] = {
     { SleepHelper::eventsEnabledTimeToConnect, "ttc", 50 },
     { SleepHelper::eventsEnabledResetReason, "rr", 50 },
     { SleepHelper::eventsEnabledBatterySoC, "soc", 50 },
+    { SleepHelper::eventsEnabledSampleInterval, "si", 20 },
+    { SleepHelper::eventsEnabledQuickWakeTime, "qwt", 20 },
+    { SleepHelper::eventsEnabledCallbackStats, "cbs", 10 },
 };
 
 static const SleepHelperWakeEvents *_findWakeEvent(uint64_t flag) {
@@ -66,6 +74,90 @@ const char *SleepHelper::eventsEnableName(uint64_t flag) {
     }
 }
 
+SleepHelper &SleepHelper::withCallbackStats(bool enable, bool addToWakeEvent) {
+    std::vector<NamedCallbackList> lists;
+    getCallbackLists(lists);
+    for(auto it = lists.begin(); it != lists.end(); ++it) {
+        it->list->withStats(enable);
+    }
+    callbackStatsWakeEvent = enable && addToWakeEvent;
+    return *this;
+}
+
+void SleepHelper::forEachCallbackStats(std::function<void(const char *listName, const CallbackStats &stats)> fn) {
+    std::vector<NamedCallbackList> lists;
+    getCallbackLists(lists);
+    for(auto it = lists.begin(); it != lists.end(); ++it) {
+        const std::vector<CallbackStats> &stats = it->list->getStats();
+        for(auto statsIt = stats.begin(); statsIt != stats.end(); ++statsIt) {
+            fn(it->name, *statsIt);
+        }
+    }
+}
+
+void SleepHelper::writeCallbackStats(JSONWriter &writer) {
+    std::vector<NamedCallbackList> lists;
+    getCallbackLists(lists);
+
+    writer.beginObject();
+    for(auto it = lists.begin(); it != lists.end(); ++it) {
+        const std::vector<CallbackStats> &stats = it->list->getStats();
+
+        bool called = false;
+        for(auto statsIt = stats.begin(); statsIt != stats.end(); ++statsIt) {
+            if (statsIt->callCount) {
+                called = true;
+                break;
+            }
+        }
+        if (!called) {
+            continue;
+        }
+
+        writer.name(it->name).beginArray();
+        for(auto statsIt = stats.begin(); statsIt != stats.end(); ++statsIt) {
+            writer.beginObject();
+            if (statsIt->name) {
+                writer.name("n").value(statsIt->name);
+            }
+            writer.name("c").value((unsigned long)statsIt->callCount);
+            writer.name("t").value((unsigned long)(statsIt->totalMicros / 1000));
+            writer.name("m").value((unsigned long)statsIt->maxMicros);
+            writer.name("w").value((unsigned long)statsIt->lastTrueWakeCycle);
+            writer.endObject();
+        }
+        writer.endArray();
+    }
+    writer.endObject();
+}
+
+void SleepHelper::getCallbackLists(std::vector<NamedCallbackList> &lists) {
+    lists.clear();
+#ifndef UNITTEST
+    lists.push_back(NamedCallbackList{"sleepConfiguration", &sleepConfigurationFunctions});
+    lists.push_back(NamedCallbackList{"wake", &wakeFunctions});
+#endif
+    lists.push_back(NamedCallbackList{"setup", &setupFunctions});
+    lists.push_back(NamedCallbackList{"loop", &loopFunctions});
+    lists.push_back(NamedCallbackList{"dataCapture", &dataCaptureFunctions});
+    lists.push_back(NamedCallbackList{"sleepReady", &sleepReadyFunctions});
+    lists.push_back(NamedCallbackList{"shouldConnect", &shouldConnectFunctions});
+    lists.push_back(NamedCallbackList{"wakeOrBoot", &wakeOrBootFunctions});
+    lists.push_back(NamedCallbackList{"sleepOrReset", &sleepOrResetFunctions});
+    lists.push_back(NamedCallbackList{"maximumTimeToConnect", &maximumTimeToConnectFunctions});
+    lists.push_back(NamedCallbackList{"noConnection", &noConnectionFunctions});
+}
+
+// [static]
+int SleepHelper::calculateWakeJitter(const char *deviceId, int maxSpreadSec) {
+    if (!deviceId || maxSpreadSec <= 0) {
+        return 0;
+    }
+    uint32_t hash = StorageHelperRK::murmur3_32((const uint8_t *)deviceId, strlen(deviceId), WAKE_JITTER_HASH_SEED);
+
+    return (int)(hash % (uint32_t)(maxSpreadSec + 1));
+}
+
 
 SleepHelper::SleepHelper() : appLog("app.sleep"), persistentData("/usr/sleepData.dat") {
 
@@ -76,22 +168,48 @@ SleepHelper::SleepHelper() : appLog("app.sleep"), persistentData("/usr/sleepData
 }
 
 SleepHelper::~SleepHelper() {
+    delete dataCaptureWorkers;
 }
 
 #ifndef UNITTEST
 void SleepHelper::setup() {
     #if HAL_PLATFORM_FILESYSTEM || defined(UNITTEST)
-    int resetReason = (int) System.resetReason();
+    resetReasonInt = (int) System.resetReason();
     #endif
 
+    wakeStartMillis = millis();
+
     // Register for system events
     System.on(firmware_update | firmware_update_pending | reset | out_of_memory, systemEventHandlerStatic);
 
     #if HAL_PLATFORM_FILESYSTEM || defined(UNITTEST)
+    addWakeEventSlots();
     settingsFile.setup();
-    persistentData.setup();
+    if (persistentData.loadRetained()) {
+        appLog.trace("persistent data loaded from retained memory");
+    }
+    else {
+        // Cold boot, not using retained memory, or retained copy is corrupted
+        persistentData.setup();
+        persistentData.saveRetained();
+    }
+
+    // Restore the wake timeline when waking from HIBERNATE, since the firmware and the schedules
+    // set from it are the same as before sleep. It's still only used if the configuration hash matches.
+    // Any other reset, including a firmware update, recalculates it.
+    if (resetReasonInt == RESET_REASON_POWER_MANAGEMENT) {
+        WakeTimeline::TimelineData timelineData;
+        persistentData.getValue_wakeTimeline(timelineData);
+        wakeTimeline.setData(timelineData);
+    }
     #endif
 
+    // The per-device wake offset is calculated from the Device ID, so it's the same on every boot
+    if (wakeJitterMaxSec > 0) {
+        wakeJitterSec = calculateWakeJitter(System.deviceID(), wakeJitterMaxSec);
+        appLog.info("wake offset %d sec", wakeJitterSec);
+    }
+
     // Setup empty quick and full wake schedules to start. Data schedule is a quick wake, but also runs 
     // while the device is running, including while it's trying to connect.
     getScheduleQuick().withFlags(LocalTimeSchedule::FLAG_QUICK_WAKE);
@@ -118,9 +236,7 @@ void SleepHelper::setup() {
 
     #if HAL_PLATFORM_FILESYSTEM || defined(UNITTEST)
     // If reset reason events are enabled, add to the wake event
-    withWakeEventFlagOneTimeFunction(eventsEnabledResetReason, [resetReason](JSONWriter &writer, int &priority) {
-        writer.value(resetReason);
-    });
+    setWakeEventPending(eventsEnabledResetReason);
     #endif // HAL_PLATFORM_FILESYSTEM || defined(UNITTEST)
 
     withShouldConnectFunction([this](int &connectConviction, int &noConnectConviction) {
@@ -131,18 +247,7 @@ void SleepHelper::setup() {
             return true;
         }
 
-        time_t t = 0;
-        #if HAL_PLATFORM_FILESYSTEM || defined(UNITTEST)
-        SleepHelper::instance().persistentData.getValue_lastFullWake();
-        #endif // HAL_PLATFORM_FILESYSTEM || defined(UNITTEST)
-        if (t == 0) {
-            t = Time.now();
-        }
-
-        LocalTimeConvert conv;
-        conv.withTime(t).convert();
-
-        t = scheduleManager.getNextFullWake(conv);
+        time_t t = getNextScheduledTime(WakeTimeline::TYPE_FULL_WAKE);
         if (t <= Time.now()) {
             // It's time to do a full wake
             appLog.info("time to do full wake");
@@ -161,12 +266,23 @@ void SleepHelper::loop() {
     // Call all loop functions
     loopFunctions.forEach();
 
+    #if HAL_PLATFORM_FILESYSTEM || defined(UNITTEST)
+    // Write persistent data if the write-behind delay has elapsed
+    persistentData.flushWriteBehind(false);
+    #endif // HAL_PLATFORM_FILESYSTEM || defined(UNITTEST)
+
     // The data capture handler runs in parallel to the main state machine
     dataCaptureHandler();
 
     // Call the connection state handler
+    idleWaitMs = 0;
     stateHandler(*this);
 
+    if (idleWaitMs && loopFunctions.isEmpty()) {
+        // All callbacks are sleeping or waiting, so let the CPU idle instead of polling
+        delay(idleWaitMs);
+        idleWaitTotalMs += idleWaitMs;
+    }
 }
 
 void SleepHelper::systemEventHandler(system_event_t event, int param) {
@@ -192,6 +308,10 @@ void SleepHelper::systemEventHandler(system_event_t event, int param) {
 
         case reset:
             sleepOrResetFunctions.forEach(true);
+            #if HAL_PLATFORM_FILESYSTEM || defined(UNITTEST)
+            persistentData.flushWriteBehind(true);
+            wakeEventFunctions.flushDeferred();
+            #endif // HAL_PLATFORM_FILESYSTEM || defined(UNITTEST)
             break;
 
         case out_of_memory:
@@ -217,15 +337,30 @@ void SleepHelper::calculateSleepSettings(bool isConnected) {
     sleepParams.isConnected = isConnected;
     sleepParams.sleepTimeMs = std::chrono::duration_cast<std::chrono::milliseconds>(15min).count();
 
-    //
-    LocalTimeConvert conv;
-    conv.withCurrentTime().convert();
-    time_t nextWake = scheduleManager.getNextWake(conv);
+    // Schedule times come from the precomputed timeline
+    time_t nextWake = getNextScheduledTime(WakeTimeline::TYPE_WAKE);
     if (nextWake != 0) {
         sleepParams.sleepTimeMs = (nextWake - Time.now()) * 1000;
     }
 
-    sleepParams.nextFullWakeTime = scheduleManager.getNextFullWake(conv);
+    sleepParams.nextFullWakeTime = getNextScheduledTime(WakeTimeline::TYPE_FULL_WAKE);
+    if (wakeJitterSec != 0) {
+        nextWake = getNextWakeWithJitter();
+        if (nextWake != 0) {
+            sleepParams.sleepTimeMs = (nextWake - Time.now()) * 1000;
+        }
+    }
+
+#if HAL_PLATFORM_FILESYSTEM || defined(UNITTEST)
+    if (adaptiveSampler) {
+        // Data capture times come from the adaptive sampler, not the schedule
+        time_t nextDataCapture = persistentData.getValue_nextDataCapture();
+        if (nextDataCapture > Time.now() && (nextDataCapture - Time.now()) * 1000 < sleepParams.sleepTimeMs) {
+            sleepParams.sleepTimeMs = (nextDataCapture - Time.now()) * 1000;
+        }
+    }
+#endif // HAL_PLATFORM_FILESYSTEM || defined(UNITTEST)
+
     if (sleepParams.nextFullWakeTime != 0) {
         sleepParams.timeUntilNextFullWakeMs = (sleepParams.nextFullWakeTime - Time.now()) * 1000;
     }
@@ -246,6 +381,82 @@ void SleepHelper::calculateSleepSettings(bool isConnected) {
     sleepConfig.duration(sleepParams.sleepTimeMs);
 }
 
+time_t SleepHelper::getNextScheduledTime(int type) {
+    // The per-device offset shifts the schedule later, so look up the schedule for earlier time 
+    int offset = 0;
+    if (type == WakeTimeline::TYPE_FULL_WAKE || (type == WakeTimeline::TYPE_DATA_CAPTURE && wakeJitterDataCapture)) {
+        offset = wakeJitterSec;
+    }
+
+    time_t t = wakeTimeline.getNextTime(scheduleManager, type, Time.now() - offset);
+    if (t != 0) {
+        t += offset;
+    }
+
+    #if HAL_PLATFORM_FILESYSTEM || defined(UNITTEST)
+    if (wakeTimeline.getAndClearModified()) {
+        persistentData.setValue_wakeTimeline(wakeTimeline.getData());
+    }
+    #endif // HAL_PLATFORM_FILESYSTEM || defined(UNITTEST)
+
+    return t;
+}
+
+time_t SleepHelper::getNextWakeWithJitter() {
+    time_t nextWake = calculateNextWakeWithJitter(scheduleManager, wakeTimeline, Time.now(), wakeJitterSec, wakeJitterDataCapture);
+
+    #if HAL_PLATFORM_FILESYSTEM || defined(UNITTEST)
+    if (wakeTimeline.getAndClearModified()) {
+        persistentData.setValue_wakeTimeline(wakeTimeline.getData());
+    }
+    #endif // HAL_PLATFORM_FILESYSTEM || defined(UNITTEST)
+
+    return nextWake;
+}
+
+time_t SleepHelper::calculateNextWakeWithJitter(LocalTimeScheduleManager &scheduleManager, WakeTimeline &timeline, time_t now, int jitterSec, bool jitterDataCapture) {
+    time_t nextWake = timeline.getNextTime(scheduleManager, WakeTimeline::TYPE_WAKE, now);
+
+    // If the next wake is for the unshifted full wake or data capture time, it's not needed
+    // unless the quick wake schedule also wakes at that time
+    if (nextWake != 0 && (nextWake == timeline.getNextTime(scheduleManager, WakeTimeline::TYPE_FULL_WAKE, now) ||
+        (jitterDataCapture && nextWake == timeline.getNextTime(scheduleManager, WakeTimeline::TYPE_DATA_CAPTURE, now)))) {
+        nextWake = 0;
+    }
+
+    time_t candidates[3] = { 0, 0, 0 };
+
+    // Full wake is shifted later by the offset, so look up the schedule for the earlier time
+    candidates[0] = timeline.getNextTime(scheduleManager, WakeTimeline::TYPE_FULL_WAKE, now - jitterSec);
+    if (candidates[0] != 0) {
+        candidates[0] += jitterSec;
+    }
+
+    int dataOffset = jitterDataCapture ? jitterSec : 0;
+    candidates[1] = timeline.getNextTime(scheduleManager, WakeTimeline::TYPE_DATA_CAPTURE, now - dataOffset);
+    if (candidates[1] != 0) {
+        candidates[1] += dataOffset;
+    }
+
+    // The quick wake schedule is not in the timeline, so evaluate it directly
+    const LocalTimeSchedule &quick = scheduleManager.getScheduleByName("quick");
+    if (!quick.isEmpty()) {
+        LocalTimeConvert conv;
+        conv.withTime(now).convert();
+        if (quick.getNextScheduledTime(conv)) {
+            candidates[2] = conv.time;
+        }
+    }
+
+    for(size_t ii = 0; ii < sizeof(candidates) / sizeof(candidates[0]); ii++) {
+        if (candidates[ii] != 0 && (nextWake == 0 || candidates[ii] < nextWake)) {
+            nextWake = candidates[ii];
+        }
+    }
+
+    return nextWake;
+}
+
 void SleepHelper::dataCaptureHandler() {
     // Data capture runs in a separate state machine so it will continue to run while in any state
     // as long as there is valid RTC time
@@ -260,51 +471,91 @@ void SleepHelper::dataCaptureHandler() {
         return;
     }
 
-    if (scheduleManager.getScheduleByName("data").isEmpty()) {
-        // If there is no data capture schedule, don't attempt data capture
-        // since it will run continuously
-        return;
+    time_t nextDataCapture;
+    if (adaptiveSampler) {
+        // The sampler determines the next time once the capture has completed. Until then,
+        // don't capture again sooner than the minimum interval.
+        nextDataCapture = Time.now() + adaptiveSampler->getMinIntervalSec();
+    }
+    else {
+        // This comes from the wake timeline so it's fast enough to check on every loop
+        nextDataCapture = getNextScheduledTime(WakeTimeline::TYPE_DATA_CAPTURE);
+        if (nextDataCapture == 0) {
+            // If there is no data capture schedule, don't attempt data capture
+            // since it will run continuously
+            return;
+        }
     }
 
     if (dataCaptureActive) {
-        // Previously started capture, waiting for callbacks to finish
-        if (!dataCaptureFunctions.whileAnyTrue()) {
+        // Previously started capture, waiting for callbacks to finish. With parallel data capture
+        // the callbacks are called from the worker threads instead.
+        bool stillRunning;
+        if (dataCaptureWorkers) {
+            stillRunning = dataCaptureWorkers->isBusy();
+        }
+        else {
+            stillRunning = dataCaptureFunctions.whileAnyTrue();
+        }
+        if (!stillRunning) {
             dataCaptureActive = false;
+
+#if HAL_PLATFORM_FILESYSTEM || defined(UNITTEST)
+            if (adaptiveSampler && adaptiveSampler->getNextCaptureTime() > nextDataCapture) {
+                persistentData.setValue_nextDataCapture(adaptiveSampler->getNextCaptureTime());
+            }
+#endif // HAL_PLATFORM_FILESYSTEM || defined(UNITTEST)
         }
     }
     else {
 #if HAL_PLATFORM_FILESYSTEM || defined(UNITTEST)
         bool updateSchedule = false;
 
-        if (!persistentData.getValue_nextDataCapture()) {
+        if (!persistentData.getValue_nextDataCapture() && !adaptiveSampler) {
             // There no schedule, so update it
             updateSchedule = true;
         }
         else {
+            // With adaptive sampling and no saved time, this captures immediately
             if (persistentData.getValue_nextDataCapture() <= Time.now()) {
                 // Capture now
                 dataCaptureFunctions.setStartState();
                 dataCaptureActive = true;
                 updateSchedule = true;
+
+                if (dataCaptureWorkers) {
+                    dataCaptureWorkers->start(dataCaptureFunctions);
+                }
             }
         }
 
         if (updateSchedule) {
-            LocalTimeConvert conv;
-            conv.withCurrentTime().convert();
-
-            time_t t = scheduleManager.getNextDataCapture(conv);
-            if (t != 0) {
-                persistentData.setValue_nextDataCapture(t);
-            }
+            persistentData.setValue_nextDataCapture(nextDataCapture);
         }
 #endif // HAL_PLATFORM_FILESYSTEM || defined(UNITTEST)
     }
 }
 
+void SleepHelper::setIdleWait(system_tick_t ms) {
+    if (!idleWaitMaxMs) {
+        return;
+    }
+
+    if (dataCaptureActive && !dataCaptureWorkers) {
+        system_tick_t dataCaptureMs = dataCaptureFunctions.getMillisUntilReady(millis());
+        if (dataCaptureMs < ms) {
+            ms = dataCaptureMs;
+        }
+    }
+
+    idleWaitMs = (ms < idleWaitMaxMs) ? ms : idleWaitMaxMs;
+}
+
 void SleepHelper::stateHandlerStart() {
     appLog.info("stateHandlerStart");
 
+    CallbackStats::wakeCycle++;
+
     // This handles when we do a quick wake cycle by schedule and we've woken up
     // again. There doesn't need to be a handle to handle this common case.
     bool isQuickWake = false;
@@ -312,7 +563,10 @@ void SleepHelper::stateHandlerStart() {
         isQuickWake = (Time.now() < sleepParams.nextFullWakeTime);
     }
 
-    if (isQuickWake || !shouldConnectFunctions.shouldConnect()) {
+    bool noConnectionWake = isQuickWake || !shouldConnectFunctions.shouldConnect();
+    setNoConnectionWake(noConnectionWake);
+
+    if (noConnectionWake) {
         // We should not connect, so go into no connection state
         appLog.info("running in no connection mode");
         #if HAL_PLATFORM_FILESYSTEM || defined(UNITTEST)
@@ -369,27 +623,37 @@ void SleepHelper::stateHandlerTimeValidWait() {
 void SleepHelper::stateHandlerConnectedStart() {
     connectedStartMillis = millis();
 
+    // Connecting already handles anything that requested a connection check
+    connectionCheckRequested = false;
+
 #if HAL_PLATFORM_FILESYSTEM || defined(UNITTEST)
     SleepHelper::instance().persistentData.setValue_lastFullWake(Time.now());
+
+    if (quickWakeNoFilesystem) {
+        // Write changes deferred during quick wakes
+        persistentData.flushWriteBehind(true);
+        wakeEventFunctions.flushDeferred();
+    }
 #endif // HAL_PLATFORM_FILESYSTEM || defined(UNITTEST)
 
     system_tick_t elapsedMs = connectedStartMillis - connectAttemptStartMillis;
     appLog.info("connected to cloud in %lu ms", elapsedMs);
 
 #if HAL_PLATFORM_FILESYSTEM || defined(UNITTEST)
-    withWakeEventFlagOneTimeFunction(eventsEnabledTimeToConnect, [elapsedMs](JSONWriter &writer, int &priority) {
-        writer.value((int)elapsedMs);
-    });
-#endif // HAL_PLATFORM_FILESYSTEM || defined(UNITTEST)
-
+    setWakeEventPending(eventsEnabledTimeToConnect);
+    if (lastQuickWakeMs != 0) {
+        setWakeEventPending(eventsEnabledQuickWakeTime);
+    }
+    if (adaptiveSampler) {
+        setWakeEventPending(eventsEnabledSampleInterval);
+    }
 #if HAL_PLATFORM_POWER_MANAGEMENT
-    withWakeEventFlagOneTimeFunction(eventsEnabledBatterySoC, [](JSONWriter &writer, int &priority) {
-        float soc = System.batteryCharge();
-        if (soc > 0) {
-            writer.value(soc, 1);
-        }
-    });
+    setWakeEventPending(eventsEnabledBatterySoC);
 #endif // HAL_PLATFORM_POWER_MANAGEMENT
+    if (callbackStatsWakeEvent) {
+        setWakeEventPending(eventsEnabledCallbackStats);
+    }
+#endif // HAL_PLATFORM_FILESYSTEM || defined(UNITTEST)
 
 
 
@@ -477,6 +741,12 @@ void SleepHelper::stateHandlerConnected() {
         }
     }
     
+    // Event history is checked once per second
+    system_tick_t ms = sleepReadyFunctions.getMillisUntilReady(millis());
+    if (ms > 1000) {
+        ms = 1000;
+    }
+    setIdleWait(ms);
 
 }
 
@@ -517,8 +787,29 @@ void SleepHelper::stateHandlerNoConnection() {
 
     if (dataCaptureActive) {
         // Wait until data capture completes before calling no connection functions
+        setIdleWait(0xffffffff);
         return;
     }
+
+    if (connectionCheckRequested) {
+        // Something during data capture, such as an alarm, may warrant a connection. Unlike
+        // stateHandlerStart, a conviction must actually be expressed to connect.
+        connectionCheckRequested = false;
+
+        int connectConviction, noConnectConviction;
+        shouldConnectFunctions.getConvictions(connectConviction, noConnectConviction);
+        if (connectConviction > 0 && connectConviction >= noConnectConviction) {
+            appLog.info("connecting to cloud from no connection mode");
+            setNoConnectionWake(false);
+
+            Particle.connect();    
+            stateHandler = &SleepHelper::stateHandlerConnectWait;
+            connectAttemptStartMillis = millis();
+            networkConnectedMillis = 0;
+            reconnectAttemptStartMillis = 0;
+            return;
+        }
+    }
     
     if (!noConnectionFunctions.whileAnyTrue()) {
         // No more noConnectionFunctions need time, so go to sleep now
@@ -531,6 +822,7 @@ void SleepHelper::stateHandlerNoConnection() {
     }
     
     // Stay in this state while any noConnectionFunction returns true
+    setIdleWait(noConnectionFunctions.getMillisUntilReady(millis()));
     return;
 }
 
@@ -591,10 +883,37 @@ void SleepHelper::stateHandlerSleep() {
     // Prior states:
     // stateHandlerWaitCellularOff (trigger: cellular is off)
     // stateHandlerDisconnectBeforeSleep (trigger: not turning cellular off due to short sleep)
+
+    if (dataCaptureWorkers && dataCaptureWorkers->isBusy()) {
+        // After a connection timeout, worker threads can still be in a data capture function, 
+        // possibly holding its lock resource, so wait for them to finish before sleep
+        setIdleWait(0xffffffff);
+        return;
+    }
+
     appLog.info("stateHandlerSleep");
 
+    // A sleep configuration function can select HIBERNATE, which does not preserve RAM, so
+    // nothing can be left in RAM for the next wake
+    sleepPreservesRam = (sleepConfig.sleepMode() != SystemSleepMode::HIBERNATE);
+
     sleepOrResetFunctions.forEach(false);
 
+    #if HAL_PLATFORM_FILESYSTEM || defined(UNITTEST)
+    writeFilesBeforeSleep();
+    #endif // HAL_PLATFORM_FILESYSTEM || defined(UNITTEST)
+
+    if (!isNoConnectionWake) {
+        // Data captured during a connected wake was sent on this wake, so it does not need
+        // to be checked again on the next quick wake
+        connectionCheckRequested = false;
+    }
+
+    if (isNoConnectionWake) {
+        lastQuickWakeMs = millis() - wakeStartMillis;
+        appLog.info("quick wake took %lu ms", lastQuickWakeMs);
+    }
+
     // Especially in the cloud disconnect case it can take several seconds to disconnect, so
     // adjust the sleep time here
     int adjustmentMs = System.millis() - sleepParams.calculatedMillis;
@@ -617,6 +936,7 @@ void SleepHelper::stateHandlerSleep() {
         wakeFunctions.forEach(sleepResult);
 
         wakeReasonInt = (int) sleepResult.wakeupReason();
+        wakeStartMillis = millis();
         stateHandler = &SleepHelper::stateHandlerSleepDone;
     }
     else {
@@ -639,15 +959,78 @@ void SleepHelper::stateHandlerSleepDone() {
     wakeOrBootFunctions.forEach(wakeReasonInt);
 
     #if HAL_PLATFORM_FILESYSTEM || defined(UNITTEST)
-    withWakeEventFlagOneTimeFunction(eventsEnabledWakeReason, [this](JSONWriter &writer, int &priority) {
-        writer.value(wakeReasonInt);
-    });     
+    setWakeEventPending(eventsEnabledWakeReason);
     #endif // HAL_PLATFORM_FILESYSTEM || defined(UNITTEST)
 
 }
 
+#if HAL_PLATFORM_FILESYSTEM || defined(UNITTEST)
+void SleepHelper::addWakeEventSlots() {
+    size_t numWakeEvents = sizeof(_wakeEvents) / sizeof(_wakeEvents[0]);
+    for(size_t ii = 0; ii < numWakeEvents; ii++) {
+        uint64_t flag = _wakeEvents[ii].flag;
+        size_t slot = wakeEventFunctions.addSlot(_wakeEvents[ii].name, _wakeEvents[ii].priority, [this, flag](JSONWriter &writer) {
+            writeWakeEvent(flag, writer);
+        });
+        if (ii == 0) {
+            wakeEventSlotBase = slot;
+        }
+    }
+}
+
+void SleepHelper::setWakeEventPending(uint64_t flag) {
+    if ((eventsEnabled & flag) == 0) {
+        return;
+    }
+    size_t numWakeEvents = sizeof(_wakeEvents) / sizeof(_wakeEvents[0]);
+    for(size_t ii = 0; ii < numWakeEvents; ii++) {
+        if (_wakeEvents[ii].flag == flag) {
+            wakeEventFunctions.setSlotPending(wakeEventSlotBase + ii);
+            break;
+        }
+    }
+}
+
+void SleepHelper::writeWakeEvent(uint64_t flag, JSONWriter &writer) {
+    if (flag == eventsEnabledWakeReason) {
+        writer.value(wakeReasonInt);
+    }
+    else
+    if (flag == eventsEnabledTimeToConnect) {
+        writer.value((int)(connectedStartMillis - connectAttemptStartMillis));
+    }
+    else
+    if (flag == eventsEnabledResetReason) {
+        writer.value(resetReasonInt);
+    }
+    else
+    if (flag == eventsEnabledSampleInterval) {
+        writer.value(adaptiveSampler ? (int)adaptiveSampler->getEffectiveIntervalSec() : 0);
+    }
+    else
+    if (flag == eventsEnabledQuickWakeTime) {
+        writer.value((int)lastQuickWakeMs);
+    }
+    else
+    if (flag == eventsEnabledCallbackStats) {
+        writeCallbackStats(writer);
+    }
+#if HAL_PLATFORM_POWER_MANAGEMENT
+    else
+    if (flag == eventsEnabledBatterySoC) {
+        float soc = System.batteryCharge();
+        if (soc > 0) {
+            writer.value(soc, 1);
+        }
+    }
+#endif // HAL_PLATFORM_POWER_MANAGEMENT
+}
+#endif // HAL_PLATFORM_FILESYSTEM || defined(UNITTEST)
+
 void SleepHelper::stateHandlerSleepShort() {
     if (millis() - stateTime >= sleepParams.sleepTimeMs) {
+        // The next wake cycle starts now, so the time spent waiting is not part of the quick wake time
+        wakeStartMillis = millis();
         stateHandler = &SleepHelper::stateHandlerSleepDone;
         return;
     }
@@ -656,266 +1039,1999 @@ void SleepHelper::stateHandlerSleepShort() {
 
 #endif // UNITTEST
 
+void SleepHelper::setNoConnectionWake(bool noConnectionWake) {
+    isNoConnectionWake = noConnectionWake;
+
+    #if HAL_PLATFORM_FILESYSTEM || defined(UNITTEST)
+    if (quickWakeNoFilesystem) {
+        if (getFileSystemWritesDeferred()) {
+            wakeEventFunctions.withDeferredWrites(quickWakeEventBufferBytes);
+        }
+        else {
+            // Write events held from earlier quick wakes first so the file stays in order
+            wakeEventFunctions.flushDeferred();
+            wakeEventFunctions.withDeferredWrites(0);
+        }
+    }
+    #endif // HAL_PLATFORM_FILESYSTEM || defined(UNITTEST)
+}
+
+#if HAL_PLATFORM_FILESYSTEM || defined(UNITTEST)
+void SleepHelper::writeFilesBeforeSleep() {
+    bool deferred = getFileSystemWritesDeferred();
+
+    // In write-behind mode, this is the single write for this wake cycle. Retained memory survives
+    // sleep so in retained mode the file is only written on its interval, or if the battery is low.
+    bool forceSave = !persistentData.getRetained() && !deferred;
+    #if HAL_PLATFORM_POWER_MANAGEMENT
+    float soc = System.batteryCharge();
+    if (soc >= 0 && soc < retainedLowBatterySoC) {
+        forceSave = true;
+    }
+    #endif // HAL_PLATFORM_POWER_MANAGEMENT
+    persistentData.flushWriteBehind(forceSave);
+
+    if (!deferred) {
+        // Events held in RAM from a quick wake that was followed by a full wake, or a quick wake 
+        // before a sleep mode that does not preserve RAM
+        wakeEventFunctions.flushDeferred();
+
+        // Compact the settings journal while nothing else is happening. A small journal is left alone, 
+        // since compacting rewrites the whole settings file.
+        settingsFile.compactJournal(settingsFile.getMaxJournalSize() / 2);
+    }
+}
+#endif // HAL_PLATFORM_FILESYSTEM || defined(UNITTEST)
+
 //
-// SettingsFile
+// DataCaptureWorkers
 //
-#if HAL_PLATFORM_FILESYSTEM || defined(UNITTEST)
-void SleepHelper::SettingsFile::setup() {
+SleepHelper::DataCaptureWorkers::DataCaptureWorkers(size_t numWorkers, size_t stackSize) : 
+    numWorkers(numWorkers), stackSize(stackSize), jobsRemaining(0) {
 }
 
-bool SleepHelper::SettingsFile::load() {
-    WITH_LOCK(*this) {
-        bool loaded = false;
+SleepHelper::DataCaptureWorkers::~DataCaptureWorkers() {
+    join();
 
-        int dataSize = 0;
+    for(size_t ii = 0; ii < threads.size(); ii++) {
+        putJob(-1);
+    }
+#ifndef UNITTEST
+    for(auto it = threads.begin(); it != threads.end(); ++it) {
+        (*it)->join();
+        delete *it;
+    }
+    if (queue) {
+        os_queue_destroy(queue, 0);
+    }
+#else
+    for(auto it = threads.begin(); it != threads.end(); ++it) {
+        it->join();
+    }
+#endif
+}
 
-        int fd = open(path, O_RDONLY);
-        if (fd != -1) {
-            dataSize = read(fd, parser.getBuffer(), parser.getBufferLen());
-            if (dataSize > 0) {                
-                parser.setOffset(dataSize);
-                if (parser.parse()) {
-                    loaded = true;
+bool SleepHelper::DataCaptureWorkers::start(AppCallbackWithState<> &callbacks) {
+    if (isBusy()) {
+        return false;
+    }
+    this->callbacks = &callbacks;
+
+    // Callbacks in the same lock group are run in order as a single job. Other callbacks
+    // are a job by themselves.
+    jobs.clear();
+    std::vector<const void *> jobLockGroups;
+    for(size_t ii = 0; ii < callbacks.callbackState.size(); ii++) {
+        const void *lockGroup = callbacks.callbackState[ii].lockGroup;
+
+        size_t jobIndex = jobs.size();
+        if (lockGroup) {
+            for(size_t jj = 0; jj < jobLockGroups.size(); jj++) {
+                if (jobLockGroups[jj] == lockGroup) {
+                    jobIndex = jj;
+                    break;
                 }
             }
-            close(fd);
         }
-        
-        if (!loaded) {
-            parser.addString("{}");
-            parser.parse();
+        if (jobIndex == jobs.size()) {
+            jobs.push_back(std::vector<size_t>());
+            jobLockGroups.push_back(lockGroup);
         }
+        jobs[jobIndex].push_back(ii);
     }
-
-    // Merge in any default values
-    if (defaultValues) {
-        addDefaultValues(defaultValues);
+    if (jobs.empty()) {
+        return true;
     }
 
-    return true;
-}
+    startThreads(jobs.size());
 
-bool SleepHelper::SettingsFile::save() {
-    WITH_LOCK(*this) {
-        int fd = open(path, O_RDWR | O_CREAT | O_TRUNC, 0666);
-        if (fd != -1) {            
-            write(fd, parser.getBuffer(), parser.getOffset());
-            close(fd);
-        }
-        else {            
-            return false;
+    jobsRemaining.store((int)jobs.size());
+    for(size_t jobIndex = 0; jobIndex < jobs.size(); jobIndex++) {
+        if (!putJob((int)jobIndex)) {
+            // Should not happen since the queue is sized for all jobs, but run it here if it does
+            runJob((int)jobIndex);
         }
     }
-
     return true;
 }
 
-bool SleepHelper::SettingsFile::setValuesJson(const char *inputJson) {
-    std::vector<String> updatedKeys;
+void SleepHelper::DataCaptureWorkers::join() {
+    while(isBusy()) {
+        delayMs(1);
+    }
+}
 
-    WITH_LOCK(*this) {
-        JsonParserStatic<particle::protocol::MAX_EVENT_DATA_LENGTH, 50> inputParser;
-        inputParser.addString(inputJson);
-        inputParser.parse();
+void SleepHelper::DataCaptureWorkers::startThreads(size_t minQueueSize) {
+#ifndef UNITTEST
+    if (queue && queueSize < minQueueSize) {
+        // More callbacks have been added since the queue was created. The queue is empty here
+        // because no jobs are running, so it can be replaced.
+        os_queue_destroy(queue, 0);
+        queue = 0;
+    }
+    if (!queue) {
+        queueSize = (minQueueSize > numWorkers) ? minQueueSize : numWorkers;
+        os_queue_create(&queue, sizeof(int), queueSize, 0);
+    }
+#endif
 
-        const JsonParserGeneratorRK::jsmntok_t *keyToken;
-		const JsonParserGeneratorRK::jsmntok_t *valueToken;
+    while(threads.size() < numWorkers) {
+#ifndef UNITTEST
+        threads.push_back(new Thread("dataCapture", [this]() { workerThread(); }, OS_THREAD_PRIORITY_DEFAULT, stackSize));
+#else
+        threads.push_back(std::thread([this]() { workerThread(); }));
+#endif
+    }
+}
+
+void SleepHelper::DataCaptureWorkers::workerThread() {
+    while(true) {
+        int jobIndex = takeJob();
+        if (jobIndex < 0) {
+            break;
+        }
+        runJob(jobIndex);
+    }
+}
+
+void SleepHelper::DataCaptureWorkers::runJob(int jobIndex) {
+    const std::vector<size_t> &job = jobs[jobIndex];
+
+    for(auto it = job.begin(); it != job.end(); ++it) {
+        while(callbacks->callAt(*it, millis())) {
+            // Callback still needs time. If it's sleeping, wait until it's ready. Otherwise delay
+            // briefly so other threads at the same priority can run.
+            system_tick_t ms = callbacks->callbackState[*it].getMillisUntilReady(millis());
+            delayMs(ms ? ms : 1);
+        }
+    }
+
+    jobsRemaining--;
+}
+
+bool SleepHelper::DataCaptureWorkers::putJob(int jobIndex) {
+#ifndef UNITTEST
+    return os_queue_put(queue, &jobIndex, 0, 0) == 0;
+#else
+    {
+        std::lock_guard<std::mutex> lock(queueMutex);
+        queue.push_back(jobIndex);
+    }
+    queueCondition.notify_one();
+    return true;
+#endif
+}
+
+int SleepHelper::DataCaptureWorkers::takeJob() {
+    int jobIndex = -1;
+#ifndef UNITTEST
+    if (os_queue_take(queue, &jobIndex, CONCURRENT_WAIT_FOREVER, 0) != 0) {
+        jobIndex = -1;
+    }
+#else
+    std::unique_lock<std::mutex> lock(queueMutex);
+    queueCondition.wait(lock, [this]() { return !queue.empty(); });
+    jobIndex = queue.front();
+    queue.pop_front();
+#endif
+    return jobIndex;
+}
+
+void SleepHelper::DataCaptureWorkers::delayMs(system_tick_t ms) {
+#ifndef UNITTEST
+    delay(ms);
+#else
+    std::this_thread::sleep_for(std::chrono::milliseconds(ms));
+#endif
+}
+
+//
+// WakeTimeline
+//
+SleepHelper::WakeTimeline::WakeTimeline() {
+    memset(&data, 0, sizeof(data));
+}
+
+SleepHelper::WakeTimeline &SleepHelper::WakeTimeline::withTimeConfig(const char *tzConfig) {
+    tzHash = StorageHelperRK::murmur3_32((const uint8_t *)tzConfig, strlen(tzConfig), HASH_SEED);
+    invalidate();
+    return *this;
+}
+
+time_t SleepHelper::WakeTimeline::getNextTime(LocalTimeScheduleManager &scheduleManager, int type, time_t now) {
+    if (type < 0 || type >= NUM_TYPES) {
+        return 0;
+    }
+
+    if (configChanged) {
+        configChanged = false;
+
+        uint32_t configHash = calculateConfigHash(scheduleManager);
+        if (!restored || configHash != data.configHash || data.validMask == 0) {
+            // Configuration may have changed, discard all of the previously calculated times
+            memset(&data, 0, sizeof(data));
+            data.configHash = configHash;
+            modified = true;
+        }
+        restored = false;
+    }
+
+    if ((data.validMask & (1 << type)) == 0 || now < (time_t)data.baseTime[type]) {
+        // Not calculated yet, or asking about a time before the table was calculated
+        rebuild(scheduleManager, type, now);
+    }
+
+    if (data.times[type][0] == 0) {
+        // No schedule of this type
+        return 0;
+    }
+
+    for(size_t ii = 0; ii < TIMELINE_SIZE; ii++) {
+        time_t t = (time_t) data.times[type][ii];
+        if (t == 0) {
+            break;
+        }
+        if (t >= now) {
+            return t;
+        }
+    }
+
+    // All of the times in the table have passed
+    rebuild(scheduleManager, type, now);
+
+    return (time_t) data.times[type][0];
+}
+
+void SleepHelper::WakeTimeline::setData(const TimelineData &data) {
+    this->data = data;
+    configChanged = true;
+    restored = true;
+}
+
+bool SleepHelper::WakeTimeline::getAndClearModified() {
+    bool result = modified;
+    modified = false;
+    return result;
+}
+
+uint32_t SleepHelper::WakeTimeline::calculateConfigHash(LocalTimeScheduleManager &scheduleManager) {
+    // Reference times at different times of day and different sides of daylight saving in
+    // both hemispheres. The values don't matter, but must never change.
+    static const time_t referenceTimes[] = {
+        1640995200, // 2022-01-01 00:00:00 UTC
+        1656678896, // 2022-07-01 12:34:56 UTC
+    };
+    uint32_t hash = tzHash;
+
+    for(size_t ii = 0; ii < sizeof(referenceTimes) / sizeof(referenceTimes[0]); ii++) {
+        uint32_t times[NUM_TYPES];
+        for(int type = 0; type < NUM_TYPES; type++) {
+            times[type] = (uint32_t) evaluate(scheduleManager, type, referenceTimes[ii]);
+        }
+        hash = StorageHelperRK::murmur3_32((const uint8_t *)times, sizeof(times), hash ^ HASH_SEED);
+    }
+
+    return hash;
+}
+
+time_t SleepHelper::WakeTimeline::evaluate(LocalTimeScheduleManager &scheduleManager, int type, time_t t) {
+    LocalTimeConvert conv;
+    conv.withTime(t).convert();
+
+    evaluationCount++;
+
+    switch(type) {
+        case TYPE_WAKE:
+            return scheduleManager.getNextWake(conv);
+
+        case TYPE_FULL_WAKE:
+            return scheduleManager.getNextFullWake(conv);
+
+        case TYPE_DATA_CAPTURE:
+            return scheduleManager.getNextDataCapture(conv);
+
+        default:
+            return 0;
+    }
+}
+
+void SleepHelper::WakeTimeline::rebuild(LocalTimeScheduleManager &scheduleManager, int type, time_t now) {
+    data.baseTime[type] = (uint32_t) now;
+    data.validMask |= (1 << type);
+
+    // The first time can be now, the same as evaluating the schedule directly. Later times
+    // must be after the previous time.
+    time_t t = now;
+    for(size_t ii = 0; ii < TIMELINE_SIZE; ii++) {
+        time_t next = (t != 0) ? evaluate(scheduleManager, type, t) : 0;
+        if (ii > 0 && next != 0 && next <= t) {
+            // Schedule returned the time passed in, get the one after it
+            next = evaluate(scheduleManager, type, t + 1);
+        }
+        if (next < t || (ii > 0 && next == t)) {
+            next = 0;
+        }
+        data.times[type][ii] = (uint32_t) next;
+        t = next;
+    }
+    modified = true;
+}
+
+//
+// SettingsFile
+//
+#if HAL_PLATFORM_FILESYSTEM || defined(UNITTEST)
+void SleepHelper::SettingsFile::setup() {
+}
+
+bool SleepHelper::SettingsFile::load() {
+    // Partitions are loaded first so bound variables in this object are set from them below
+    for(auto it = partitions.begin(); it != partitions.end(); ++it) {
+        if (it->settings->path.length() == 0) {
+            it->settings->withPath(getPartitionPath(it->name));
+        }
+        it->settings->load();
+    }
+
+    WITH_LOCK(*this) {
+        loadedFromBackup = false;
+
+        bool loaded = loadFile(path);
+        if (!loaded) {
+            loaded = loadFile(path + ".bak");
+            loadedFromBackup = loaded;
+        }
+        
+        if (!loaded) {
+            parser.clear();
+            parser.addString("{}");
+            parser.parse();
+            fileHash = 0;
+            loadedSchemaVersion = 0;
+        }
+        if (maxJournalSize > 0) {
+            replayJournal();
+            if (schema && loadedSchemaVersion != schemaVersion) {
+                // Schema version is only stored in the settings file
+                journalNeedsCompact = true;
+            }
+        }
+        contentChanged();
+
+        defaultsMergedOnLoad = !(schema && loaded && loadedSchemaVersion == schemaVersion);
+    }
+
+    if (defaultsMergedOnLoad) {
+        bool needsSave = false;
+
+        // Schema defaults for keys stored in a partition belong in the partition. This is found before 
+        // locking this object because the partition lock is never taken while holding this lock.
+        std::vector<String> partitionKeys;
+        if (schema && !partitions.empty()) {
+            for(size_t ii = 0; ii < schemaCount; ii++) {
+                if (findPartition(schema[ii]->key)) {
+                    partitionKeys.push_back(schema[ii]->key);
+                }
+            }
+        }
+
+        WITH_LOCK(*this) {
+            needsSave = addSchemaDefaults(partitionKeys);
+
+            // Save the current schema version, even if no defaults were added
+            if (schema && loadedSchemaVersion != schemaVersion) {
+                needsSave = true;
+            }
+        }
+
+        // Merge in any default values
+        if (defaultValues) {
+            beginTransaction();
+            addDefaultValues(defaultValues);
+            if (needsSave) {
+                deferSave();
+            }
+            commitTransaction();
+        }
+        else
+        if (needsSave && !deferSave()) {
+            save();
+        }
+    }
+
+    return true;
+}
+
+SleepHelper::SettingsFile &SleepHelper::SettingsFile::addPartition(const char *name) {
+    SettingsFile *partition = new SettingsFile();
+    partition->parent = this;
+
+    WITH_LOCK(*this) {
+        partitions.push_back(Partition{String(name), partition});
+    }
+    return *partition;
+}
+
+SleepHelper::SettingsFile *SleepHelper::SettingsFile::getPartition(const char *name) const {
+    for(auto it = partitions.begin(); it != partitions.end(); ++it) {
+        if (it->name == name) {
+            return it->settings;
+        }
+    }
+    return NULL;
+}
+
+SleepHelper::SettingsFile *SleepHelper::SettingsFile::findPartition(const char *name) const {
+    for(auto it = partitions.begin(); it != partitions.end(); ++it) {
+        bool found = false;
+        WITH_LOCK(*it->settings) {
+            found = (it->settings->findValueToken(name) != NULL);
+        }
+        if (found) {
+            return it->settings;
+        }
+    }
+    return NULL;
+}
+
+String SleepHelper::SettingsFile::getPartitionPath(const char *name) const {
+    if (path.endsWith(".json")) {
+        return path.substring(0, path.length() - 5) + "." + name + ".json";
+    }
+    else {
+        return path + "." + name;
+    }
+}
+
+bool SleepHelper::SettingsFile::getMergedValuesJson(String &json) {
+    std::vector<String> keys;
+
+    json = "{";
+
+    // This object and each partition are copied and then merged without holding a lock, so the 
+    // lock on this object is never taken while a partition is locked
+    for(size_t ii = 0; ii <= partitions.size(); ii++) {
+        String sourceJson;
+        if (ii == 0) {
+            getValuesJson(sourceJson);
+        }
+        else {
+            partitions[ii - 1].settings->getValuesJson(sourceJson);
+        }
+
+        JsonParser jp;
+        jp.addString(sourceJson);
+        if (!jp.parse()) {
+            return false;
+        }
+
+        std::vector<KeyValueTokens> pairs;
+        getOuterKeyValueTokens(jp, pairs);
+
+        for(auto it = pairs.begin(); it != pairs.end(); ++it) {
+            String key;
+            jp.getTokenValue(it->key, key);
+
+            // A key stored in a partition is read from the partition, like getValue(), even if an 
+            // earlier version left a copy in this object. Otherwise an earlier partition takes precedence.
+            if ((ii == 0 && findPartition(key)) || std::find(keys.begin(), keys.end(), key) != keys.end()) {
+                continue;
+            }
+            keys.push_back(key);
+
+            if (keys.size() > 1) {
+                json.concat(',');
+            }
+            appendTokenJson(json, jp, it->key);
+            json.concat(':');
+            appendTokenJson(json, jp, it->value);
+        }
+    }
+    json.concat('}');
+
+    return true;
+}
+
+bool SleepHelper::SettingsFile::loadFile(const char *filePath) {
+    bool loaded = false;
+
+    int fd = open(filePath, O_RDONLY);
+    if (fd == -1) {
+        return false;
+    }
+
+    struct stat sb;
+    fstat(fd, &sb);
+    size_t fileSize = sb.st_size;
+
+    SettingsFileMeta meta = {0};
+    loadedSchemaVersion = 0;
+    int metaFd = open(getMetaPath(filePath), O_RDONLY);
+    if (metaFd != -1) {
+        if (read(metaFd, &meta, sizeof(SettingsFileMeta)) != (int)sizeof(SettingsFileMeta)) {
+            meta.magic = 0;
+        }
+        close(metaFd);
+    }
+
+    if (meta.magic == SETTINGS_META_MAGIC && meta.size == fileSize) {
+        if (meta.size <= maxSize) {
+            if (fileHash != 0 && meta.hash == fileHash && meta.hash == getBufferHash()) {
+                // Already have these settings parsed in RAM
+                loaded = true;
+            }
+            else {
+                parser.clear();
+                int dataSize = 0;
+                if (reserve(meta.size)) {
+                    dataSize = read(fd, parser.getBuffer(), meta.size);
+                }
+                if (dataSize == (int)meta.size) {
+                    parser.setOffset(dataSize);
+                    if (getBufferHash() == meta.hash && parser.parse()) {
+                        loaded = true;
+                    }
+                }
+            }
+            if (loaded) {
+                loadedSchemaVersion = meta.schemaVersion;
+            }
+        }
+    }
+    else {
+        // No .meta file, or one that is for a different file, such as a file written by an earlier 
+        // version after a rollback. Validate by parsing.
+        parser.clear();
+        int dataSize = 0;
+        if (fileSize <= maxSize && reserve(fileSize)) {
+            dataSize = read(fd, parser.getBuffer(), fileSize);
+        }
+        if (dataSize > 0 && dataSize == (int)fileSize) {
+            parser.setOffset(dataSize);
+            if (parser.parse()) {
+                loaded = true;
+            }
+        }
+    }
+    close(fd);
+
+    fileHash = loaded ? getBufferHash() : 0;
+
+    return loaded;
+}
+
+bool SleepHelper::SettingsFile::save() {
+    if (path.length() == 0) {
+        return false;
+    }
+
+    WITH_LOCK(*this) {
+        if (maxJournalSize > 0 && appendJournal()) {
+            return true;
+        }
+
+        if (!writeSnapshot()) {
+            return false;
+        }
+
+        if (maxJournalSize > 0) {
+            // The settings file now contains everything in the journal
+            unlink(getJournalPath());
+            journalSize = 0;
+            journalKeys.clear();
+            journalNeedsCompact = false;
+        }
+    }
+
+    return true;
+}
+
+bool SleepHelper::SettingsFile::compactJournal(size_t minJournalSize) {
+    if (maxJournalSize == 0) {
+        return false;
+    }
+
+    WITH_LOCK(*this) {
+        if (!journalNeedsCompact && (journalSize == 0 || journalSize < minJournalSize)) {
+            return false;
+        }
+        journalNeedsCompact = true;
+    }
+
+    return save();
+}
+
+bool SleepHelper::SettingsFile::appendJournal() {
+    if (journalNeedsCompact || journalKeys.empty() || fileHash == 0) {
+        return false;
+    }
+
+    String record = "{";
+    for(auto it = journalKeys.begin(); it != journalKeys.end(); ++it) {
+        const IndexEntry *entry = findIndexEntry(*it);
+        if (!entry) {
+            // Removed keys can't be represented in the journal
+            return false;
+        }
+        if (record.length() > 1) {
+            record.concat(',');
+        }
+        appendTokenJson(record, parser, entry->keyToken);
+        record.concat(':');
+        appendTokenJson(record, parser, entry->valueToken);
+    }
+    record.concat("}\n");
+
+    if (journalSize + record.length() > maxJournalSize) {
+        return false;
+    }
+
+    int fd = open(getJournalPath(), O_WRONLY | O_CREAT | O_APPEND, 0666);
+    if (fd == -1) {
+        return false;
+    }
+
+    bool success = true;
+    if (journalSize == 0) {
+        // The journal only applies to the settings file with this hash
+        String header = String::format("#%08lx\n", (unsigned long)fileHash);
+        success = (write(fd, header.c_str(), header.length()) == (int)header.length());
+        journalSize += header.length();
+    }
+    if (success) {
+        success = (write(fd, record.c_str(), record.length()) == (int)record.length());
+        journalSize += record.length();
+    }
+    close(fd);
+
+    if (!success) {
+        // Partial record is ignored by replayJournal(), but the settings file must be written
+        journalNeedsCompact = true;
+        return false;
+    }
+    journalKeys.clear();
+
+    return true;
+}
+
+void SleepHelper::SettingsFile::replayJournal() {
+    journalSize = 0;
+    journalKeys.clear();
+    journalNeedsCompact = false;
+
+    int fd = open(getJournalPath(), O_RDONLY);
+    if (fd == -1) {
+        return;
+    }
+
+    struct stat sb;
+    fstat(fd, &sb);
+    size_t fileSize = sb.st_size;
+
+    // Read the whole journal in one call, then parse the records in place
+    char *journal = nullptr;
+    size_t journalLen = 0;
+    if (fileSize <= maxSize * 2) {
+        journal = (char *)malloc(fileSize + 1);
+        if (journal) {
+            int count = read(fd, journal, fileSize);
+            journalLen = (count > 0) ? (size_t)count : 0;
+            journal[journalLen] = 0;
+        }
+    }
+    close(fd);
+
+    String header = String::format("#%08lx\n", (unsigned long)fileHash);
+    if (fileHash == 0 || journalLen < header.length() || memcmp(journal, header.c_str(), header.length()) != 0) {
+        // Journal for a different version of the settings file
+        free(journal);
+        journalNeedsCompact = true;
+        return;
+    }
+
+    size_t start = header.length();
+    while(start < journalLen) {
+        char *end = (char *)memchr(journal + start, '\n', journalLen - start);
+        if (!end) {
+            // Incomplete last record from a reset during save
+            journalNeedsCompact = true;
+            break;
+        }
+        *end = 0;
+
+        std::vector<String> updatedKeys;
+        if (!mergeValuesJson(journal + start, false, updatedKeys)) {
+            journalNeedsCompact = true;
+            break;
+        }
+        start = (end - journal) + 1;
+    }
+    journalSize = start;
+    free(journal);
+}
+
+bool SleepHelper::SettingsFile::writeSnapshot() {
+    WITH_LOCK(*this) {
+        String tempPath = path + ".tmp";
+        String backupPath = path + ".bak";
+
+        SettingsFileMeta meta;
+        meta.magic = SETTINGS_META_MAGIC;
+        meta.size = parser.getOffset();
+        meta.hash = getBufferHash();
+        meta.schemaVersion = schema ? schemaVersion : 0;
+
+        int fd = open(tempPath, O_RDWR | O_CREAT | O_TRUNC, 0666);
+        if (fd == -1) {
+            return false;
+        }
+        bool success = (write(fd, parser.getBuffer(), meta.size) == (int)meta.size);
+        close(fd);
+
+        if (success) {
+            fd = open(getMetaPath(tempPath), O_RDWR | O_CREAT | O_TRUNC, 0666);
+            if (fd == -1) {
+                success = false;
+            }
+            else {
+                success = (write(fd, &meta, sizeof(SettingsFileMeta)) == (int)sizeof(SettingsFileMeta));
+                close(fd);
+            }
+        }
+
+        if (!success) {
+            unlink(tempPath);
+            unlink(getMetaPath(tempPath));
+            return false;
+        }
+
+        // Keep the previous version as the backup, then swap in the new version. If a reset
+        // occurs between the renames, load() uses the backup. A settings file without its
+        // .meta file is validated by parsing it.
+        unlink(backupPath);
+        unlink(getMetaPath(backupPath));
+        rename(path, backupPath);
+        rename(getMetaPath(path), getMetaPath(backupPath));
+        if (rename(tempPath, path) != 0) {
+            return false;
+        }
+        rename(getMetaPath(tempPath), getMetaPath(path));
+        fileHash = meta.hash;
+    }
+
+    return true;
+}
+
+bool SleepHelper::SettingsFile::setValuesJson(const char *inputJson) {
+    if (partitions.empty()) {
+        return replaceValuesJson(inputJson);
+    }
+
+    // Keys stored in a partition are merged into the partition. The partition's other keys are kept,
+    // since they normally come from its default values.
+    String ownJson;
+    std::vector<String> partitionJson;
+    if (!splitPartitionJson(inputJson, ownJson, partitionJson) || !replaceValuesJson(ownJson)) {
+        return false;
+    }
+
+    bool result = true;
+    for(size_t ii = 0; ii < partitions.size(); ii++) {
+        if (partitionJson[ii].length()) {
+            result = partitions[ii].settings->updateValuesJson(partitionJson[ii]) && result;
+        }
+    }
+    return result;
+}
+
+bool SleepHelper::SettingsFile::replaceValuesJson(const char *inputJson) {
+    std::vector<String> updatedKeys;
+    bool contentDiffers = false;
+
+    size_t inputLen = strlen(inputJson);
+    if (inputLen > maxSize) {
+        return false;
+    }
+
+    WITH_LOCK(*this) {
+        // Save the existing key/value byte ranges so the new settings can be parsed directly
+        // into parser, instead of parsing them once to compare and again to replace.
+        // Always at least one byte, so data() is not null when there are no settings yet.
+        size_t oldSize = parser.getOffset();
+        std::vector<char> oldBuffer(oldSize + 1, 0);
+        if (oldSize > 0) {
+            memcpy(oldBuffer.data(), parser.getBuffer(), oldSize);
+        }
+
+        struct OldValue {
+            size_t keyStart;
+            size_t keyLen;
+            size_t valueStart;
+            size_t valueLen;
+            JsonParserGeneratorRK::jsmntype_t valueType;
+        };
+        std::unordered_multimap<uint32_t, OldValue> oldValues;
+
+        std::vector<KeyValueTokens> pairs;
+        getOuterKeyValueTokens(parser, pairs);
+        for(auto it = pairs.begin(); it != pairs.end(); ++it) {
+            OldValue oldValue;
+            oldValue.keyStart = it->key->start;
+            oldValue.keyLen = it->key->end - it->key->start;
+            oldValue.valueStart = it->value->start;
+            oldValue.valueLen = it->value->end - it->value->start;
+            oldValue.valueType = it->value->type;
+            oldValues.insert(std::make_pair(keyHash(parser.getBuffer() + oldValue.keyStart, oldValue.keyLen), oldValue));
+        }
+
+        parser.clear();
+        if (!reserve(inputLen) || !parser.addData(inputJson, inputLen) || !parser.parse() || !parser.getOuterObject() || parser.getOuterObject()->type != JsonParserGeneratorRK::JSMN_OBJECT || !validateJson(parser)) {
+            // Not valid, restore the previous settings
+            parser.clear();
+            parser.addData(oldBuffer.data(), oldSize);
+            parser.parse();
+            contentChanged();
+            return false;
+        }
+
+        // Keys may have been removed or reordered without any value changing
+        contentDiffers = (inputLen != oldSize || memcmp(inputJson, oldBuffer.data(), inputLen) != 0);
+        if (contentDiffers) {
+            // Removed keys can't be represented in the journal
+            journalNeedsCompact = true;
+        }
+
+        getOuterKeyValueTokens(parser, pairs);
+        for(auto it = pairs.begin(); it != pairs.end(); ++it) {
+            const char *key = parser.getBuffer() + it->key->start;
+            size_t keyLen = it->key->end - it->key->start;
+            size_t valueLen = it->value->end - it->value->start;
+
+            bool changed = true;
+            auto range = oldValues.equal_range(keyHash(key, keyLen));
+            for(auto oldIt = range.first; oldIt != range.second; ++oldIt) {
+                const OldValue &oldValue = oldIt->second;
+                if (oldValue.keyLen == keyLen && memcmp(oldBuffer.data() + oldValue.keyStart, key, keyLen) == 0) {
+                    changed = (oldValue.valueType != it->value->type || 
+                        oldValue.valueLen != valueLen ||
+                        memcmp(oldBuffer.data() + oldValue.valueStart, parser.getBuffer() + it->value->start, valueLen) != 0);
+                    break;
+                }
+            }
+            if (changed) {
+                String keyStr;
+                parser.getTokenValue(it->key, keyStr);
+                updatedKeys.push_back(keyStr);
+            }
+        }
+
+        contentChanged();
+    }
+
+    if (!updatedKeys.empty()) {
+        notifyChanged(updatedKeys);
+    }
+    if (contentDiffers && !deferSave()) {
+        save();
+    }
+
+
+    return true;
+}
+
+
+
+bool SleepHelper::SettingsFile::updateValuesJson(const char *inputJson) {
+    std::vector<String> updatedKeys;
+    bool result;
+
+    if (partitions.empty()) {
+        result = mergeValuesJson(inputJson, false, updatedKeys);
+    }
+    else {
+        // The whole update is validated against the schema of this object before the keys stored
+        // in partitions are sent to the partition. This object is updated first, since it's the 
+        // one most likely to fail by exceeding its maximum size, so a failure normally leaves 
+        // everything unchanged.
+        String ownJson;
+        std::vector<String> partitionJson;
+        result = splitPartitionJson(inputJson, ownJson, partitionJson) && mergeValuesJson(ownJson, false, updatedKeys);
+        if (result) {
+            for(size_t ii = 0; ii < partitions.size(); ii++) {
+                if (partitionJson[ii].length()) {
+                    result = partitions[ii].settings->updateValuesJson(partitionJson[ii]) && result;
+                }
+            }
+        }
+    }
+
+    if (!updatedKeys.empty()) {
+        notifyChanged(updatedKeys);
+
+        if (!deferSave()) {
+            save();
+        }
+    }
+
+    return result;
+}
+
+bool SleepHelper::SettingsFile::addDefaultValues(const char *inputJson) {
+    std::vector<String> addedKeys;
+    bool result;
+
+    if (partitions.empty()) {
+        result = mergeValuesJson(inputJson, true, addedKeys);
+    }
+    else {
+        // Defaults for keys stored in a partition are not added to this object
+        String ownJson;
+        std::vector<String> partitionJson;
+        result = splitPartitionJson(inputJson, ownJson, partitionJson) && mergeValuesJson(ownJson, true, addedKeys);
+        if (result) {
+            for(size_t ii = 0; ii < partitions.size(); ii++) {
+                if (partitionJson[ii].length()) {
+                    result = partitions[ii].settings->addDefaultValues(partitionJson[ii]) && result;
+                }
+            }
+        }
+    }
+
+    if (!addedKeys.empty() && !deferSave()) {
+        save();
+    }
+
+    return result;
+}
+
+bool SleepHelper::SettingsFile::splitPartitionJson(const char *inputJson, String &ownJson, std::vector<String> &partitionJson) const {
+    JsonParser jp;
+    jp.addString(inputJson);
+    if (!jp.parse() || !jp.getOuterObject() || jp.getOuterObject()->type != JsonParserGeneratorRK::JSMN_OBJECT || !validateJson(jp)) {
+        return false;
+    }
+
+    std::vector<KeyValueTokens> pairs;
+    getOuterKeyValueTokens(jp, pairs);
+
+    partitionJson.clear();
+    partitionJson.resize(partitions.size());
+    ownJson = "";
+    for(auto it = pairs.begin(); it != pairs.end(); ++it) {
+        String key;
+        jp.getTokenValue(it->key, key);
+
+        String *target = &ownJson;
+        SettingsFile *partition = findPartition(key);
+        for(size_t ii = 0; ii < partitions.size(); ii++) {
+            if (partitions[ii].settings == partition) {
+                target = &partitionJson[ii];
+                break;
+            }
+        }
+
+        target->concat(target->length() ? ',' : '{');
+        appendTokenJson(*target, jp, it->key);
+        target->concat(':');
+        appendTokenJson(*target, jp, it->value);
+    }
+
+    for(auto it = partitionJson.begin(); it != partitionJson.end(); ++it) {
+        if (it->length()) {
+            it->concat('}');
+        }
+    }
+    if (ownJson.length()) {
+        ownJson.concat('}');
+    }
+    else {
+        ownJson = "{}";
+    }
+    return true;
+}
+
+bool SleepHelper::SettingsFile::mergeValuesJson(const char *inputJson, bool onlyMissing, std::vector<String> &updatedKeys) {
+    JsonParser inputParser;
+    inputParser.addString(inputJson);
+    if (!inputParser.parse() || !validateJson(inputParser)) {
+        return false;
+    }
+
+    WITH_LOCK(*this) {
+        const JsonParserGeneratorRK::jsmntok_t *outerObject = parser.getOuterObject();
+        if (!outerObject || outerObject->type != JsonParserGeneratorRK::JSMN_OBJECT) {
+            return false;
+        }
+
+        // Pass 1: find the values to replace and the keys to add, using the index for the existing keys
+        struct Replacement {
+            int start; //!< Start of the existing value, including quotes
+            int end; //!< End of the existing value, including quotes
+            const JsonParserGeneratorRK::jsmntok_t *valueToken; //!< New value in inputParser
+        };
+        std::vector<Replacement> replacements;
+        std::vector<KeyValueTokens> additions;
+
+        std::vector<KeyValueTokens> pairs;
+        getOuterKeyValueTokens(inputParser, pairs);
+
+        std::vector<String> seenKeys;
+        seenKeys.reserve(pairs.size());
+        for(auto it = pairs.begin(); it != pairs.end(); ++it) {
+            String key;
+            inputParser.getTokenValue(it->key, key);
+
+            if (std::find(seenKeys.begin(), seenKeys.end(), key) != seenKeys.end()) {
+                // Duplicate key in inputJson, the first one is used even if it was unchanged
+                continue;
+            }
+            seenKeys.push_back(key);
+
+            const JsonParserGeneratorRK::jsmntok_t *oldValueToken = findValueToken(key);
+            if (oldValueToken) {
+                int valueLen = it->value->end - it->value->start;
+                int oldValueLen = oldValueToken->end - oldValueToken->start;
+
+                if (onlyMissing ||
+                    (it->value->type == oldValueToken->type && 
+                    valueLen == oldValueLen &&
+                    memcmp(inputParser.getBuffer() + it->value->start, parser.getBuffer() + oldValueToken->start, valueLen) == 0)) {
+                    // Unchanged
+                    continue;
+                }
+
+                Replacement replacement;
+                replacement.start = oldValueToken->start;
+                replacement.end = oldValueToken->end;
+                if (oldValueToken->type == JsonParserGeneratorRK::JSMN_STRING) {
+                    replacement.start--;
+                    replacement.end++;
+                }
+                replacement.valueToken = it->value;
+                replacements.push_back(replacement);
+            }
+            else {
+                additions.push_back(*it);
+            }
+            updatedKeys.push_back(key);
+        }
+
+        if (updatedKeys.empty()) {
+            return true;
+        }
+
+        // Pass 2: generate the merged settings in a single buffer
+        std::sort(replacements.begin(), replacements.end(), [](const Replacement &a, const Replacement &b) {
+            return a.start < b.start;
+        });
+
+        String merged;
+        merged.reserve(parser.getOffset() + strlen(inputJson));
+
+        const char *oldBuf = parser.getBuffer();
+        int oldOffset = 0;
+        auto appendOld = [&merged, oldBuf, &oldOffset](int end) {
+            for(; oldOffset < end; oldOffset++) {
+                merged.concat(oldBuf[oldOffset]);
+            }
+        };
+
+        for(auto it = replacements.begin(); it != replacements.end(); ++it) {
+            appendOld(it->start);
+            appendTokenJson(merged, inputParser, it->valueToken);
+            oldOffset = it->end;
+        }
+
+        // Additions go before the closing brace of the outer object
+        appendOld(outerObject->end - 1);
+        bool needsComma = (outerObject->size > 0);
+        for(auto it = additions.begin(); it != additions.end(); ++it) {
+            if (needsComma) {
+                merged.concat(',');
+            }
+            appendTokenJson(merged, inputParser, it->key);
+            merged.concat(':');
+            appendTokenJson(merged, inputParser, it->value);
+            needsComma = true;
+        }
+        appendOld(parser.getOffset());
+
+        if (merged.length() > maxSize) {
+            updatedKeys.clear();
+            return false;
+        }
+
+        bool hashValid = getCombinedHashValid();
+        std::vector<uint32_t> oldHashes;
+        if (hashValid) {
+            for(auto it = updatedKeys.begin(); it != updatedKeys.end(); ++it) {
+                oldHashes.push_back(getKeyValueHash(*it));
+            }
+        }
+
+        // Make sure the merged settings fit before discarding the current ones, so a failure
+        // leaves all of the previous settings intact instead of applying part of the update
+        size_t currentSize = parser.getOffset();
+        if (!reserve((merged.length() > currentSize) ? merged.length() - currentSize : 0)) {
+            updatedKeys.clear();
+            return false;
+        }
+
+        parser.clear();
+        parser.addData(merged.c_str(), merged.length());
+        parser.parse();
+        contentChanged();
+        updateCombinedHash(updatedKeys, oldHashes, hashValid);
+    }
+
+    return true;
+}
+
+bool SleepHelper::SettingsFile::getValuesJson(String &json) {
+    ValuesView view = getValuesView();
+    json = view.c_str();
+
+    return true;
+}
+
+SleepHelper::SettingsFile::ValuesView SleepHelper::SettingsFile::getValuesView() {
+    lock();
+
+    // reserve() always leaves room for a null terminator after the JSON
+    if (!reserve(0) || !parser.getBuffer()) {
+        return ValuesView(this, "", 0);
+    }
+    parser.getBuffer()[parser.getOffset()] = 0;
+
+    return ValuesView(this, parser.getBuffer(), parser.getOffset());
+}
+
+size_t SleepHelper::SettingsFile::copyValuesJson(char *buf, size_t bufSize) {
+    size_t size = 0;
+
+    WITH_LOCK(*this) {
+        size = parser.getOffset();
+        if (bufSize > 0) {
+            size_t copySize = (size < bufSize) ? size : (bufSize - 1);
+            memcpy(buf, parser.getBuffer(), copySize);
+            buf[copySize] = 0;
+        }
+    }
+
+    return size;
+}
+
+bool SleepHelper::SettingsFile::writeValuesJson(JSONWriter &writer) {
+    WITH_LOCK(*this) {
+        const JsonParserGeneratorRK::jsmntok_t *outerObject = parser.getOuterObject();
+        if (!outerObject || outerObject->type != JsonParserGeneratorRK::JSMN_OBJECT) {
+            return false;
+        }
+        bool exact = true;
+        writeToken(writer, parser, outerObject, exact);
+        if (!exact) {
+            return false;
+        }
+    }
+
+    return true;
+}
+
+const JsonParserGeneratorRK::jsmntok_t *SleepHelper::SettingsFile::writeToken(JSONWriter &writer, const JsonParser &jp, const JsonParserGeneratorRK::jsmntok_t *token, bool &exact) {
+    const JsonParserGeneratorRK::jsmntok_t *next = token + 1;
+
+    switch(token->type) {
+        case JsonParserGeneratorRK::JSMN_OBJECT:
+            writer.beginObject();
+            for(int ii = 0; ii < token->size; ii++) {
+                String key;
+                jp.getTokenValue(next, key);
+                writer.name(key);
+                next = writeToken(writer, jp, next + 1, exact);
+            }
+            writer.endObject();
+            break;
+
+        case JsonParserGeneratorRK::JSMN_ARRAY:
+            writer.beginArray();
+            for(int ii = 0; ii < token->size; ii++) {
+                next = writeToken(writer, jp, next, exact);
+            }
+            writer.endArray();
+            break;
+
+        case JsonParserGeneratorRK::JSMN_STRING: {
+            String value;
+            jp.getTokenValue(token, value);
+            writer.value(value);
+            break;
+        }
+
+        default: {
+            const char *value = jp.getBuffer() + token->start;
+            size_t valueLen = token->end - token->start;
+            char buf[32];
+            if (valueLen >= sizeof(buf)) {
+                // Too many digits to be represented exactly, and truncating would change the value
+                writer.nullValue();
+                exact = false;
+                break;
+            }
+            memcpy(buf, value, valueLen);
+            buf[valueLen] = 0;
+
+            if (strcmp(buf, "true") == 0 || strcmp(buf, "false") == 0) {
+                writer.value(buf[0] == 't');
+            }
+            else
+            if (strcmp(buf, "null") == 0) {
+                writer.nullValue();
+            }
+            else
+            if (!writeNumber(writer, buf)) {
+                // Keep the output valid JSON, but report the failure
+                writer.nullValue();
+                exact = false;
+            }
+            break;
+        }
+    }
+
+    return next;
+}
+
+// [static]
+bool SleepHelper::SettingsFile::writeNumber(JSONWriter &writer, const char *text) {
+    char *end;
+
+    if (!strpbrk(text, ".eE")) {
+        errno = 0;
+        long longValue = strtol(text, &end, 10);
+        if (errno == 0 && *end == 0 && longValue >= INT_MIN && longValue <= INT_MAX) {
+            writer.value((int)longValue);
+            return true;
+        }
+    }
+
+    double doubleValue = strtod(text, &end);
+    if (*end != 0 || !std::isfinite(doubleValue)) {
+        return false;
+    }
+
+    // A double only holds DBL_DIG significant decimal digits exactly
+    int significantDigits = 0;
+    int decimalPlaces = 0;
+    bool afterPoint = false;
+    const char *cp;
+    for(cp = text; *cp && *cp != 'e' && *cp != 'E'; cp++) {
+        if (*cp == '.') {
+            afterPoint = true;
+        }
+        else
+        if (*cp >= '0' && *cp <= '9') {
+            if (significantDigits > 0 || *cp != '0') {
+                significantDigits++;
+            }
+            if (afterPoint) {
+                decimalPlaces++;
+            }
+        }
+    }
+    if (significantDigits > DBL_DIG) {
+        return false;
+    }
+    if (*cp) {
+        // Exponent moves the decimal point
+        decimalPlaces -= atoi(cp + 1);
+        if (decimalPlaces < 0) {
+            decimalPlaces = 0;
+        }
+    }
+
+    // Make sure the formatted value is a reasonable length and reads back as the same value
+    char check[32];
+    int len = snprintf(check, sizeof(check), "%.*f", decimalPlaces, doubleValue);
+    if (len < 0 || len >= (int)sizeof(check) || strtod(check, NULL) != doubleValue) {
+        return false;
+    }
+
+    writer.value(doubleValue, decimalPlaces);
+    return true;
+}
 
-        for(size_t index = 0; ; index++) {
-    		if (!inputParser.getKeyValueTokenByIndex(inputParser.getOuterObject(), keyToken, valueToken, index)) {
-                break;
-            }
+const JsonParserGeneratorRK::jsmntok_t *SleepHelper::SettingsFile::findValueToken(const char *name) const {
+    const IndexEntry *entry = findIndexEntry(name);
+    return entry ? entry->valueToken : NULL;
+}
 
-            String key;
-            inputParser.getTokenValue(keyToken, key);
+const SleepHelper::SettingsFile::IndexEntry *SleepHelper::SettingsFile::findIndexEntry(const char *name) const {
+    if (!indexValid) {
+        buildIndex();
+    }
+    if (index.empty()) {
+        return NULL;
+    }
 
-            // Does this item exist?
-    		const JsonParserGeneratorRK::jsmntok_t *oldValueToken;
-            if (!parser.getValueTokenByKey(parser.getOuterObject(), key, oldValueToken)) {
-                // Key does not exist, issue a change notification
-                updatedKeys.push_back(key);
-            }
-            else {
-                int valueLen = valueToken->end - valueToken->start;
-                int oldValueLen = oldValueToken->end - oldValueToken->start;
+    size_t nameLen = strlen(name);
+    uint32_t hash = keyHash(name, nameLen);
+    size_t mask = index.size() - 1;
+
+    for(size_t ii = hash & mask; index[ii].keyToken; ii = (ii + 1) & mask) {
+        const JsonParserGeneratorRK::jsmntok_t *keyToken = index[ii].keyToken;
+        if (index[ii].hash == hash && 
+            (size_t)(keyToken->end - keyToken->start) == nameLen && 
+            memcmp(parser.getBuffer() + keyToken->start, name, nameLen) == 0) {
+            return &index[ii];
+        }
+    }
+    return NULL;
+}
 
-                if (valueToken->type != oldValueToken->type || 
-                    valueLen != oldValueLen ||
-                    memcmp(inputParser.getBuffer() + valueToken->start, parser.getBuffer() + oldValueToken->start, valueLen) != 0) {
+void SleepHelper::SettingsFile::buildIndex() const {
+    std::vector<KeyValueTokens> pairs;
+    getOuterKeyValueTokens(parser, pairs);
 
-                    // Changed value
-                    updatedKeys.push_back(key);
-                }
+    // Keep the table at most half full so probe sequences stay short
+    size_t tableSize = 8;
+    while(tableSize < pairs.size() * 2) {
+        tableSize *= 2;
+    }
+    index.assign(tableSize, IndexEntry{0, NULL, NULL});
+    size_t mask = tableSize - 1;
+
+    for(size_t ii = 0; ii < pairs.size(); ii++) {
+        const char *key = parser.getBuffer() + pairs[ii].key->start;
+        size_t keyLen = pairs[ii].key->end - pairs[ii].key->start;
+        uint32_t hash = keyHash(key, keyLen);
+
+        size_t jj = hash & mask;
+        bool duplicate = false;
+        for(; index[jj].keyToken; jj = (jj + 1) & mask) {
+            const JsonParserGeneratorRK::jsmntok_t *existing = index[jj].keyToken;
+            if (index[jj].hash == hash && 
+                (size_t)(existing->end - existing->start) == keyLen && 
+                memcmp(parser.getBuffer() + existing->start, key, keyLen) == 0) {
+                // Same as getOuterValueByKey, the first occurrence of a key is used
+                duplicate = true;
+                break;
             }
+        }
+        if (!duplicate) {
+            index[jj].hash = hash;
+            index[jj].keyToken = pairs[ii].key;
+            index[jj].valueToken = pairs[ii].value;
+        }
+    }
 
+    indexValid = true;
+}
+
+void SleepHelper::SettingsFile::getObjectKeyValueTokens(const JsonParser &jp, const JsonParserGeneratorRK::jsmntok_t *object, std::vector<KeyValueTokens> &pairs) {
+    pairs.clear();
 
-                
+    if (!object || object->type != JsonParserGeneratorRK::JSMN_OBJECT) {
+        return;
+    }
+    pairs.reserve(object->size);
+
+    const JsonParserGeneratorRK::jsmntok_t *token = object + 1;
+    for(int ii = 0; ii < object->size; ii++) {
+        KeyValueTokens pair;
+        pair.key = token;
+        pair.value = token + 1;
+        pairs.push_back(pair);
+
+        if ((ii + 1) < object->size) {
+            // Skip over any tokens contained in an object or array value
+            for(token = pair.value + 1; token->start < pair.value->end; token++) {
+            }
         }
     }
+}
 
-    if (!updatedKeys.empty()) {
-        for(auto it = updatedKeys.begin(); it != updatedKeys.end(); ++it) {
-            settingChangeFunctions.forEach(*it);
-        }
+void SleepHelper::SettingsFile::appendTokenJson(String &str, const JsonParser &jp, const JsonParserGeneratorRK::jsmntok_t *token) {
+    int start = token->start;
+    int end = token->end;
+    if (token->type == JsonParserGeneratorRK::JSMN_STRING) {
+        start--;
+        end++;
+    }
+    for(int ii = start; ii < end; ii++) {
+        str.concat(jp.getBuffer()[ii]);
+    }
+}
 
-        // Replace existing settings
-        parser.clear();
-        parser.addString(inputJson);
-        parser.parse();
+void SleepHelper::SettingsFile::contentChanged() {
+    indexValid = false;
+    contentGeneration++;
 
-        save();
+    for(auto it = bindings.begin(); it != bindings.end(); ++it) {
+        (*it)();
+    }
+}
+
+const SleepHelper::SettingsFile::SettingDef *SleepHelper::SettingsFile::findSchemaDef(const char *key, size_t keyLen) const {
+    for(size_t ii = 0; ii < schemaCount; ii++) {
+        if (strlen(schema[ii]->key) == keyLen && memcmp(schema[ii]->key, key, keyLen) == 0) {
+            return schema[ii];
+        }
     }
+    return NULL;
+}
 
+bool SleepHelper::SettingsFile::validateJson(const JsonParser &jp) const {
+    if (!schema) {
+        return true;
+    }
 
+    std::vector<KeyValueTokens> pairs;
+    getOuterKeyValueTokens(jp, pairs);
+    for(auto it = pairs.begin(); it != pairs.end(); ++it) {
+        const SettingDef *def = findSchemaDef(jp.getBuffer() + it->key->start, it->key->end - it->key->start);
+        if (def && !validateValue(*def, jp, it->value)) {
+            return false;
+        }
+    }
     return true;
 }
 
+bool SleepHelper::SettingsFile::validateValue(const SettingDef &def, const JsonParser &jp, const JsonParserGeneratorRK::jsmntok_t *token) {
+    const char *value = jp.getBuffer() + token->start;
+    size_t valueLen = token->end - token->start;
 
+    switch(def.type) {
+        case SETTING_TYPE_STRING: {
+            if (token->type != JsonParserGeneratorRK::JSMN_STRING) {
+                return false;
+            }
+            if (def.maxValue > 0) {
+                String str;
+                jp.getTokenValue(token, str);
+                if (str.length() > def.maxValue) {
+                    return false;
+                }
+            }
+            return true;
+        }
 
-bool SleepHelper::SettingsFile::updateValuesJson(const char *inputJson) {
-    std::vector<String> updatedKeys;
+        case SETTING_TYPE_BOOL:
+            return token->type == JsonParserGeneratorRK::JSMN_PRIMITIVE && 
+                ((valueLen == 4 && memcmp(value, "true", 4) == 0) || (valueLen == 5 && memcmp(value, "false", 5) == 0));
 
-    WITH_LOCK(*this) {
-        JsonParserStatic<particle::protocol::MAX_EVENT_DATA_LENGTH, 50> inputParser;
-        inputParser.addString(inputJson);
-        inputParser.parse();
+        case SETTING_TYPE_INT:
+        case SETTING_TYPE_DOUBLE: {
+            char buf[32];
+            if (token->type != JsonParserGeneratorRK::JSMN_PRIMITIVE || valueLen == 0 || valueLen >= sizeof(buf)) {
+                return false;
+            }
+            memcpy(buf, value, valueLen);
+            buf[valueLen] = 0;
 
-        const JsonParserGeneratorRK::jsmntok_t *keyToken;
-		const JsonParserGeneratorRK::jsmntok_t *valueToken;
+            if (def.type == SETTING_TYPE_INT && strpbrk(buf, ".eE")) {
+                return false;
+            }
 
-        for(size_t index = 0; ; index++) {
-    		if (!inputParser.getKeyValueTokenByIndex(inputParser.getOuterObject(), keyToken, valueToken, index)) {
-                break;
+            char *end;
+            double number = strtod(buf, &end);
+            if (*end != 0) {
+                // Not a number (true, false, null, or invalid)
+                return false;
             }
+            return number >= def.minValue && number <= def.maxValue;
+        }
 
-            String key;
-            inputParser.getTokenValue(keyToken, key);
+        default:
+            return false;
+    }
+}
 
-            JsonModifier modifier(parser);
+bool SleepHelper::SettingsFile::addSchemaDefaults(const std::vector<String> &partitionKeys) {
+    if (!schema || !materializeDefaults) {
+        return false;
+    }
 
-            // Does this item exist?
-    		const JsonParserGeneratorRK::jsmntok_t *oldValueToken;
-            if (!parser.getValueTokenByKey(parser.getOuterObject(), key, oldValueToken)) {
-                // Key does not exist, insert a dummy key/value
-                modifier.insertOrUpdateKeyValue(parser.getOuterObject(), key, (int)0);
+    const JsonParserGeneratorRK::jsmntok_t *outerObject = parser.getOuterObject();
+    if (!outerObject || outerObject->type != JsonParserGeneratorRK::JSMN_OBJECT) {
+        return false;
+    }
 
-                parser.getValueTokenByKey(parser.getOuterObject(), key, oldValueToken);
+    String additions;
+    bool needsComma = (outerObject->size > 0);
+    for(size_t ii = 0; ii < schemaCount; ii++) {
+        if (!findValueToken(schema[ii]->key) && 
+            std::find(partitionKeys.begin(), partitionKeys.end(), schema[ii]->key) == partitionKeys.end()) {
+            if (needsComma) {
+                additions.concat(',');
             }
+            appendSchemaDefault(additions, *schema[ii]);
+            needsComma = true;
+        }
+    }
+    if (additions.length() == 0) {
+        return false;
+    }
+
+    // Insert before the closing brace of the outer object
+    size_t insertAt = outerObject->end - 1;
+    size_t tailLen = parser.getOffset() - insertAt;
+    if (!reserve(additions.length())) {
+        return false;
+    }
+    char *buf = parser.getBuffer();
+    memmove(buf + insertAt + additions.length(), buf + insertAt, tailLen);
+    memcpy(buf + insertAt, additions.c_str(), additions.length());
+    parser.setOffset(parser.getOffset() + additions.length());
+    parser.parse();
+    contentChanged();
+
+    return true;
+}
 
-            int valueLen = valueToken->end - valueToken->start;
-            int oldValueLen = oldValueToken->end - oldValueToken->start;
+void SleepHelper::SettingsFile::appendSchemaDefault(String &json, const SettingDef &def) {
+    json += String::format("\"%s\":", def.key);
 
-            if (valueToken->type != oldValueToken->type || 
-                valueLen != oldValueLen ||
-                memcmp(inputParser.getBuffer() + valueToken->start, parser.getBuffer() + oldValueToken->start, valueLen) != 0) {
+    switch(def.type) {
+        case SETTING_TYPE_INT:
+            json += String::format("%d", (int)def.defaultNumber);
+            break;
 
-                const JsonParserGeneratorRK::jsmntok_t expandedValueToken = modifier.tokenWithQuotes(valueToken);
-                const JsonParserGeneratorRK::jsmntok_t expandedOldValueToken = modifier.tokenWithQuotes(oldValueToken);
-                modifier.startModify(&expandedOldValueToken);
-                
-                for(int ii = expandedValueToken.start; ii < expandedValueToken.end; ii++) {
-                    modifier.insertChar(inputParser.getBuffer()[ii]);
-                }
+        case SETTING_TYPE_DOUBLE:
+            json += String::format("%.10g", def.defaultNumber);
+            break;
 
-                modifier.finish();
+        case SETTING_TYPE_BOOL:
+            json += (def.defaultNumber != 0) ? "true" : "false";
+            break;
 
-                updatedKeys.push_back(key);
+        case SETTING_TYPE_STRING:
+            json.concat('"');
+            for(const char *cp = def.defaultString ? def.defaultString : ""; *cp; cp++) {
+                if (*cp == '"' || *cp == '\\') {
+                    json.concat('\\');
+                    json.concat(*cp);
+                }
+                else
+                if ((uint8_t)*cp < 0x20) {
+                    json += String::format("\\u%04x", (unsigned)(uint8_t)*cp);
+                }
+                else {
+                    json.concat(*cp);
+                }
             }
-                
+            json.concat('"');
+            break;
+    }
+}
+
+size_t SleepHelper::SettingsFile::getMemoryUsage() const {
+    size_t result;
+
+    WITH_LOCK(*this) {
+        result = parser.getBufferLen() + getTokenCount() * sizeof(JsonParserGeneratorRK::jsmntok_t);
+    }
+    return result;
+}
+
+size_t SleepHelper::SettingsFile::getTokenCount() const {
+    int result = 0;
+
+    WITH_LOCK(*this) {
+        // Counting pass only, does not store the tokens
+        JsonParserGeneratorRK::jsmn_parser countParser;
+        JsonParserGeneratorRK::jsmn_init(&countParser);
+        result = JsonParserGeneratorRK::jsmn_parse(&countParser, parser.getBuffer(), parser.getOffset(), NULL, 0);
+    }
+    return (result > 0) ? (size_t)result : 0;
+}
+
+bool SleepHelper::SettingsFile::reserve(size_t additional) {
+    WITH_LOCK(*this) {
+        // Leave room for a null terminator
+        size_t needed = parser.getOffset() + additional + 1;
+        if (needed <= parser.getBufferLen()) {
+            return true;
+        }
+        if (needed > maxSize) {
+            return false;
         }
+
+        size_t newSize = ((needed + pageSize - 1) / pageSize) * pageSize;
+        if (newSize > maxSize) {
+            newSize = maxSize;
+        }
+        return parser.allocate(newSize);
     }
+    return false;
+}
 
-    if (!updatedKeys.empty()) {
-        for(auto it = updatedKeys.begin(); it != updatedKeys.end(); ++it) {
-            settingChangeFunctions.forEach(*it);
+bool SleepHelper::SettingsFile::commitTransaction() {
+    std::vector<String> keys;
+    bool needsSave = false;
+
+    WITH_LOCK(*this) {
+        if (transactionDepth == 0 || --transactionDepth > 0) {
+            // Not in a transaction, or not the outermost transaction
+            return false;
         }
+        keys.swap(transactionKeys);
+        needsSave = transactionNeedsSave;
+        transactionNeedsSave = false;
+    }
 
+    if (needsSave) {
         save();
     }
 
+    // Notify after saving so the callbacks see the committed settings
+    if (!keys.empty()) {
+        dispatchChanges(keys);
+    }
 
-    return true;
+    return needsSave;
 }
 
-bool SleepHelper::SettingsFile::addDefaultValues(const char *inputJson) {
-    bool needsSave = false;
+SleepHelper::SettingsFile &SleepHelper::SettingsFile::withSettingChangeFunction(const char *key, std::function<bool(const char *)> fn) {
+    WITH_LOCK(*this) {
+        size_t keyLen = strlen(key);
+        if (keyLen > 0 && key[keyLen - 1] == '*') {
+            keyLen--;
+            prefixChangeFunctions[keyHash(key, keyLen)].push_back(KeySubscription{String(key).substring(0, keyLen), fn});
+            if (std::find(prefixLengths.begin(), prefixLengths.end(), keyLen) == prefixLengths.end()) {
+                prefixLengths.push_back(keyLen);
+            }
+        }
+        else {
+            keyChangeFunctions[keyHash(key, keyLen)].push_back(KeySubscription{String(key), fn});
+        }
+    }
+    return *this;
+}
 
+void SleepHelper::SettingsFile::notifyChanged(const std::vector<String> &keys) {
     WITH_LOCK(*this) {
-        JsonParserStatic<particle::protocol::MAX_EVENT_DATA_LENGTH, 50> inputParser;
-        inputParser.addString(inputJson);
-        inputParser.parse();
+        if (maxJournalSize > 0) {
+            for(auto it = keys.begin(); it != keys.end(); ++it) {
+                if (std::find(journalKeys.begin(), journalKeys.end(), *it) == journalKeys.end()) {
+                    journalKeys.push_back(*it);
+                }
+            }
+        }
+
+        if (transactionDepth > 0) {
+            for(auto it = keys.begin(); it != keys.end(); ++it) {
+                if (std::find(transactionKeys.begin(), transactionKeys.end(), *it) == transactionKeys.end()) {
+                    transactionKeys.push_back(*it);
+                }
+            }
+            return;
+        }
+    }
 
-        const JsonParserGeneratorRK::jsmntok_t *keyToken;
-		const JsonParserGeneratorRK::jsmntok_t *valueToken;
+    dispatchChanges(keys);
+}
 
-        for(size_t index = 0; ; index++) {
-    		if (!inputParser.getKeyValueTokenByIndex(inputParser.getOuterObject(), keyToken, valueToken, index)) {
-                break;
+void SleepHelper::SettingsFile::dispatchChanges(const std::vector<String> &keys) {
+    for(auto it = keys.begin(); it != keys.end(); ++it) {
+        const char *key = it->c_str();
+        size_t keyLen = it->length();
+
+        settingChangeFunctions.forEach(key);
+
+        if (!keyChangeFunctions.empty()) {
+            auto mapIt = keyChangeFunctions.find(keyHash(key, keyLen));
+            if (mapIt != keyChangeFunctions.end()) {
+                for(auto subIt = mapIt->second.begin(); subIt != mapIt->second.end(); ++subIt) {
+                    if (subIt->key == *it) {
+                        subIt->fn(key);
+                    }
+                }
             }
+        }
 
-            String key;
-            inputParser.getTokenValue(keyToken, key);
-
-            JsonModifier modifier(parser);
-
-            // Does this item exist?
-    		const JsonParserGeneratorRK::jsmntok_t *oldValueToken;
-            if (!parser.getValueTokenByKey(parser.getOuterObject(), key, oldValueToken)) {
-                // Key does not exist, insert a dummy key/value
-                modifier.insertOrUpdateKeyValue(parser.getOuterObject(), key, (int)0);
-
-                // Update the inserted token to be the actual data to insert
-                parser.getValueTokenByKey(parser.getOuterObject(), key, oldValueToken);
-                const JsonParserGeneratorRK::jsmntok_t expandedValueToken = modifier.tokenWithQuotes(valueToken);
-                const JsonParserGeneratorRK::jsmntok_t expandedOldValueToken = modifier.tokenWithQuotes(oldValueToken);
-                modifier.startModify(&expandedOldValueToken);
-                
-                for(int ii = expandedValueToken.start; ii < expandedValueToken.end; ii++) {
-                    modifier.insertChar(inputParser.getBuffer()[ii]);
+        // One hash lookup per distinct prefix length, not per subscription
+        for(auto lenIt = prefixLengths.begin(); lenIt != prefixLengths.end(); ++lenIt) {
+            if (*lenIt > keyLen) {
+                continue;
+            }
+            auto mapIt = prefixChangeFunctions.find(keyHash(key, *lenIt));
+            if (mapIt != prefixChangeFunctions.end()) {
+                for(auto subIt = mapIt->second.begin(); subIt != mapIt->second.end(); ++subIt) {
+                    if (strncmp(key, subIt->key, *lenIt) == 0) {
+                        subIt->fn(key);
+                    }
                 }
+            }
+        }
+    }
 
-                modifier.finish();
-                needsSave = true;
-            }                
+    batchChangeFunctions.forEach(keys);
+
+    if (parent) {
+        // Variables bound in the parent may be for keys in this partition
+        for(auto it = parent->bindings.begin(); it != parent->bindings.end(); ++it) {
+            (*it)();
         }
+        parent->dispatchChanges(keys);
     }
+}
 
-    if (needsSave) {
-        save();
+bool SleepHelper::SettingsFile::deferSave() {
+    bool result = false;
+
+    WITH_LOCK(*this) {
+        if (transactionDepth > 0) {
+            if (transactionNeedsSave) {
+                // Already going to save on commit
+                savesAvoided++;
+            }
+            transactionNeedsSave = true;
+            result = true;
+        }
     }
+    return result;
+}
 
-    return true;
+uint32_t SleepHelper::SettingsFile::getHash() const {
+    uint32_t combined;
+
+    WITH_LOCK(*this) {
+        if (!getCombinedHashValid()) {
+            std::vector<KeyValueTokens> pairs;
+            getOuterKeyValueTokens(parser, pairs);
+
+            combinedHash = 0;
+            for(auto it = pairs.begin(); it != pairs.end(); ++it) {
+                combinedHash ^= getKeyValueHash(parser, *it);
+            }
+            combinedHashGeneration = contentGeneration;
+        }
+        combined = combinedHash;
+    }
+
+    return StorageHelperRK::murmur3_32((const uint8_t *)&combined, sizeof(combined), HASH_SEED);
 }
 
+uint32_t SleepHelper::SettingsFile::getBufferHash() const {
+    uint32_t hash;
 
-bool SleepHelper::SettingsFile::getValuesJson(String &json) {
     WITH_LOCK(*this) {
-        // This annoying code is necessary because String does not have a method to set the
-        // string by pointer and length
-        json = "";
-        size_t size = parser.getOffset();
-        json.reserve(size);
-        for(size_t ii = 0; ii < size; ii++) {
-            char ch = parser.getBuffer()[ii];
-            json.concat(ch);
+        hash = StorageHelperRK::murmur3_32((const uint8_t *)parser.getBuffer(), parser.getOffset(), HASH_SEED);
+    }
+
+    return hash;
+}
+
+uint32_t SleepHelper::SettingsFile::getKeyValueHash(const JsonParser &jp, const KeyValueTokens &pair) {
+    uint32_t hash = keyHash(jp.getBuffer() + pair.key->start, pair.key->end - pair.key->start) ^ HASH_SEED;
+
+    // Hash each token in the value separately so whitespace between tokens is ignored
+    int remaining = 1;
+    for(const JsonParserGeneratorRK::jsmntok_t *token = pair.value; remaining > 0; token++, remaining--) {
+        if (token->type == JsonParserGeneratorRK::JSMN_OBJECT || token->type == JsonParserGeneratorRK::JSMN_ARRAY) {
+            // Bracket and number of children
+            uint8_t buf[5];
+            buf[0] = (uint8_t)jp.getBuffer()[token->start];
+            memcpy(&buf[1], &token->size, 4);
+            hash = StorageHelperRK::murmur3_32(buf, sizeof(buf), hash);
+        }
+        else {
+            // Strings include the quotes so "1" and 1 are different
+            int start = token->start;
+            int end = token->end;
+            if (token->type == JsonParserGeneratorRK::JSMN_STRING) {
+                start--;
+                end++;
+            }
+            hash = StorageHelperRK::murmur3_32((const uint8_t *)jp.getBuffer() + start, end - start, hash);
         }
+
+        // Object children are keys, which each have a value as a child
+        remaining += token->size;
     }
 
-    return true;
+    return hash;
+}
+
+uint32_t SleepHelper::SettingsFile::getKeyValueHash(const char *key) const {
+    const IndexEntry *entry = findIndexEntry(key);
+    if (!entry) {
+        return 0;
+    }
+
+    KeyValueTokens pair;
+    pair.key = entry->keyToken;
+    pair.value = entry->valueToken;
+    return getKeyValueHash(parser, pair);
 }
 
+void SleepHelper::SettingsFile::updateCombinedHash(const std::vector<String> &keys, const std::vector<uint32_t> &oldHashes, bool wasValid) {
+    if (!wasValid) {
+        // Calculated on the next getHash()
+        return;
+    }
+    for(size_t ii = 0; ii < keys.size(); ii++) {
+        combinedHash ^= oldHashes[ii] ^ getKeyValueHash(keys[ii]);
+    }
+    combinedHashGeneration = contentGeneration;
+}
 //
 // SleepHelper::CloudSettingsFile
 //
-uint32_t SleepHelper::CloudSettingsFile::getHash() const {
-    uint32_t hash;
+bool SleepHelper::CloudSettingsFile::getDigestJson(String &json) const {
+    uint32_t buckets[DIGEST_BUCKETS];
+    getDigest(buckets);
+
+    json = "{\"b\":\"";
+    for(size_t ii = 0; ii < DIGEST_BUCKETS; ii++) {
+        json += String::format("%08lx", (unsigned long)buckets[ii]);
+    }
+    json += "\"}";
+
+    return true;
+}
 
+void SleepHelper::CloudSettingsFile::getDigest(uint32_t *buckets) const {
     WITH_LOCK(*this) {
-        hash = StorageHelperRK::murmur3_32((const uint8_t *)parser.getBuffer(), parser.getOffset(), HASH_SEED);
+        if (digestGeneration != contentGeneration) {
+            calculateDigest(parser, digest);
+            digestGeneration = contentGeneration;
+        }
+        memcpy(buckets, digest, sizeof(digest));
     }
+}
 
-    return hash;
+bool SleepHelper::CloudSettingsFile::applyDeltaJson(const char *deltaJson) {
+    JsonParser deltaParser;
+    deltaParser.addString(deltaJson);
+    if (!deltaParser.parse()) {
+        return false;
+    }
+
+    const JsonParserGeneratorRK::jsmntok_t *bucketsToken;
+    const JsonParserGeneratorRK::jsmntok_t *valuesToken;
+    if (!deltaParser.getValueTokenByKey(deltaParser.getOuterObject(), "b", bucketsToken) ||
+        !deltaParser.getValueTokenByKey(deltaParser.getOuterObject(), "v", valuesToken) ||
+        valuesToken->type != JsonParserGeneratorRK::JSMN_OBJECT) {
+        return false;
+    }
+
+    bool replaceBucket[DIGEST_BUCKETS] = {false};
+    bool hasBuckets = false;
+    int bucket;
+    for(size_t ii = 0; deltaParser.getValueByIndex(bucketsToken, ii, bucket); ii++) {
+        if (bucket < 0 || bucket >= (int)DIGEST_BUCKETS) {
+            return false;
+        }
+        replaceBucket[bucket] = true;
+        hasBuckets = true;
+    }
+    if (!hasBuckets) {
+        // Already in sync
+        return true;
+    }
+
+    // Build the new settings from the existing settings in buckets that are not being 
+    // replaced, plus the values from the delta
+    String json = "{";
+    std::vector<KeyValueTokens> pairs;
+
+    WITH_LOCK(*this) {
+        getOuterKeyValueTokens(parser, pairs);
+        for(auto it = pairs.begin(); it != pairs.end(); ++it) {
+            if (!replaceBucket[getDigestBucket(parser.getBuffer() + it->key->start, it->key->end - it->key->start)]) {
+                if (json.length() > 1) {
+                    json.concat(',');
+                }
+                appendTokenJson(json, parser, it->key);
+                json.concat(':');
+                appendTokenJson(json, parser, it->value);
+            }
+        }
+    }
+
+    getObjectKeyValueTokens(deltaParser, valuesToken, pairs);
+    for(auto it = pairs.begin(); it != pairs.end(); ++it) {
+        if (replaceBucket[getDigestBucket(deltaParser.getBuffer() + it->key->start, it->key->end - it->key->start)]) {
+            if (json.length() > 1) {
+                json.concat(',');
+            }
+            appendTokenJson(json, deltaParser, it->key);
+            json.concat(':');
+            appendTokenJson(json, deltaParser, it->value);
+        }
+    }
+    json.concat('}');
+
+    return setValuesJson(json);
+}
+
+bool SleepHelper::CloudSettingsFile::getDeltaJson(const char *settingsJson, const char *digestJson, String &deltaJson) {
+    JsonParser settingsParser;
+    settingsParser.addString(settingsJson);
+    if (!settingsParser.parse()) {
+        return false;
+    }
+
+    JsonParser digestParser;
+    digestParser.addString(digestJson);
+    String digestHex;
+    if (!digestParser.parse() || !digestParser.getOuterValueByKey("b", digestHex) || digestHex.length() != DIGEST_BUCKETS * 8) {
+        return false;
+    }
+
+    uint32_t buckets[DIGEST_BUCKETS];
+    calculateDigest(settingsParser, buckets);
+
+    bool differs[DIGEST_BUCKETS];
+    deltaJson = "{\"b\":[";
+    bool first = true;
+    for(size_t ii = 0; ii < DIGEST_BUCKETS; ii++) {
+        uint32_t deviceBucket = (uint32_t)strtoul(digestHex.substring(ii * 8, ii * 8 + 8), NULL, 16);
+        differs[ii] = (deviceBucket != buckets[ii]);
+        if (differs[ii]) {
+            if (!first) {
+                deltaJson.concat(',');
+            }
+            deltaJson += String(ii);
+            first = false;
+        }
+    }
+    deltaJson += "],\"v\":{";
+
+    std::vector<KeyValueTokens> pairs;
+    getOuterKeyValueTokens(settingsParser, pairs);
+    first = true;
+    for(auto it = pairs.begin(); it != pairs.end(); ++it) {
+        if (differs[getDigestBucket(settingsParser.getBuffer() + it->key->start, it->key->end - it->key->start)]) {
+            if (!first) {
+                deltaJson.concat(',');
+            }
+            appendTokenJson(deltaJson, settingsParser, it->key);
+            deltaJson.concat(':');
+            appendTokenJson(deltaJson, settingsParser, it->value);
+            first = false;
+        }
+    }
+    deltaJson += "}}";
+
+    return true;
+}
+
+void SleepHelper::CloudSettingsFile::calculateDigest(const JsonParser &jp, uint32_t *buckets) {
+    for(size_t ii = 0; ii < DIGEST_BUCKETS; ii++) {
+        buckets[ii] = 0;
+    }
+
+    std::vector<KeyValueTokens> pairs;
+    getOuterKeyValueTokens(jp, pairs);
+    for(auto it = pairs.begin(); it != pairs.end(); ++it) {
+        const char *key = jp.getBuffer() + it->key->start;
+        size_t keyLen = it->key->end - it->key->start;
+
+        buckets[getDigestBucket(key, keyLen)] ^= getKeyValueHash(jp, *it);
+    }
 }
+
 #endif // HAL_PLATFORM_FILESYSTEM || defined(UNITTEST)
 
 
@@ -933,6 +3049,22 @@ void SleepHelper::EventHistory::addEvent(const char *jsonObj) {
         SleepHelper::instance().appLog.write(LOG_LEVEL_TRACE, "\r\n", 2);
     }
 
+    if (deferredMaxBytes) {
+        WITH_LOCK(*this) {
+            size_t len = strlen(jsonObj) + 1;
+            if (deferredEvents.length() + len > deferredMaxBytes) {
+                // RAM buffer is full, write it out first
+                flushDeferred();
+            }
+            if (len <= deferredMaxBytes) {
+                deferredEvents.concat(jsonObj);
+                deferredEvents.concat('\n');
+                hasEvents = true;
+                return;
+            }
+        }
+    }
+
     // Append to the file
     WITH_LOCK(*this) {
         int fd = open(path, O_RDWR | O_CREAT | O_APPEND, 0666);
@@ -964,6 +3096,8 @@ bool SleepHelper::EventHistory::getEvents(JSONWriter &writer, size_t maxSize, bo
     if (maxSize < 2 || !hasEvents) {
         return false;
     }
+    flushDeferred();
+
     char *buf = (char *)malloc(maxSize);
     if (!buf) {
         return false;
@@ -1073,10 +3207,29 @@ bool SleepHelper::EventHistory::getHasEvents() {
         struct stat sb;
         int res = stat(path, &sb);
 
-        hasEvents = (res == 0 && sb.st_size > 0);
+        hasEvents = (res == 0 && sb.st_size > 0) || deferredEvents.length() > 0;
     }
     return hasEvents; 
 };
+
+bool SleepHelper::EventHistory::flushDeferred() {
+    bool bResult = false;
+
+    WITH_LOCK(*this) {
+        if (deferredEvents.length() > 0) {
+            int fd = open(path, O_RDWR | O_CREAT | O_APPEND, 0666);
+            if (fd != -1) {
+                write(fd, deferredEvents.c_str(), deferredEvents.length());
+                close(fd);
+
+                deferredEvents = "";
+                hasEvents = true;
+                bResult = true;
+            }
+        }
+    }
+    return bResult;
+}
 #endif // HAL_PLATFORM_FILESYSTEM || defined(UNITTEST)
 
 #if HAL_PLATFORM_FILESYSTEM || defined(UNITTEST)
@@ -1107,6 +3260,18 @@ void SleepHelper::EventCombiner::generateEvents(std::vector<String> &events, siz
         generateEventInternal(*it, buf, maxSize, infoArray);        
     }
 
+    for(auto it = slots.begin(); it != slots.end(); ++it) {
+        if (it->pending) {
+            const Slot &slot = *it;
+            generateEventInternal([&slot](JSONWriter &writer, int &priority) {
+                writer.name(slot.name);
+                priority = slot.priority;
+                slot.fn(writer);
+                return true;
+            }, buf, maxSize, infoArray);
+        }
+    }
+
     for(auto it = callbacks.callbackFunctions.begin(); it != callbacks.callbackFunctions.end(); ++it) {
         generateEventInternal(*it, buf, maxSize, infoArray);        
     }
@@ -1253,7 +3418,7 @@ void SleepHelper::EventCombiner::generateEvents(std::vector<String> &events, siz
 }
 
 
-void SleepHelper::EventCombiner::generateEventInternal(std::function<void(JSONWriter &, int &)> callback, char *buf, size_t maxSize, std::vector<EventInfo> &infoArray) {
+void SleepHelper::EventCombiner::generateEventInternal(const AppCallback<JSONWriter &, int &>::Function &callback, char *buf, size_t maxSize, std::vector<EventInfo> &infoArray) {
     memset(buf, 0, maxSize);
     JSONBufferWriter writer(buf, maxSize);
 
@@ -1288,6 +3453,661 @@ void SleepHelper::EventCombiner::generateEventInternal(std::function<void(JSONWr
 }
 #endif // HAL_PLATFORM_FILESYSTEM || defined(UNITTEST)
 
+#if HAL_PLATFORM_FILESYSTEM || defined(UNITTEST)
+//
+// SampleAggregator
+//
+SleepHelper::SampleAggregator &SleepHelper::SampleAggregator::withChannel(const char *name, int decimalPlaces, bool raw) {
+    if (channelConfig.size() < MAX_CHANNELS && findChannel(name) < 0) {
+        ChannelConfig config;
+        config.name = name;
+        config.nameHash = StorageHelperRK::murmur3_32((const uint8_t *)name, strlen(name), NAME_HASH_SEED);
+        config.decimalPlaces = decimalPlaces;
+        config.raw = raw;
+        channelConfig.push_back(config);
+    }
+    return *this;
+}
+
+bool SleepHelper::SampleAggregator::addSample(const char *name, float value, time_t now) {
+    int index = findChannel(name);
+    if (index < 0) {
+        return false;
+    }
+    const ChannelConfig &config = channelConfig[index];
+
+    WITH_LOCK(*this) {
+        uint32_t windowStart = (uint32_t)now - ((uint32_t)now % windowSec);
+
+        bool windowClosed = false;
+        if (aggregatorData.windowStart != windowStart) {
+            // Either the first sample or the window has ended
+            windowClosed = closeWindowInternal();
+            aggregatorData.windowStart = windowStart;
+        }
+
+        ChannelData &data = aggregatorData.channels[index];
+        if (data.nameHash != config.nameHash) {
+            // Configuration changed, discard the old statistics for this slot
+            memset(&data, 0, sizeof(ChannelData));
+            data.nameHash = config.nameHash;
+        }
+
+        // Welford's online algorithm, which does not lose precision for large counts like sum of squares does
+        data.count++;
+        double delta = value - data.mean;
+        data.mean += delta / data.count;
+        data.m2 += delta * (value - data.mean);
+
+        if (data.count == 1 || value < data.min) {
+            data.min = value;
+        }
+        if (data.count == 1 || value > data.max) {
+            data.max = value;
+        }
+
+        // Only save when reporting. Otherwise the sample is saved by saveChanges() before sleep.
+        if (windowClosed) {
+            unsavedChanges = false;
+            saveOrDefer();
+        }
+        else {
+            unsavedChanges = true;
+        }
+    }
+
+    if (config.raw && eventCombiner) {
+        eventCombiner->addEvent([&config, value, now](JSONWriter &writer) {
+            writer.name("t").value((int)now);
+            writer.name(config.name).value(value, config.decimalPlaces);
+        });
+    }
+    return true;
+}
+
+bool SleepHelper::SampleAggregator::checkWindow(time_t now) {
+    bool result = false;
+
+    WITH_LOCK(*this) {
+        if (aggregatorData.windowStart != 0 && (uint32_t)now >= aggregatorData.windowStart + windowSec) {
+            result = closeWindowInternal();
+            aggregatorData.windowStart = 0;
+            unsavedChanges = false;
+            saveOrDefer();
+        }
+    }
+    return result;
+}
+
+bool SleepHelper::SampleAggregator::closeWindow() {
+    bool result;
+
+    WITH_LOCK(*this) {
+        result = closeWindowInternal();
+        aggregatorData.windowStart = 0;
+        unsavedChanges = false;
+        saveOrDefer();
+    }
+    return result;
+}
+
+bool SleepHelper::SampleAggregator::saveChanges() {
+    bool result = false;
+
+    WITH_LOCK(*this) {
+        if (unsavedChanges) {
+            unsavedChanges = false;
+            saveOrDefer();
+            result = true;
+        }
+    }
+    return result;
+}
+
+bool SleepHelper::SampleAggregator::closeWindowInternal() {
+    bool hasSamples = false;
+    for(size_t ii = 0; ii < channelConfig.size(); ii++) {
+        if (aggregatorData.channels[ii].nameHash == channelConfig[ii].nameHash && aggregatorData.channels[ii].count) {
+            hasSamples = true;
+        }
+    }
+
+    if (hasSamples) {
+        if (eventCombiner) {
+            eventCombiner->addEvent([this](JSONWriter &writer) {
+                writeSummary(writer);
+            });
+        }
+        aggregatorData.windowCount++;
+    }
+
+    for(size_t ii = 0; ii < MAX_CHANNELS; ii++) {
+        uint32_t nameHash = aggregatorData.channels[ii].nameHash;
+        memset(&aggregatorData.channels[ii], 0, sizeof(ChannelData));
+        aggregatorData.channels[ii].nameHash = nameHash;
+    }
+
+    return hasSamples;
+}
+
+bool SleepHelper::SampleAggregator::getStats(const char *name, Stats &stats) const {
+    stats = Stats();
+
+    int index = findChannel(name);
+    if (index < 0) {
+        return false;
+    }
+
+    WITH_LOCK(*this) {
+        const ChannelData &data = aggregatorData.channels[index];
+        if (data.nameHash == channelConfig[index].nameHash && data.count) {
+            stats.count = data.count;
+            stats.mean = (float)data.mean;
+            stats.stddev = (data.count > 1) ? (float)std::sqrt(data.m2 / (data.count - 1)) : 0;
+            stats.min = data.min;
+            stats.max = data.max;
+        }
+    }
+    return true;
+}
+
+void SleepHelper::SampleAggregator::writeSummary(JSONWriter &writer) const {
+    writer.name(key).beginObject();
+    writer.name("t").value((int)getWindowStart());
+
+    for(size_t ii = 0; ii < channelConfig.size(); ii++) {
+        Stats stats;
+        getStats(channelConfig[ii].name, stats);
+        if (stats.count == 0) {
+            continue;
+        }
+        int decimalPlaces = channelConfig[ii].decimalPlaces;
+
+        writer.name(channelConfig[ii].name).beginObject();
+        writer.name("n").value((int)stats.count);
+        writer.name("mean").value(stats.mean, decimalPlaces);
+        writer.name("sd").value(stats.stddev, decimalPlaces);
+        writer.name("min").value(stats.min, decimalPlaces);
+        writer.name("max").value(stats.max, decimalPlaces);
+        writer.endObject();
+    }
+
+    writer.endObject();
+}
+
+int SleepHelper::SampleAggregator::findChannel(const char *name) const {
+    for(size_t ii = 0; ii < channelConfig.size(); ii++) {
+        if (strcmp(channelConfig[ii].name, name) == 0) {
+            return (int)ii;
+        }
+    }
+    return -1;
+}
+#endif // HAL_PLATFORM_FILESYSTEM || defined(UNITTEST)
+
+#if HAL_PLATFORM_FILESYSTEM || defined(UNITTEST)
+//
+// ReportByException
+//
+SleepHelper::ReportByException &SleepHelper::ReportByException::withChannel(const char *name, float deadband, float ratePerSec, int decimalPlaces) {
+    if (channelConfig.size() < MAX_CHANNELS && findChannel(name) < 0) {
+        ChannelConfig config;
+        config.name = name;
+        config.nameHash = StorageHelperRK::murmur3_32((const uint8_t *)name, strlen(name), NAME_HASH_SEED);
+        config.deadband = deadband;
+        config.ratePerSec = ratePerSec;
+        config.decimalPlaces = decimalPlaces;
+        channelConfig.push_back(config);
+    }
+    return *this;
+}
+
+int SleepHelper::ReportByException::addSample(const char *name, float value, time_t now) {
+    int index = findChannel(name);
+    if (index < 0) {
+        return REPORT_UNKNOWN_CHANNEL;
+    }
+    ChannelConfig &config = channelConfig[index];
+    int reason = REPORT_SUPPRESSED;
+
+    WITH_LOCK(*this) {
+        ChannelData &data = reportData.channels[index];
+
+        if (data.nameHash != config.nameHash || data.lastReportTime == 0) {
+            reason = REPORT_FIRST;
+        }
+        else
+        if (std::fabs(value - data.lastReportValue) > config.deadband) {
+            reason = REPORT_DEADBAND;
+        }
+        else
+        if (config.ratePerSec > 0 && config.lastSampleTime != 0 && now > config.lastSampleTime &&
+            std::fabs(value - config.lastSampleValue) / (float)(now - config.lastSampleTime) >= config.ratePerSec) {
+            reason = REPORT_RATE;
+        }
+        else
+        if (heartbeatSec != 0 && (uint32_t)now >= data.lastReportTime + heartbeatSec) {
+            reason = REPORT_HEARTBEAT;
+        }
+
+        if (reason != REPORT_SUPPRESSED) {
+            // Only write the file when reporting, which is the whole point
+            data.nameHash = config.nameHash;
+            data.lastReportTime = (uint32_t)now;
+            data.lastReportValue = value;
+
+            if (config.escalationConviction && (reason == REPORT_DEADBAND || reason == REPORT_RATE) && 
+                reportData.escalationPending < (uint32_t)config.escalationConviction) {
+                reportData.escalationPending = (uint32_t)config.escalationConviction;
+            }
+            saveOrDefer();
+        }
+    }
+
+    config.lastSampleTime = now;
+    config.lastSampleValue = value;
+
+    if (reason == REPORT_SUPPRESSED) {
+        suppressedCount++;
+        return reason;
+    }
+    reportedCount++;
+
+    if (eventCombiner) {
+        eventCombiner->addEvent([&config, value, now](JSONWriter &writer) {
+            writer.name("t").value((int)now);
+            writer.name(config.name).value(value, config.decimalPlaces);
+        });
+    }
+
+    if (config.escalationConviction && (reason == REPORT_DEADBAND || reason == REPORT_RATE) && escalationFunction) {
+        escalationFunction();
+    }
+    return reason;
+}
+
+bool SleepHelper::ReportByException::getLastReport(const char *name, float &value) const {
+    int index = findChannel(name);
+    if (index < 0) {
+        return false;
+    }
+
+    bool result = false;
+    WITH_LOCK(*this) {
+        const ChannelData &data = reportData.channels[index];
+        if (data.nameHash == channelConfig[index].nameHash && data.lastReportTime != 0) {
+            value = data.lastReportValue;
+            result = true;
+        }
+    }
+    return result;
+}
+
+int SleepHelper::ReportByException::findChannel(const char *name) const {
+    for(size_t ii = 0; ii < channelConfig.size(); ii++) {
+        if (strcmp(channelConfig[ii].name, name) == 0) {
+            return (int)ii;
+        }
+    }
+    return -1;
+}
+#endif // HAL_PLATFORM_FILESYSTEM || defined(UNITTEST)
+
+//
+// AdaptiveSampler
+//
+time_t SleepHelper::AdaptiveSampler::addSample(float value, time_t now) {
+    if (sampleCount >= 1 && now > sampleTime[0]) {
+        // Predict the value from the previous samples
+        float predicted = sampleValue[0];
+        if (sampleCount >= 2 && sampleTime[0] > sampleTime[1]) {
+            float slope = (sampleValue[0] - sampleValue[1]) / (float)(sampleTime[0] - sampleTime[1]);
+            predicted += slope * (float)(now - sampleTime[0]);
+        }
+        float error = std::fabs(value - predicted);
+
+        if (error > threshold) {
+            // Signal is moving, sample at the fastest rate
+            intervalSec = minIntervalSec;
+        }
+        else
+        if (error < threshold / 2) {
+            // Signal is stable, back off
+            intervalSec = std::min(intervalSec * 2, maxIntervalSec);
+        }
+
+        float actualIntervalSec = (float)(now - sampleTime[0]);
+        if (effectiveIntervalSec == 0) {
+            effectiveIntervalSec = actualIntervalSec;
+        }
+        else {
+            effectiveIntervalSec += (actualIntervalSec - effectiveIntervalSec) / 8;
+        }
+    }
+
+    sampleTime[1] = sampleTime[0];
+    sampleValue[1] = sampleValue[0];
+    sampleTime[0] = now;
+    sampleValue[0] = value;
+    sampleCount++;
+
+    return getNextCaptureTime();
+}
+
+void SleepHelper::AdaptiveSampler::reset() {
+    intervalSec = minIntervalSec;
+    sampleTime[0] = sampleTime[1] = 0;
+    sampleValue[0] = sampleValue[1] = 0;
+    sampleCount = 0;
+    effectiveIntervalSec = 0;
+}
+
+//
+// BurstCapture
+//
+SleepHelper::BurstCapture::BurstCapture(size_t capacity) {
+    samples.resize(capacity);
+
+    // The FFT is done on the largest power of 2 that fits in the buffer
+    size_t fftSize = 1;
+    while(fftSize * 2 <= capacity) {
+        fftSize *= 2;
+    }
+    fftBuffer.resize(fftSize * 2);
+}
+
+SleepHelper::BurstCapture::~BurstCapture() {
+#ifndef UNITTEST
+    if (timer) {
+        timer->stop();
+        delete timer;
+    }
+#endif
+}
+
+void SleepHelper::BurstCapture::clear() {
+    head = 0;
+    count = 0;
+}
+
+void SleepHelper::BurstCapture::addSample(float value) {
+    if (samples.empty()) {
+        return;
+    }
+    samples[head] = value;
+    if (++head >= samples.size()) {
+        head = 0;
+    }
+    if (count < samples.size()) {
+        count++;
+    }
+}
+
+float SleepHelper::BurstCapture::getSample(size_t index) const {
+    if (index >= count) {
+        return 0;
+    }
+    // Oldest sample is at head when the buffer is full, otherwise at 0
+    size_t start = (count < samples.size()) ? 0 : head;
+    return samples[(start + index) % samples.size()];
+}
+
+// [static]
+int SleepHelper::BurstCapture::getNearestSampleRateHz(int sampleRateHz) {
+    if (sampleRateHz >= 1000) {
+        return 1000;
+    }
+    if (sampleRateHz <= 1) {
+        return 1;
+    }
+
+    int result = 1000;
+    for(int periodMs = 2; periodMs <= 1000; periodMs++) {
+        if ((1000 % periodMs) == 0) {
+            int rate = 1000 / periodMs;
+            if (std::abs(rate - sampleRateHz) < std::abs(result - sampleRateHz)) {
+                result = rate;
+            }
+        }
+    }
+    return result;
+}
+
+bool SleepHelper::BurstCapture::start() {
+    if (samples.empty() || !sampleFunction) {
+        return false;
+    }
+    clear();
+
+    // sampleRateHz divides 1000 evenly, so the timer runs at exactly this rate
+    samplesRemaining = (size_t)sampleRateHz * durationMs / 1000;
+    if (samplesRemaining == 0) {
+        samplesRemaining = 1;
+    }
+    running = true;
+
+#ifndef UNITTEST
+    unsigned periodMs = 1000 / sampleRateHz;
+    if (!timer) {
+        timer = new Timer(periodMs, [this]() { timerCallback(); });
+        if (!timer) {
+            running = false;
+            return false;
+        }
+    }
+    else {
+        timer->changePeriod(periodMs);
+    }
+    timer->start();
+#endif
+
+    return true;
+}
+
+void SleepHelper::BurstCapture::stop() {
+#ifndef UNITTEST
+    if (timer) {
+        timer->stop();
+    }
+#endif
+    running = false;
+}
+
+void SleepHelper::BurstCapture::timerCallback() {
+    if (!running) {
+        return;
+    }
+    addSample(sampleFunction());
+
+    if (--samplesRemaining == 0) {
+        // The timer is stopped from stop(), not here, because this is the timer thread
+        running = false;
+    }
+}
+
+void SleepHelper::BurstCapture::getStats(Stats &stats) const {
+    stats = Stats();
+    stats.count = count;
+    if (count == 0) {
+        return;
+    }
+
+    double sum = 0;
+    double sumSquares = 0;
+    stats.min = stats.max = getSample(0);
+
+    for(size_t ii = 0; ii < count; ii++) {
+        float value = getSample(ii);
+        sum += value;
+        sumSquares += (double)value * value;
+        if (value < stats.min) {
+            stats.min = value;
+        }
+        if (value > stats.max) {
+            stats.max = value;
+        }
+    }
+    stats.mean = (float)(sum / count);
+    stats.rms = (float)std::sqrt(sumSquares / count);
+    stats.peak = std::max(std::fabs(stats.min), std::fabs(stats.max));
+}
+
+size_t SleepHelper::BurstCapture::getDownsampled(float *values, size_t numPoints) const {
+    if (numPoints > count) {
+        numPoints = count;
+    }
+    for(size_t point = 0; point < numPoints; point++) {
+        size_t start = point * count / numPoints;
+        size_t end = (point + 1) * count / numPoints;
+
+        double sum = 0;
+        for(size_t ii = start; ii < end; ii++) {
+            sum += getSample(ii);
+        }
+        values[point] = (float)(sum / (end - start));
+    }
+    return numPoints;
+}
+
+size_t SleepHelper::BurstCapture::getSpectrum(float *bins, size_t numBins) {
+    size_t n = fftBuffer.size() / 2;
+    while(n > count) {
+        n /= 2;
+    }
+    if (n < 4 || numBins == 0) {
+        return 0;
+    }
+    if (numBins > n / 2) {
+        numBins = n / 2;
+    }
+
+    // Use the most recent n samples, with the mean removed
+    size_t first = count - n;
+    double sum = 0;
+    for(size_t ii = 0; ii < n; ii++) {
+        sum += getSample(first + ii);
+    }
+    float mean = (float)(sum / n);
+
+    for(size_t ii = 0; ii < n; ii++) {
+        fftBuffer[ii * 2] = getSample(first + ii) - mean;
+        fftBuffer[ii * 2 + 1] = 0;
+    }
+
+    fft(n);
+
+    // Largest single-sided amplitude in each bin from 0 to n/2 (half the sample rate)
+    size_t half = n / 2;
+    for(size_t bin = 0; bin < numBins; bin++) {
+        size_t start = bin * half / numBins;
+        size_t end = (bin + 1) * half / numBins;
+
+        float amplitude = 0;
+        for(size_t k = start; k < end; k++) {
+            float re = fftBuffer[k * 2];
+            float im = fftBuffer[k * 2 + 1];
+            float value = 2.0f * std::sqrt(re * re + im * im) / n;
+            if (value > amplitude) {
+                amplitude = value;
+            }
+        }
+        bins[bin] = amplitude;
+    }
+
+    return numBins;
+}
+
+void SleepHelper::BurstCapture::fft(size_t n) {
+    float *data = fftBuffer.data();
+
+    // Bit reversal permutation
+    for(size_t ii = 1, jj = 0; ii < n; ii++) {
+        size_t bit = n >> 1;
+        for(; jj & bit; bit >>= 1) {
+            jj ^= bit;
+        }
+        jj ^= bit;
+        if (ii < jj) {
+            std::swap(data[ii * 2], data[jj * 2]);
+            std::swap(data[ii * 2 + 1], data[jj * 2 + 1]);
+        }
+    }
+
+    // Butterflies
+    for(size_t len = 2; len <= n; len <<= 1) {
+        double angle = -2.0 * M_PI / len;
+        float wRe = (float)std::cos(angle);
+        float wIm = (float)std::sin(angle);
+
+        for(size_t ii = 0; ii < n; ii += len) {
+            float curRe = 1.0f;
+            float curIm = 0.0f;
+            for(size_t jj = 0; jj < len / 2; jj++) {
+                float *a = &data[(ii + jj) * 2];
+                float *b = &data[(ii + jj + len / 2) * 2];
+
+                float tRe = b[0] * curRe - b[1] * curIm;
+                float tIm = b[0] * curIm + b[1] * curRe;
+
+                b[0] = a[0] - tRe;
+                b[1] = a[1] - tIm;
+                a[0] += tRe;
+                a[1] += tIm;
+
+                float nextRe = curRe * wRe - curIm * wIm;
+                curIm = curRe * wIm + curIm * wRe;
+                curRe = nextRe;
+            }
+        }
+    }
+}
+
+void SleepHelper::BurstCapture::writeSummary(JSONWriter &writer) {
+    writer.name(key).beginObject();
+
+    writer.name("hz").value(sampleRateHz);
+
+    if ((reductions & REDUCE_STATS) != 0) {
+        Stats stats;
+        getStats(stats);
+
+        writer.name("n").value((int)stats.count);
+        writer.name("mean").value(stats.mean, decimalPlaces);
+        writer.name("rms").value(stats.rms, decimalPlaces);
+        writer.name("pk").value(stats.peak, decimalPlaces);
+        writer.name("min").value(stats.min, decimalPlaces);
+        writer.name("max").value(stats.max, decimalPlaces);
+    }
+
+    if ((reductions & (REDUCE_DOWNSAMPLE | REDUCE_SPECTRUM)) != 0) {
+        size_t maxPoints = std::max(downsamplePoints, spectrumBins);
+        float *values = (float *) malloc(maxPoints * sizeof(float));
+        if (values) {
+            if ((reductions & REDUCE_DOWNSAMPLE) != 0) {
+                size_t numPoints = getDownsampled(values, downsamplePoints);
+
+                writer.name("ds").beginArray();
+                for(size_t ii = 0; ii < numPoints; ii++) {
+                    writer.value(values[ii], decimalPlaces);
+                }
+                writer.endArray();
+            }
+            if ((reductions & REDUCE_SPECTRUM) != 0) {
+                size_t numBins = getSpectrum(values, spectrumBins);
+
+                writer.name("fft").beginArray();
+                for(size_t ii = 0; ii < numBins; ii++) {
+                    writer.value(values[ii], decimalPlaces);
+                }
+                writer.endArray();
+            }
+            free(values);
+        }
+    }
+
+    writer.endObject();
+}
+
 // [static]
 void SleepHelper::JSONCopy(const char *src, JSONWriter &writer) {
     JSONCopy(JSONValue::parseCopy(src), writer);
@@ -6,6 +6,19 @@
 #include "JsonParserGeneratorRK.h"
 #include "StorageHelperRK.h"
 #include <vector>
+#include <unordered_map>
+#include <limits>
+#include <cstddef>
+#include <new>
+#include <type_traits>
+#include <utility>
+#include <atomic>
+#ifdef UNITTEST
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <deque>
+#endif
 
 #include <fcntl.h>
 #if HAL_PLATFORM_FILESYSTEM || defined(UNITTEST)
@@ -14,6 +27,10 @@
 
 /**
  *  @defgroup callbacks Callback functions you can register
+ * 
+ *  Callbacks are stored in an InlineFunction without heap allocation, so a lambda that captures 
+ *  more than INLINE_FUNCTION_SIZE bytes (4 pointers or references) is a compile error. To register
+ *  a larger one, wrap it in a std::function.
  */
 
 /**
@@ -145,6 +162,277 @@ public:
     };
 #endif /* UNITTEST */
 
+    /**
+     * @brief Default size in bytes of the inline storage in InlineFunction
+     * 
+     * This is large enough for a std::function, a lambda that captures up to 4 pointers or 
+     * references, or a function pointer.
+     */
+    static const size_t INLINE_FUNCTION_SIZE = 4 * sizeof(void *);
+
+    /**
+     * @brief Callable object like std::function that stores the function object inline, never on the heap
+     * 
+     * @tparam Signature Function type, such as bool(int)
+     * @tparam Size Bytes of storage for the function object, including lambda captures
+     * 
+     * Assigning a function object that does not fit in Size is a compile error instead of a 
+     * heap allocation. If you get a static_assert error, capture less (such as a pointer 
+     * to a struct instead of several values) or wrap the lambda in a std::function.
+     */
+    template<class Signature, size_t Size = INLINE_FUNCTION_SIZE>
+    class InlineFunction;
+
+    /**
+     * @brief Specialization of InlineFunction for a function type
+     */
+    template<class R, class... Args, size_t Size>
+    class InlineFunction<R(Args...), Size> {
+    public:
+        /**
+         * @brief Construct an empty function. Calling it is undefined; check with operator bool first.
+         */
+        InlineFunction() {}
+
+        /**
+         * @brief Construct an empty function
+         */
+        InlineFunction(std::nullptr_t) {}
+
+        /**
+         * @brief Construct from a lambda, function pointer, std::function, or other function object
+         * 
+         * @param fn The function object, which is copied or moved into the inline storage
+         */
+        template<class F, class = typename std::enable_if<!std::is_same<typename std::decay<F>::type, InlineFunction>::value>::type>
+        InlineFunction(F &&fn) {
+            typedef typename std::decay<F>::type Fn;
+            static_assert(sizeof(Fn) <= Size, "function object is too large for InlineFunction, capture less or increase Size");
+            static_assert(alignof(Fn) <= alignof(Storage), "function object alignment is too large for InlineFunction");
+
+            new (&storage) Fn(std::forward<F>(fn));
+            invoker = &invoke<Fn>;
+            manager = &manage<Fn>;
+        }
+
+        /**
+         * @brief Copy constructor
+         */
+        InlineFunction(const InlineFunction &other) {
+            if (other.manager) {
+                other.manager(OP_COPY, &storage, const_cast<Storage *>(&other.storage));
+                invoker = other.invoker;
+                manager = other.manager;
+            }
+        }
+
+        /**
+         * @brief Move constructor
+         */
+        InlineFunction(InlineFunction &&other) {
+            if (other.manager) {
+                other.manager(OP_MOVE, &storage, &other.storage);
+                invoker = other.invoker;
+                manager = other.manager;
+                other.invoker = nullptr;
+                other.manager = nullptr;
+            }
+        }
+
+        /**
+         * @brief Destructor
+         */
+        ~InlineFunction() {
+            reset();
+        }
+
+        /**
+         * @brief Copy assignment
+         */
+        InlineFunction &operator=(const InlineFunction &other) {
+            if (this != &other) {
+                reset();
+                if (other.manager) {
+                    other.manager(OP_COPY, &storage, const_cast<Storage *>(&other.storage));
+                    invoker = other.invoker;
+                    manager = other.manager;
+                }
+            }
+            return *this;
+        }
+
+        /**
+         * @brief Move assignment
+         */
+        InlineFunction &operator=(InlineFunction &&other) {
+            if (this != &other) {
+                reset();
+                if (other.manager) {
+                    other.manager(OP_MOVE, &storage, &other.storage);
+                    invoker = other.invoker;
+                    manager = other.manager;
+                    other.invoker = nullptr;
+                    other.manager = nullptr;
+                }
+            }
+            return *this;
+        }
+
+        /**
+         * @brief Call the function
+         */
+        R operator()(Args... args) const {
+            return invoker(const_cast<Storage *>(&storage), std::forward<Args>(args)...);
+        }
+
+        /**
+         * @brief Returns true if a function has been set
+         */
+        explicit operator bool() const {
+            return invoker != nullptr;
+        }
+
+        /**
+         * @brief Destroy the function object, leaving this object empty
+         */
+        void reset() {
+            if (manager) {
+                manager(OP_DESTROY, &storage, nullptr);
+                invoker = nullptr;
+                manager = nullptr;
+            }
+        }
+
+    protected:
+        /**
+         * @brief Operations for manager
+         */
+        enum ManagerOp {
+            OP_COPY, //!< Copy construct the function object in src to dst
+            OP_MOVE, //!< Move construct the function object in src to dst, then destroy src
+            OP_DESTROY //!< Destroy the function object in dst
+        };
+
+        typedef typename std::aligned_storage<Size, alignof(std::max_align_t)>::type Storage; //!< Type of the inline storage
+
+        /**
+         * @brief Call the function object of type Fn in storage
+         */
+        template<class Fn>
+        static R invoke(void *storage, Args... args) {
+            return (*static_cast<Fn *>(storage))(std::forward<Args>(args)...);
+        }
+
+        /**
+         * @brief Copy, move, or destroy the function object of type Fn
+         */
+        template<class Fn>
+        static void manage(ManagerOp op, void *dst, void *src) {
+            switch(op) {
+                case OP_COPY:
+                    new (dst) Fn(*static_cast<const Fn *>(src));
+                    break;
+
+                case OP_MOVE:
+                    new (dst) Fn(std::move(*static_cast<Fn *>(src)));
+                    static_cast<Fn *>(src)->~Fn();
+                    break;
+
+                case OP_DESTROY:
+                    static_cast<Fn *>(dst)->~Fn();
+                    break;
+            }
+        }
+
+        Storage storage; //!< Inline storage for the function object
+        R (*invoker)(void *, Args...) = nullptr; //!< Calls the function object, or nullptr if empty
+        void (*manager)(ManagerOp, void *, void *) = nullptr; //!< Copies, moves, or destroys the function object
+    };
+
+    /**
+     * @brief Execution statistics for a single callback, see AppCallbackStatsList::withStats()
+     */
+    class CallbackStats {
+    public:
+        const char *name = nullptr; //!< Name passed when the callback was added, or nullptr
+        uint32_t callCount = 0; //!< Number of times the callback was called
+        uint64_t totalMicros = 0; //!< Cumulative execution time in microseconds
+        uint32_t maxMicros = 0; //!< Longest single execution time in microseconds
+        uint32_t lastTrueWakeCycle = 0; //!< Value of wakeCycle the last time the callback returned true (stay awake), 0 if never
+
+        /**
+         * @brief Wake cycle number, incremented by SleepHelper at the start of each wake cycle
+         */
+        static uint32_t wakeCycle;
+    };
+
+    /**
+     * @brief Base class for callback lists that keeps optional per-callback execution statistics
+     */
+    class AppCallbackStatsList {
+    public:
+        /**
+         * @brief Enable or disable collecting execution time statistics
+         * 
+         * @param enable true to enable
+         * 
+         * When disabled (the default), only the names of the callbacks are stored and there is 
+         * no overhead when calling callbacks.
+         */
+        void withStats(bool enable) {
+            statsEnabled = enable;
+        }
+
+        /**
+         * @brief Returns true if statistics are being collected
+         */
+        bool getStatsEnabled() const {
+            return statsEnabled;
+        }
+
+        /**
+         * @brief Get the statistics. The indexes are in the order the callbacks were added.
+         */
+        const std::vector<CallbackStats> &getStats() const {
+            return stats;
+        }
+
+        /**
+         * @brief Clear the counts and times, but not the names
+         */
+        void resetStats() {
+            for(auto it = stats.begin(); it != stats.end(); ++it) {
+                const char *name = it->name;
+                *it = CallbackStats();
+                it->name = name;
+            }
+        }
+
+    protected:
+        /**
+         * @brief Record a call to a callback
+         * 
+         * @param index Index of the callback
+         * @param startMicros Value of micros() before the call
+         * @param result Value returned by the callback
+         */
+        void recordCall(size_t index, unsigned long startMicros, bool result) {
+            uint32_t elapsed = (uint32_t)(micros() - startMicros);
+            CallbackStats &entry = stats[index];
+            entry.callCount++;
+            entry.totalMicros += elapsed;
+            if (elapsed > entry.maxMicros) {
+                entry.maxMicros = elapsed;
+            }
+            if (result) {
+                entry.lastTrueWakeCycle = CallbackStats::wakeCycle;
+            }
+        }
+
+        std::vector<CallbackStats> stats; //!< Statistics, same indexes as the callbacks
+        bool statsEnabled = false; //!< Collect execution time statistics
+    };
+
     /**
      * @brief Base class for a list of zero or more callback functions
      * 
@@ -153,17 +441,43 @@ public:
      * Callbacks can have different parameters, and this template allows the parameters to be specified.
      */
     template<class... Types>
-    class AppCallback {
+    class AppCallback : public AppCallbackStatsList {
     public:
+        /**
+         * @brief Type of the callback functions, stored inline without heap allocation
+         */
+        typedef InlineFunction<bool(Types...)> Function;
+
         /**
          * @brief Adds a callback function. Zero or more callbacks can be defined.
          * 
-         * @param callback 
+         * @param callback A lambda, function, or std::function
+         * @param name Name to identify the callback in statistics (optional). Must be a string that 
+         * remains valid, such as a string constant.
          * 
          * The callback always returns a bool, but the parameters are defined by the template.
+         * 
+         * The callback is stored in an InlineFunction, so a lambda with too many captures is a
+         * compile error instead of a heap allocation.
+         */
+        template<class F>
+        void add(F &&callback, const char *name = nullptr) {
+            callbackFunctions.push_back(Function(std::forward<F>(callback)));
+            stats.push_back(CallbackStats());
+            stats.back().name = name;
+        }
+
+        /**
+         * @brief Preallocate space for callbacks so adding up to count callbacks does not allocate
+         * 
+         * @param count Number of callbacks
+         * 
+         * Since removeAll() keeps the allocated space, a list of one-time callbacks that is
+         * cleared and refilled every wake cycle only allocates the first time.
          */
-        void add(std::function<bool(Types... args)> callback) {
-            callbackFunctions.push_back(callback);
+        void reserve(size_t count) {
+            callbackFunctions.reserve(count);
+            stats.reserve(count);
         }
 
         /**
@@ -174,8 +488,8 @@ public:
          * The bool result is ignored when using forEach.
          */
         void forEach(Types... args) {
-            for(auto it = callbackFunctions.begin(); it != callbackFunctions.end(); ++it) {
-                (*it)(args...);
+            for(size_t ii = 0; ii < callbackFunctions.size(); ii++) {
+                call(ii, args...);
             }
         }
 
@@ -191,8 +505,8 @@ public:
          */
         bool untilTrue(bool defaultResult, Types... args) {
             bool res = defaultResult;
-            for(auto it = callbackFunctions.begin(); it != callbackFunctions.end(); ++it) {
-                res = (*it)(args...);
+            for(size_t ii = 0; ii < callbackFunctions.size(); ii++) {
+                res = call(ii, args...);
                 if (res) {
                     break;
                 }
@@ -211,8 +525,8 @@ public:
         bool whileAnyTrue(bool defaultResult, Types... args) {
             bool finalRes = defaultResult;
 
-            for(auto it = callbackFunctions.begin(); it != callbackFunctions.end(); ++it) {
-                bool res = (*it)(args...);
+            for(size_t ii = 0; ii < callbackFunctions.size(); ii++) {
+                bool res = call(ii, args...);
                 if (res) {
                     finalRes = true;
                 }
@@ -232,8 +546,8 @@ public:
          */
         bool untilFalse(bool defaultResult, Types... args) {
             bool res = defaultResult;
-            for(auto it = callbackFunctions.begin(); it != callbackFunctions.end(); ++it) {
-                res = (*it)(args...);
+            for(size_t ii = 0; ii < callbackFunctions.size(); ii++) {
+                res = call(ii, args...);
                 if (!res) {
                     break;
                 }
@@ -251,8 +565,8 @@ public:
          */
         bool whileAnyFalse(bool defaultResult, Types... args) {
             bool finalRes = defaultResult;
-            for(auto it = callbackFunctions.begin(); it != callbackFunctions.end(); ++it) {
-                bool res = (*it)(args...);
+            for(size_t ii = 0; ii < callbackFunctions.size(); ii++) {
+                bool res = call(ii, args...);
                 if (!res) {
                     finalRes = res;
                 }
@@ -269,12 +583,38 @@ public:
          */
         void removeAll() {
             callbackFunctions.clear();
+            stats.clear();
+        }
+
+        /**
+         * @brief Call a callback, recording statistics if enabled
+         * 
+         * @param index Index of the callback in callbackFunctions
+         * @param args 
+         * @return The value returned by the callback
+         */
+        bool call(size_t index, Types... args) {
+            if (!statsEnabled) {
+                return callbackFunctions[index](args...);
+            }
+            unsigned long start = micros();
+            bool res = callbackFunctions[index](args...);
+            recordCall(index, start, res);
+            return res;
         }
 
+        /**
+         * @brief Returns true if there are no callbacks registered
+         * 
+         * @return true No callbacks registered
+         * @return false At least one callback is registered
+         */
+        bool isEmpty() const { return callbackFunctions.empty(); };
+
         /**
          * @brief Vector of all callbacks, limited only by available RAM.
          */
-        std::vector<std::function<bool(Types... args)>> callbackFunctions;
+        std::vector<Function> callbackFunctions;
     };
 
     /**
@@ -285,14 +625,189 @@ public:
      * 
      * Since callbacks are typically never removed, you can put an allocated pointer
      * in the callbackData field.
+     * 
+     * A callback can also behave like a cooperative task by returning the result of yield(), 
+     * sleepFor(), sleepUntil(), or waitUntil(). The callback is not called again until it is
+     * ready, and SleepHelper can use the time until the next callback is ready to wait in
+     * low-power mode instead of polling, see withIdleWait().
+     * 
+     * ```
+     * return state.sleepFor(500, 2); // Resume in state 2 in 500 milliseconds
+     * ```
      */
     class AppCallbackState {
     public:
         static const int CALLBACK_STATE_START = -1; //!< The callback has just started this wake cycle
         static const int CALLBACK_START_RETURNED_FALSE = -2; //!< The callback return false and should not be called again for this wake cycle
+        static const system_tick_t WAIT_POLL_MS = 100; //!< Default interval to check the condition for waitUntil()
+
+        /**
+         * @brief Run the callback again on the next loop, optionally changing state
+         * 
+         * @param nextState The state to resume in, or the current state if omitted
+         * @return true Always returns true so it can be returned from the callback
+         */
+        bool yield(int nextState) {
+            callbackState = nextState;
+            return yield();
+        }
+
+        /**
+         * @brief Run the callback again on the next loop
+         * 
+         * @return true Always returns true so it can be returned from the callback
+         */
+        bool yield() {
+            resumePending = false;
+            waitCondition.reset();
+            return true;
+        }
+
+        /**
+         * @brief Don't run the callback again until ms milliseconds after it was called
+         * 
+         * @param ms Number of milliseconds to wait
+         * @param nextState The state to resume in, or the current state if omitted
+         * @return true Always returns true so it can be returned from the callback
+         */
+        bool sleepFor(system_tick_t ms, int nextState) {
+            callbackState = nextState;
+            return sleepFor(ms);
+        }
+
+        /**
+         * @brief Don't run the callback again until ms milliseconds after it was called
+         * 
+         * @param ms Number of milliseconds to wait
+         * @return true Always returns true so it can be returned from the callback
+         */
+        bool sleepFor(system_tick_t ms) {
+            return sleepUntil(callMillis + ms);
+        }
+
+        /**
+         * @brief Don't run the callback again until millis() reaches deadline
+         * 
+         * @param deadline The millis() value to resume at
+         * @param nextState The state to resume in, or the current state if omitted
+         * @return true Always returns true so it can be returned from the callback
+         */
+        bool sleepUntil(system_tick_t deadline, int nextState) {
+            callbackState = nextState;
+            return sleepUntil(deadline);
+        }
+
+        /**
+         * @brief Don't run the callback again until millis() reaches deadline
+         * 
+         * @param deadline The millis() value to resume at
+         * @return true Always returns true so it can be returned from the callback
+         */
+        bool sleepUntil(system_tick_t deadline) {
+            waitCondition.reset();
+            resumeMillis = deadline;
+            resumePending = true;
+            return true;
+        }
+
+        /**
+         * @brief Don't run the callback again until condition returns true
+         * 
+         * @param condition Function or lambda returning bool, must be small enough for InlineFunction
+         * @param nextState The state to resume in
+         * @param pollMs How often to check the condition, which limits how long a low-power wait can be
+         * @return true Always returns true so it can be returned from the callback
+         * 
+         * The condition should be fast, such as checking a flag set from an interrupt or another thread.
+         */
+        template<class F>
+        bool waitUntil(F &&condition, int nextState, system_tick_t pollMs = WAIT_POLL_MS) {
+            callbackState = nextState;
+            waitCondition = InlineFunction<bool()>(std::forward<F>(condition));
+            waitPollMs = pollMs;
+            resumeMillis = callMillis + pollMs;
+            resumePending = true;
+            return true;
+        }
+
+        /**
+         * @brief Returns true if the callback is waiting because of sleepFor(), sleepUntil(), or waitUntil()
+         */
+        bool isWaiting() const { return resumePending; };
+
+        /**
+         * @brief Check whether the callback should be called now
+         * 
+         * @param now The current millis() value
+         * @return true The callback should be called
+         * @return false The callback is still sleeping or waiting for its condition
+         * 
+         * If waiting for a condition and the condition is not met, the next poll time is updated.
+         */
+        bool checkReady(system_tick_t now) {
+            if (!resumePending) {
+                return true;
+            }
+            if (waitCondition) {
+                if (waitCondition()) {
+                    return yield();
+                }
+                resumeMillis = now + waitPollMs;
+                return false;
+            }
+            if ((int32_t)(now - resumeMillis) >= 0) {
+                return yield();
+            }
+            return false;
+        }
+
+        /**
+         * @brief Returns the number of milliseconds until the callback should be checked again
+         * 
+         * @param now The current millis() value
+         * @return system_tick_t 0 if the callback is ready now
+         */
+        system_tick_t getMillisUntilReady(system_tick_t now) const {
+            if (!resumePending || (int32_t)(now - resumeMillis) >= 0) {
+                return 0;
+            }
+            return resumeMillis - now;
+        }
 
         int callbackState = CALLBACK_STATE_START; //!< The current state of this callback
         void *callbackData = 0; //!< Callback can store data here
+        system_tick_t callMillis = 0; //!< millis() value when the callback was called, used by sleepFor()
+        system_tick_t resumeMillis = 0; //!< millis() value to resume at, or to check waitCondition again
+        system_tick_t waitPollMs = WAIT_POLL_MS; //!< Interval to check waitCondition
+        bool resumePending = false; //!< True if waiting for resumeMillis or waitCondition
+        /**
+         * @brief Lock a resource while the callback is running
+         * 
+         * @tparam L Type of the resource, which must have lock() and unlock() methods, such as 
+         * TwoWire, std::recursive_mutex, or SleepHelperRecursiveMutex
+         * @param resource The resource, which must remain valid. It's also used as the lockGroup.
+         * 
+         * The resource is locked during each call to the callback, so other code that locks it is 
+         * excluded too, not just other callbacks in the same lockGroup. It's not locked between calls,
+         * such as while the callback is waiting after sleepFor() or waitUntil().
+         */
+        template<class L>
+        void setLockResource(L &resource) {
+            lockGroup = &resource;
+            lockFunction = [](const void *lockGroup, bool lock) {
+                L *resource = const_cast<L *>(static_cast<const L *>(lockGroup));
+                if (lock) {
+                    resource->lock();
+                }
+                else {
+                    resource->unlock();
+                }
+            };
+        }
+
+        InlineFunction<bool()> waitCondition; //!< Condition set by waitUntil(), empty when not used
+        const void *lockGroup = nullptr; //!< Callbacks with the same non-null lockGroup never run at the same time on worker threads, see DataCaptureWorkers
+        void (*lockFunction)(const void *lockGroup, bool lock) = nullptr; //!< Locks or unlocks lockGroup around each call, set by setLockResource()
     };
 
     /**
@@ -301,18 +816,39 @@ public:
      * This is used by data capture functions.
      */
     template<class... Types>
-    class AppCallbackWithState {
+    class AppCallbackWithState : public AppCallbackStatsList {
     public: 
+        /**
+         * @brief Type of the callback functions, stored inline without heap allocation
+         */
+        typedef InlineFunction<bool(AppCallbackState &, Types...)> Function;
+
         /**
          * @brief Adds a callback function. Zero or more callbacks can be defined.
          * 
-         * @param callback 
+         * @param callback A lambda, function, or std::function
+         * @param name Name to identify the callback in statistics (optional). Must be a string that 
+         * remains valid, such as a string constant.
          * 
          * The callback always returns a bool, but the parameters are defined by the template.
          */
-        void add(std::function<bool(AppCallbackState &, Types... args)> callback) {
-            callbackFunctions.push_back(callback);
+        template<class F>
+        void add(F &&callback, const char *name = nullptr) {
+            callbackFunctions.push_back(Function(std::forward<F>(callback)));
             callbackState.push_back(AppCallbackState());
+            stats.push_back(CallbackStats());
+            stats.back().name = name;
+        }
+
+        /**
+         * @brief Preallocate space for callbacks so adding up to count callbacks does not allocate
+         * 
+         * @param count Number of callbacks
+         */
+        void reserve(size_t count) {
+            callbackFunctions.reserve(count);
+            callbackState.reserve(count);
+            stats.reserve(count);
         }
 
         /**
@@ -325,6 +861,7 @@ public:
         void setState(int newState) {
             for(auto it = callbackState.begin(); it != callbackState.end(); ++it) {
                 it->callbackState = newState;
+                it->yield();
             }
         }
 
@@ -348,33 +885,106 @@ public:
          * Once all callbacks return false, this function returns false.
          */
         bool whileAnyTrue(Types... args) {
-            bool finalRes = false;
+            return whileAnyTrueAt(millis(), args...);
+        }
 
-            for(auto it = callbackState.begin(), it2 = callbackFunctions.begin(); it != callbackState.end(); ++it, ++it2) {
-                if (it->callbackState != AppCallbackState::CALLBACK_START_RETURNED_FALSE) {
+        /**
+         * @brief Works like whileAnyTrue() but the current millis() value is passed in
+         * 
+         * @param now The millis() value. Used for sleepFor(), sleepUntil(), and waitUntil().
+         * @param args Parameters to pass to the callbacks
+         * @return true Call this function again, as not all callbacks are done for this wake cycle.
+         * @return false All callbacks are done
+         * 
+         * Callbacks that are sleeping or waiting are not called, but still count as returning true.
+         */
+        bool whileAnyTrueAt(system_tick_t now, Types... args) {
+            bool finalRes = false;
 
-                    bool res = (*it2)(*it, args...);
-                    if (res) {
-                        finalRes = true;
-                    }
-                    else {
-                        it->callbackState = AppCallbackState::CALLBACK_START_RETURNED_FALSE;
-                    }
+            for(size_t ii = 0; ii < callbackFunctions.size(); ii++) {
+                if (callAt(ii, now, args...)) {
+                    finalRes = true;
                 }
             }
             return finalRes;
         }
 
         /**
-         * @brief Returns true if there are no callbacks registered
+         * @brief Calls a single callback if it is not done and is ready
          * 
-         * @return true No callbacks registered
-         * @return false At least one callback is registered
+         * @param index Index of the callback (0 = first added)
+         * @param now The millis() value
+         * @param args Parameters to pass to the callback
+         * @return true The callback needs to be called again this wake cycle, or is sleeping or waiting
+         * @return false The callback is done for this wake cycle
+         * 
+         * Only one thread at a time may call this for a given index. This is used by whileAnyTrueAt() and 
+         * DataCaptureWorkers.
          */
-        bool isEmpty() const { return callbackFunctions.empty(); };
-
-        std::vector<std::function<bool(AppCallbackState &, Types... args)>> callbackFunctions; //!< The callback functions
-        std::vector<AppCallbackState> callbackState; //!< The state for the callback functions. The array indexes match callbackFunctions.
+        bool callAt(size_t index, system_tick_t now, Types... args) {
+            AppCallbackState &state = callbackState[index];
+            if (state.callbackState == AppCallbackState::CALLBACK_START_RETURNED_FALSE) {
+                return false;
+            }
+            if (!state.checkReady(now)) {
+                return true;
+            }
+            state.callMillis = now;
+
+            if (state.lockFunction) {
+                state.lockFunction(state.lockGroup, true);
+            }
+            bool res;
+            if (statsEnabled) {
+                unsigned long start = micros();
+                res = callbackFunctions[index](state, args...);
+                recordCall(index, start, res);
+            }
+            else {
+                res = callbackFunctions[index](state, args...);
+            }
+            if (state.lockFunction) {
+                state.lockFunction(state.lockGroup, false);
+            }
+            if (!res) {
+                state.callbackState = AppCallbackState::CALLBACK_START_RETURNED_FALSE;
+                state.yield();
+            }
+            return res;
+        }
+
+        /**
+         * @brief Returns the number of milliseconds until any callback needs to be called
+         * 
+         * @param now The millis() value
+         * @return system_tick_t 0 if any callback is ready to run now, 0xffffffff if all callbacks are done
+         * 
+         * This is used to wait in low-power mode instead of calling whileAnyTrue() on every loop.
+         */
+        system_tick_t getMillisUntilReady(system_tick_t now) const {
+            system_tick_t result = 0xffffffff;
+
+            for(auto it = callbackState.begin(); it != callbackState.end(); ++it) {
+                if (it->callbackState != AppCallbackState::CALLBACK_START_RETURNED_FALSE) {
+                    system_tick_t ms = it->getMillisUntilReady(now);
+                    if (ms < result) {
+                        result = ms;
+                    }
+                }
+            }
+            return result;
+        }
+
+        /**
+         * @brief Returns true if there are no callbacks registered
+         * 
+         * @return true No callbacks registered
+         * @return false At least one callback is registered
+         */
+        bool isEmpty() const { return callbackFunctions.empty(); };
+
+        std::vector<Function> callbackFunctions; //!< The callback functions
+        std::vector<AppCallbackState> callbackState; //!< The state for the callback functions. The array indexes match callbackFunctions.
 
     };
 
@@ -427,13 +1037,28 @@ public:
          * Return true from the function in all cases.
          */
         bool shouldConnect() {
-            int maxConnectConviction = 0;
-            int maxNoConnectConviction = 0;
+            int maxConnectConviction;
+            int maxNoConnectConviction;
+
+            getConvictions(maxConnectConviction, maxNoConnectConviction);
+
+            return (maxConnectConviction >= maxNoConnectConviction);
+        }
+
+        /**
+         * @brief Call all of the shouldConnect functions and return the maximum convictions
+         * 
+         * @param maxConnectConviction Filled in with the highest connectConviction (0 if none)
+         * @param maxNoConnectConviction Filled in with the highest noConnectConviction (0 if none)
+         */
+        void getConvictions(int &maxConnectConviction, int &maxNoConnectConviction) {
+            maxConnectConviction = 0;
+            maxNoConnectConviction = 0;
 
-            for(auto it = callbackFunctions.begin(); it != callbackFunctions.end(); ++it) {
+            for(size_t ii = 0; ii < callbackFunctions.size(); ii++) {
                 int connectConviction = 0;
                 int noConnectConviction = 0;
-                (*it)(connectConviction, noConnectConviction);
+                call(ii, connectConviction, noConnectConviction);
                 if (connectConviction > maxConnectConviction) {
                     maxConnectConviction = connectConviction;
                 }
@@ -441,11 +1066,136 @@ public:
                     maxNoConnectConviction = noConnectConviction;
                 }
             }
-
-            return (maxConnectConviction >= maxNoConnectConviction);
         }
     };
 
+    /**
+     * @brief Pool of worker threads that runs data capture callbacks in parallel
+     * 
+     * This is used by withParallelDataCapture(). Instead of calling the data capture callbacks 
+     * from loop(), each callback is run on a worker thread, which calls it until it returns false. 
+     * A callback that blocks, such as waiting for a slow sensor conversion, then only delays itself.
+     * 
+     * Callbacks with the same AppCallbackState::lockGroup are run one after another on the same 
+     * worker, so callbacks that share a bus such as I2C are never run at the same time. This does
+     * not lock the bus against other code unless the callback was registered with a lock resource,
+     * see AppCallbackState::setLockResource().
+     * 
+     * On device, Device OS threads are used. For UNITTEST, std::thread is used. The threads are
+     * created on the first call to start(), not from the constructor, so the object can be created
+     * from a global constructor.
+     */
+    class DataCaptureWorkers {
+    public:
+        /**
+         * @brief Constructor
+         * 
+         * @param numWorkers Number of worker threads
+         * @param stackSize Stack size for each worker thread in bytes (ignored for UNITTEST)
+         */
+        DataCaptureWorkers(size_t numWorkers, size_t stackSize = 3072);
+
+        /**
+         * @brief Destructor. Waits for running callbacks to finish and stops the worker threads.
+         */
+        virtual ~DataCaptureWorkers();
+
+        /**
+         * @brief This class is not copyable
+         */
+        DataCaptureWorkers(const DataCaptureWorkers&) = delete;
+
+        /**
+         * @brief This class is not copyable
+         */
+        DataCaptureWorkers& operator=(const DataCaptureWorkers&) = delete;
+
+        /**
+         * @brief Start running callbacks on the worker threads
+         * 
+         * @param callbacks The callbacks to run. setStartState() should be called first.
+         * @return true The callbacks were started
+         * @return false The previous callbacks are still running
+         * 
+         * This returns immediately. Use isBusy() to find out when all of the callbacks have returned false.
+         * The calling thread must not call the callbacks or change their state until then.
+         */
+        bool start(AppCallbackWithState<> &callbacks);
+
+        /**
+         * @brief Returns true if callbacks are still running on worker threads
+         */
+        bool isBusy() const { return jobsRemaining.load() != 0; };
+
+        /**
+         * @brief Block until all of the callbacks have returned false
+         */
+        void join();
+
+        /**
+         * @brief Get the number of worker threads
+         */
+        size_t getNumWorkers() const { return numWorkers; };
+
+    protected:
+        /**
+         * @brief Creates the queue and worker threads, if not already created
+         * 
+         * @param queueSize Minimum number of jobs the queue needs to hold
+         */
+        void startThreads(size_t queueSize);
+
+        /**
+         * @brief Worker thread function. Runs jobs until a negative job index is taken from the queue.
+         */
+        void workerThread();
+
+        /**
+         * @brief Calls each callback in a job until it returns false
+         * 
+         * @param jobIndex Index into jobs
+         */
+        void runJob(int jobIndex);
+
+        /**
+         * @brief Add a job index to the queue
+         * 
+         * @param jobIndex Index into jobs, or -1 to stop a worker
+         * @return true if queued, false if the queue was full
+         */
+        bool putJob(int jobIndex);
+
+        /**
+         * @brief Wait for a job index from the queue
+         * 
+         * @return int The job index, or -1 to stop the worker
+         */
+        int takeJob();
+
+        /**
+         * @brief Delay the current thread
+         * 
+         * @param ms Milliseconds to delay
+         */
+        static void delayMs(system_tick_t ms);
+
+        size_t numWorkers; //!< Number of worker threads
+        size_t stackSize; //!< Stack size for worker threads
+        AppCallbackWithState<> *callbacks = nullptr; //!< Callbacks being run, set by start()
+        std::vector<std::vector<size_t>> jobs; //!< Each job is a list of callback indexes to run in order
+        std::atomic<int> jobsRemaining; //!< Number of jobs not yet finished
+#ifndef UNITTEST
+        std::vector<Thread *> threads; //!< Worker threads
+        os_queue_t queue = 0; //!< Queue of job indexes
+        size_t queueSize = 0; //!< Number of entries in queue
+#else
+        std::vector<std::thread> threads; //!< Worker threads
+        std::mutex queueMutex; //!< Protects queue
+        std::condition_variable queueCondition; //!< Signalled when a job is added to queue
+        std::deque<int> queue; //!< Queue of job indexes
+#endif
+    };
+
     #if HAL_PLATFORM_FILESYSTEM || defined(UNITTEST)
     /**
      * @brief Class for managing the SleepHelper settings file
@@ -470,7 +1220,11 @@ public:
         /**
          * @brief Destructor
          */
-        virtual ~SettingsFile() {};
+        virtual ~SettingsFile() {
+            for(auto it = partitions.begin(); it != partitions.end(); ++it) {
+                delete it->settings;
+            }
+        };
 
         /**
          * @brief Sets the path to the settings file on the file system
@@ -495,727 +1249,3253 @@ public:
         }
 
         /**
-         * @brief Register a function to be called when a settings value is changed
+         * @brief Maximum size of the settings in bytes (default: 16384)
          * 
-         * @param fn a function or lamba to call
+         * @param maxSize Maximum size in bytes
          * @return SettingsFile& 
+         * 
+         * The buffer holding the settings is sized from the settings file when loaded and grows
+         * as values are added, but never beyond this size. Changes that would exceed it fail, 
+         * and a settings file larger than this is treated as invalid.
          */
-        SettingsFile &withSettingChangeFunction(std::function<bool(const char *)> fn) { 
-            settingChangeFunctions.add(fn);
+        SettingsFile &withMaxSize(size_t maxSize) {
+            this->maxSize = maxSize;
             return *this;
         }
+
         /**
-         * @brief Initialize this object for use in SleepHelper
+         * @brief Allocation increment when growing the settings buffer (default: 256)
          * 
-         * This is used from SleepHeler::setup(). You should not use this if you are creating your
-         * own SettingsFile object; this is only used to hook this class into SleepHelper/
+         * @param pageSize Size in bytes
+         * @return SettingsFile& 
+         * 
+         * Growing in pages instead of exactly to size reduces the number of reallocations
+         * when adding several values.
          */
-        void setup();
+        SettingsFile &withPageSize(size_t pageSize) {
+            this->pageSize = pageSize;
+            return *this;
+        }
+
+        static const int SETTING_TYPE_INT = 0; //!< SettingDef type for int values
+        static const int SETTING_TYPE_DOUBLE = 1; //!< SettingDef type for double values
+        static const int SETTING_TYPE_BOOL = 2; //!< SettingDef type for bool values
+        static const int SETTING_TYPE_STRING = 3; //!< SettingDef type for string values
 
         /**
-         * @brief Load the settings file. You normally do not need to call this; it will be loaded automatically.
+         * @brief Definition of a setting in a schema. Use IntSetting, DoubleSetting, BoolSetting, or StringSetting.
          * 
-         * @return true 
-         * @return false 
+         * These are designed to be declared constexpr so the schema is stored in flash.
          */
-        bool load();
+        class SettingDef {
+        public:
+            /**
+             * @brief Constructor, normally called from the typed subclass
+             */
+            constexpr SettingDef(const char *key, int type, double defaultNumber, const char *defaultString, double minValue, double maxValue) :
+                key(key), type(type), defaultNumber(defaultNumber), defaultString(defaultString), minValue(minValue), maxValue(maxValue) {}
+
+            const char *key; //!< Key name
+            int type; //!< One of the SETTING_TYPE constants
+            double defaultNumber; //!< Default value for int, double, and bool (0 or 1) settings
+            const char *defaultString; //!< Default value for string settings
+            double minValue; //!< Minimum value for int and double settings
+            double maxValue; //!< Maximum value for int and double settings, maximum length for string settings (0 = no limit)
+        };
 
         /**
-         * @brief Save the settings file. You normally do not need to call this; it will be saved automatically.
-         * 
-         * @return true 
-         * @return false 
+         * @brief Schema definition of an int setting
          */
-        bool save();
-        
+        class IntSetting : public SettingDef {
+        public:
+            /**
+             * @brief Define an int setting
+             * 
+             * @param key Key name
+             * @param defaultValue Value if not set
+             * @param minValue Minimum allowed value (inclusive)
+             * @param maxValue Maximum allowed value (inclusive)
+             */
+            constexpr IntSetting(const char *key, int defaultValue, int minValue = std::numeric_limits<int>::min(), int maxValue = std::numeric_limits<int>::max()) :
+                SettingDef(key, SETTING_TYPE_INT, defaultValue, nullptr, minValue, maxValue) {}
+        };
+
         /**
-         * @brief Get a value from the settings file
+         * @brief Schema definition of a double setting
+         */
+        class DoubleSetting : public SettingDef {
+        public:
+            /**
+             * @brief Define a double setting
+             * 
+             * @param key Key name
+             * @param defaultValue Value if not set
+             * @param minValue Minimum allowed value (inclusive)
+             * @param maxValue Maximum allowed value (inclusive)
+             */
+            constexpr DoubleSetting(const char *key, double defaultValue, double minValue = std::numeric_limits<double>::lowest(), double maxValue = std::numeric_limits<double>::max()) :
+                SettingDef(key, SETTING_TYPE_DOUBLE, defaultValue, nullptr, minValue, maxValue) {}
+        };
+
+        /**
+         * @brief Schema definition of a bool setting
+         */
+        class BoolSetting : public SettingDef {
+        public:
+            /**
+             * @brief Define a bool setting
+             * 
+             * @param key Key name
+             * @param defaultValue Value if not set
+             */
+            constexpr BoolSetting(const char *key, bool defaultValue) :
+                SettingDef(key, SETTING_TYPE_BOOL, defaultValue ? 1 : 0, nullptr, 0, 1) {}
+        };
+
+        /**
+         * @brief Schema definition of a string setting
+         */
+        class StringSetting : public SettingDef {
+        public:
+            /**
+             * @brief Define a string setting
+             * 
+             * @param key Key name
+             * @param defaultValue Value if not set
+             * @param maxLength Maximum length in bytes, or 0 for no limit
+             */
+            constexpr StringSetting(const char *key, const char *defaultValue, size_t maxLength = 0) :
+                SettingDef(key, SETTING_TYPE_STRING, 0, defaultValue, 0, (double)maxLength) {}
+        };
+
+        /**
+         * @brief Use a schema to define the settings, their types, defaults, and bounds
          * 
-         * @tparam T 
-         * @param name 
-         * @param value 
-         * @return true 
-         * @return false 
+         * @param schema Array of pointers to constexpr IntSetting, DoubleSetting, BoolSetting, or StringSetting objects
+         * @param schemaCount Number of entries in schema
+         * @param schemaVersion Version of the schema. Increment this when changing the schema or default values.
+         * @return SettingsFile& 
          * 
-         * The values are cached in RAM, so this is normally fast. Note that you must request the same data type as 
-         * the original data in the JSON file - it does not coerce types.
+         * Default values from the schema are added to the settings on load without parsing JSON. The schema
+         * version is stored in the settings file, and if it matches on load, merging default values (including
+         * withDefaultValues()) is skipped.
+         * 
+         * setValuesJson() and updateValuesJson() reject the entire update if any value of a key in the
+         * schema has the wrong type or is out of bounds. Keys not in the schema are not checked.
          */
-    	template<class T>
-	    bool getValue(const char *name, T &value) const {
-            bool result = false;
-            WITH_LOCK(*this) {
-                result = parser.getOuterValueByKey(name, value);
-            };
-            return result;
+        SettingsFile &withSchema(const SettingDef * const *schema, size_t schemaCount, uint32_t schemaVersion) {
+            this->schema = schema;
+            this->schemaCount = schemaCount;
+            this->schemaVersion = schemaVersion;
+            return *this;
         }
 
         /**
-         * @brief Sets the value of a key to a bool, int, double, or String value
-         * 
-         * @tparam T 
-         * @param name 
-         * @param value 
-         * @return true 
-         * @return false
+         * @brief Use a schema to define the settings, their types, defaults, and bounds
          * 
-         * This call returns quickly if the value does not change and does not write to
-         * the file system if the value is unchanged.
-         * 
-         * You should use the same data type as was originally in the JSON data beacause
-         * the change detection does not coerce data types.
+         * @param schema Array of pointers to constexpr IntSetting, DoubleSetting, BoolSetting, or StringSetting objects
+         * @param schemaVersion Version of the schema. Increment this when changing the schema or default values.
+         * @return SettingsFile& 
          */
-    	template<class T>
-	    bool setValue(const char *name, const T &value) {
-            bool result = true;
-            bool changed = false;
+        template<size_t N>
+        SettingsFile &withSchema(const SettingDef * const (&schema)[N], uint32_t schemaVersion) {
+            return withSchema(schema, N, schemaVersion);
+        }
 
-            WITH_LOCK(*this) {
-                T oldValue;
-                bool getResult = parser.getOuterValueByKey(name, oldValue);
-                if (!getResult || oldValue != value) {
-                    JsonModifier modifier(parser);
+        /**
+         * @brief Get an int setting, or its default value if not set
+         */
+        int get(const IntSetting &setting) const {
+            int value = (int)setting.defaultNumber;
+            getValue(setting.key, value);
+            return value;
+        }
 
-                    modifier.insertOrUpdateKeyValue(parser.getOuterObject(), name, value);
-                    changed = true;
-                }
+        /**
+         * @brief Get a double setting, or its default value if not set
+         */
+        double get(const DoubleSetting &setting) const {
+            double value = setting.defaultNumber;
+            getValue(setting.key, value);
+            return value;
+        }
 
-            };
+        /**
+         * @brief Get a bool setting, or its default value if not set
+         */
+        bool get(const BoolSetting &setting) const {
+            bool value = (setting.defaultNumber != 0);
+            getValue(setting.key, value);
+            return value;
+        }
 
-            if (changed) {
-                settingChangeFunctions.forEach(name);
-                save();
+        /**
+         * @brief Get a string setting, or its default value if not set
+         */
+        String get(const StringSetting &setting) const {
+            String value;
+            if (!getValue(setting.key, value)) {
+                value = setting.defaultString;
             }
-            return result;
+            return value;
         }
 
         /**
-         * @brief Set the value of a key to a constant string
-         * 
-         * @param name 
-         * @param value 
-         * @return true 
-         * @return false 
+         * @brief Set an int setting
          * 
-         * This call returns quickly if the value does not change.
-         * 
-         * This specific overload is required because the templated version above can't get the
-         * value to see if it changed into a const char *. Making a copy of it in a string
-         * solves this issue.
+         * @return true if set, false if out of bounds
          */
-	    bool setValue(const char *name, const char *value) {
-            String tempStr(value);
-
-            return setValue(name, tempStr);
+        bool set(const IntSetting &setting, int value) {
+            if (value < setting.minValue || value > setting.maxValue) {
+                return false;
+            }
+            return setValue(setting.key, value);
         }
 
         /**
-         * @brief Set value to the specified JSON, replacing the existing settings. Calls update callbacks if necessary.
+         * @brief Set a double setting
          * 
-         * @param json 
-         * @return true 
-         * @return false 
+         * @return true if set, false if out of bounds
          */
-        bool setValuesJson(const char *json);
+        bool set(const DoubleSetting &setting, double value) {
+            if (value < setting.minValue || value > setting.maxValue) {
+                return false;
+            }
+            return setValue(setting.key, value);
+        }
 
         /**
-         * @brief Merges multiple values from JSON data into the settings. Calls update callbacks if necessary.
-         * 
-         * @param json 
-         * @return true 
-         * @return false 
-         * 
-         * This is a merge; values that are not included in json but already exist in the settings
-         * will be left unchanged.
+         * @brief Set a bool setting
          */
-        bool updateValuesJson(const char *json);
+        bool set(const BoolSetting &setting, bool value) {
+            return setValue(setting.key, value);
+        }
 
         /**
-         * @brief Merge in default values
-         * 
-         * @param inputJson 
-         * @return true 
-         * @return false 
+         * @brief Set a string setting
          * 
-         * This is like updateValuesJson but only updates the values from inputJson if the 
-         * value does not already exist in the settings. This allows the initial set of default
-         * settings to be created. It's also used on every load, so if you add a new default
-         * setting in defaultValues, then that value will be added to the settings.
+         * @return true if set, false if longer than the maximum length
          */
-        bool addDefaultValues(const char *inputJson);
+        bool set(const StringSetting &setting, const char *value) {
+            if (setting.maxValue > 0 && strlen(value) > setting.maxValue) {
+                return false;
+            }
+            return setValue(setting.key, value);
+        }
 
         /**
-         * @brief Get all of the current settings as a JSON string
+         * @brief Returns true if default values were merged on the last load(), false if skipped because the schema version matched
+         */
+        bool getDefaultsMergedOnLoad() const {
+            return defaultsMergedOnLoad;
+        }
+
+        /**
+         * @brief Register a function to be called when a settings value is changed
+         * 
+         * @param fn a function or lamba to call
+         * @return SettingsFile& 
+         */
+        template<class F>
+        SettingsFile &withSettingChangeFunction(F &&fn) {
+            settingChangeFunctions.add(std::forward<F>(fn));
+            return *this;
+        }
+
+        /**
+         * @brief Register a function to be called when a specific settings key, or keys with a prefix, change
+         * 
+         * @param key The key name, or a prefix followed by * to match all keys beginning with the prefix
+         * @param fn a function or lamba to call. It's passed the key that changed.
+         * @return SettingsFile& 
+         * 
+         * Subscriptions are stored in a hash table by key, so only the functions for the changed keys
+         * are called, instead of every setting change function for every key.
+         */
+        SettingsFile &withSettingChangeFunction(const char *key, std::function<bool(const char *)> fn);
+
+        /**
+         * @brief Register a function to be called once per update with all of the keys that changed
+         * 
+         * @param fn a function or lamba to call. It's passed a vector of the keys that changed.
+         * @return SettingsFile& 
+         * 
+         * A single call to setValuesJson(), updateValuesJson(), or commitTransaction() results
+         * in one call to this function, after the individual setting change functions.
+         */
+        template<class F>
+        SettingsFile &withSettingsBatchChangeFunction(F &&fn) {
+            batchChangeFunctions.add(std::forward<F>(fn));
+            return *this;
+        }
+        /**
+         * @brief Initialize this object for use in SleepHelper
+         * 
+         * This is used from SleepHeler::setup(). You should not use this if you are creating your
+         * own SettingsFile object; this is only used to hook this class into SleepHelper/
+         */
+        void setup();
+
+        /**
+         * @brief Load the settings file. You normally do not need to call this; it will be loaded automatically.
          * 
-         * @param json 
          * @return true 
          * @return false 
          * 
-         * If you are getting a single value you should use getValue instead. This method is used
-         * so the cloud can get all settings from a calculated variable.
+         * The file is validated using the size and hash stored in a separate file, with .meta appended
+         * to the path. If it's corrupted or missing, the previous version (path with .bak appended) is 
+         * used instead. If the stored hash matches
+         * the settings already in RAM, such as when load() is called again after saving, the file data 
+         * is not read or parsed again. This does not apply at boot, when nothing is in RAM yet, so the 
+         * file is always read, hashed, and parsed then.
          */
-        bool getValuesJson(String &json);
+        bool load();
 
-    protected:
         /**
-         * This class cannot be copied
+         * @brief Save the settings file. You normally do not need to call this; it will be saved automatically.
+         * 
+         * @return true 
+         * @return false 
+         * 
+         * The settings are written to a temporary file which is then renamed over the settings file, 
+         * so a reset during save leaves either the old or new version intact. The previous version is
+         * kept as a backup. The settings file only contains the JSON; the hash used to validate it is
+         * written to a .meta file next to it, so earlier versions and other tools can still read it.
+         * 
+         * If the journal is enabled with withJournal(), the changed values are appended to the
+         * journal instead, unless a compaction is needed.
          */
-        SettingsFile(const SettingsFile&) = delete;
+        bool save();
 
         /**
-         * This class cannot be copied
+         * @brief Append changes to a journal instead of rewriting the settings file on every save
+         * 
+         * @param maxJournalSize When the journal exceeds this size in bytes, it is compacted by writing
+         * the settings file and removing the journal (default: 2048). 0 disables the journal.
+         * @return SettingsFile& 
+         * 
+         * The journal is stored next to the settings file with .journal appended to the filename.
+         * Each save appends one line containing the keys that changed and their new values, and load()
+         * applies the journal to the settings file. setValuesJson(), which can remove keys, always 
+         * compacts.
          */
-        SettingsFile& operator=(const SettingsFile&) = delete;
+        SettingsFile &withJournal(size_t maxJournalSize = 2048) {
+            this->maxJournalSize = maxJournalSize;
+            return *this;
+        }
 
-        JsonParserStatic<particle::protocol::MAX_EVENT_DATA_LENGTH, 50> parser; //!< Parser for JSON data in settings file
+        /**
+         * @brief Write the settings file and remove the journal, if the journal is not empty
+         * 
+         * @param minJournalSize Only compact if the journal is at least this many bytes (default: 0, 
+         * compact if not empty). A compaction required by setValuesJson() or a schema change is 
+         * always done.
+         * @return true if the journal was compacted
+         * 
+         * This is done automatically when the journal exceeds the maximum size, and by SleepHelper
+         * before sleep when the journal is over half of the maximum size, but can be called whenever 
+         * the device is idle.
+         */
+        bool compactJournal(size_t minJournalSize = 0);
 
-        AppCallback<const char *> settingChangeFunctions; //!< Functions to call whenb settings change
-        String path; //!< Path to the settings file
-        const char *defaultValues = 0; //!< Default values for settings (not used with cloud-based settings)
-    };
-    #endif // HAL_PLATFORM_FILESYSTEM || defined(UNITTEST)
+        /**
+         * @brief Maximum journal size in bytes set by withJournal(), 0 if the journal is not enabled
+         */
+        size_t getMaxJournalSize() const {
+            return maxJournalSize;
+        }
 
-    #if HAL_PLATFORM_FILESYSTEM || defined(UNITTEST)
-    /**
-     * @brief Cloud-based settings
-     * 
-     * This is a specialized subclass of SettingsFile. It still stores JSON data in a file
-     * on the flash file system. However, it is designed to be used with the cloud as the
-     * source of truth. 
-     * 
-     * At specified times, the device will send up a 32-bit hash code of its current settings
-     * in a publish. If the cloud has a different version of the settings, it will send
-     * down a new configuration by Particle function call.
-     * 
-     * The new settings are designed to always fit in a single function payload, 1024 bytes
-     * on most Gen 3 devices, and the entire configuration is always sent to make sure the
-     * data and hash values match.
-     * 
-     * Because you cannot make local changes to settings, all of the set, update, and default
-     * settings methods of SettingsFile are hidden when using CloudSettingsFile.
-     */
-    class CloudSettingsFile : public SettingsFile {
-    public:
-        CloudSettingsFile() {
-        };
+        /**
+         * @brief Size of the journal file in bytes, 0 if empty or the journal is not enabled
+         */
+        size_t getJournalSize() const {
+            return journalSize;
+        }
 
         /**
-         * @brief Default values are never used with cloud settings, because the settings must originate from the cloud side
+         * @brief Get the number of bytes of RAM used for the settings buffer and parsed tokens
+         */
+        size_t getMemoryUsage() const;
+
+        /**
+         * @brief Get the number of JSON tokens in the settings
+         */
+        size_t getTokenCount() const;
+
+        /**
+         * @brief Returns true if the last load() used the backup file because the settings file was invalid
+         */
+        bool getLoadedFromBackup() const {
+            return loadedFromBackup;
+        }
+
+        /**
+         * @brief Get the hashed value of the current settings, used to check if they need to be updated
          * 
-         * @param defaultValues 
-         * @return SettingsFile& 
+         * @return uint32_t 
+         * 
+         * The hash combines a hash of each key and value in the outer object, so it does not depend
+         * on the order of keys or whitespace. It's cached and updated as settings are changed, so
+         * calling this is fast. Settings stored in partitions are not included.
          */
-        SettingsFile &withDefaultValues(const char *defaultValues) = delete;
+        uint32_t getHash() const;
 
         /**
-         * @brief You can never set a value when using cloud settings because the source of truth is always the cloud version
+         * @brief Get a hash of the bytes of the settings JSON, used to validate the settings file
+         * 
+         * @return uint32_t 
+         */
+        uint32_t getBufferHash() const;
+
+        /**
+         * @brief The hash seed used for settings file changes
+         */
+        static const uint32_t HASH_SEED = 0x5b4ffa05;
+
+        /**
+         * @brief Contents of the .meta file stored next to the settings file
+         */
+        struct SettingsFileMeta {
+            uint32_t magic; //!< SETTINGS_META_MAGIC
+            uint32_t size; //!< Size of the JSON data in the settings file
+            uint32_t hash; //!< Hash of the JSON data, same as getBufferHash()
+            uint32_t schemaVersion; //!< Schema version when saved, 0 if no schema
+        };
+
+        /**
+         * @brief Magic bytes for SettingsFileMeta
+         */
+        static const uint32_t SETTINGS_META_MAGIC = 0x2d5e94c6;
+        
+        /**
+         * @brief Get a value from the settings file
          * 
          * @tparam T 
          * @param name 
          * @param value 
          * @return true 
          * @return false 
+         * 
+         * The values are cached in RAM, so this is normally fast. Note that you must request the same data type as 
+         * the original data in the JSON file - it does not coerce types.
+         * 
+         * Keys are found using a hash index of the outer object, which is rebuilt on the first lookup
+         * after the settings change.
+         */
+    	template<class T>
+	    bool getValue(const char *name, T &value) const {
+            bool result = false;
+            if (!partitions.empty()) {
+                // Keys in a partition are read from the partition, the same as setValue(). Not locked 
+                // here, so the partition lock is never taken while holding this lock.
+                SettingsFile *partition = findPartition(name);
+                if (partition) {
+                    return partition->getValue(name, value);
+                }
+            }
+            WITH_LOCK(*this) {
+                const JsonParserGeneratorRK::jsmntok_t *valueToken = findValueToken(name);
+                if (valueToken) {
+                    result = parser.getTokenValue(valueToken, value);
+                }
+            };
+            return result;
+        }
+
+        /**
+         * @brief Bind a variable to a settings key so it's updated whenever the settings change
+         * 
+         * @tparam T bool, int, double, String, etc.
+         * @param name Key name
+         * @param variable Variable to update. Must remain valid for the life of this object.
+         * @return SettingsFile& 
+         * 
+         * The variable is set immediately if the key exists, and again after load and after any 
+         * change to the settings, before the setting change functions are called. If the key does
+         * not exist, the variable is left unchanged. This allows code that reads settings 
+         * frequently, such as from loop(), to read the variable directly without a lookup.
+         * 
+         * The variable is written with the settings locked, by the thread that changes the settings, 
+         * normally the application thread. Reading it without locking is only safe from that thread.
+         * From other threads, such as data capture functions with withParallelDataCapture(), use 
+         * getValue() or read the variable inside WITH_LOCK() on this object.
          */
         template<class T>
-	    bool setValue(const char *name, const T &value) = delete;
-        
+        SettingsFile &withBinding(const char *name, T &variable) {
+            String key(name);
+            std::function<void()> fn = [this, key, &variable]() {
+                getValue(key, variable);
+            };
+            WITH_LOCK(*this) {
+                bindings.push_back(fn);
+            }
+            fn();
+            return *this;
+        }
+
         /**
-         * @brief You can never set a value when using cloud settings because the source of truth is always the cloud version
+         * @brief Sets the value of a key to a bool, int, double, or String value
+         * 
+         * @tparam T 
+         * @param name 
+         * @param value 
+         * @return true 
+         * @return false
+         * 
+         * This call returns quickly if the value does not change and does not write to
+         * the file system if the value is unchanged.
+         * 
+         * You should use the same data type as was originally in the JSON data beacause
+         * the change detection does not coerce data types.
+         */
+    	template<class T>
+	    bool setValue(const char *name, const T &value) {
+            bool result = true;
+            bool changed = false;
+
+            if (!partitions.empty()) {
+                SettingsFile *partition = findPartition(name);
+                if (partition) {
+                    return partition->setValue(name, value);
+                }
+            }
+
+            WITH_LOCK(*this) {
+                T oldValue;
+                bool getResult = parser.getOuterValueByKey(name, oldValue);
+                if (!getResult || oldValue != value) {
+                    if (!reserve(strlen(name) + estimateJsonSize(value) + 8)) {
+                        return false;
+                    }
+                    bool hashValid = getCombinedHashValid();
+                    std::vector<uint32_t> oldHashes{getKeyValueHash(name)};
+
+                    JsonModifier modifier(parser);
+
+                    modifier.insertOrUpdateKeyValue(parser.getOuterObject(), name, value);
+                    contentChanged();
+                    updateCombinedHash(std::vector<String>{String(name)}, oldHashes, hashValid);
+                    changed = true;
+                }
+
+            };
+
+            if (changed) {
+                notifyChanged(std::vector<String>{String(name)});
+                if (!deferSave()) {
+                    save();
+                }
+            }
+            return result;
+        }
+
+        /**
+         * @brief Set the value of a key to a constant string
          * 
          * @param name 
          * @param value 
          * @return true 
          * @return false 
+         * 
+         * This call returns quickly if the value does not change.
+         * 
+         * This specific overload is required because the templated version above can't get the
+         * value to see if it changed into a const char *. Making a copy of it in a string
+         * solves this issue.
          */
-        bool setValue(const char *name, const char *value) = delete;
+	    bool setValue(const char *name, const char *value) {
+            String tempStr(value);
+
+            return setValue(name, tempStr);
+        }
 
         /**
-         * @brief Cloud settings must always exactly match the cloud version, so you only server setValueJson, not update
+         * @brief Set value to the specified JSON, replacing the existing settings. Calls update callbacks if necessary.
          * 
          * @param json 
          * @return true 
          * @return false 
+         * 
+         * Keys stored in a partition are merged into the partition instead; other keys in the
+         * partition are not removed. A key is only sent to a partition if it already exists
+         * there, normally from the partition's default values.
          */
-        bool updateValuesJson(const char *json) = delete;
+        bool setValuesJson(const char *json);
+
+        /**
+         * @brief Merges multiple values from JSON data into the settings. Calls update callbacks if necessary.
+         * 
+         * @param json 
+         * @return true 
+         * @return false 
+         * 
+         * This is a merge; values that are not included in json but already exist in the settings
+         * will be left unchanged.
+         */
+        bool updateValuesJson(const char *json);
+
+        /**
+         * @brief Merge in default values
+         * 
+         * @param inputJson 
+         * @return true 
+         * @return false 
+         * 
+         * This is like updateValuesJson but only updates the values from inputJson if the 
+         * value does not already exist in the settings. This allows the initial set of default
+         * settings to be created. It's also used on every load, so if you add a new default
+         * setting in defaultValues, then that value will be added to the settings.
+         */
+        bool addDefaultValues(const char *inputJson);
+
+        /**
+         * @brief Get all of the current settings as a JSON string
+         * 
+         * @param json 
+         * @return true 
+         * @return false 
+         * 
+         * If you are getting a single value you should use getValue instead. This method is used
+         * so the cloud can get all settings from a calculated variable.
+         */
+        bool getValuesJson(String &json);
+
+        /**
+         * @brief Read-only view of the settings JSON in the settings buffer, without copying
+         * 
+         * The settings object is locked for as long as the view exists, so keep it in a 
+         * limited scope and do not change settings while holding it.
+         */
+        class ValuesView {
+        public:
+            /**
+             * @brief Move constructor. The lock is transferred to the new view.
+             */
+            ValuesView(ValuesView &&other) : settings(other.settings), data(other.data), size(other.size) {
+                other.settings = nullptr;
+            }
+
+            /**
+             * @brief Destructor. Releases the lock on the settings.
+             */
+            ~ValuesView() {
+                if (settings) {
+                    settings->unlock();
+                }
+            }
+
+            /**
+             * @brief Pointer to the settings JSON, null terminated
+             */
+            const char *c_str() const {
+                return data;
+            }
+
+            /**
+             * @brief Length of the settings JSON in bytes, not including the null terminator
+             */
+            size_t length() const {
+                return size;
+            }
+
+        protected:
+            /**
+             * @brief Constructor, used from getValuesView()
+             */
+            ValuesView(const SettingsFile *settings, const char *data, size_t size) : settings(settings), data(data), size(size) {
+            }
+
+            /**
+             * This class cannot be copied
+             */
+            ValuesView(const ValuesView&) = delete;
+
+            /**
+             * This class cannot be copied
+             */
+            ValuesView& operator=(const ValuesView&) = delete;
+
+            const SettingsFile *settings; //!< Settings object that is locked, or nullptr if moved
+            const char *data; //!< Settings JSON
+            size_t size; //!< Length of data
+
+            friend class SettingsFile;
+        };
+
+        /**
+         * @brief Get a view of the settings JSON without copying it
+         * 
+         * @return ValuesView, which holds the lock on the settings until it is destroyed
+         * 
+         * The JSON can be passed directly to functions that take a const char *, as long as they
+         * don't block. Other threads that access the settings wait until the view is destroyed, so
+         * use copyValuesJson() instead for Particle.publish() or anything else that can block.
+         * 
+         * ```
+         * {
+         *     SleepHelper::SettingsFile::ValuesView view = settings.getValuesView();
+         *     Log.info("settings %s", view.c_str());
+         * }
+         * ```
+         */
+        ValuesView getValuesView();
+
+        /**
+         * @brief Copy the settings JSON into a buffer, such as a publish buffer
+         * 
+         * @param buf Buffer to copy to
+         * @param bufSize Size of buf in bytes. The copy is truncated and null terminated if it does not fit.
+         * @return size_t The length of the settings JSON, not including the null terminator. If 
+         * greater than or equal to bufSize, the output was truncated, like snprintf.
+         */
+        size_t copyValuesJson(char *buf, size_t bufSize);
+
+        /**
+         * @brief Write the settings as a JSON object to a JSONWriter
+         * 
+         * @param writer The writer, which must be positioned where a value is expected, such as
+         * after name() when writing an object
+         * @return true on success, false if there are no settings or a number could not be written exactly
+         * 
+         * The settings are written directly from the parsed tokens without creating a copy of the
+         * JSON. Numbers are written by value with the same number of decimal places, so exponent 
+         * notation is not preserved. If a number has more significant digits than a double can hold,
+         * it's written as null and false is returned; use copyValuesJson() for those settings.
+         */
+        bool writeValuesJson(JSONWriter &writer);
+
+        /**
+         * @brief Add a partition of the settings stored in its own file
+         * 
+         * @param name Partition name, used in the filename. For example, with a path of 
+         * /usr/sleepSettings.json and name "cal", the partition is stored in /usr/sleepSettings.cal.json.
+         * @return SettingsFile& The partition, which can be configured with withDefaultValues(), withSchema(), etc.
+         * 
+         * A partition has its own file, lock, and transactions, so values that change frequently
+         * can be saved without rewriting all of the other settings. The keys that exist in a partition,
+         * normally from its default values, are read and written through this object as well, and 
+         * changes to them call the setting change functions of both the partition and this object.
+         * All of the functions that set values send these keys to the partition, after checking 
+         * them against the schema of this object, and never store them in this object. Keys are 
+         * routed by whether they exist in the partition when they are set, so a key that is not in 
+         * the partition's default values or file yet is stored in this object instead.
+         * 
+         * getHash() and writeValuesJson() only include the settings in this object. Use 
+         * getMergedValuesJson() to get the settings from all partitions.
+         * 
+         * Add partitions during setup, before load(). Partitions are loaded by load() and cannot be removed.
+         */
+        SettingsFile &addPartition(const char *name);
+
+        /**
+         * @brief Get a partition added with addPartition()
+         * 
+         * @param name Partition name
+         * @return SettingsFile* The partition or NULL if there is no partition with that name
+         */
+        SettingsFile *getPartition(const char *name) const;
+
+        /**
+         * @brief Get the number of partitions added with addPartition()
+         */
+        size_t getPartitionCount() const {
+            return partitions.size();
+        }
+
+        /**
+         * @brief Get the settings in this object and all partitions as a single JSON object
+         * 
+         * @param json Filled in with the JSON object
+         * @return true on success
+         * 
+         * If a key exists in more than one place, the value from this object is used. Each 
+         * partition is locked only while it is being copied.
+         */
+        bool getMergedValuesJson(String &json);
+
+        /**
+         * @brief Begin a transaction to group multiple changes into a single save
+         * 
+         * Between beginTransaction() and commitTransaction(), setValue(), setValuesJson(),
+         * updateValuesJson(), and addDefaultValues() change the settings in RAM only. On
+         * commit, the file is saved once and the setting change functions are called once
+         * for each key that changed, after the save.
+         * 
+         * Transactions can be nested; only the outermost commitTransaction() saves. The 
+         * transaction applies to this object, not the calling thread.
+         */
+        void beginTransaction() {
+            WITH_LOCK(*this) {
+                transactionDepth++;
+            }
+        }
+
+        /**
+         * @brief Commit a transaction started with beginTransaction()
+         * 
+         * @return true if the settings were saved
+         */
+        bool commitTransaction();
+
+        /**
+         * @brief Returns true if a transaction is in progress
+         */
+        bool getInTransaction() const {
+            return transactionDepth > 0;
+        }
+
+        /**
+         * @brief Number of saves avoided by grouping changes in transactions since boot
+         */
+        uint32_t getSavesAvoided() const {
+            return savesAvoided;
+        }
+
+    protected:
+        /**
+         * @brief Key and value tokens in the outer object
+         */
+        struct KeyValueTokens {
+            const JsonParserGeneratorRK::jsmntok_t *key; //!< Key token
+            const JsonParserGeneratorRK::jsmntok_t *value; //!< Value token, may be an object or array
+        };
+
+        /**
+         * @brief Get all of the key/value pairs in the outer object in a single pass over the tokens
+         * 
+         * @param jp Parser, which must already have been parsed
+         * @param pairs Filled in with the key and value tokens, in order
+         */
+        static void getOuterKeyValueTokens(const JsonParser &jp, std::vector<KeyValueTokens> &pairs) {
+            getObjectKeyValueTokens(jp, jp.getOuterObject(), pairs);
+        }
+
+        /**
+         * @brief Get all of the key/value pairs in an object in a single pass over the tokens
+         * 
+         * @param jp Parser, which must already have been parsed
+         * @param object Object token in jp
+         * @param pairs Filled in with the key and value tokens, in order
+         */
+        static void getObjectKeyValueTokens(const JsonParser &jp, const JsonParserGeneratorRK::jsmntok_t *object, std::vector<KeyValueTokens> &pairs);
+
+        /**
+         * @brief Write a token, including any children, to a JSONWriter
+         * 
+         * @param writer The writer
+         * @param jp Parser containing the token
+         * @param token The token to write
+         * @param exact Set to false if a number could not be written exactly. It's written as null instead.
+         * @return Pointer to the token after token and its children
+         */
+        static const JsonParserGeneratorRK::jsmntok_t *writeToken(JSONWriter &writer, const JsonParser &jp, const JsonParserGeneratorRK::jsmntok_t *token, bool &exact);
+
+        /**
+         * @brief Write a JSON number so it reads back as the same value
+         * 
+         * @param writer The writer
+         * @param text The number from the JSON, null terminated
+         * @return true if written, false if the value can't be represented exactly as an int or double
+         * 
+         * Integers outside of the range of int and numbers with a fractional part are written as a 
+         * double with the number of decimal places in text. Numbers with more significant digits than
+         * a double can hold are not written.
+         */
+        static bool writeNumber(JSONWriter &writer, const char *text);
+
+        /**
+         * @brief Hash a key and its value, independent of whitespace
+         * 
+         * @param jp Parser, which must already have been parsed
+         * @param pair Key and value tokens in jp
+         * @return uint32_t 
+         */
+        static uint32_t getKeyValueHash(const JsonParser &jp, const KeyValueTokens &pair);
+
+        /**
+         * @brief Get the hash of a key and its value in the settings, or 0 if the key does not exist.
+         * Must be called with the lock held.
+         */
+        uint32_t getKeyValueHash(const char *key) const;
+
+        /**
+         * @brief After changing keys, update the cached hash from the previous hashes of those keys
+         * 
+         * @param keys Keys that changed
+         * @param oldHashes Result of getKeyValueHash() for each key before the change
+         * @param wasValid True if the cached hash was valid before the change
+         * 
+         * Must be called with the lock held, after contentChanged().
+         */
+        void updateCombinedHash(const std::vector<String> &keys, const std::vector<uint32_t> &oldHashes, bool wasValid);
+
+        /**
+         * @brief Returns true if combinedHash is valid for the current settings
+         */
+        bool getCombinedHashValid() const {
+            return combinedHashGeneration == contentGeneration;
+        }
+
+        /**
+         * @brief Append the JSON text of a token to a string, including quotes for strings
+         * 
+         * @param str String to append to
+         * @param jp Parser containing the token
+         * @param token Token to append
+         */
+        static void appendTokenJson(String &str, const JsonParser &jp, const JsonParserGeneratorRK::jsmntok_t *token);
+
+        /**
+         * @brief Merge values from JSON into the settings, writing the merged buffer once
+         * 
+         * @param inputJson JSON object to merge
+         * @param onlyMissing If true, only keys that do not exist are added (default values)
+         * @param updatedKeys Filled in with the keys that were added or changed
+         * @return true on success, false if inputJson is invalid or the result would exceed the maximum size
+         * 
+         * Changed values are replaced and new keys appended by copying into a new buffer, 
+         * which is parsed once, instead of one JsonModifier edit and reparse per key.
+         */
+        bool mergeValuesJson(const char *inputJson, bool onlyMissing, std::vector<String> &updatedKeys);
+
+        /**
+         * @brief Replace the settings in this object with JSON, not including partitions
+         * 
+         * @param inputJson JSON object
+         * @return true on success, false if inputJson is invalid, in which case the settings are unchanged
+         */
+        bool replaceValuesJson(const char *inputJson);
+
+        /**
+         * @brief Validate JSON against the schema of this object and split it by partition
+         * 
+         * @param inputJson JSON object
+         * @param ownJson Filled in with a JSON object of the keys that are not in a partition, "{}" if none
+         * @param partitionJson Filled in with a JSON object for each partition, in the order they were 
+         * added, or an empty string if there are no keys for that partition
+         * @return true on success, false if inputJson is not a valid object or fails validation
+         * 
+         * Must be called without holding the lock on this object.
+         */
+        bool splitPartitionJson(const char *inputJson, String &ownJson, std::vector<String> &partitionJson) const;
+
+        /**
+         * @brief Entry in the key index
+         */
+        struct IndexEntry {
+            uint32_t hash; //!< Hash of the key name
+            const JsonParserGeneratorRK::jsmntok_t *keyToken; //!< Key token, or NULL for an empty entry
+            const JsonParserGeneratorRK::jsmntok_t *valueToken; //!< Value token
+        };
+
+        /**
+         * @brief Find the value token for a key in the outer object using the index
+         * 
+         * @param name Key name
+         * @return Value token or NULL if the key does not exist
+         * 
+         * Must be called with the lock held.
+         */
+        const JsonParserGeneratorRK::jsmntok_t *findValueToken(const char *name) const;
+
+        /**
+         * @brief Find the index entry for a key in the outer object. Must be called with the lock held.
+         * 
+         * @param name Key name
+         * @return Index entry or NULL if the key does not exist
+         */
+        const IndexEntry *findIndexEntry(const char *name) const;
+
+        /**
+         * @brief Rebuild the key index from the parsed tokens. Must be called with the lock held.
+         */
+        void buildIndex() const;
+
+        /**
+         * @brief Call after the settings buffer has been modified and reparsed
+         * 
+         * Invalidates the key index and updates bound variables. Must be called with the lock held.
+         */
+        void contentChanged();
+
+        /**
+         * @brief Hash seed for key names in the index
+         */
+        static const uint32_t INDEX_HASH_SEED = 0x43f1a7d5;
+
+        /**
+         * @brief Find the schema definition for a key
+         * 
+         * @param key Key name, not null terminated
+         * @param keyLen Length of key
+         * @return Definition, or NULL if not in the schema
+         */
+        const SettingDef *findSchemaDef(const char *key, size_t keyLen) const;
+
+        /**
+         * @brief Check the values in parsed JSON against the schema
+         * 
+         * @param jp Parser containing a JSON object
+         * @return true if all values of keys in the schema have the correct type and are within bounds
+         */
+        bool validateJson(const JsonParser &jp) const;
+
+        /**
+         * @brief Check a value against its schema definition
+         * 
+         * @param def Schema definition
+         * @param jp Parser containing the value
+         * @param token Value token
+         * @return true if valid
+         */
+        static bool validateValue(const SettingDef &def, const JsonParser &jp, const JsonParserGeneratorRK::jsmntok_t *token);
+
+        /**
+         * @brief Add default values from the schema for keys that do not exist. Must be called with the lock held.
+         * 
+         * @param partitionKeys Schema keys that are stored in a partition, which are not added
+         * @return true if any values were added
+         * 
+         * The JSON for the defaults is generated from the schema and inserted into the buffer, which
+         * is parsed once.
+         */
+        bool addSchemaDefaults(const std::vector<String> &partitionKeys);
+
+        /**
+         * @brief Append the JSON for a key and default value from the schema
+         * 
+         * @param json String to append to
+         * @param def Schema definition
+         */
+        static void appendSchemaDefault(String &json, const SettingDef &def);
+
+        /**
+         * @brief Make sure there is room for additional bytes in the settings buffer
+         * 
+         * @param additional Number of bytes that will be added
+         * @return true if there is room, false if it would exceed the maximum size
+         * 
+         * JsonModifier only uses free space in the existing buffer, so this must be called
+         * before modifying the settings.
+         */
+        bool reserve(size_t additional);
+
+        /**
+         * @brief Estimated size of a value when formatted as JSON
+         */
+        template<class T>
+        static size_t estimateJsonSize(const T &value) {
+            return 24;
+        }
+
+        /**
+         * @brief Estimated size of a string value when formatted as JSON, allowing for escaping
+         */
+        static size_t estimateJsonSize(const String &value) {
+            return value.length() * 2 + 2;
+        }
+
+        /**
+         * @brief Load and validate a settings file into parser
+         * 
+         * @param filePath Path to the settings file or backup file
+         * @return true if the file was valid
+         * 
+         * Files without a .meta file, or with a size that does not match it, were written by earlier 
+         * versions or another tool. These are validated by parsing them.
+         */
+        bool loadFile(const char *filePath);
+
+        /**
+         * @brief Path to the .meta file for a settings file or backup file
+         */
+        static String getMetaPath(const char *filePath) {
+            return String(filePath) + ".meta";
+        }
+
+        /**
+         * @brief Write the settings file with a temporary file and rename
+         * 
+         * @return true on success
+         */
+        bool writeSnapshot();
+
+        /**
+         * @brief Append the values of the keys in journalKeys to the journal. Must be called with the lock held.
+         * 
+         * @return true if appended, false if the settings file must be written instead
+         */
+        bool appendJournal();
+
+        /**
+         * @brief Apply the journal to the settings loaded from the settings file. Must be called with the lock held.
+         */
+        void replayJournal();
+
+        /**
+         * @brief Path to the journal file
+         */
+        String getJournalPath() const {
+            return path + ".journal";
+        }
+
+        /**
+         * @brief Notify the setting change functions, or defer until commit if in a transaction
+         * 
+         * @param keys The keys that changed
+         */
+        void notifyChanged(const std::vector<String> &keys);
+
+        /**
+         * @brief Call the setting change functions for each key, then the batch change functions
+         * 
+         * @param keys The keys that changed
+         */
+        void dispatchChanges(const std::vector<String> &keys);
+
+        /**
+         * @brief Setting change function subscribed to a key or prefix
+         */
+        struct KeySubscription {
+            String key; //!< Key or prefix (without the *)
+            std::function<bool(const char *)> fn; //!< Function to call
+        };
+
+        /**
+         * @brief Hash a key or prefix for keyChangeFunctions and prefixChangeFunctions
+         */
+        static uint32_t keyHash(const char *key, size_t keyLen) {
+            return StorageHelperRK::murmur3_32((const uint8_t *)key, keyLen, INDEX_HASH_SEED);
+        }
+
+        /**
+         * @brief Find the partition that contains a key
+         * 
+         * @param name Key name
+         * @return SettingsFile* The partition or NULL if the key is not in a partition
+         * 
+         * Must be called without holding the lock on this object.
+         */
+        SettingsFile *findPartition(const char *name) const;
+
+        /**
+         * @brief Get the path to a partition file from the path of this file
+         * 
+         * @param name Partition name
+         * @return String The path with the name inserted before .json, or appended if there is no .json
+         */
+        String getPartitionPath(const char *name) const;
+
+        /**
+         * @brief Partition added with addPartition()
+         */
+        struct Partition {
+            String name; //!< Partition name
+            SettingsFile *settings; //!< Settings for the partition, owned by this object
+        };
+
+        /**
+         * @brief If a transaction is in progress, record that a save is needed on commit
+         * 
+         * @return true if in a transaction, false if the save should be done now
+         */
+        bool deferSave();
+
+        /**
+         * This class cannot be copied
+         */
+        SettingsFile(const SettingsFile&) = delete;
+
+        /**
+         * This class cannot be copied
+         */
+        SettingsFile& operator=(const SettingsFile&) = delete;
+
+        JsonParser parser; //!< Parser for JSON data in settings file, buffer and tokens are allocated as needed
+
+        AppCallback<const char *> settingChangeFunctions; //!< Functions to call whenb settings change
+        std::unordered_map<uint32_t, std::vector<KeySubscription>> keyChangeFunctions; //!< Functions for specific keys, by key hash
+        std::unordered_map<uint32_t, std::vector<KeySubscription>> prefixChangeFunctions; //!< Functions for key prefixes, by prefix hash
+        std::vector<size_t> prefixLengths; //!< Distinct lengths of the prefixes in prefixChangeFunctions
+        AppCallback<const std::vector<String> &> batchChangeFunctions; //!< Functions to call once per update
+        String path; //!< Path to the settings file
+        const char *defaultValues = 0; //!< Default values for settings (not used with cloud-based settings)
+        uint32_t fileHash = 0; //!< Hash of the settings in parser when last loaded or saved, 0 if not valid
+        bool loadedFromBackup = false; //!< The last load() used the backup file
+        size_t maxSize = 16384; //!< Maximum size of the settings buffer in bytes
+        size_t pageSize = 256; //!< Allocation increment for the settings buffer in bytes
+        const SettingDef * const *schema = nullptr; //!< Schema definitions, or nullptr if no schema
+        size_t schemaCount = 0; //!< Number of entries in schema
+        uint32_t schemaVersion = 0; //!< Version of schema
+        uint32_t loadedSchemaVersion = 0; //!< Schema version stored in the settings file when loaded
+        bool defaultsMergedOnLoad = false; //!< Default values were merged on the last load()
+        bool materializeDefaults = true; //!< Store schema defaults in the settings (false for cloud settings)
+
+        mutable std::vector<IndexEntry> index; //!< Open addressing hash table of keys, size is a power of 2
+        mutable bool indexValid = false; //!< index matches the parsed tokens
+        uint32_t contentGeneration = 0; //!< Incremented every time the settings change
+        mutable uint32_t combinedHash = 0; //!< XOR of getKeyValueHash() for all keys, valid if combinedHashGeneration == contentGeneration
+        mutable uint32_t combinedHashGeneration = 0xffffffff; //!< contentGeneration when combinedHash was last valid
+        std::vector<std::function<void()>> bindings; //!< Functions that update variables bound by withBinding()
+
+        int transactionDepth = 0; //!< Number of nested beginTransaction() calls
+        bool transactionNeedsSave = false; //!< A change was made during the transaction
+        std::vector<String> transactionKeys; //!< Keys changed during the transaction, in order, without duplicates
+        uint32_t savesAvoided = 0; //!< Number of saves avoided by transactions
+
+        size_t maxJournalSize = 0; //!< Compact the journal when it exceeds this size, 0 if the journal is not enabled
+        size_t journalSize = 0; //!< Size of the journal file in bytes
+        std::vector<String> journalKeys; //!< Keys changed since the last save, to write to the journal
+        bool journalNeedsCompact = false; //!< The next save must write the settings file
+
+        std::vector<Partition> partitions; //!< Partitions added with addPartition()
+        SettingsFile *parent = nullptr; //!< For a partition, the settings it was added to
+    };
+    #endif // HAL_PLATFORM_FILESYSTEM || defined(UNITTEST)
+
+    #if HAL_PLATFORM_FILESYSTEM || defined(UNITTEST)
+    /**
+     * @brief Cloud-based settings
+     * 
+     * This is a specialized subclass of SettingsFile. It still stores JSON data in a file
+     * on the flash file system. However, it is designed to be used with the cloud as the
+     * source of truth. 
+     * 
+     * At specified times, the device will send up a 32-bit hash code of its current settings
+     * in a publish. If the cloud has a different version of the settings, it will send
+     * down a new configuration by Particle function call.
+     * 
+     * The new settings are designed to always fit in a single function payload, 1024 bytes
+     * on most Gen 3 devices, and the entire configuration is always sent to make sure the
+     * data and hash values match.
+     * 
+     * Alternatively, the device can send a digest of per-key hashes (getDigestJson()) and the 
+     * cloud sends only the keys that differ (getDeltaJson(), applyDeltaJson()).
+     * 
+     * Because you cannot make local changes to settings, all of the set, update, and default
+     * settings methods of SettingsFile are hidden when using CloudSettingsFile.
+     */
+    class CloudSettingsFile : public SettingsFile {
+    public:
+        CloudSettingsFile() {
+            // Schema defaults are returned by get() but not stored, since the cloud version is the source of truth
+            materializeDefaults = false;
+        };
+
+        /**
+         * @brief You can never set a value when using cloud settings because the source of truth is always the cloud version
+         */
+        template<class S, class T>
+        bool set(const S &setting, const T &value) = delete;
+
+        /**
+         * @brief Default values are never used with cloud settings, because the settings must originate from the cloud side
+         * 
+         * @param defaultValues 
+         * @return SettingsFile& 
+         */
+        SettingsFile &withDefaultValues(const char *defaultValues) = delete;
+
+        /**
+         * @brief You can never set a value when using cloud settings because the source of truth is always the cloud version
+         * 
+         * @tparam T 
+         * @param name 
+         * @param value 
+         * @return true 
+         * @return false 
+         */
+        template<class T>
+	    bool setValue(const char *name, const T &value) = delete;
+        
+        /**
+         * @brief You can never set a value when using cloud settings because the source of truth is always the cloud version
+         * 
+         * @param name 
+         * @param value 
+         * @return true 
+         * @return false 
+         */
+        bool setValue(const char *name, const char *value) = delete;
+
+        /**
+         * @brief Cloud settings must always exactly match the cloud version, so you only server setValueJson, not update
+         * 
+         * @param json 
+         * @return true 
+         * @return false 
+         */
+        bool updateValuesJson(const char *json) = delete;
+
+        /**
+         * @brief Default values are never used with cloud settings
+         * 
+         * @param inputJson 
+         * @return true 
+         * @return false 
+         */
+        bool addDefaultValues(const char *inputJson) = delete;
+
+        /**
+         * @brief Partitions are not supported with cloud settings
+         * 
+         * The hash and digest must match the complete settings stored in the cloud, and 
+         * setValuesJson() must be able to remove any key, so the settings cannot be split 
+         * across files.
+         */
+        SettingsFile &addPartition(const char *name) = delete;
+
+        /**
+         * @brief Get a digest of the settings to send to the cloud for delta sync
+         * 
+         * @param json Filled in with the digest JSON
+         * @return true on success
+         * 
+         * The digest is a JSON object with a "b" member containing DIGEST_BUCKETS 32-bit bucket 
+         * hashes as hex. Each key is assigned to a bucket by a hash of its name, and the bucket 
+         * hash is the XOR of a hash of each key and value in the bucket, so it does not depend on
+         * key order. The digest is recalculated only after the settings change.
+         */
+        bool getDigestJson(String &json) const;
+
+        /**
+         * @brief Get the digest bucket hashes
+         * 
+         * @param buckets Array of DIGEST_BUCKETS values to fill in
+         */
+        void getDigest(uint32_t *buckets) const;
+
+        /**
+         * @brief Apply a delta generated by getDeltaJson() from the cloud settings
+         * 
+         * @param deltaJson JSON object with "b", an array of bucket numbers to replace, and "v", an 
+         * object containing all of the settings in those buckets.
+         * @return true on success, false if deltaJson is invalid
+         * 
+         * Settings in the listed buckets that are not in "v" are removed. Settings in other buckets
+         * are unchanged. Setting change functions are called for changed keys, as with setValuesJson().
+         */
+        bool applyDeltaJson(const char *deltaJson);
+
+        /**
+         * @brief Generate a delta to send to a device (reference implementation of the cloud side)
+         * 
+         * @param settingsJson The complete settings JSON, as stored in the cloud
+         * @param digestJson The digest from the device, from getDigestJson()
+         * @param deltaJson Filled in with the delta to pass to applyDeltaJson() on the device
+         * @return true on success, false if settingsJson or digestJson are invalid
+         * 
+         * If the settings match, the "b" array in deltaJson is empty.
+         */
+        static bool getDeltaJson(const char *settingsJson, const char *digestJson, String &deltaJson);
+
+        /**
+         * @brief Calculate the digest bucket hashes for parsed settings
+         * 
+         * @param jp Parser containing the settings
+         * @param buckets Array of DIGEST_BUCKETS values to fill in
+         */
+        static void calculateDigest(const JsonParser &jp, uint32_t *buckets);
+
+        /**
+         * @brief Get the digest bucket for a key
+         * 
+         * @param key Key name, not null terminated
+         * @param keyLen Length of key
+         */
+        static size_t getDigestBucket(const char *key, size_t keyLen) {
+            return keyHash(key, keyLen) & (DIGEST_BUCKETS - 1);
+        }
+
+        /**
+         * @brief Number of buckets in the digest. Must be a power of 2.
+         */
+        static const size_t DIGEST_BUCKETS = 16;
+
+        /**
+         * @brief Murmur3 hash algorithm implementation
+         * 
+         * @param buf Pointer to the buffer to hash (const uint8_t *) 
+         * @param len Length of the data in bytes
+         * @param seed hash seed value (uint32_t)
+         * @return uint32_t 
+         * 
+         * This implementation is now in the StorageHelperRK library, but this method is still exists
+         * for backward compatibility.
+         */
+        static uint32_t murmur3_32(const uint8_t* buf, size_t len, uint32_t seed) {
+            return StorageHelperRK::murmur3_32(buf, len, seed);
+        }
+
+    private:
+        mutable uint32_t digest[DIGEST_BUCKETS]; //!< Digest bucket hashes, valid if digestGeneration == contentGeneration
+        mutable uint32_t digestGeneration = 0xffffffff; //!< contentGeneration when digest was calculated
+    };
+    #endif // HAL_PLATFORM_FILESYSTEM || defined(UNITTEST)
+
+    /**
+     * @brief Precomputed timeline of upcoming scheduled times
+     *
+     * Evaluating a LocalTimeSchedule requires a local time conversion including the timezone and
+     * daylight saving calculations, which is relatively slow. Since the schedules rarely change,
+     * the next TIMELINE_SIZE times for the wake, full wake, and data capture schedules are
+     * calculated at once and stored in a table. Lookups just find the first time in the table
+     * that is in the future, and the table is only recalculated when it runs out.
+     *
+     * Calling invalidate(), which SleepHelper does whenever a schedule is accessed for modification
+     * or the timezone is changed, discards the table.
+     *
+     * The TimelineData is a plain structure so it can be saved in persistent data, allowing
+     * the timeline to survive sleep modes that reset the device. Restored data is tagged with 
+     * a configuration hash calculated from the timezone configuration string and the results of 
+     * evaluating each schedule at fixed reference times. Since this only samples the schedules,
+     * it does not detect every change, so SleepHelper only restores the timeline when waking from
+     * HIBERNATE sleep, never after a firmware update or other reset.
+     */
+    class WakeTimeline {
+    public:
+        static const size_t TIMELINE_SIZE = 4; //!< Number of upcoming times stored for each schedule type
+
+        static const int TYPE_WAKE = 0; //!< Next wake of any kind, LocalTimeScheduleManager::getNextWake
+        static const int TYPE_FULL_WAKE = 1; //!< Next full wake, LocalTimeScheduleManager::getNextFullWake
+        static const int TYPE_DATA_CAPTURE = 2; //!< Next data capture, LocalTimeScheduleManager::getNextDataCapture
+        static const int NUM_TYPES = 3; //!< Number of schedule types
+
+        /**
+         * @brief Timeline data. This is a plain structure so it can be stored in persistent data.
+         */
+        class TimelineData {
+        public:
+            uint32_t configHash; //!< Hash of the configuration used to calculate the times
+            uint32_t validMask; //!< Bit (1 << type) is set if the times for that type have been calculated
+            uint32_t baseTime[NUM_TYPES]; //!< Time (Unix time, UTC) the times for each type were calculated from
+            uint32_t times[NUM_TYPES][TIMELINE_SIZE]; //!< Upcoming times (Unix time, UTC), ascending, 0 = no more times
+        };
+
+        /**
+         * @brief Default constructor. The timeline is initially empty.
+         */
+        WakeTimeline();
+
+        /**
+         * @brief Sets the timezone configuration string, which is included in the configuration hash
+         *
+         * @param tzConfig Timezone configuration string, as passed to LocalTime::withConfig()
+         * @return WakeTimeline&
+         */
+        WakeTimeline &withTimeConfig(const char *tzConfig);
+
+        /**
+         * @brief Mark the configuration as possibly changed
+         *
+         * The timeline is discarded on the next lookup, unless the data was restored using setData() 
+         * and the configuration hash matches. Call this after modifying a schedule.
+         */
+        void invalidate() { configChanged = true; };
+
+        /**
+         * @brief Get the next scheduled time of a given type
+         *
+         * @param scheduleManager The schedule manager to calculate times from
+         * @param type Schedule type, such as TYPE_FULL_WAKE
+         * @param now The current time (Unix time, UTC), typically Time.now()
+         * @return time_t The next scheduled time, or 0 if there is no schedule of that type
+         *
+         * The result is the same as the corresponding LocalTimeScheduleManager call with a
+         * LocalTimeConvert at now, but in most cases the result comes from the table.
+         */
+        time_t getNextTime(LocalTimeScheduleManager &scheduleManager, int type, time_t now);
+
+        /**
+         * @brief Get the timeline data, typically so it can be saved in persistent data
+         *
+         * @return const TimelineData&
+         */
+        const TimelineData &getData() const { return data; };
+
+        /**
+         * @brief Replace the timeline data, typically with the value from persistent data after reset
+         *
+         * @param data
+         *
+         * The data is only used if the configuration hash matches the current configuration
+         * on the next lookup.
+         */
+        void setData(const TimelineData &data);
+
+        /**
+         * @brief Returns true if the timeline data has changed since the last call
+         *
+         * @return true
+         * @return false
+         *
+         * This is used to determine if the timeline needs to be saved to persistent data.
+         */
+        bool getAndClearModified();
+
+        /**
+         * @brief Get the number of schedule evaluations that have been done
+         *
+         * @return uint32_t
+         *
+         * Each evaluation is a local time conversion plus a LocalTimeScheduleManager call.
+         * This is used to measure the effectiveness of the cache.
+         */
+        uint32_t getEvaluationCount() const { return evaluationCount; };
+
+        /**
+         * @brief Calculate the configuration hash
+         *
+         * @param scheduleManager The schedule manager to calculate times from
+         * @return uint32_t
+         *
+         * This evaluates each schedule type at fixed reference times, so it's relatively slow.
+         */
+        uint32_t calculateConfigHash(LocalTimeScheduleManager &scheduleManager);
+
+        /**
+         * @brief The hash seed used for the configuration hash
+         */
+        static const uint32_t HASH_SEED = 0x3f62c1a9;
+
+    protected:
+        /**
+         * @brief Evaluates a schedule using LocalTimeScheduleManager
+         *
+         * @param scheduleManager The schedule manager to calculate times from
+         * @param type Schedule type, such as TYPE_FULL_WAKE
+         * @param t The time to calculate the next scheduled time after
+         * @return time_t The next scheduled time or 0 if there is no schedule of that type
+         */
+        time_t evaluate(LocalTimeScheduleManager &scheduleManager, int type, time_t t);
+
+        /**
+         * @brief Recalculate the times for a schedule type
+         *
+         * @param scheduleManager The schedule manager to calculate times from
+         * @param type Schedule type, such as TYPE_FULL_WAKE
+         * @param now The time to start calculating from
+         */
+        void rebuild(LocalTimeScheduleManager &scheduleManager, int type, time_t now);
+
+        TimelineData data; //!< Timeline data (can be saved to persistent data)
+        uint32_t tzHash = 0; //!< Hash of the timezone configuration string
+        bool configChanged = true; //!< The configuration hash needs to be recalculated
+        bool restored = false; //!< Data was set by setData() and is kept if the configuration hash matches
+        bool modified = false; //!< The data has changed since getAndClearModified() was called
+        uint32_t evaluationCount = 0; //!< Number of schedule evaluations
+    };
+
+    #if HAL_PLATFORM_FILESYSTEM || defined(UNITTEST)
+    /**
+     * @brief Class for storing small data used by SleepHelper in the flash file system
+     * 
+     * You must not access the persistent data at global constructor time. Only use it from
+     * setup() or later. You can access it from worker threads.
+     * 
+     * This class is only for SleepHelper private data. For storing your own data,
+     * you should subclass PersistentDataBase (for retained memory) or 
+     * subclass PersistentDataFile (for file-stored data).
+     */
+    class PersistentData : public StorageHelperRK::PersistentDataFile {
+    public:
+        /**
+         * @brief Structure saved to the persistent data file (binary)
+         * 
+         * It must always begin with the SavedDataHeader (16 bytes)!
+         * 
+         * You can expand the structure later without incrementing the
+         * version number. Added fields will be initialized to 0. The size is 
+         * limited to 65536 bytes (uint16_t maximum value).
+         * 
+         * Since the SleepHelperData structure is always stored in RAM, you should not
+         * make it excessively large.
+         */
+        class SleepHelperData {
+        public:
+            SavedDataHeader header; //!< Must be at the beginning of the data structure
+            uint32_t lastUpdateCheck; //!< time_t last update check (Unix time, UTC)
+            uint32_t lastFullWake; //!< time_t last full wake (Unix time, UTC)
+            uint32_t lastQuickWake; //!< time_t last quick wake (Unix time, UTC)
+            uint32_t nextDataCapture; //!< time_t next data capture time (Unix time, UTC)
+            WakeTimeline::TimelineData wakeTimeline; //!< Precomputed schedule timeline
+            // OK to add more fields here later without incremeting version.
+            // New fields will be zero-initialized.
+        };
+
+        /**
+         * @brief Retained memory copy of SleepHelperData
+         * 
+         * Declare one of these as a retained global variable and pass it to 
+         * SleepHelper::withPersistentDataRetained() to keep the primary copy of the 
+         * persistent data in retained memory.
+         */
+        class RetainedData {
+        public:
+            uint32_t magic; //!< RETAINED_MAGIC if the data has been initialized
+            uint32_t hash; //!< murmur3 hash of data, to detect corruption
+            uint32_t size; //!< sizeof(SleepHelperData) when the data was stored
+            uint32_t lastFileSave; //!< time_t the file mirror was last written (Unix time, UTC)
+            SleepHelperData data; //!< Copy of the persistent data
+        };
+
+        /**
+         * @brief Constructor
+         * 
+         * @param filename Path to the persistent data file
+         */
+        PersistentData(const char *filename) : StorageHelperRK::PersistentDataFile(filename, &sleepHelperData.header, sizeof(SleepHelperData), SAVED_DATA_MAGIC, SAVED_DATA_VERSION) {};
+
+        /**
+         * @brief Destructor
+         */
+        virtual ~PersistentData() {};
+
+
+        /**
+         * @brief Get the value lastUpdateCheck (Unix time, UTC)
+         * 
+         * @return time_t Unix time at UTC, like the value of Time.now()
+         * 
+         * This is the clock time when we should next stay online long enough for a software update check
+         */
+        time_t getValue_lastUpdateCheck() const {
+            return (time_t) getValue<uint32_t>(offsetof(SleepHelperData, lastUpdateCheck));
+        }
+
+        /**
+         * @brief Set lastUpdateCheck value (Unix time, UTC)
+         * 
+         * @param value time_t Unix time at UTC, like the value of Time.now()
+         */
+        void setValue_lastUpdateCheck(time_t value) {
+            setValue<uint32_t>(offsetof(SleepHelperData, lastUpdateCheck), (uint32_t) value);
+        }
+
+        /**
+         * @brief Get the value lastFullWake (Unix time, UTC)
+         * 
+         * @return time_t Unix time at UTC, like the value of Time.now()
+         */
+        time_t getValue_lastFullWake() const {
+            return (time_t) getValue<uint32_t>(offsetof(SleepHelperData, lastFullWake));
+        }
+        /**
+         * @brief Set lastFullWake value (Unix time, UTC)
+         * 
+         * @param value time_t Unix time at UTC, like the value of Time.now()
+         */
+        void setValue_lastFullWake(time_t value) {
+            setValue<uint32_t>(offsetof(SleepHelperData, lastFullWake), (uint32_t)value);
+        }
+
+        /**
+         * @brief Get the value lastQuickWake (Unix time, UTC)
+         * 
+         * @return time_t Unix time at UTC, like the value of Time.now()
+         */
+        time_t getValue_lastQuickWake() const {
+            return (time_t) getValue<uint32_t>(offsetof(SleepHelperData, lastQuickWake));
+        }
+
+        /**
+         * @brief Set lastQuickWake value (Unix time, UTC)
+         * 
+         * @param value time_t Unix time at UTC, like the value of Time.now()
+         */
+        void setValue_lastQuickWake(time_t value) {
+            setValue<uint32_t>(offsetof(SleepHelperData, lastQuickWake), (uint32_t)value);
+        }
+
+        /**
+         * @brief Get time of the next data capture
+         * 
+         * @return time_t Unix time at UTC, like the value of Time.now(). Can be 0 (no time set)
+         * 
+         * Note that this setting is the next time, not the last time, as several other settings
+         * are. This improves efficiency and simplifies the code dramatically. On the minus side,
+         * changing the schedule will only affect the next schedule, not the current schedule.
+         * Since the data capture periods tend to be short, regular, and rarely changing this
+         * probably won't be an issue.
+         */
+        time_t getValue_nextDataCapture() const {
+            return (time_t) getValue<uint32_t>(offsetof(SleepHelperData, nextDataCapture));
+        }
+
+        /**
+         * @brief Get time of the next data capture
+         * 
+         * @return time_t Unix time at UTC, like the value of Time.now()
+         */
+        void setValue_nextDataCapture(time_t value) {
+            setValue<uint32_t>(offsetof(SleepHelperData, nextDataCapture), (uint32_t)value);
+        }
+
+        /**
+         * @brief Get the saved wake timeline
+         * 
+         * @param value Filled in with the saved timeline data. All zero if it has never been saved.
+         */
+        void getValue_wakeTimeline(WakeTimeline::TimelineData &value) const {
+            WITH_LOCK(*this) {
+                memcpy(&value, &sleepHelperData.wakeTimeline, sizeof(WakeTimeline::TimelineData));
+            }
+        }
+
+        /**
+         * @brief Save the wake timeline
+         * 
+         * @param value The timeline data to save. The file is only written if the data changed.
+         */
+        void setValue_wakeTimeline(const WakeTimeline::TimelineData &value) {
+            WITH_LOCK(*this) {
+                if (memcmp(&sleepHelperData.wakeTimeline, &value, sizeof(WakeTimeline::TimelineData)) != 0) {
+                    memcpy(&sleepHelperData.wakeTimeline, &value, sizeof(WakeTimeline::TimelineData));
+                    saveOrDefer();
+                }
+            }
+        }
+
+    
+        /**
+         * @brief Enable write-behind mode
+         * 
+         * @param maxDelay Maximum time to hold changes in RAM before writing them. 0 disables write-behind mode.
+         * @return PersistentData& 
+         * 
+         * Normally each setValue call that changes a value writes the file, so a single wake cycle can 
+         * write it several times. In write-behind mode, changes only mark the data dirty in RAM and are 
+         * written by a single save from flushWriteBehind(), which SleepHelper calls before sleep, on 
+         * reset, and from loop() once maxDelay has elapsed since the first unsaved change.
+         * 
+         * The delay is measured using the real-time clock, not millis(), so time spent in sleep 
+         * modes where millis() does not advance is counted. The resolution is 1 second.
+         */
+        PersistentData &withWriteBehind(std::chrono::milliseconds maxDelay) {
+            writeBehindMaxDelayMs = (uint32_t)maxDelay.count();
+            return *this;
+        }
+
+        /**
+         * @brief Returns true if write-behind mode is enabled
+         */
+        bool getWriteBehind() const {
+            return writeBehindMaxDelayMs != 0;
+        }
+
+        /**
+         * @brief Keep the primary copy of the data in retained memory, mirrored to the file
+         * 
+         * @param retainedData Retained memory buffer. Must be declared retained and must remain valid.
+         * @param fileSaveInterval Minimum time between writes of the file mirror
+         * @return PersistentData& 
+         * 
+         * Changes update the retained copy immediately, which is just a memory copy. The file is only
+         * written by flushWriteBehind() when the file save interval has elapsed, or when forced, such
+         * as on reset. At boot, loadRetained() uses the retained copy if it's valid so the file is only
+         * read after a cold boot or if the retained copy is corrupted.
+         */
+        PersistentData &withRetained(RetainedData *retainedData, std::chrono::seconds fileSaveInterval) {
+            this->retainedData = retainedData;
+            this->fileSaveIntervalSec = (uint32_t)fileSaveInterval.count();
+            return *this;
+        }
+
+        /**
+         * @brief Returns true if the primary copy of the data is in retained memory
+         */
+        bool getRetained() const {
+            return retainedData != nullptr;
+        }
+
+        /**
+         * @brief Load the data from the retained copy, if it's valid
+         * 
+         * @return true if the retained copy was valid and was loaded, false if the file should be loaded instead
+         */
+        bool loadRetained() {
+            bool result = false;
+            WITH_LOCK(*this) {
+                if (retainedData && retainedData->magic == RETAINED_MAGIC && retainedData->size == sizeof(SleepHelperData) &&
+                    retainedData->hash == StorageHelperRK::murmur3_32((const uint8_t *)&retainedData->data, sizeof(SleepHelperData), RETAINED_HASH_SEED)) {
+                    memcpy(&sleepHelperData, &retainedData->data, sizeof(SleepHelperData));
+                    result = true;
+                }
+            }
+            return result;
+        }
+
+        /**
+         * @brief Copy the data to the retained copy
+         * 
+         * This is done automatically when values change. It's also done after loading from the file.
+         */
+        void saveRetained() {
+            WITH_LOCK(*this) {
+                if (retainedData) {
+                    if (retainedData->magic != RETAINED_MAGIC) {
+                        retainedData->lastFileSave = 0;
+                    }
+                    memcpy(&retainedData->data, &sleepHelperData, sizeof(SleepHelperData));
+                    retainedData->size = sizeof(SleepHelperData);
+                    retainedData->hash = StorageHelperRK::murmur3_32((const uint8_t *)&retainedData->data, sizeof(SleepHelperData), RETAINED_HASH_SEED);
+                    retainedData->magic = RETAINED_MAGIC;
+                }
+            }
+        }
+
+        /**
+         * @brief Returns true if there are changes that are due to be written to the file mirror
+         * 
+         * @param now Current time (Unix time, UTC)
+         * 
+         * Only used when the primary copy is in retained memory.
+         */
+        bool getFileSaveDue(time_t now) const {
+            bool result = false;
+            WITH_LOCK(*this) {
+                result = writeBehindDirty && retainedData && (uint32_t)now >= retainedData->lastFileSave + fileSaveIntervalSec;
+            }
+            return result;
+        }
+
+        /**
+         * @brief Marks the data as dirty in write-behind or retained mode, otherwise saves as usual
+         * 
+         * This is called by setValue when a value changes.
+         */
+        virtual void saveOrDefer() {
+            if (retainedData) {
+                saveRetained();
+            }
+            else
+            if (writeBehindMaxDelayMs == 0) {
+                StorageHelperRK::PersistentDataFile::saveOrDefer();
+                return;
+            }
+            WITH_LOCK(*this) {
+                if (writeBehindDirty) {
+                    // This change will be written by the save that's already pending
+                    writesAvoided++;
+                }
+                else {
+                    writeBehindDirty = true;
+                    writeBehindDirtyTime = Time.now();
+                }
+            }
+        }
+
+        /**
+         * @brief Writes pending changes in write-behind or retained mode
+         * 
+         * @param force true to write now, false to only write if the maximum delay (write-behind mode) or
+         * file save interval (retained mode) has elapsed
+         * @return true if the file was written
+         */
+        bool flushWriteBehind(bool force) {
+            bool doSave = false;
+            WITH_LOCK(*this) {
+                if (retainedData) {
+                    // Retained memory survives sleep, so the file is only written periodically
+                    if (force ? writeBehindDirty : getFileSaveDue(Time.now())) {
+                        retainedData->lastFileSave = (uint32_t)Time.now();
+                        writeBehindDirty = false;
+                        doSave = true;
+                    }
+                }
+                else
+                if (writeBehindDirty) {
+                    // millis() does not advance in some sleep modes, so use the RTC like the retained mode
+                    // file save interval. A clock that was set backwards also flushes.
+                    time_t now = Time.now();
+                    if (force || now < writeBehindDirtyTime || 
+                        (uint32_t)(now - writeBehindDirtyTime) >= (writeBehindMaxDelayMs + 999) / 1000) {
+                        writeBehindDirty = false;
+                        doSave = true;
+                    }
+                }
+            }
+            if (doSave) {
+                save();
+            }
+            return doSave;
+        }
+
+        /**
+         * @brief Returns true if there are changes that have not been written in write-behind mode
+         */
+        bool getWriteBehindDirty() const {
+            return writeBehindDirty;
+        }
+
+        /**
+         * @brief Number of file writes avoided by coalescing changes in write-behind mode since boot
+         */
+        uint32_t getWritesAvoided() const {
+            return writesAvoided;
+        }
+
+        static const uint32_t SAVED_DATA_MAGIC = 0xd87cb6ce; //!< Magic bytes in the data structure
+        static const uint16_t SAVED_DATA_VERSION = 1; //!< Version of the data structure
+
+        static const uint32_t RETAINED_MAGIC = 0x3b9e41d7; //!< Magic bytes in RetainedData
+        static const uint32_t RETAINED_HASH_SEED = 0x7a1c52e3; //!< Seed for the RetainedData hash
+
+    protected:
+        SleepHelperData sleepHelperData; //!< Data stored in the persistent data file
+
+        RetainedData *retainedData = nullptr; //!< Retained memory copy, or nullptr if not using retained memory
+        uint32_t fileSaveIntervalSec = 0; //!< Minimum time between file mirror writes in retained mode
+
+        uint32_t writeBehindMaxDelayMs = 0; //!< Maximum write-behind delay, 0 = write-behind disabled
+        bool writeBehindDirty = false; //!< There are changes that have not been written
+        time_t writeBehindDirtyTime = 0; //!< Time.now() value when writeBehindDirty was set
+        uint32_t writesAvoided = 0; //!< Number of file writes avoided
+    };
+    #endif // HAL_PLATFORM_FILESYSTEM || defined(UNITTEST)
+
+    #if HAL_PLATFORM_FILESYSTEM || defined(UNITTEST)
+    /**
+     * @brief Class to manage small events, typically used for time-series data
+     * 
+     * For example, if you want to frequently measure the temperature, but publish the data 
+     * less frequently, to save on cellular connections, battery, and data operations, this
+     * class can be helpful.
+     * 
+     * Each event is JSON data. The data is stored in a single file in the flash file
+     * system. When it's time to publish, all of the events that will fit in the appropriate
+     * size will be aggregated into a single JSON array, reducing the number of data 
+     * operations and speeding the Particle event publishing process, which is limited to
+     * one event per second-ish.
+     */
+    class EventHistory : public SleepHelperRecursiveMutex {
+    public:
+        EventHistory() {};
+
+        /**
+         * @brief Sets the path of the event history file
+         * 
+         * @param path 
+         * @return EventHistory& 
+         */
+        EventHistory &withPath(const char *path) {
+            this->path = path;
+            return *this;
+        }
+
+        /**
+         * @brief Adds an event to the event history
+         * 
+         * @param jsonObj Must be a string containing a JSON object (including the surrounding {}).
+         * 
+         * If the data you want to send is an array, you should encapsulate the array under a key in the outermost
+         * object. If the data is just a single primitive such as a number or string, also surround it with
+         * a key and object.
+         */
+        void addEvent(const char *jsonObj);
+
+        /**
+         * @brief Adds an event to the event history using a callback and writer
+         * 
+         * @param callback The callback function, typically a lambda
+         * @return EventCombiner& 
+         * 
+         * The callback/lambda has this prototype:
+         * 
+         * void callback(JSONWriter &writer)
+         * 
+         * You typically use it like:
+         * 
+         * SleepHelper::instance().addEvent([](JSONWriter &writer) {
+		 *      writer.name("b").value(1111)
+         *            .name("c").value("testing!");
+		 * });
+         * 
+         * This is using the addEvent method of SleepHelper(), which just calls this
+         * method on the correct object.
+         */;
+        void addEvent(std::function<void(JSONWriter &)>callback);
+
+        /**
+         * @brief Get saved events and insert them as an array to writer
+         * 
+         * @param writer 
+         * @param maxSize 
+         * @param removeEvents 
+         * @return true 
+         * @return false 
+         * 
+         * If there are no events (getHasEvent() == false), this method returns quickly
+         * so there is no need to preflight this call with a test for having events.
+         */
+        bool getEvents(JSONWriter &writer, size_t maxSize, bool removeEvents = true);
+        
+        /**
+         * @brief Remove the events last retrieved using getEvents
+         * 
+         * By default, events are removed automatically so there is no need to call
+         * this. The function exists so you can do a two-phase removal. 
+         * 
+         * It's safe to add events in the time period between getEvents() and
+         * removeEvents() however you should not have multiple getEvents() in a row
+         * or from different threads, as you will get the same events multiple times
+         * and data corruption can occur.
+         * 
+         * If the device resets between getEvents() and removeEvents(), the events
+         * will be sent again later.
+         */
+        void removeEvents();
+
+        /**
+         * @brief Returns true if there are events to get using getEvents
+         * 
+         * @return true 
+         * @return false 
+         * 
+         * This operation is fast, just checks a flag variable. It's not necessary to
+         * check before calling getEvents(), because that method has the same check
+         * internally.
+         * 
+         * Except for the first run after wake, when it needs to check the file
+         * system to see if there is a file that was not processed before reboot.
+         * This is why this method is not const.
+         */
+        bool getHasEvents();
+
+        /**
+         * @brief Hold added events in RAM instead of appending each one to the file
+         * 
+         * @param maxBytes Maximum number of bytes to hold in RAM. 0 disables deferred writes.
+         * @return EventHistory& 
+         * 
+         * Events are appended to the file in a single write by flushDeferred(), or automatically 
+         * when the RAM buffer is full or when getting events. RAM is preserved in ULTRA_LOW_POWER
+         * sleep but not across reset, so flushDeferred() should be called on reset.
+         */
+        EventHistory &withDeferredWrites(size_t maxBytes) {
+            deferredMaxBytes = maxBytes;
+            return *this;
+        }
+
+        /**
+         * @brief Append events held in RAM to the file
+         * 
+         * @return true if the file was written
+         */
+        bool flushDeferred();
+
+        /**
+         * @brief Number of bytes of events held in RAM
+         */
+        size_t getDeferredSize() const {
+            return deferredEvents.length();
+        }
+
+    protected:
+        /**
+         * This class cannot be copied
+         */
+        EventHistory(const EventHistory&) = delete;
+
+        /**
+         * This class cannot be copied
+         */
+        EventHistory& operator=(const EventHistory&) = delete;
+
+        String path; //!< path to the event history file
+        bool firstRun = true; //!< Used to flag the first time the file has been accessed
+        bool hasEvents = false; //!< True if there are events in the event history file
+        size_t removeOffset = 0; //!< Where to remove events from
+        size_t deferredMaxBytes = 0; //!< Maximum bytes of events to hold in RAM, 0 = write each event to the file
+        String deferredEvents; //!< Events held in RAM, in the same format as the file
+    };
+    #endif // HAL_PLATFORM_FILESYSTEM || defined(UNITTEST)
+
+    #if HAL_PLATFORM_FILESYSTEM || defined(UNITTEST)
+    /**
+     * @brief Class to handle building JSON events from multiple callbacks with priority 
+     * and the ability to generate multiple events if necessary
+     * 
+     * The idea is that you want to combine all of the data into a single event if possible
+     * to minimize data operations. Sometimes you have unimportant data that would be nice
+     * to include if there's space but omit if not. And sometimes you have important 
+     * data that must be sent, and it's OK to send multiple events if necessary.
+     * 
+     * This class also has a priority-based de-duplication of keys.
+     */
+    class EventCombiner {
+    public:
+        /**
+         * @brief Container to hold a JSON fragment and a priority value 0 - 100.
+         * 
+         * Note that this is only a fragment, basically an object without the surrounding {}!
+         */
+        class EventInfo {
+        public:
+            String json; //!< JSON fragment, an object without the surrounding {}
+            int priority = 0; //!< Priority 0 - 100 inclusive.
+            std::vector<String> keys; //!< Top level keys
+        };
+
+        /**
+         * @brief Function to write the value for a slot added with addSlot()
+         */
+        typedef InlineFunction<void(JSONWriter &)> SlotFunction;
+
+        /**
+         * @brief Default constructor
+         * 
+         * Use withCallback to add callback functions
+         */
+        EventCombiner() {
+            oneTimeCallbacks.reserve(8);
+        };
+
+        /**
+         * @brief Adds a callback function to generate JSON data
+         * 
+         * @param fn 
+         * @return EventCombiner& 
+         * 
+         * The callback function has this prototype:
+         * 
+         * bool callback(JSONWriter &writer, int &priority)
+         * 
+         * The return value is ignored; you should return true.
+         * 
+         * writer is the JSONWriter to store the data into
+         * priority should be set to a value from 1 to 100. If you leave it at zero your data will not be saved!
+         * 
+         * Items are added to the event in priority order, largest first.
+         * 
+         * If you have a priority < 50 and the event is full, then your data will be discarded to 
+         * avoid generating another event.
+         */
+        template<class F>
+        EventCombiner &withCallback(F &&fn) {
+            callbacks.add(std::forward<F>(fn)); 
+            return *this;
+        }
+
+        /**
+         * @brief Add a callback that is removed after generating events
+         * 
+         * @param fn 
+         * @return EventCombiner& 
+         */
+        template<class F>
+        EventCombiner &withOneTimeCallback(F &&fn) {
+            oneTimeCallbacks.add(std::forward<F>(fn)); 
+            return *this;
+        }
+
+        /**
+         * @brief Add a fixed slot for a value that is only added to the next event after setSlotPending()
+         * 
+         * @param name JSON key for the value. Must be a string that remains valid, such as a string constant.
+         * @param priority Priority 1 - 100, see withCallback()
+         * @param fn Function to write the value. The key has already been written.
+         * @return size_t Slot number to pass to setSlotPending()
+         * 
+         * This works like a one-time callback, except the function is only added once, typically
+         * during setup, so a value reported every wake cycle does not add a callback every wake cycle.
+         */
+        size_t addSlot(const char *name, int priority, SlotFunction fn) {
+            slots.push_back(Slot{name, priority, fn, false});
+            return slots.size() - 1;
+        }
+
+        /**
+         * @brief Include a slot added with addSlot() in the next generateEvents()
+         * 
+         * @param slot Slot number returned by addSlot()
+         * 
+         * The slot is no longer pending after generateEvents() or clearOneTimeCallbacks().
+         */
+        void setSlotPending(size_t slot) {
+            if (slot < slots.size()) {
+                slots[slot].pending = true;
+            }
+        }
+
+        /**
+         * @brief Returns true if setSlotPending() has been called since the last generateEvents()
+         * 
+         * @param slot Slot number returned by addSlot()
+         */
+        bool getSlotPending(size_t slot) const {
+            return slot < slots.size() && slots[slot].pending;
+        }
+
+        /**
+         * @brief Sets parameters for the EventHistory feature
+         * 
+         * @param path path to store the event history
+         * @param key JSON key to publish event history items under
+         * @return EventCombiner& 
+         */
+        EventCombiner &withEventHistory(const char *path, const char *key) {
+            eventHistory.withPath(path);
+            this->eventHistoryKey = key;
+            return *this;
+        }
+
+        /**
+         * @brief Adds an event to the event history (preformatted JSON)
+         * 
+         * @param jsonObj A string containing a complete JSON object surrounded by {}
+         * 
+         * See the version with a callback for an easier way to build the JSON.
+         */
+        EventCombiner &addEvent(const char *jsonObj) {
+            eventHistory.addEvent(jsonObj);
+            return *this;
+        }
+
+        /**
+         * @brief Adds an event to the event history using a callback and writer
+         * 
+         * @param callback The callback function, typically a lambda
+         * @return EventCombiner& 
+         * 
+         * The callback/lambda has this prototype:
+         * 
+         * void callback(JSONWriter &writer)
+         * 
+         * You typically use it like:
+         * 
+         * SleepHelper::instance().addEvent([](JSONWriter &writer) {
+		 *      writer.name("b").value(1111)
+         *            .name("c").value("testing!");
+		 * });
+         */
+        EventCombiner &addEvent(std::function<void(JSONWriter &)>callback) {
+            eventHistory.addEvent(callback);
+            return *this;
+        }
+
+
+        /**
+         * @brief Generate one or more events based on the maximum event size
+         * 
+         * @param events vector of String objects to fill in with event data
+         * 
+         * The events vector you pass into this method will be cleared. It will be returned filled in
+         * with zero or more Strings, each containing event data in valid JSON format.
+         */
+        void generateEvents(std::vector<String> &events);
+
+        /**
+         * @brief generate one or more events based on desired size
+         * 
+         * @param events vector of String objects to fill in with event data
+         * @param maxSize Maximum size of each even in bytes
+         * 
+         * The events vector you pass into this method will be cleared. It will be returned filled in
+         * with zero or more Strings, each containing event data in valid JSON format.
+         */
+        void generateEvents(std::vector<String> &events, size_t maxSize);
+
+        /**
+         * @brief Hold event history events in RAM instead of writing each one to the file
+         * 
+         * @param maxBytes Maximum number of bytes to hold in RAM. 0 disables deferred writes.
+         * @return EventCombiner& 
+         */
+        EventCombiner &withDeferredWrites(size_t maxBytes) {
+            eventHistory.withDeferredWrites(maxBytes);
+            return *this;
+        }
+
+        /**
+         * @brief Append event history events held in RAM to the file
+         * 
+         * @return true if the file was written
+         */
+        bool flushDeferred() {
+            return eventHistory.flushDeferred();
+        }
+
+        /**
+         * @brief Number of bytes of event history events held in RAM
+         */
+        size_t getDeferredSize() const {
+            return eventHistory.getDeferredSize();
+        }
+
+        /**
+         * @brief Clear the one-time callbacks
+         * 
+         * This is done automatically after generateEvents, but can be done manually in unusual cases.
+         */
+        void clearOneTimeCallbacks() {
+            oneTimeCallbacks.removeAll();
+            for(auto it = slots.begin(); it != slots.end(); ++it) {
+                it->pending = false;
+            }
+        }
+
+    protected:
+        /**
+         * This class cannot be copied
+         */
+        EventCombiner(const EventCombiner&) = delete;
+
+        /**
+         * This class cannot be copied
+         */
+        EventCombiner& operator=(const EventCombiner&) = delete;
+
+        /**
+         * @brief Used internally to generate events based on priority
+         * 
+         * @param callback The callback to call
+         * @param buf The event buffer
+         * @param maxSize The size of the event buffer
+         * @param infoArray Data to be added to the event
+         * 
+         * A separate function is used because the process is run twice, once for the regular callbacks and once for the one-time callbacks.
+         */
+        void generateEventInternal(const AppCallback<JSONWriter &, int &>::Function &callback, char *buf, size_t maxSize, std::vector<EventInfo> &infoArray);
+
+        /**
+         * @brief Slot added with addSlot()
+         */
+        struct Slot {
+            const char *name; //!< JSON key
+            int priority; //!< Priority 1 - 100
+            SlotFunction fn; //!< Function to write the value
+            bool pending; //!< Include in the next generateEvents()
+        };
+
+        AppCallback<JSONWriter &, int &> callbacks; //!< Callback functions
+        AppCallback<JSONWriter &, int &> oneTimeCallbacks; //!< One-time use callback functions 
+        std::vector<Slot> slots; //!< Fixed slots added with addSlot()
+        EventHistory eventHistory; //!< Event history
+        String eventHistoryKey; //!< Key to use when publishing the event history
+    };
+    #endif // HAL_PLATFORM_FILESYSTEM || defined(UNITTEST)
+
+    #if HAL_PLATFORM_FILESYSTEM || defined(UNITTEST)
+    /**
+     * @brief Aggregates captured samples into per-window statistics
+     * 
+     * If you capture data every 2 minutes but your backend only needs 15 minute statistics,
+     * adding every sample to the event history wastes flash writes and publish bytes. Instead,
+     * pass each sample to addSample() and one summary record per window is added to the 
+     * event history, containing the count, mean, standard deviation, min, and max for each
+     * channel.
+     * 
+     * The running statistics are stored in a persistent data file so they are preserved
+     * across sleep and reset. To avoid a flash write per sample, the file is only written when
+     * a window is closed and by saveChanges(), which SleepHelper calls before sleep or reset.
+     * Channels are identified by name, and you can have up to MAX_CHANNELS of them.
+     * 
+     * Use SleepHelper::withSampleAggregator() to register the aggregator with SleepHelper.
+     */
+    class SampleAggregator : public StorageHelperRK::PersistentDataFile {
+    public:
+        /**
+         * @brief Maximum number of channels in one aggregator
+         */
+        static const size_t MAX_CHANNELS = 8;
+
+        /**
+         * @brief Running statistics for one channel, saved in the persistent data file
+         */
+        class ChannelData {
+        public:
+            uint32_t nameHash; //!< Hash of the channel name, used to detect configuration changes
+            uint32_t count; //!< Number of samples in this window
+            float min; //!< Minimum sample value
+            float max; //!< Maximum sample value
+            double mean; //!< Running mean (Welford's method)
+            double m2; //!< Running sum of squares of differences from the mean (Welford's method)
+        };
+
+        /**
+         * @brief Structure saved to the persistent data file (binary)
+         * 
+         * It must always begin with the SavedDataHeader (16 bytes)!
+         */
+        class AggregatorData {
+        public:
+            SavedDataHeader header; //!< Must be at the beginning of the data structure
+            uint32_t windowStart; //!< time_t start of the current window (Unix time, UTC)
+            uint32_t windowCount; //!< Number of windows that have been emitted
+            ChannelData channels[MAX_CHANNELS]; //!< Running statistics, in the order of withChannel() calls
+        };
+
+        /**
+         * @brief Statistics for a channel, returned from getStats()
+         */
+        class Stats {
+        public:
+            size_t count = 0; //!< Number of samples
+            float mean = 0; //!< Mean value
+            float stddev = 0; //!< Sample standard deviation (0 if there are fewer than 2 samples)
+            float min = 0; //!< Minimum value
+            float max = 0; //!< Maximum value
+        };
+
+        /**
+         * @brief Constructor
+         * 
+         * @param filename Path to the persistent data file. Use a different file for each aggregator.
+         */
+        SampleAggregator(const char *filename = "/usr/sleepAggregator.dat") : StorageHelperRK::PersistentDataFile(filename, &aggregatorData.header, sizeof(AggregatorData), SAVED_DATA_MAGIC, SAVED_DATA_VERSION) {};
+
+        /**
+         * @brief Destructor
+         */
+        virtual ~SampleAggregator() {};
+
+        /**
+         * @brief Key for the summary record in the event history (default: "agg")
+         * 
+         * @param key Key name. Must be a string literal or a string that remains valid.
+         * @return SampleAggregator& 
+         */
+        SampleAggregator &withKey(const char *key) {
+            this->key = key;
+            return *this;
+        }
+
+        /**
+         * @brief Length of the aggregation window (default: 15 minutes)
+         * 
+         * @param window Window length in seconds. Windows are aligned to a multiple of this length
+         * from midnight UTC, so a 15 minute window starts on the hour and at :15, :30, and :45.
+         * @return SampleAggregator& 
+         */
+        SampleAggregator &withWindow(std::chrono::seconds window) {
+            this->windowSec = (window.count() > 0) ? (uint32_t)window.count() : 1;
+            return *this;
+        }
+
+        /**
+         * @brief Adds a channel
+         * 
+         * @param name Channel name, used as the key in the summary record. Must be a string literal or a string that remains valid.
+         * @param decimalPlaces Number of decimal places in the summary record (default: 2)
+         * @param raw Also add each sample to the event history (raw passthrough). Default: false.
+         * @return SampleAggregator& 
+         * 
+         * Channels are stored in the persistent data file in the order they are added. If you 
+         * change the order the existing statistics for the changed channels are discarded.
+         * Adding more than MAX_CHANNELS channels, or the same name twice, is ignored.
+         */
+        SampleAggregator &withChannel(const char *name, int decimalPlaces = 2, bool raw = false);
+
+        /**
+         * @brief Sets the EventCombiner summary records and raw samples are added to
+         * 
+         * @param eventCombiner The EventCombiner
+         * @return SampleAggregator& 
+         * 
+         * This is done automatically by SleepHelper::withSampleAggregator().
+         */
+        SampleAggregator &withEventCombiner(EventCombiner &eventCombiner) {
+            this->eventCombiner = &eventCombiner;
+            return *this;
+        }
+
+        /**
+         * @brief Adds a sample to a channel
+         * 
+         * @param name Channel name, as passed to withChannel()
+         * @param value Value to add
+         * @param now Sample time (Unix time, UTC)
+         * @return true if the sample was added or false if the channel does not exist
+         * 
+         * If the sample is after the end of the current window, the summary for the 
+         * current window is added to the event history first and the file is saved. 
+         * Otherwise the sample is only held in RAM until saveChanges() is called.
+         */
+        bool addSample(const char *name, float value, time_t now);
+
+        /**
+         * @brief Adds a sample to a channel at the current time (Time.now())
+         * 
+         * @param name Channel name, as passed to withChannel()
+         * @param value Value to add
+         * @return true if the sample was added or false if the channel does not exist
+         */
+        bool addSample(const char *name, float value) {
+            return addSample(name, value, Time.now());
+        }
+
+        /**
+         * @brief Closes the current window if it has ended
+         * 
+         * @param now Current time (Unix time, UTC)
+         * @return true if a summary record was added to the event history
+         */
+        bool checkWindow(time_t now);
+
+        /**
+         * @brief Closes the current window immediately, adding the summary record if there are samples
+         * 
+         * @return true if a summary record was added to the event history
+         */
+        bool closeWindow();
+
+        /**
+         * @brief Writes the running statistics to the file if samples were added since the last save
+         * 
+         * @return true if there were changes to save
+         * 
+         * This is done automatically before sleep or reset by SleepHelper::withSampleAggregator().
+         */
+        bool saveChanges();
+
+        /**
+         * @brief Returns true if samples have been added since the file was last saved
+         */
+        bool getUnsavedChanges() const { return unsavedChanges; };
+
+        /**
+         * @brief Gets the statistics for a channel in the current window
+         * 
+         * @param name Channel name, as passed to withChannel()
+         * @param stats Filled in with the statistics
+         * @return true if the channel exists
+         */
+        bool getStats(const char *name, Stats &stats) const;
+
+        /**
+         * @brief Gets the start of the current window (Unix time, UTC), or 0 if no samples have been added
+         */
+        time_t getWindowStart() const {
+            return (time_t) getValue<uint32_t>(offsetof(AggregatorData, windowStart));
+        }
+
+        /**
+         * @brief Gets the number of summary records that have been added to the event history
+         */
+        uint32_t getWindowCount() const {
+            return getValue<uint32_t>(offsetof(AggregatorData, windowCount));
+        }
+
+        /**
+         * @brief Writes the summary record for the current window
+         * 
+         * @param writer The JSONWriter to write to, positioned inside an object
+         * 
+         * The summary is written as an object under the key, containing "t" (window start), 
+         * and an object for each channel with samples containing "n", "mean", "sd", "min", 
+         * and "max".
+         */
+        void writeSummary(JSONWriter &writer) const;
+
+        static const uint32_t SAVED_DATA_MAGIC = 0x5a0c2e91; //!< Magic bytes in the data structure
+        static const uint16_t SAVED_DATA_VERSION = 1; //!< Version of the data structure
+
+        static const uint32_t NAME_HASH_SEED = 0x6b43a9f1; //!< Seed for channel name hashes
 
+    protected:
         /**
-         * @brief Default values are never used with cloud settings
-         * 
-         * @param inputJson 
-         * @return true 
-         * @return false 
+         * @brief Configuration for a channel (not saved)
          */
-        bool addDefaultValues(const char *inputJson) = delete;
+        class ChannelConfig {
+        public:
+            const char *name; //!< Channel name
+            uint32_t nameHash; //!< Hash of the channel name
+            int decimalPlaces; //!< Number of decimal places in the summary record
+            bool raw; //!< Also add each sample to the event history
+        };
 
         /**
-         * @brief Get the hashed value of the current settings, used to check if they need to be updated
-         * 
-         * @return uint32_t 
+         * This class cannot be copied
          */
-        uint32_t getHash() const;
+        SampleAggregator(const SampleAggregator&) = delete;
 
         /**
-         * @brief The hash seed used for settings file changes
+         * This class cannot be copied
          */
-        static const uint32_t HASH_SEED = 0x5b4ffa05;
+        SampleAggregator& operator=(const SampleAggregator&) = delete;
 
         /**
-         * @brief Murmur3 hash algorithm implementation
-         * 
-         * @param buf Pointer to the buffer to hash (const uint8_t *) 
-         * @param len Length of the data in bytes
-         * @param seed hash seed value (uint32_t)
-         * @return uint32_t 
+         * @brief Finds a channel by name
          * 
-         * This implementation is now in the StorageHelperRK library, but this method is still exists
-         * for backward compatibility.
+         * @param name Channel name
+         * @return int Index into channelConfig and aggregatorData.channels, or -1 if not found
          */
-        static uint32_t murmur3_32(const uint8_t* buf, size_t len, uint32_t seed) {
-            return StorageHelperRK::murmur3_32(buf, len, seed);
-        }
-
-    private:
+        int findChannel(const char *name) const;
 
+        /**
+         * @brief Used internally to close the window. Must be called with the lock held.
+         */
+        bool closeWindowInternal();
+
+        AggregatorData aggregatorData; //!< Data stored in the persistent data file
+        std::vector<ChannelConfig> channelConfig; //!< Channel configuration, in the same order as aggregatorData.channels
+        EventCombiner *eventCombiner = nullptr; //!< Where to add summary records and raw samples
+        const char *key = "agg"; //!< Key for the summary record
+        uint32_t windowSec = 15 * 60; //!< Length of the window in seconds
+        bool unsavedChanges = false; //!< Samples have been added since the last save
     };
     #endif // HAL_PLATFORM_FILESYSTEM || defined(UNITTEST)
 
     #if HAL_PLATFORM_FILESYSTEM || defined(UNITTEST)
     /**
-     * @brief Class for storing small data used by SleepHelper in the flash file system
+     * @brief Report-by-exception filter for captured samples
      * 
-     * You must not access the persistent data at global constructor time. Only use it from
-     * setup() or later. You can access it from worker threads.
+     * Many readings barely change between captures, but each sample added to the event
+     * history costs a flash write and publish bytes. Pass each sample to addSample()
+     * instead, and it's only added to the event history if:
      * 
-     * This class is only for SleepHelper private data. For storing your own data,
-     * you should subclass PersistentDataBase (for retained memory) or 
-     * subclass PersistentDataFile (for file-stored data).
+     * - It's the first sample for the channel
+     * - It differs from the last reported value by more than the deadband
+     * - It changed faster than the rate-of-change threshold since the previous sample
+     * - The heartbeat interval has elapsed since the last report for the channel
+     * 
+     * The last reported value and time for each channel are stored in a persistent data 
+     * file, which is only written when a sample is reported. The previous sample, used for 
+     * rate-of-change, is kept in RAM, which is preserved in ULTRA_LOW_POWER sleep.
+     * 
+     * Channels can be set to escalate on a deadband or rate-of-change breach. This
+     * votes for a cloud connection through a ShouldConnect function, even during a
+     * quick wake, so alarms are delivered promptly.
+     * 
+     * Use SleepHelper::withReportByException() to register it with SleepHelper.
      */
-    class PersistentData : public StorageHelperRK::PersistentDataFile {
+    class ReportByException : public StorageHelperRK::PersistentDataFile {
     public:
+        /**
+         * @brief Maximum number of channels
+         */
+        static const size_t MAX_CHANNELS = 8;
+
+        static const int REPORT_UNKNOWN_CHANNEL = -1; //!< addSample() result, channel does not exist
+        static const int REPORT_SUPPRESSED = 0; //!< addSample() result, sample was not reported
+        static const int REPORT_FIRST = 1; //!< addSample() result, first sample for the channel
+        static const int REPORT_DEADBAND = 2; //!< addSample() result, sample moved past the deadband
+        static const int REPORT_RATE = 3; //!< addSample() result, sample exceeded the rate-of-change threshold
+        static const int REPORT_HEARTBEAT = 4; //!< addSample() result, heartbeat interval elapsed
+
+        /**
+         * @brief Last reported value for one channel, saved in the persistent data file
+         */
+        class ChannelData {
+        public:
+            uint32_t nameHash; //!< Hash of the channel name, used to detect configuration changes
+            uint32_t lastReportTime; //!< time_t of the last report (Unix time, UTC), 0 if never reported
+            float lastReportValue; //!< Last reported value
+            uint32_t reserved; //!< Reserved for future use, currently 0
+        };
+
         /**
          * @brief Structure saved to the persistent data file (binary)
          * 
          * It must always begin with the SavedDataHeader (16 bytes)!
-         * 
-         * You can expand the structure later without incrementing the
-         * version number. Added fields will be initialized to 0. The size is 
-         * limited to 65536 bytes (uint16_t maximum value).
-         * 
-         * Since the SleepHelperData structure is always stored in RAM, you should not
-         * make it excessively large.
          */
-        class SleepHelperData {
+        class ReportData {
         public:
             SavedDataHeader header; //!< Must be at the beginning of the data structure
-            uint32_t lastUpdateCheck; //!< time_t last update check (Unix time, UTC)
-            uint32_t lastFullWake; //!< time_t last full wake (Unix time, UTC)
-            uint32_t lastQuickWake; //!< time_t last quick wake (Unix time, UTC)
-            uint32_t nextDataCapture; //!< time_t next data capture time (Unix time, UTC)
-            // OK to add more fields here later without incremeting version.
-            // New fields will be zero-initialized.
+            uint32_t escalationPending; //!< Connect conviction of the highest breached escalating channel not acted on yet, 0 if none
+            uint32_t reserved; //!< Reserved for future use, currently 0
+            ChannelData channels[MAX_CHANNELS]; //!< Last reports, in the order of withChannel() calls
         };
 
         /**
-         * @brief 
+         * @brief Constructor
+         * 
+         * @param filename Path to the persistent data file
          */
-        PersistentData(const char *filename) : StorageHelperRK::PersistentDataFile(filename, &sleepHelperData.header, sizeof(SleepHelperData), SAVED_DATA_MAGIC, SAVED_DATA_VERSION) {};
+        ReportByException(const char *filename = "/usr/sleepReport.dat") : StorageHelperRK::PersistentDataFile(filename, &reportData.header, sizeof(ReportData), SAVED_DATA_MAGIC, SAVED_DATA_VERSION) {};
 
         /**
          * @brief Destructor
          */
-        virtual ~PersistentData() {};
-
+        virtual ~ReportByException() {};
 
         /**
-         * @brief Get the value lastUpdateCheck (Unix time, UTC)
+         * @brief Adds a channel
          * 
-         * @return time_t Unix time at UTC, like the value of Time.now()
+         * @param name Channel name, used as the key in the event history. Must be a string literal or a string that remains valid.
+         * @param deadband Report when the value differs from the last reported value by more than this. 0 reports every change.
+         * @param ratePerSec Report when the value changes faster than this many units per second since the previous sample. 0 disables.
+         * @param decimalPlaces Number of decimal places in the event history (default: 2)
+         * @return ReportByException& 
+         */
+        ReportByException &withChannel(const char *name, float deadband, float ratePerSec = 0, int decimalPlaces = 2);
+
+        /**
+         * @brief Makes the most recently added channel escalate to a full wake on deadband or rate-of-change breach
          * 
-         * This is the clock time when we should next stay online long enough for a software update check
+         * @param conviction Connect conviction to use for this channel (1 - 100, default: 60)
+         * @return ReportByException& 
          */
-        time_t getValue_lastUpdateCheck() const {
-            return (time_t) getValue<uint32_t>(offsetof(SleepHelperData, lastUpdateCheck));
+        ReportByException &withEscalation(int conviction = 60) {
+            if (!channelConfig.empty()) {
+                channelConfig.back().escalationConviction = (conviction > 0) ? conviction : 1;
+            }
+            return *this;
         }
 
         /**
-         * @brief Set lastUpdateCheck value (Unix time, UTC)
+         * @brief Maximum time between reports for each channel, even if the value does not change (default: 1 hour)
          * 
-         * @param value time_t Unix time at UTC, like the value of Time.now()
+         * @param heartbeat Heartbeat interval in seconds. 0 disables the heartbeat.
+         * @return ReportByException& 
          */
-        void setValue_lastUpdateCheck(time_t value) {
-            setValue<uint32_t>(offsetof(SleepHelperData, lastUpdateCheck), (uint32_t) value);
+        ReportByException &withHeartbeat(std::chrono::seconds heartbeat) {
+            this->heartbeatSec = (uint32_t)heartbeat.count();
+            return *this;
         }
 
         /**
-         * @brief Get the value lastFullWake (Unix time, UTC)
+         * @brief Sets the EventCombiner reported samples are added to
          * 
-         * @return time_t Unix time at UTC, like the value of Time.now()
+         * @param eventCombiner The EventCombiner
+         * @return ReportByException& 
+         * 
+         * This is done automatically by SleepHelper::withReportByException().
          */
-        time_t getValue_lastFullWake() const {
-            return (time_t) getValue<uint32_t>(offsetof(SleepHelperData, lastFullWake));
+        ReportByException &withEventCombiner(EventCombiner &eventCombiner) {
+            this->eventCombiner = &eventCombiner;
+            return *this;
         }
+
         /**
-         * @brief Set lastFullWake value (Unix time, UTC)
+         * @brief Function to call when an escalating channel is breached
          * 
-         * @param value time_t Unix time at UTC, like the value of Time.now()
+         * @param fn Function to call
+         * @return ReportByException& 
+         * 
+         * This is done automatically by SleepHelper::withReportByException().
          */
-        void setValue_lastFullWake(time_t value) {
-            setValue<uint32_t>(offsetof(SleepHelperData, lastFullWake), (uint32_t)value);
+        ReportByException &withEscalationFunction(std::function<void()> fn) {
+            escalationFunction = fn;
+            return *this;
         }
 
         /**
-         * @brief Get the value lastQuickWake (Unix time, UTC)
+         * @brief Adds a sample to a channel, reporting it if it meets the reporting criteria
          * 
-         * @return time_t Unix time at UTC, like the value of Time.now()
+         * @param name Channel name, as passed to withChannel()
+         * @param value Sample value
+         * @param now Sample time (Unix time, UTC)
+         * @return int One of the REPORT_ constants. REPORT_SUPPRESSED (0) if not reported.
          */
-        time_t getValue_lastQuickWake() const {
-            return (time_t) getValue<uint32_t>(offsetof(SleepHelperData, lastQuickWake));
-        }
+        int addSample(const char *name, float value, time_t now);
 
         /**
-         * @brief Set lastQuickWake value (Unix time, UTC)
+         * @brief Adds a sample to a channel at the current time (Time.now())
          * 
-         * @param value time_t Unix time at UTC, like the value of Time.now()
+         * @param name Channel name, as passed to withChannel()
+         * @param value Sample value
+         * @return int One of the REPORT_ constants. REPORT_SUPPRESSED (0) if not reported.
          */
-        void setValue_lastQuickWake(time_t value) {
-            setValue<uint32_t>(offsetof(SleepHelperData, lastQuickWake), (uint32_t)value);
+        int addSample(const char *name, float value) {
+            return addSample(name, value, Time.now());
         }
 
         /**
-         * @brief Get time of the next data capture
-         * 
-         * @return time_t Unix time at UTC, like the value of Time.now(). Can be 0 (no time set)
+         * @brief Returns true if an escalating channel was breached and the escalation has not been cleared
+         */
+        bool getEscalationPending() const {
+            return getValue<uint32_t>(offsetof(ReportData, escalationPending)) != 0;
+        }
+
+        /**
+         * @brief Clears the escalation pending flag
+         */
+        void clearEscalation() {
+            setValue<uint32_t>(offsetof(ReportData, escalationPending), 0);
+        }
+
+        /**
+         * @brief Gets the connect conviction for the pending escalation
          * 
-         * Note that this setting is the next time, not the last time, as several other settings
-         * are. This improves efficiency and simplifies the code dramatically. On the minus side,
-         * changing the schedule will only affect the next schedule, not the current schedule.
-         * Since the data capture periods tend to be short, regular, and rarely changing this
-         * probably won't be an issue.
+         * @return int The highest conviction of the escalating channels breached since the escalation 
+         * was last cleared, or 0 if no escalation is pending
          */
-        time_t getValue_nextDataCapture() const {
-            return (time_t) getValue<uint32_t>(offsetof(SleepHelperData, nextDataCapture));
+        int getEscalationConviction() const {
+            return (int) getValue<uint32_t>(offsetof(ReportData, escalationPending));
         }
 
         /**
-         * @brief Get time of the next data capture
+         * @brief Gets the last reported value for a channel
          * 
-         * @return time_t Unix time at UTC, like the value of Time.now()
+         * @param name Channel name, as passed to withChannel()
+         * @param value Filled in with the last reported value
+         * @return true if the channel exists and has been reported
          */
-        void setValue_nextDataCapture(time_t value) {
-            setValue<uint32_t>(offsetof(SleepHelperData, nextDataCapture), (uint32_t)value);
+        bool getLastReport(const char *name, float &value) const;
+
+        /**
+         * @brief Number of samples reported since boot
+         */
+        uint32_t getReportedCount() const {
+            return reportedCount;
         }
 
-    
-        static const uint32_t SAVED_DATA_MAGIC = 0xd87cb6ce; //!< Magic bytes in the data structure
+        /**
+         * @brief Number of samples suppressed since boot
+         */
+        uint32_t getSuppressedCount() const {
+            return suppressedCount;
+        }
+
+        static const uint32_t SAVED_DATA_MAGIC = 0x2e7d50b4; //!< Magic bytes in the data structure
         static const uint16_t SAVED_DATA_VERSION = 1; //!< Version of the data structure
 
+        static const uint32_t NAME_HASH_SEED = 0x6b43a9f1; //!< Seed for channel name hashes
 
     protected:
-        SleepHelperData sleepHelperData; //!< Data stored in the persistent data file
+        /**
+         * @brief Configuration for a channel (not saved)
+         */
+        class ChannelConfig {
+        public:
+            const char *name; //!< Channel name
+            uint32_t nameHash; //!< Hash of the channel name
+            float deadband; //!< Deadband
+            float ratePerSec; //!< Rate-of-change threshold in units per second, 0 = disabled
+            int decimalPlaces; //!< Number of decimal places in the event history
+            int escalationConviction = 0; //!< Connect conviction on breach, 0 = does not escalate
+            time_t lastSampleTime = 0; //!< Time of the previous sample (RAM only)
+            float lastSampleValue = 0; //!< Value of the previous sample (RAM only)
+        };
+
+        /**
+         * This class cannot be copied
+         */
+        ReportByException(const ReportByException&) = delete;
+
+        /**
+         * This class cannot be copied
+         */
+        ReportByException& operator=(const ReportByException&) = delete;
+
+        /**
+         * @brief Finds a channel by name
+         * 
+         * @param name Channel name
+         * @return int Index into channelConfig and reportData.channels, or -1 if not found
+         */
+        int findChannel(const char *name) const;
+
+        ReportData reportData; //!< Data stored in the persistent data file
+        std::vector<ChannelConfig> channelConfig; //!< Channel configuration, in the same order as reportData.channels
+        EventCombiner *eventCombiner = nullptr; //!< Where to add reported samples
+        std::function<void()> escalationFunction = nullptr; //!< Called on breach of an escalating channel
+        uint32_t heartbeatSec = 3600; //!< Heartbeat interval in seconds, 0 = disabled
+        uint32_t reportedCount = 0; //!< Number of samples reported since boot
+        uint32_t suppressedCount = 0; //!< Number of samples suppressed since boot
     };
     #endif // HAL_PLATFORM_FILESYSTEM || defined(UNITTEST)
 
-    #if HAL_PLATFORM_FILESYSTEM || defined(UNITTEST)
     /**
-     * @brief Class to manage small events, typically used for time-series data
-     * 
-     * For example, if you want to frequently measure the temperature, but publish the data 
-     * less frequently, to save on cellular connections, battery, and data operations, this
-     * class can be helpful.
-     * 
-     * Each event is JSON data. The data is stored in a single file in the flash file
-     * system. When it's time to publish, all of the events that will fit in the appropriate
-     * size will be aggregated into a single JSON array, reducing the number of data 
-     * operations and speeding the Particle event publishing process, which is limited to
-     * one event per second-ish.
+     * @brief Adjusts the data capture interval based on how much the signal is changing
+     * 
+     * A fixed data capture schedule oversamples a stable signal and undersamples one that is
+     * changing quickly. Instead, pass each sample to addSample(), which predicts the value 
+     * by linear extrapolation from the previous two samples. If the prediction error is less 
+     * than half the threshold, the interval is doubled, up to the maximum. If the error exceeds 
+     * the threshold, the interval drops back to the minimum.
+     * 
+     * Use SleepHelper::withAdaptiveSampling() to have the data capture and sleep times come 
+     * from this object instead of the data capture schedule. The state is kept in RAM, which
+     * is preserved in ULTRA_LOW_POWER sleep. After a reset, sampling restarts at the minimum
+     * interval.
      */
-    class EventHistory : public SleepHelperRecursiveMutex {
+    class AdaptiveSampler {
     public:
-        EventHistory() {};
+        /**
+         * @brief Default constructor
+         */
+        AdaptiveSampler() {};
 
         /**
-         * @brief Sets the path of the event history file
+         * @brief Sets the minimum and maximum interval between samples (default: 2 to 30 minutes)
          * 
-         * @param path 
-         * @return EventHistory& 
+         * @param minInterval Minimum interval, used while the signal is changing
+         * @param maxInterval Maximum interval, used while the signal is stable
+         * @return AdaptiveSampler& 
          */
-        EventHistory &withPath(const char *path) {
-            this->path = path;
+        AdaptiveSampler &withIntervalRange(std::chrono::seconds minInterval, std::chrono::seconds maxInterval) {
+            this->minIntervalSec = (minInterval.count() > 0) ? (int)minInterval.count() : 1;
+            this->maxIntervalSec = (maxInterval.count() > this->minIntervalSec) ? (int)maxInterval.count() : this->minIntervalSec;
+            intervalSec = this->minIntervalSec;
             return *this;
         }
 
         /**
-         * @brief Adds an event to the event history
-         * 
-         * @param jsonObj Must be a string containing a JSON object (including the surrounding {}).
+         * @brief Sets the prediction error that is considered a change in the signal (default: 1.0)
          * 
-         * If the data you want to send is an array, you should encapsulate the array under a key in the outermost
-         * object. If the data is just a single primitive such as a number or string, also surround it with
-         * a key and object.
+         * @param threshold Threshold, in the units of the sample value
+         * @return AdaptiveSampler& 
          */
-        void addEvent(const char *jsonObj);
+        AdaptiveSampler &withThreshold(float threshold) {
+            this->threshold = threshold;
+            return *this;
+        }
 
         /**
-         * @brief Adds an event to the event history using a callback and writer
-         * 
-         * @param callback The callback function, typically a lambda
-         * @return EventCombiner& 
-         * 
-         * The callback/lambda has this prototype:
-         * 
-         * void callback(JSONWriter &writer)
-         * 
-         * You typically use it like:
-         * 
-         * SleepHelper::instance().addEvent([](JSONWriter &writer) {
-		 *      writer.name("b").value(1111)
-         *            .name("c").value("testing!");
-		 * });
+         * @brief Adds a sample and calculates the next capture time
          * 
-         * This is using the addEvent method of SleepHelper(), which just calls this
-         * method on the correct object.
-         */;
-        void addEvent(std::function<void(JSONWriter &)>callback);
+         * @param value Sample value
+         * @param now Sample time (Unix time, UTC)
+         * @return time_t Time of the next capture (Unix time, UTC)
+         */
+        time_t addSample(float value, time_t now);
 
         /**
-         * @brief Get saved events and insert them as an array to writer
+         * @brief Adds a sample at the current time (Time.now()) and calculates the next capture time
          * 
-         * @param writer 
-         * @param maxSize 
-         * @param removeEvents 
-         * @return true 
-         * @return false 
-         * 
-         * If there are no events (getHasEvent() == false), this method returns quickly
-         * so there is no need to preflight this call with a test for having events.
+         * @param value Sample value
+         * @return time_t Time of the next capture (Unix time, UTC)
          */
-        bool getEvents(JSONWriter &writer, size_t maxSize, bool removeEvents = true);
-        
+        time_t addSample(float value) {
+            return addSample(value, Time.now());
+        }
+
         /**
-         * @brief Remove the events last retrieved using getEvents
-         * 
-         * By default, events are removed automatically so there is no need to call
-         * this. The function exists so you can do a two-phase removal. 
-         * 
-         * It's safe to add events in the time period between getEvents() and
-         * removeEvents() however you should not have multiple getEvents() in a row
-         * or from different threads, as you will get the same events multiple times
-         * and data corruption can occur.
-         * 
-         * If the device resets between getEvents() and removeEvents(), the events
-         * will be sent again later.
+         * @brief Discard previous samples and restart at the minimum interval
          */
-        void removeEvents();
+        void reset();
 
         /**
-         * @brief Returns true if there are events to get using getEvents
-         * 
-         * @return true 
-         * @return false 
-         * 
-         * This operation is fast, just checks a flag variable. It's not necessary to
-         * check before calling getEvents(), because that method has the same check
-         * internally.
-         * 
-         * Except for the first run after wake, when it needs to check the file
-         * system to see if there is a file that was not processed before reboot.
-         * This is why this method is not const.
+         * @brief Gets the time of the next capture (Unix time, UTC), or 0 if there have been no samples
          */
-        bool getHasEvents();
+        time_t getNextCaptureTime() const {
+            return (sampleCount > 0) ? (sampleTime[0] + intervalSec) : 0;
+        }
+
+        /**
+         * @brief Gets the current interval in seconds
+         */
+        int getIntervalSec() const {
+            return intervalSec;
+        }
+
+        /**
+         * @brief Gets the minimum interval in seconds
+         */
+        int getMinIntervalSec() const {
+            return minIntervalSec;
+        }
 
-    protected:
         /**
-         * This class cannot be copied
+         * @brief Gets the effective interval between samples in seconds
+         * 
+         * This is an exponentially weighted moving average of the actual intervals between 
+         * samples, so it reflects the effective sample rate over roughly the last 8 samples.
+         * It's 0 until there have been two samples.
          */
-        EventHistory(const EventHistory&) = delete;
+        float getEffectiveIntervalSec() const {
+            return effectiveIntervalSec;
+        }
 
         /**
-         * This class cannot be copied
+         * @brief Gets the number of samples since boot or reset()
          */
-        EventHistory& operator=(const EventHistory&) = delete;
+        uint32_t getSampleCount() const {
+            return sampleCount;
+        }
 
-        String path; //!< path to the event history file
-        bool firstRun = true; //!< Used to flag the first time the file has been accessed
-        bool hasEvents = false; //!< True if there are events in the event history file
-        size_t removeOffset = 0; //!< Where to remove events from
+    protected:
+        int minIntervalSec = 120; //!< Minimum interval in seconds
+        int maxIntervalSec = 1800; //!< Maximum interval in seconds
+        float threshold = 1.0; //!< Prediction error that is considered a change
+        int intervalSec = 120; //!< Current interval in seconds
+        time_t sampleTime[2] = { 0, 0 }; //!< Time of the most recent sample [0] and previous sample [1]
+        float sampleValue[2] = { 0, 0 }; //!< Value of the most recent sample [0] and previous sample [1]
+        uint32_t sampleCount = 0; //!< Number of samples
+        float effectiveIntervalSec = 0; //!< Moving average of the actual interval
     };
-    #endif // HAL_PLATFORM_FILESYSTEM || defined(UNITTEST)
 
-    #if HAL_PLATFORM_FILESYSTEM || defined(UNITTEST)
     /**
-     * @brief Class to handle building JSON events from multiple callbacks with priority 
-     * and the ability to generate multiple events if necessary
-     * 
-     * The idea is that you want to combine all of the data into a single event if possible
-     * to minimize data operations. Sometimes you have unimportant data that would be nice
-     * to include if there's space but omit if not. And sometimes you have important 
-     * data that must be sent, and it's OK to send multiple events if necessary.
-     * 
-     * This class also has a priority-based de-duplication of keys.
+     * @brief Captures a burst of samples at a high rate into a RAM buffer, then reduces it to a single record
+     *
+     * This is used for things like vibration or current monitoring, where you need to sample at 10 to 100 Hz
+     * for a few seconds. Saving each sample in the event history would require a flash write per sample,
+     * so instead the samples are stored in a preallocated ring buffer and reduced to summary statistics, a
+     * downsampled waveform, and a frequency spectrum, which are stored as one event history record.
+     *
+     * On the device, sampling is done from a software timer at the sample rate. The sample function is called
+     * from the timer thread, so it must be fast and should not block. If more samples are taken than the
+     * buffer holds, the oldest samples are overwritten.
+     *
+     * All buffers are allocated in the constructor, so a capture does not allocate memory. The memory
+     * used is 4 bytes per sample for the ring buffer and 8 bytes per sample (rounded down to a power of 2)
+     * for the spectrum calculation.
+     *
+     * Use SleepHelper::withBurstCapture() to run a burst capture as a data capture function.
      */
-    class EventCombiner {
+    class BurstCapture {
     public:
         /**
-         * @brief Container to hold a JSON fragment and a priority value 0 - 100.
-         * 
-         * Note that this is only a fragment, basically an object without the surrounding {}!
+         * @brief Summary statistics for the samples in the buffer
          */
-        class EventInfo {
+        class Stats {
         public:
-            String json; //!< JSON fragment, an object without the surrounding {}
-            int priority = 0; //!< Priority 0 - 100 inclusive.
-            std::vector<String> keys; //!< Top level keys
+            size_t count = 0; //!< Number of samples
+            float mean = 0; //!< Mean (average) value
+            float rms = 0; //!< Root mean square value
+            float peak = 0; //!< Largest absolute value
+            float min = 0; //!< Minimum value
+            float max = 0; //!< Maximum value
         };
 
+        static const uint32_t REDUCE_STATS      = 0x0001; //!< Include count, mean, RMS, peak, min, and max in the summary
+        static const uint32_t REDUCE_DOWNSAMPLE = 0x0002; //!< Include a downsampled waveform (array) in the summary
+        static const uint32_t REDUCE_SPECTRUM   = 0x0004; //!< Include the FFT magnitude in frequency bins (array) in the summary
+
         /**
-         * @brief Default constructor
-         * 
-         * Use withCallback to add callback functions
+         * @brief Construct a burst capture object
+         *
+         * @param capacity Maximum number of samples to store. The buffer is allocated here.
          */
-        EventCombiner() {};
+        BurstCapture(size_t capacity);
 
         /**
-         * @brief Adds a callback function to generate JSON data
-         * 
-         * @param fn 
-         * @return EventCombiner& 
-         * 
-         * The callback function has this prototype:
-         * 
-         * bool callback(JSONWriter &writer, int &priority)
-         * 
-         * The return value is ignored; you should return true.
-         * 
-         * writer is the JSONWriter to store the data into
-         * priority should be set to a value from 1 to 100. If you leave it at zero your data will not be saved!
-         * 
-         * Items are added to the event in priority order, largest first.
-         * 
-         * If you have a priority < 50 and the event is full, then your data will be discarded to 
-         * avoid generating another event.
+         * @brief Destructor
+         */
+        virtual ~BurstCapture();
+
+        /**
+         * @brief Sets the JSON key the summary is stored under in the event history. Default: "burst"
+         *
+         * @param key
+         * @return BurstCapture&
          */
-        EventCombiner &withCallback(std::function<bool(JSONWriter &, int &)> fn) { 
-            callbacks.add(fn); 
+        BurstCapture &withKey(const char *key) {
+            this->key = key;
             return *this;
         }
 
         /**
-         * @brief Add a callback that is removed after generating events
-         * 
-         * @param fn 
-         * @return EventCombiner& 
+         * @brief Sets the sample rate in Hz. Default: 100. Maximum: 1000.
+         *
+         * @param sampleRateHz
+         * @return BurstCapture&
+         *
+         * The timer period is a whole number of milliseconds, so the rate is changed to the nearest 
+         * rate that divides 1000 evenly: 1000, 500, 250, 200, 125, 100, 50, 40, 25, 20, 10, 8, 5, 4, 
+         * 2, or 1 Hz. Use getSampleRateHz() to get the rate that is used.
          */
-        EventCombiner &withOneTimeCallback(std::function<bool(JSONWriter &, int &)> fn) { 
-            oneTimeCallbacks.add(fn); 
+        BurstCapture &withSampleRateHz(int sampleRateHz) {
+            this->sampleRateHz = getNearestSampleRateHz(sampleRateHz);
             return *this;
         }
 
         /**
-         * @brief Sets parameters for the EventHistory feature
-         * 
-         * @param path path to store the event history
-         * @param key JSON key to publish event history items under
-         * @return EventCombiner& 
+         * @brief Gets the sample rate in Hz, which is also reported as "hz" in the summary
          */
-        EventCombiner &withEventHistory(const char *path, const char *key) {
-            eventHistory.withPath(path);
-            this->eventHistoryKey = key;
-            return *this;
+        int getSampleRateHz() const {
+            return sampleRateHz;
         }
 
         /**
-         * @brief Adds an event to the event history (preformatted JSON)
-         * 
-         * @param jsonObj A string containing a complete JSON object surrounded by {}
-         * 
-         * See the version with a callback for an easier way to build the JSON.
+         * @brief Gets the rate closest to sampleRateHz that has a whole number of milliseconds period
+         *
+         * @param sampleRateHz Requested rate in Hz
+         * @return int A rate that divides 1000 evenly, from 1 to 1000
          */
-        EventCombiner &addEvent(const char *jsonObj) {
-            eventHistory.addEvent(jsonObj);
+        static int getNearestSampleRateHz(int sampleRateHz);
+
+        /**
+         * @brief Sets the duration of the burst. Default: 1 second.
+         *
+         * @param duration Duration as a chrono literal, such as 3s for 3 seconds.
+         * @return BurstCapture&
+         */
+        BurstCapture &withDuration(std::chrono::milliseconds duration) {
+            durationMs = (system_tick_t) duration.count();
             return *this;
         }
 
         /**
-         * @brief Adds an event to the event history using a callback and writer
-         * 
-         * @param callback The callback function, typically a lambda
-         * @return EventCombiner& 
-         * 
-         * The callback/lambda has this prototype:
-         * 
-         * void callback(JSONWriter &writer)
-         * 
-         * You typically use it like:
-         * 
-         * SleepHelper::instance().addEvent([](JSONWriter &writer) {
-		 *      writer.name("b").value(1111)
-         *            .name("c").value("testing!");
-		 * });
+         * @brief Sets the function that takes a sample
+         *
+         * @param fn Function or lambda with the prototype float callback()
+         * @return BurstCapture&
+         *
+         * This is called from the timer thread so it must be fast and should not block.
          */
-        EventCombiner &addEvent(std::function<void(JSONWriter &)>callback) {
-            eventHistory.addEvent(callback);
+        BurstCapture &withSampleFunction(std::function<float()> fn) {
+            sampleFunction = fn;
             return *this;
         }
 
+        /**
+         * @brief Sets which reductions are included in the summary. Default: all.
+         *
+         * @param flags REDUCE_STATS, REDUCE_DOWNSAMPLE, and REDUCE_SPECTRUM logically ORed together
+         * @return BurstCapture&
+         */
+        BurstCapture &withReductions(uint32_t flags) {
+            reductions = flags;
+            return *this;
+        }
 
         /**
-         * @brief Generate one or more events based on the maximum event size
-         * 
-         * @param events vector of String objects to fill in with event data
-         * 
-         * The events vector you pass into this method will be cleared. It will be returned filled in
-         * with zero or more Strings, each containing event data in valid JSON format.
+         * @brief Sets the number of points in the downsampled waveform. Default: 16.
+         *
+         * @param points
+         * @return BurstCapture&
          */
-        void generateEvents(std::vector<String> &events);
+        BurstCapture &withDownsamplePoints(size_t points) {
+            downsamplePoints = points;
+            return *this;
+        }
 
         /**
-         * @brief generate one or more events based on desired size
-         * 
-         * @param events vector of String objects to fill in with event data
-         * @param maxSize Maximum size of each even in bytes
-         * 
-         * The events vector you pass into this method will be cleared. It will be returned filled in
-         * with zero or more Strings, each containing event data in valid JSON format.
+         * @brief Sets the number of frequency bins in the spectrum summary. Default: 8.
+         *
+         * @param bins
+         * @return BurstCapture&
+         *
+         * The bins evenly divide the range from 0 Hz to half the sample rate.
          */
-        void generateEvents(std::vector<String> &events, size_t maxSize);
+        BurstCapture &withSpectrumBins(size_t bins) {
+            spectrumBins = bins;
+            return *this;
+        }
 
         /**
-         * @brief Clear the one-time callbacks
-         * 
-         * This is done automatically after generateEvents, but can be done manually in unusual cases.
+         * @brief Sets the number of decimal places for values in the summary. Default: 3.
+         *
+         * @param places
+         * @return BurstCapture&
          */
-        void clearOneTimeCallbacks() {
-            oneTimeCallbacks.removeAll();
+        BurstCapture &withDecimalPlaces(int places) {
+            decimalPlaces = places;
+            return *this;
         }
 
+        /**
+         * @brief Remove all samples from the buffer
+         */
+        void clear();
+
+        /**
+         * @brief Add a sample to the buffer
+         *
+         * @param value
+         *
+         * This is normally called from the timer, but you can also call it directly.
+         */
+        void addSample(float value);
+
+        /**
+         * @brief Get the number of samples in the buffer
+         */
+        size_t getCount() const { return count; };
+
+        /**
+         * @brief Get the maximum number of samples in the buffer
+         */
+        size_t getCapacity() const { return samples.size(); };
+
+        /**
+         * @brief Get a sample from the buffer
+         *
+         * @param index 0 is the oldest sample
+         * @return float
+         */
+        float getSample(size_t index) const;
+
+        /**
+         * @brief Clear the buffer and start sampling from the timer
+         *
+         * @return true Sampling started
+         * @return false There is no sample function or buffer
+         */
+        bool start();
+
+        /**
+         * @brief Stop sampling
+         */
+        void stop();
+
+        /**
+         * @brief Returns true if sampling is in progress
+         */
+        bool isRunning() const { return running; };
+
+        /**
+         * @brief Calculate the summary statistics for the samples in the buffer
+         *
+         * @param stats Filled in with the statistics
+         */
+        void getStats(Stats &stats) const;
+
+        /**
+         * @brief Get a downsampled waveform by averaging adjacent samples
+         *
+         * @param values Array to fill in
+         * @param numPoints Number of points to fill in
+         * @return size_t Number of points filled in, less than numPoints if there are not enough samples
+         */
+        size_t getDownsampled(float *values, size_t numPoints) const;
+
+        /**
+         * @brief Calculate the frequency spectrum summary
+         *
+         * @param bins Array to fill in with the largest amplitude in each frequency bin
+         * @param numBins Number of bins
+         * @return size_t Number of bins filled in. 0 if there are too few samples.
+         *
+         * The FFT is done on the most recent samples, the largest power of 2 that is not larger than
+         * the number of samples. The mean is removed first, so bins are the AC amplitude.
+         */
+        size_t getSpectrum(float *bins, size_t numBins);
+
+        /**
+         * @brief Write the summary JSON to a writer
+         *
+         * @param writer The writer, which must be inside an object. The summary is added as an object under key.
+         */
+        void writeSummary(JSONWriter &writer);
+
     protected:
         /**
          * This class cannot be copied
          */
-        EventCombiner(const EventCombiner&) = delete;
+        BurstCapture(const BurstCapture&) = delete;
 
         /**
          * This class cannot be copied
          */
-        EventCombiner& operator=(const EventCombiner&) = delete;
+        BurstCapture& operator=(const BurstCapture&) = delete;
 
         /**
-         * @brief Used internally to generate events based on priority
-         * 
-         * @param callback The callback to call
-         * @param buf The event buffer
-         * @param maxSize The size of the event buffer
-         * @param infoArray Data to be added to the event
-         * 
-         * A separate function is used because the process is run twice, once for the regular callbacks and once for the one-time callbacks.
+         * @brief Called from the timer at the sample rate
          */
-        void generateEventInternal(std::function<void(JSONWriter &, int &)> callback, char *buf, size_t maxSize, std::vector<EventInfo> &infoArray);
+        void timerCallback();
 
-        AppCallback<JSONWriter &, int &> callbacks; //!< Callback functions
-        AppCallback<JSONWriter &, int &> oneTimeCallbacks; //!< One-time use callback functions 
-        EventHistory eventHistory; //!< Event history
-        String eventHistoryKey; //!< Key to use when publishing the event history
+        /**
+         * @brief In-place radix-2 FFT on fftBuffer (interleaved real and imaginary values)
+         *
+         * @param n Number of complex values, must be a power of 2
+         */
+        void fft(size_t n);
+
+        std::vector<float> samples; //!< Ring buffer of samples, allocated in the constructor
+        std::vector<float> fftBuffer; //!< Scratch buffer for the FFT, allocated in the constructor
+        size_t head = 0; //!< Index in samples to write the next sample to
+        volatile size_t count = 0; //!< Number of valid samples in samples
+        volatile size_t samplesRemaining = 0; //!< Number of samples left to take in this burst
+        volatile bool running = false; //!< True while sampling
+
+        String key = "burst"; //!< JSON key for the summary
+        int sampleRateHz = 100; //!< Sample rate in Hz
+        system_tick_t durationMs = 1000; //!< Burst duration in milliseconds
+        uint32_t reductions = REDUCE_STATS | REDUCE_DOWNSAMPLE | REDUCE_SPECTRUM; //!< Which reductions to include in the summary
+        size_t downsamplePoints = 16; //!< Number of points in the downsampled waveform
+        size_t spectrumBins = 8; //!< Number of bins in the spectrum summary
+        int decimalPlaces = 3; //!< Decimal places for values in the summary
+        std::function<float()> sampleFunction = 0; //!< Function to take a sample
+
+#ifndef UNITTEST
+        Timer *timer = nullptr; //!< Sample timer, created on first start()
+#endif
     };
-    #endif // HAL_PLATFORM_FILESYSTEM || defined(UNITTEST)
 
     /**
      * @brief Class to hold data to be published by Particle.publish
@@ -1311,6 +4591,7 @@ public:
      * @brief Register a function to be called to configure sleep
      * 
      * @param fn Callback function or C++11 lambda to call.
+     * @param name Name to identify the callback in callback statistics (optional), see withCallbackStats()
      * @return SleepHelper& 
      * 
      * The callback function has the prototype:
@@ -1324,8 +4605,9 @@ public:
      * 
      * @ingroup callbacks
      */
-    SleepHelper &withSleepConfigurationFunction(std::function<bool(SystemSleepConfiguration &, SleepConfigurationParameters&)> fn) { 
-        sleepConfigurationFunctions.add(fn); 
+    template<class F>
+    SleepHelper &withSleepConfigurationFunction(F &&fn, const char *name = nullptr) {
+        sleepConfigurationFunctions.add(std::forward<F>(fn), name);
         return *this;
     }
 
@@ -1333,6 +4615,7 @@ public:
      * @brief Register a function to be called on wake from sleep
      * 
      * @param fn Callback function or C++11 lambda to call.
+     * @param name Name to identify the callback in callback statistics (optional), see withCallbackStats()
      * @return SleepHelper& 
      * 
      * The wake function has the prototype:
@@ -1345,8 +4628,9 @@ public:
      * 
      * @ingroup callbacks
      */
-    SleepHelper &withWakeFunction(std::function<bool(const SystemSleepResult &)> fn) { 
-        wakeFunctions.add(fn); 
+    template<class F>
+    SleepHelper &withWakeFunction(F &&fn, const char *name = nullptr) {
+        wakeFunctions.add(std::forward<F>(fn), name);
         return *this;
     }
 
@@ -1369,70 +4653,178 @@ public:
      * @param timeMs 
      * @return SleepHelper& 
      * 
-     * If the time to sleep is less than that, we stay awake until the event occurs.
+     * If the time to sleep is less than that, we stay awake until the event occurs.
+     */
+    SleepHelper &withMinimumSleepTimeMs(std::chrono::milliseconds timeMs) { 
+        minimumSleepTimeMs = timeMs.count();
+        return *this;
+    }
+
+    /**
+     * @brief Offset scheduled full wakes by a per-device amount to spread cloud load
+     * 
+     * @param maxSpread The maximum offset, such as 5min. The offset for each device will be between 0 
+     * and this value, inclusive. Pass 0s to disable (the default).
+     * @param dataCapture Also apply the offset to the data capture schedule. Default: false.
+     * @return SleepHelper& 
+     * 
+     * If a large number of devices use the same full wake schedule, they all connect to the cloud and 
+     * publish during the same second, which can cause webhook servers to throttle requests. The 
+     * offset is calculated from a hash of the Device ID, so it's different for each device but 
+     * the same on every wake cycle for a given device.
+     * 
+     * The maximum offset should be less than the full wake schedule interval. When the data capture
+     * schedule is not offset, a full wake that does not coincide with a data capture will require 
+     * a separate wake.
+     */
+    SleepHelper &withWakeJitter(std::chrono::seconds maxSpread, bool dataCapture = false) { 
+        wakeJitterMaxSec = (int) maxSpread.count();
+        wakeJitterDataCapture = dataCapture;
+        return *this;
+    }
+
+    /**
+     * @brief Get the per-device wake offset in seconds
+     * 
+     * @return int Offset in seconds, 0 if withWakeJitter() has not been used. Only valid after setup().
+     */
+    int getWakeJitterSec() const {
+        return wakeJitterSec;
+    }
+
+#endif
+
+
+
+    /**
+     * @brief Adds a function to be called during setup()
+     * 
+     * @param fn Callback function or C++11 lambda to call.
+     * @param name Name to identify the callback in callback statistics (optional), see withCallbackStats()
+     * @return SleepHelper& 
+     * 
+     * You must register this callback before actually calling setup() for obvious
+     * reasons. You will probably never need to use this, but it exists just in case.
+     * 
+     * @ingroup callbacks
+     */
+    template<class F>
+    SleepHelper &withSetupFunction(F &&fn, const char *name = nullptr) {
+        setupFunctions.add(std::forward<F>(fn), name);
+        return *this;
+    }
+
+    /**
+     * @brief Adds a function to be called on every call to loop()
+     * 
+     * @param fn Callback function or C++11 lambda to call.
+     * @param name Name to identify the callback in callback statistics (optional), see withCallbackStats()
+     * @return SleepHelper& 
+     * 
+     * You will normally register a more specific function, such as a data capture function, no connect function, etc.
+     * but this function is provided just in case.
+     * 
+     * @ingroup callbacks
+     */
+    template<class F>
+    SleepHelper &withLoopFunction(F &&fn, const char *name = nullptr) {
+        loopFunctions.add(std::forward<F>(fn), name);
+        return *this;
+    }
+
+    /**
+     * @brief The data capture function is called on a schedule to capture data
+     * 
+     * @param fn Callback function or C++11 lambda to call.
+     * @param name Name to identify the callback in callback statistics (optional), see withCallbackStats()
+     * @return SleepHelper& 
+     * 
+     * The callback has this prototype
+     * 
+     * bool callback()
+     * 
+     * Return true if you need to be called back to finish capturing data
+     * 
+     * Return false if you are done capturing data.
+     * 
+     * This callback is called for quick wake, full wake, and while connected. It
+     * runs in a parallel state machine to the connection state machine. 
+     * 
+     * @ingroup callbacks
      */
-    SleepHelper &withMinimumSleepTimeMs(std::chrono::milliseconds timeMs) { 
-        minimumSleepTimeMs = timeMs.count();
+    template<class F>
+    SleepHelper &withDataCaptureFunction(F &&fn, const char *name = nullptr) {
+        dataCaptureFunctions.add(std::forward<F>(fn), name);
         return *this;
     }
 
-#endif
-
-
-
     /**
-     * @brief Adds a function to be called during setup()
+     * @brief Add a data capture function that uses a shared resource such as a bus
      * 
      * @param fn Callback function or C++11 lambda to call.
+     * @param name Name to identify the callback in callback statistics, or nullptr
+     * @param lockGroup Pointer that identifies the shared resource, such as &Wire 
      * @return SleepHelper& 
      * 
-     * You must register this callback before actually calling setup() for obvious
-     * reasons. You will probably never need to use this, but it exists just in case.
+     * With withParallelDataCapture(), data capture functions with the same lockGroup
+     * are never run at the same time. Without it, this is the same as withDataCaptureFunction().
+     * 
+     * The lockGroup only orders the data capture functions; it does not lock the resource. If 
+     * other code, such as loop() or another thread, uses the same resource, pass the resource
+     * itself instead of a pointer to it so it's locked.
      * 
      * @ingroup callbacks
      */
-    SleepHelper &withSetupFunction(std::function<bool()> fn) { 
-        setupFunctions.add(fn);
+    template<class F>
+    SleepHelper &withDataCaptureFunction(F &&fn, const char *name, const void *lockGroup) {
+        dataCaptureFunctions.add(std::forward<F>(fn), name);
+        dataCaptureFunctions.callbackState.back().lockGroup = lockGroup;
         return *this;
     }
 
     /**
-     * @brief Adds a function to be called on every call to loop()
+     * @brief Add a data capture function that locks a shared resource while it runs
      * 
      * @param fn Callback function or C++11 lambda to call.
+     * @param name Name to identify the callback in callback statistics, or nullptr
+     * @param resource Object with lock() and unlock() methods, such as Wire, a std::recursive_mutex,
+     * or a SleepHelperRecursiveMutex. It must remain valid.
      * @return SleepHelper& 
      * 
-     * You will normally register a more specific function, such as a data capture function, no connect function, etc.
-     * but this function is provided just in case.
+     * The resource is locked during each call to fn, so other code that locks the resource cannot 
+     * use it at the same time. It's also the lockGroup, so with withParallelDataCapture() the 
+     * data capture functions that use it run one after another.
      * 
      * @ingroup callbacks
      */
-    SleepHelper &withLoopFunction(std::function<bool()> fn) { 
-        loopFunctions.add(fn); 
+    template<class F, class L, class = typename std::enable_if<!std::is_pointer<L>::value>::type>
+    SleepHelper &withDataCaptureFunction(F &&fn, const char *name, L &resource) {
+        dataCaptureFunctions.add(std::forward<F>(fn), name);
+        dataCaptureFunctions.callbackState.back().setLockResource(resource);
         return *this;
     }
 
     /**
-     * @brief The data capture function is called on a schedule to capture data
+     * @brief Run data capture functions on worker threads instead of from loop()
      * 
-     * @param fn Callback function or C++11 lambda to call.
+     * @param numWorkers Number of worker threads (default: 2)
+     * @param stackSize Stack size for each worker thread in bytes (default: 3072)
      * @return SleepHelper& 
      * 
-     * The callback has this prototype
-     * 
-     * bool callback()
-     * 
-     * Return true if you need to be called back to finish capturing data
-     * 
-     * Return false if you are done capturing data.
-     * 
-     * This callback is called for quick wake, full wake, and while connected. It
-     * runs in a parallel state machine to the connection state machine. 
+     * Each data capture function runs on a worker thread until it returns false, so a slow 
+     * sensor does not delay the other data capture functions or the connection state machine.
+     * The wake event is not generated until all of the data capture functions have finished,
+     * and the device does not sleep while a worker thread is still running one, even after a 
+     * connection timeout.
      * 
-     * @ingroup callbacks
+     * Your data capture functions must be thread-safe. Register functions that share a bus with 
+     * the bus, such as Wire, as the lock resource (see withDataCaptureFunction()). Adding to the 
+     * event history is thread-safe.
      */
-    SleepHelper &withDataCaptureFunction(std::function<bool(AppCallbackState &state)> fn) {
-        dataCaptureFunctions.add(fn);
+    SleepHelper &withParallelDataCapture(size_t numWorkers = 2, size_t stackSize = 3072) {
+        if (!dataCaptureWorkers) {
+            dataCaptureWorkers = new DataCaptureWorkers(numWorkers, stackSize);
+        }
         return *this;
     }
 
@@ -1440,6 +4832,7 @@ public:
      * @brief Determine if it's OK to sleep now, when in connected state
      * 
      * @param fn Callback function or C++11 lambda to call.
+     * @param name Name to identify the callback in callback statistics (optional), see withCallbackStats()
      * @return SleepHelper& 
      * 
      * The sleep ready function prototype is:
@@ -1455,8 +4848,9 @@ public:
      * 
      * @ingroup callbacks
      */
-    SleepHelper &withSleepReadyFunction(std::function<bool(AppCallbackState &, system_tick_t)> fn) {
-        sleepReadyFunctions.add(fn); 
+    template<class F>
+    SleepHelper &withSleepReadyFunction(F &&fn, const char *name = nullptr) {
+        sleepReadyFunctions.add(std::forward<F>(fn), name);
         return *this;
     }
 
@@ -1464,6 +4858,7 @@ public:
      * @brief Function to call to determine if a full wake should be done
      * 
      * @param fn Callback function or C++11 lambda to call.
+     * @param name Name to identify the callback in callback statistics (optional), see withCallbackStats()
      * @return SleepHelper& 
      * 
      * The callback has the prototype:
@@ -1484,8 +4879,9 @@ public:
      * 
      * @ingroup callbacks
      */
-    SleepHelper &withShouldConnectFunction(std::function<bool(int &connectConviction, int &noConnectConviction)> fn) { 
-        shouldConnectFunctions.add(fn); 
+    template<class F>
+    SleepHelper &withShouldConnectFunction(F &&fn, const char *name = nullptr) {
+        shouldConnectFunctions.add(std::forward<F>(fn), name);
         return *this; 
     }
 
@@ -1493,6 +4889,7 @@ public:
      * @brief Called during setup, after sleep, or an aborted sleep because duration was too short
      * 
      * @param fn 
+     * @param name Name to identify the callback in callback statistics (optional), see withCallbackStats()
      * @return SleepHelper& 
      * 
      * - WAKEUP_REASON_SETUP Called from setup after cold boot or reset
@@ -1506,8 +4903,9 @@ public:
      * 
      * @ingroup callbacks
      */
-    SleepHelper &withWakeOrBootFunction(std::function<bool(int)> fn) { 
-        wakeOrBootFunctions.add(fn); 
+    template<class F>
+    SleepHelper &withWakeOrBootFunction(F &&fn, const char *name = nullptr) {
+        wakeOrBootFunctions.add(std::forward<F>(fn), name);
         return *this;
     }
 
@@ -1555,8 +4953,9 @@ public:
      * 
      * @ingroup callbacks
      */
-    SleepHelper &withWakeEventFunction(std::function<bool(JSONWriter &, int &)> fn) {
-        wakeEventFunctions.withCallback(fn);
+    template<class F>
+    SleepHelper &withWakeEventFunction(F &&fn) {
+        wakeEventFunctions.withCallback(std::forward<F>(fn));
         return *this;
     }
 #endif // HAL_PLATFORM_FILESYSTEM || defined(UNITTEST)
@@ -1571,8 +4970,9 @@ public:
      * 
      * @ingroup callbacks
      */
-    SleepHelper &withWakeEventOneTimeFunction(std::function<bool(JSONWriter &, int &)> fn) {
-        wakeEventFunctions.withOneTimeCallback(fn);
+    template<class F>
+    SleepHelper &withWakeEventOneTimeFunction(F &&fn) {
+        wakeEventFunctions.withOneTimeCallback(std::forward<F>(fn));
         return *this;
     }
 #endif // HAL_PLATFORM_FILESYSTEM || defined(UNITTEST)
@@ -1589,13 +4989,14 @@ public:
      */
     SleepHelper &withWakeEventFlagOneTimeFunction(uint64_t flag, std::function<void(JSONWriter &, int &)> fn) {
         if ((eventsEnabled & flag) != 0) {
-            wakeEventFunctions.withOneTimeCallback([flag, fn](JSONWriter &writer, int &priority) {
+            // Capturing fn, a std::function, is too large to store inline, so store it as a std::function
+            wakeEventFunctions.withOneTimeCallback(std::function<bool(JSONWriter &, int &)>([flag, fn](JSONWriter &writer, int &priority) {
                 const char *name = eventsEnableName(flag);
                 writer.name(name);
                 priority = eventsEnablePriority(flag);
                 fn(writer, priority);
                 return true;
-            });
+            }));
         }
         return *this;
     }
@@ -1653,6 +5054,7 @@ public:
      * @brief Adds a function to be called right before sleep or reset.
      * 
      * @param fn A function or lambda to call. The bool result is ignored.
+     * @param name Name to identify the callback in callback statistics (optional), see withCallbackStats()
      * 
      * @return SleepHelper& 
      * 
@@ -1666,8 +5068,9 @@ public:
      * 
      * @ingroup callbacks
      */
-    SleepHelper &withSleepOrResetFunction(std::function<bool(bool)> fn) { 
-        sleepOrResetFunctions.add(fn); 
+    template<class F>
+    SleepHelper &withSleepOrResetFunction(F &&fn, const char *name = nullptr) {
+        sleepOrResetFunctions.add(std::forward<F>(fn), name);
         return *this;
     }
 
@@ -1675,6 +5078,7 @@ public:
      * @brief Adds a function to be called while connecting
      * 
      * @param fn 
+     * @param name Name to identify the callback in callback statistics (optional), see withCallbackStats()
      * @return SleepHelper& 
      * 
      * Function or lambda prototype:
@@ -1688,8 +5092,9 @@ public:
      * 
      * @ingroup callbacks
      */
-    SleepHelper &withMaximumTimeToConnectFunction(std::function<bool(system_tick_t ms)> fn) {
-        maximumTimeToConnectFunctions.add(fn); 
+    template<class F>
+    SleepHelper &withMaximumTimeToConnectFunction(F &&fn, const char *name = nullptr) {
+        maximumTimeToConnectFunctions.add(std::forward<F>(fn), name);
         return *this; 
     }
 
@@ -1739,12 +5144,14 @@ public:
      * does double duty as the whileConnected function.
      * 
      * @param fn 
+     * @param name Name to identify the callback in callback statistics (optional), see withCallbackStats()
      * @return SleepHelper& 
      * 
      * @ingroup callbacks
      */
-    SleepHelper &withNoConnectionFunction(std::function<bool(AppCallbackState &state)> fn) {
-        noConnectionFunctions.add(fn); 
+    template<class F>
+    SleepHelper &withNoConnectionFunction(F &&fn, const char *name = nullptr) {
+        noConnectionFunctions.add(std::forward<F>(fn), name);
         return *this;
     }
 
@@ -1756,7 +5163,10 @@ public:
      */
     SleepHelper &withMinimumConnectedTime(system_tick_t timeMs) { 
         return withSleepReadyFunction([timeMs](AppCallbackState &state, system_tick_t ms) {
-            return (ms < timeMs);
+            if (ms < timeMs) {
+                return state.sleepFor(timeMs - ms);
+            }
+            return false;
         }); 
     }
 
@@ -1768,10 +5178,260 @@ public:
      */
     SleepHelper &withMinimumConnectedTime(std::chrono::milliseconds timeMs) { 
         return withSleepReadyFunction([timeMs](AppCallbackState &state, system_tick_t ms) {
-            return (ms < timeMs.count());
+            if (ms < timeMs.count()) {
+                return state.sleepFor(timeMs.count() - ms);
+            }
+            return false;
         }); 
     }
 
+#if HAL_PLATFORM_FILESYSTEM || defined(UNITTEST)
+    /**
+     * @brief Run a burst capture as a data capture function
+     * 
+     * @param burst The BurstCapture object, typically a global. It must not be deleted after registering it.
+     * @return SleepHelper& 
+     * 
+     * On each scheduled data capture, the burst capture is started. Data capture continues until the
+     * burst is complete, then the samples are reduced to a single record that is added to the event
+     * history under the burst key.
+     */
+    SleepHelper &withBurstCapture(BurstCapture &burst) {
+        return withDataCaptureFunction([&burst](AppCallbackState &state) {
+            if (state.callbackState == AppCallbackState::CALLBACK_STATE_START) {
+                if (!burst.start()) {
+                    return false;
+                }
+                state.callbackState = 1;
+                return true;
+            }
+            if (burst.isRunning()) {
+                // Return true to keep being called until the burst is complete
+                return true;
+            }
+            burst.stop();
+
+            SleepHelper::instance().addEvent([&burst](JSONWriter &writer) {
+                burst.writeSummary(writer);
+            });
+            return false;
+        });
+    }
+
+    /**
+     * @brief Registers a SampleAggregator to add its summary records to the event history
+     * 
+     * @param aggregator The SampleAggregator object, typically a global. It must not be deleted after registering it.
+     * @return SleepHelper& 
+     * 
+     * The aggregator's persistent data is loaded during setup and saved when a window is closed 
+     * and before sleep or reset. 
+     * On every wake, a window that has ended is closed so the summary is included in the
+     * next publish, even if no samples have been added since the window ended.
+     */
+    SleepHelper &withSampleAggregator(SampleAggregator &aggregator) {
+        aggregator.withEventCombiner(wakeEventFunctions);
+
+        withSetupFunction([&aggregator]() {
+            aggregator.setup();
+            return true;
+        });
+        withWakeOrBootFunction([&aggregator](int) {
+            if (Time.isValid()) {
+                aggregator.checkWindow(Time.now());
+            }
+            return true;
+        });
+        return withSleepOrResetFunction([this, &aggregator](bool isReset) {
+            if (isReset || !getFileSystemWritesDeferred()) {
+                aggregator.saveChanges();
+                aggregator.flush(true);
+            }
+            return true;
+        });
+    }
+
+    /**
+     * @brief Registers a ReportByException filter to add reported samples to the event history
+     * 
+     * @param report The ReportByException object, typically a global. It must not be deleted after registering it.
+     * @return SleepHelper& 
+     * 
+     * The persistent data is loaded during setup and saved before sleep or reset. If an escalating 
+     * channel is breached, a ShouldConnect function votes to connect with the escalation conviction.
+     * This is checked again after data capture completes during a quick wake, so the device
+     * can connect without waiting for the next full wake. The escalation is only cleared once 
+     * connected, when the wake events are generated, so it is kept if another ShouldConnect 
+     * function vetoes the connection with a higher no connect conviction.
+     */
+    SleepHelper &withReportByException(ReportByException &report) {
+        report.withEventCombiner(wakeEventFunctions)
+            .withEscalationFunction([this]() {
+                requestConnectionCheck();
+            });
+
+        withSetupFunction([&report]() {
+            report.setup();
+            return true;
+        });
+        withShouldConnectFunction([&report](int &connectConviction, int &noConnectConviction) {
+            if (report.getEscalationPending()) {
+                connectConviction = report.getEscalationConviction();
+            }
+            return true;
+        });
+        wakeEventFunctions.withCallback([&report](JSONWriter &writer, int &priority) {
+            // Wake events are only generated when connected, so the escalation has been acted on.
+            // Nothing is written and priority stays 0, so this does not add to the event.
+            if (report.getEscalationPending()) {
+                report.clearEscalation();
+            }
+            return true;
+        });
+        return withSleepOrResetFunction([this, &report](bool isReset) {
+            if (isReset || !getFileSystemWritesDeferred()) {
+                report.flush(true);
+            }
+            return true;
+        });
+    }
+
+    /**
+     * @brief Use an AdaptiveSampler to determine when data capture occurs
+     * 
+     * @param sampler The AdaptiveSampler object, typically a global. It must not be deleted after registering it.
+     * @return SleepHelper& 
+     * 
+     * Your data capture function should call sampler.addSample() with the captured value. When 
+     * data capture completes, the next data capture time comes from the sampler instead of the 
+     * data capture schedule, and the device will wake from sleep at that time. You should not 
+     * set a data capture schedule (getScheduleDataCapture()) when using this.
+     * 
+     * If eventsEnabledSampleInterval is enabled, the effective sample interval is added to
+     * the wake event as "si" on full wake.
+     */
+    SleepHelper &withAdaptiveSampling(AdaptiveSampler &sampler) {
+        adaptiveSampler = &sampler;
+        return *this;
+    }
+
+    /**
+     * @brief Hold changes to SleepHelper persistent data in RAM and write them once per wake cycle
+     * 
+     * @param maxDelay Maximum time to hold changes before writing them (default: 1 minute)
+     * @return SleepHelper& 
+     * 
+     * The persistent data is written before sleep, on reset, or after maxDelay, whichever comes
+     * first. Use persistentData.getWritesAvoided() to see how many writes were saved.
+     */
+    SleepHelper &withPersistentDataWriteBehind(std::chrono::milliseconds maxDelay = std::chrono::minutes(1)) {
+        persistentData.withWriteBehind(maxDelay);
+        return *this;
+    }
+
+    /**
+     * @brief Wait in low-power mode when all callbacks are sleeping instead of polling on every loop
+     * 
+     * @param maxWait The maximum time to wait on a single loop (default: 100 milliseconds)
+     * @return SleepHelper& 
+     * 
+     * When data capture, no connection, and sleep ready callbacks use AppCallbackState::sleepFor(), 
+     * sleepUntil(), or waitUntil(), SleepHelper knows when the next one needs to run. With this enabled,
+     * loop() uses delay() until then, which allows the CPU to be idle. Since delay() still processes
+     * the cloud connection and other threads continue to run, maxWait only limits how long before
+     * loop() returns to your code. 
+     * 
+     * No wait is done if there are loop functions, because those expect to be called on every loop.
+     */
+    SleepHelper &withIdleWait(std::chrono::milliseconds maxWait = std::chrono::milliseconds(100)) {
+        idleWaitMaxMs = maxWait.count();
+        return *this;
+    }
+
+    /**
+     * @brief Returns the number of milliseconds loop() waited in low-power mode since boot
+     * 
+     * @return uint32_t Total idle wait time in milliseconds 
+     */
+    uint32_t getIdleWaitTotalMs() const { return idleWaitTotalMs; };
+
+    /**
+     * @brief Keep the primary copy of SleepHelper persistent data in retained memory
+     * 
+     * @param retainedData A global variable declared retained
+     * @param fileSaveInterval Minimum time between writes of the file mirror (default: 1 hour)
+     * @return SleepHelper& 
+     * 
+     * For example:
+     * 
+     * ```
+     * retained SleepHelper::PersistentData::RetainedData sleepHelperRetained;
+     * 
+     * SleepHelper::instance().withPersistentDataRetained(&sleepHelperRetained);
+     * ```
+     * 
+     * Quick wake cycles then update the retained copy only. The file is read only after a cold
+     * boot or if the retained copy is corrupted, and is written when the file save interval has
+     * elapsed, on reset, or before sleep when the battery is low.
+     */
+    SleepHelper &withPersistentDataRetained(PersistentData::RetainedData *retainedData, std::chrono::seconds fileSaveInterval = std::chrono::hours(1)) {
+        persistentData.withRetained(retainedData, fileSaveInterval);
+        return *this;
+    }
+
+    /**
+     * @brief Run quick wake cycles without accessing the flash file system
+     * 
+     * @param eventBufferBytes Maximum bytes of event history to hold in RAM between full wakes (default: 2048)
+     * @param maxDeferral Maximum time to hold changes to persistent data (default: 1 hour)
+     * @return SleepHelper& 
+     * 
+     * Event history events added during a quick wake are held in RAM, and persistent data changes are held 
+     * in RAM (write-behind mode) unless withPersistentDataRetained() is used. Both are written to the file 
+     * system at the next full wake, on reset, when the event buffer is full, or when maxDeferral has elapsed. 
+     * Changes to a SampleAggregator or ReportByException registered with SleepHelper are also held in RAM, 
+     * and are written before sleep at the end of the next full wake, or on reset.
+     * 
+     * RAM is preserved in ULTRA_LOW_POWER sleep, the default sleep mode, and STOP mode. If a sleep 
+     * configuration function selects HIBERNATE, everything held in RAM is written before sleep.
+     * 
+     * The time from wake to sleep for the last quick wake is available from getLastQuickWakeMs(), 
+     * and is added to the wake event as "qwt" (milliseconds) if eventsEnabledQuickWakeTime is enabled.
+     */
+    SleepHelper &withQuickWakeNoFilesystem(size_t eventBufferBytes = 2048, std::chrono::milliseconds maxDeferral = std::chrono::hours(1)) {
+        quickWakeNoFilesystem = true;
+        quickWakeEventBufferBytes = eventBufferBytes;
+        if (!persistentData.getRetained()) {
+            persistentData.withWriteBehind(maxDeferral);
+        }
+        return *this;
+    }
+
+    /**
+     * @brief Gets the time from wake to sleep in milliseconds for the most recent quick wake
+     * 
+     * @return uint32_t milliseconds, or 0 if there has not been a quick wake since boot
+     * 
+     * A quick wake is a wake cycle that did not connect to the cloud.
+     */
+    uint32_t getLastQuickWakeMs() const {
+        return lastQuickWakeMs;
+    }
+
+    /**
+     * @brief Returns true if file system writes are being deferred for this wake cycle
+     * 
+     * This is true during a quick wake when withQuickWakeNoFilesystem() is used, unless the 
+     * device is about to enter a sleep mode that does not preserve RAM, such as HIBERNATE. 
+     * Objects that write files from a sleepOrReset function should skip the write when this 
+     * is true and the device is going to sleep, not resetting. The write then occurs before 
+     * sleep at the end of the next full wake, or on reset.
+     */
+    bool getFileSystemWritesDeferred() const {
+        return quickWakeNoFilesystem && isNoConnectionWake && sleepPreservesRam;
+    }
+#endif // HAL_PLATFORM_FILESYSTEM || defined(UNITTEST)
+
 #if HAL_PLATFORM_FILESYSTEM || defined(UNITTEST)
     /**
      * @brief Function to call when settings change
@@ -1791,8 +5451,23 @@ public:
      * 
      * @ingroup callbacks
      */
-    SleepHelper &withSettingChangeFunction(std::function<bool(const char *)> fn) { 
-        settingsFile.withSettingChangeFunction(fn);
+    template<class F>
+    SleepHelper &withSettingChangeFunction(F &&fn) {
+        settingsFile.withSettingChangeFunction(std::forward<F>(fn));
+        return *this;
+    }
+
+    /**
+     * @brief Adds a setting change function for a specific key, or keys beginning with a prefix
+     * 
+     * @param key The key name, or a prefix followed by * 
+     * @param fn A function or lambda to call. See withSettingChangeFunction(std::function<bool(const char *)> fn)
+     * @return SleepHelper& 
+     * 
+     * @ingroup callbacks
+     */
+    SleepHelper &withSettingChangeFunction(const char *key, std::function<bool(const char *)> fn) { 
+        settingsFile.withSettingChangeFunction(key, fn);
         return *this;
     }
 #endif
@@ -1942,6 +5617,7 @@ public:
      */
     SleepHelper &withTimeConfig(const char *tzConfig) {
         LocalTime::instance().withConfig(tzConfig);
+        wakeTimeline.withTimeConfig(tzConfig);
         return *this;
     }
 
@@ -1951,6 +5627,9 @@ public:
     static const uint64_t eventsEnabledTimeToConnect        = 0x0000000000000002ul;  //!< "ttc" time to connect event
     static const uint64_t eventsEnabledResetReason          = 0x0000000000000004ul;  //!< "rr" reset reason event
     static const uint64_t eventsEnabledBatterySoC           = 0x0000000000000008ul;  //!< "soc" report battery SoC on full wake
+    static const uint64_t eventsEnabledSampleInterval       = 0x0000000000000010ul;  //!< "si" effective adaptive sample interval in seconds on full wake
+    static const uint64_t eventsEnabledQuickWakeTime        = 0x0000000000000020ul;  //!< "qwt" wake to sleep time of the last quick wake in milliseconds on full wake
+    static const uint64_t eventsEnabledCallbackStats        = 0x0000000000000040ul;  //!< "cbs" callback statistics on full wake, only if enabled with withCallbackStats()
 
     /**
      * @brief Enable an eventsEnable flag. These determine whether the add values to the wake event
@@ -1975,6 +5654,82 @@ public:
     }
     
 
+    /**
+     * @brief Collect execution time statistics for the registered callback functions
+     * 
+     * @param enable true to enable collecting statistics (default: disabled)
+     * @param addToWakeEvent true to add the statistics to the wake event as "cbs" (priority 10)
+     * @return SleepHelper& 
+     * 
+     * For each callback, the number of calls, the cumulative and maximum execution time, and the
+     * last wake cycle in which it returned true (stay awake, for sleep ready, data capture, and no
+     * connection functions) are recorded. Pass a name when registering the callback, such as 
+     * withSleepReadyFunction(fn, "gps"), to identify it.
+     * 
+     * The wake event fragment is an object with a key for each callback list that has been called,
+     * such as "sleepReady", containing an array with an object for each callback in the order they 
+     * were registered: n (name), c (call count), t (total time in milliseconds), m (maximum time in 
+     * microseconds), w (last wake cycle it returned true, 0 if never).
+     */
+    SleepHelper &withCallbackStats(bool enable = true, bool addToWakeEvent = false);
+
+    /**
+     * @brief Call a function for the statistics of each registered callback
+     * 
+     * @param fn Called with the name of the callback list, such as "sleepReady", and the statistics
+     * for one callback
+     * 
+     * Statistics are only collected after withCallbackStats(true).
+     */
+    void forEachCallbackStats(std::function<void(const char *listName, const CallbackStats &stats)> fn);
+
+    /**
+     * @brief Write the callback statistics as a JSON object, in the format of the "cbs" wake event
+     * 
+     * @param writer The writer, positioned where a value is expected
+     */
+    void writeCallbackStats(JSONWriter &writer);
+
+    /**
+     * @brief Wake cycle number used in the callback statistics, incremented at the start of each wake cycle
+     */
+    uint32_t getWakeCycle() const {
+        return CallbackStats::wakeCycle;
+    }
+
+    /**
+     * @brief Calculate the per-device wake offset
+     * 
+     * @param deviceId The Device ID (24 hexadecimal characters), typically from System.deviceID()
+     * @param maxSpreadSec The maximum offset in seconds
+     * @return int An offset from 0 to maxSpreadSec inclusive. The same Device ID always returns the same value.
+     * 
+     * This is used by withWakeJitter() but is a separate static function so it can be used in simulations.
+     */
+    static int calculateWakeJitter(const char *deviceId, int maxSpreadSec);
+
+    /**
+     * @brief Calculate the next wake time including the per-device wake offset
+     * 
+     * @param scheduleManager The schedules
+     * @param timeline The precomputed timeline for scheduleManager
+     * @param now The current time (Unix time, UTC)
+     * @param jitterSec The per-device offset in seconds, from calculateWakeJitter()
+     * @param jitterDataCapture true if the offset also applies to the data capture schedule
+     * @return time_t The next wake time, or 0 if there are no scheduled wakes
+     * 
+     * The combined wake schedule does not include the offset. A time in it that matches the unshifted 
+     * full wake (or data capture) time is only kept if the quick wake schedule also wakes then. 
+     * Otherwise it's replaced by the shifted times. This is used by withWakeJitter() but is a separate 
+     * static function so it can be tested.
+     */
+    static time_t calculateNextWakeWithJitter(LocalTimeScheduleManager &scheduleManager, WakeTimeline &timeline, time_t now, int jitterSec, bool jitterDataCapture);
+
+    /**
+     * @brief The hash seed used for the per-device wake offset
+     */
+    static const uint32_t WAKE_JITTER_HASH_SEED = 0x1d8e4e27;
+
     /**
      * @brief Returns true if the eventsEnable flag is set
      * 
@@ -2074,6 +5829,19 @@ public:
         return sleepEnabled;
     }
 
+    /**
+     * @brief Request that the ShouldConnect functions be checked again during a quick wake
+     * 
+     * Normally the ShouldConnect functions are only called at the start of a wake cycle that
+     * is not a scheduled quick wake. If something happens during data capture that warrants
+     * a connection, such as an alarm, call this. After data capture completes, if any 
+     * ShouldConnect function sets a connectConviction that is not outweighed by a
+     * noConnectConviction, the device connects to the cloud instead of going back to sleep.
+     */
+    void requestConnectionCheck() {
+        connectionCheckRequested = true;
+    }
+
 
     /**
      * @brief Perform setup operations; call this from global application setup()
@@ -2112,12 +5880,21 @@ public:
      */
     LocalTimeScheduleManager scheduleManager;
 
+    /**
+     * @brief Precomputed upcoming times for scheduleManager
+     */
+    WakeTimeline wakeTimeline;
+
     /**
      * @brief Get the quick wake schedule
      * 
      * @return LocalTimeSchedule& 
+     * 
+     * The schedule getters return a modifiable schedule, so calling them discards the cached 
+     * wake timeline if the schedule configuration was changed.
      */
     LocalTimeSchedule &getScheduleQuick() {
+        wakeTimeline.invalidate();
         return scheduleManager.getScheduleByName("quick");
     }
 
@@ -2127,6 +5904,7 @@ public:
      * @return LocalTimeSchedule& 
      */
     LocalTimeSchedule &getScheduleFull() {
+        wakeTimeline.invalidate();
         return scheduleManager.getScheduleByName("full");
     }
 
@@ -2137,6 +5915,7 @@ public:
      * 
      */
     LocalTimeSchedule &getScheduleDataCapture() {
+        wakeTimeline.invalidate();
         return scheduleManager.getScheduleByName("data");
     }
 
@@ -2200,6 +5979,27 @@ protected:
      */
     void calculateSleepSettings(bool isConnected);
 
+    /**
+     * @brief Get the next scheduled time from the wake timeline
+     * 
+     * @param type Schedule type, such as WakeTimeline::TYPE_FULL_WAKE
+     * @return time_t Next scheduled time (Unix time, UTC) or 0 if there is no schedule of that type
+     * 
+     * This is fast because the result normally comes from the precomputed table instead of 
+     * a local time conversion. If the table is recalculated, it's saved in persistent data.
+     */
+    time_t getNextScheduledTime(int type);
+
+    /**
+     * @brief Gets the time of the next wake including the per-device wake offset
+     * 
+     * @return time_t The next wake time including the per-device offset, or 0 if there are no scheduled wakes
+     * 
+     * See calculateNextWakeWithJitter(). If the timeline is recalculated, it's saved in persistent data. 
+     * Only used when withWakeJitter() is enabled.
+     */
+    time_t getNextWakeWithJitter();
+
     /**
      * @brief Calls the data capture handlers
      * 
@@ -2209,6 +6009,16 @@ protected:
      */
     void dataCaptureHandler();
 
+    /**
+     * @brief Called from state handlers when they are only waiting for callbacks
+     * 
+     * @param ms Number of milliseconds until the next callback for that state needs to run
+     * 
+     * Also takes into account data capture callbacks, if a capture is in progress. The result
+     * is stored in idleWaitMs and used by loop(). Only used when withIdleWait() is enabled.
+     */
+    void setIdleWait(system_tick_t ms);
+
     /**
      * @brief Initial state at boot or after sleep
      * 
@@ -2368,6 +6178,7 @@ protected:
     /**
      * @brief Handles sleep
      * 
+     * - Waits for data capture worker threads to finish, if withParallelDataCapture() is used
      * - Calls sleepOrResetFunctions 
      * - Adjust sleep time to account for the time to disconnect from the cloud and cellular (could be a couple seconds)
      * - Uses System.sleep to sleep
@@ -2398,6 +6209,31 @@ protected:
      */
     void stateHandlerSleepShort();
 
+#if HAL_PLATFORM_FILESYSTEM || defined(UNITTEST)
+    /**
+     * @brief Add the fixed wake event slots for the built-in wake events (wr, ttc, rr, soc, si, qwt, cbs)
+     * 
+     * Called once from setup(). The slots are in the same order as the built-in wake event table,
+     * starting at wakeEventSlotBase.
+     */
+    void addWakeEventSlots();
+
+    /**
+     * @brief Include a built-in wake event in the next wake event, if enabled
+     * 
+     * @param flag The flag, such as eventsEnabledWakeReason
+     */
+    void setWakeEventPending(uint64_t flag);
+
+    /**
+     * @brief Write the value for a built-in wake event
+     * 
+     * @param flag The flag, such as eventsEnabledWakeReason
+     * @param writer The writer, after the key has been written
+     */
+    void writeWakeEvent(uint64_t flag, JSONWriter &writer);
+#endif // HAL_PLATFORM_FILESYSTEM || defined(UNITTEST)
+
     AppCallback<SystemSleepConfiguration &, SleepConfigurationParameters&> sleepConfigurationFunctions; //!< Callback functions for adjusting sleep behavior
 
     AppCallback<const SystemSleepResult &> wakeFunctions; //!< Callback functions called on wake from sleep
@@ -2407,6 +6243,39 @@ protected:
 
 #endif // UNITTEST
 
+#if HAL_PLATFORM_FILESYSTEM || defined(UNITTEST)
+    /**
+     * @brief Writes changes held in RAM before sleep, unless file system writes are deferred
+     * 
+     * Called from stateHandlerSleep after the sleepOrReset functions.
+     */
+    void writeFilesBeforeSleep();
+#endif // HAL_PLATFORM_FILESYSTEM || defined(UNITTEST)
+
+    /**
+     * @brief Sets whether the current wake cycle is connecting to the cloud
+     * 
+     * @param noConnectionWake true for a quick wake (no connection)
+     * 
+     * With withQuickWakeNoFilesystem(), event history events are held in RAM only while file 
+     * system writes are deferred. Events already held in RAM are written when that ends.
+     */
+    void setNoConnectionWake(bool noConnectionWake);
+
+    /**
+     * @brief Callback list and the name used for it in callback statistics
+     */
+    struct NamedCallbackList {
+        const char *name; //!< Name such as "sleepReady"
+        AppCallbackStatsList *list; //!< The callback list
+    };
+
+    /**
+     * @brief Get all of the callback lists
+     * 
+     * @param lists Filled in with the lists in a fixed order
+     */
+    void getCallbackLists(std::vector<NamedCallbackList> &lists);
 
     AppCallback<> setupFunctions; //!< Callback functions called during setup()
 
@@ -2442,6 +6311,10 @@ protected:
 #endif
     int wakeReasonInt = 0; //!< Wake reason after sleep
 
+    int wakeJitterMaxSec = 0; //!< Maximum per-device wake offset in seconds, 0 = disabled
+    int wakeJitterSec = 0; //!< Per-device wake offset in seconds, calculated during setup()
+    bool wakeJitterDataCapture = false; //!< Apply the per-device wake offset to the data capture schedule as well
+
     std::vector<PublishData> publishData; //!< Wake event data to publish (JSON strings)
 
     /**
@@ -2451,6 +6324,8 @@ protected:
      */
     uint64_t eventsEnabled = 0xfffffffffffffffful;
 
+    bool callbackStatsWakeEvent = false; //!< Add callback statistics to the wake event, set by withCallbackStats()
+
     /**
      * @brief Flag to indicate if sleep is allowed (default) or if it has been disabled.
      */
@@ -2463,6 +6338,24 @@ protected:
      */
     uint64_t logEnabled = logEnabledNormal;
 
+    bool connectionCheckRequested = false; //!< Set by requestConnectionCheck() to check ShouldConnect again in no connection mode
+
+    AdaptiveSampler *adaptiveSampler = nullptr; //!< Set by withAdaptiveSampling(), determines the data capture times
+
+    DataCaptureWorkers *dataCaptureWorkers = nullptr; //!< Set by withParallelDataCapture(), runs data capture functions on worker threads
+
+    float retainedLowBatterySoC = 10.0; //!< Below this battery SoC, retained persistent data is written to the file before every sleep
+
+    bool quickWakeNoFilesystem = false; //!< Set by withQuickWakeNoFilesystem(), defers file system writes to the next full wake
+    size_t quickWakeEventBufferBytes = 0; //!< Set by withQuickWakeNoFilesystem(), event history bytes to hold in RAM during quick wakes
+    bool isNoConnectionWake = false; //!< True if the current wake cycle is not connecting to the cloud
+    bool sleepPreservesRam = true; //!< False if the sleep mode being entered does not preserve RAM, such as HIBERNATE
+    uint32_t lastQuickWakeMs = 0; //!< Wake to sleep time of the most recent quick wake in milliseconds
+
+    system_tick_t idleWaitMaxMs = 0; //!< Maximum low-power wait in loop(), 0 = disabled. Set using withIdleWait().
+    system_tick_t idleWaitMs = 0; //!< Low-power wait requested by the state handler on this loop
+    uint32_t idleWaitTotalMs = 0; //!< Total time waited in low-power mode
+
 #ifndef UNITTEST
     system_tick_t minimumCellularOffTimeMs = std::chrono::duration_cast<std::chrono::milliseconds>(13min).count(); //!< Default value for the minimum time to turn cellular off
     system_tick_t minimumSleepTimeMs = std::chrono::duration_cast<std::chrono::milliseconds>(10s).count(); //!< Default value for the minimum time to sleep
@@ -2476,7 +6369,11 @@ protected:
     system_tick_t connectedStartMillis = 0; //!< millis value when Particle.connected returned true
     system_tick_t lastEventHistoryCheckMillis = 0; //!< millis value the last time the event history was checked
 
+    int resetReasonInt = 0; //!< Reset reason at boot, for the "rr" wake event
+    size_t wakeEventSlotBase = 0; //!< Slot in wakeEventFunctions for the first built-in wake event
+
     bool outOfMemory = false; //!< Set to true if an out of memory system event occurs
+    system_tick_t wakeStartMillis = 0; //!< millis value at boot or wake from sleep
     
     /**
      * @brief True if data capture handlers are being called